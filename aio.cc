@@ -0,0 +1,426 @@
+#include <stdexcept>
+#include <deque>
+#include <cerrno>
+#include <cstring>
+#include <cstdlib>
+#include "aio.hh"
+#include "thread.hh"
+
+extern "C" {
+	#include <unistd.h>
+	#include <sys/uio.h>
+}
+
+#if defined(__linux__) && defined(__has_include)
+# if __has_include(<linux/io_uring.h>)
+#  define HAVE_IO_URING 1
+# endif
+#endif
+
+#ifdef HAVE_IO_URING
+extern "C" {
+	#include <sys/mman.h>
+	#include <sys/syscall.h>
+	#include <linux/io_uring.h>
+}
+# ifndef __NR_io_uring_setup
+#  undef HAVE_IO_URING // headers newer than libc's
+# endif
+#endif
+
+//
+// The pread(2) pool
+//
+
+// A batch being read by the pool. Workers hand back the indices of
+// the ops they've finished.
+struct pool_batch : public monitor {
+	explicit pool_batch(std::vector<read_op>& ops) : ops(ops) { }
+
+	void finish(size_t i)
+	{
+		scoped_lock sync(monitor_mutex);
+		finished.push_back(i);
+		notify_one();
+	}
+
+	// Wait for some ops to finish, taking their indices.
+	void take_finished(std::vector<size_t>& dst)
+	{
+		dst.clear();
+		scoped_lock sync(monitor_mutex);
+		while (finished.empty()) {
+			wait();
+		}
+		dst.swap(finished);
+	}
+
+	std::vector<read_op>& ops;
+	std::vector<size_t> finished;
+};
+
+class pread_pool : public monitor
+{
+public:
+	pread_pool();
+	~pread_pool();
+
+	void read(std::vector<read_op>& ops, read_done_func done, void *arg);
+
+private:
+	class worker : public threadbase
+	{
+	public:
+		explicit worker(pread_pool& pool) : m_pool(pool) { }
+		virtual void run() { m_pool.work(); }
+
+	private:
+		pread_pool& m_pool;
+	};
+
+	void work();
+
+	typedef std::pair<pool_batch *, size_t> job; // batch, index of op
+	std::deque<job> m_jobs;
+	std::vector<worker *> m_workers; // started on first use
+	bool m_stopping;
+};
+
+pread_pool::pread_pool()
+: m_stopping(false)
+{
+	//
+}
+
+pread_pool::~pread_pool()
+{
+	{
+		scoped_lock sync(monitor_mutex);
+		m_stopping = true;
+		notify_all();
+	}
+	for (size_t i(0); i < m_workers.size(); ++i) {
+		m_workers[i]->join();
+		delete m_workers[i];
+	}
+}
+
+void pread_pool::read(std::vector<read_op>& ops, read_done_func done, void *arg)
+{
+	pool_batch b(ops);
+	{
+		scoped_lock sync(monitor_mutex);
+		while (m_workers.size() < AIO_POOL_THREADS) {
+			m_workers.push_back(new worker(*this));
+			m_workers.back()->start();
+		}
+		for (size_t i(0); i < ops.size(); ++i) {
+			m_jobs.push_back(job(&b, i));
+		}
+		notify_all();
+	}
+	size_t completed(0);
+	std::vector<size_t> finished;
+	try {
+		while (completed < ops.size()) {
+			b.take_finished(finished);
+			for (size_t i(0); i < finished.size(); ++i) {
+				completed++;
+				done(ops, finished[i], arg);
+			}
+		}
+	} catch (...) {
+		// the workers still have the batch
+		while (completed < ops.size()) {
+			b.take_finished(finished);
+			completed += finished.size();
+		}
+		throw;
+	}
+}
+
+void pread_pool::work()
+{
+	while (true) {
+		job j;
+		{
+			scoped_lock sync(monitor_mutex);
+			while (m_jobs.empty() && !m_stopping) {
+				wait();
+			}
+			if (m_jobs.empty()) {
+				return;
+			}
+			j = m_jobs.front();
+			m_jobs.pop_front();
+		}
+		read_op& op(j.first->ops[j.second]);
+		ssize_t n(0);
+		do {
+			n = op.buf.empty() ? 0 : pread(op.fd, &op.buf[0], op.buf.size(), op.offset);
+		} while (n < 0 && errno == EINTR);
+		op.result = n < 0 ? -errno : n;
+		j.first->finish(j.second);
+	}
+}
+
+static pread_pool POOL;
+
+//
+// io_uring
+//
+
+#ifdef HAVE_IO_URING
+
+class uring : private noncopyable
+{
+public:
+	// Throws if the kernel won't set one up.
+	explicit uring(unsigned entries);
+	~uring();
+
+	void read(std::vector<read_op>& ops, read_done_func done, void *arg);
+
+private:
+	// Submit what's queued, and wait for at least one completion.
+	void enter(unsigned& unsubmitted);
+
+	// Take the next completion, if there is one.
+	bool reap(std::vector<read_op>& ops, size_t& i);
+
+	void release();
+
+	int m_fd;
+	unsigned m_entries;
+
+	void *m_sq_ring;
+	size_t m_sq_ring_len;
+	unsigned *m_sq_head;
+	unsigned *m_sq_tail;
+	unsigned m_sq_mask;
+	unsigned *m_sq_array;
+	io_uring_sqe *m_sqes;
+	size_t m_sqes_len;
+
+	void *m_cq_ring;
+	size_t m_cq_ring_len;
+	unsigned *m_cq_head;
+	unsigned *m_cq_tail;
+	unsigned m_cq_mask;
+	io_uring_cqe *m_cqes;
+};
+
+template<typename T>
+static T *at(void *base, uint32_t offset)
+{
+	return reinterpret_cast<T *>(static_cast<char *>(base) + offset);
+}
+
+uring::uring(unsigned entries)
+: m_fd(-1)
+, m_sq_ring(MAP_FAILED)
+, m_sqes(reinterpret_cast<io_uring_sqe *>(MAP_FAILED))
+, m_cq_ring(MAP_FAILED)
+{
+	io_uring_params p;
+	memset(&p, 0, sizeof(p));
+	m_fd = syscall(__NR_io_uring_setup, entries, &p);
+	if (m_fd < 0) {
+		throw std::runtime_error("io_uring_setup failed");
+	}
+	m_entries = p.sq_entries;
+	m_sq_ring_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	m_cq_ring_len = p.cq_off.cqes + p.cq_entries * sizeof(io_uring_cqe);
+	m_sqes_len = p.sq_entries * sizeof(io_uring_sqe);
+	m_sq_ring = mmap(NULL, m_sq_ring_len, PROT_READ | PROT_WRITE,
+		MAP_SHARED | MAP_POPULATE, m_fd, IORING_OFF_SQ_RING);
+	m_cq_ring = mmap(NULL, m_cq_ring_len, PROT_READ | PROT_WRITE,
+		MAP_SHARED | MAP_POPULATE, m_fd, IORING_OFF_CQ_RING);
+	m_sqes = reinterpret_cast<io_uring_sqe *>(mmap(NULL, m_sqes_len, PROT_READ | PROT_WRITE,
+		MAP_SHARED | MAP_POPULATE, m_fd, IORING_OFF_SQES));
+	if (m_sq_ring == MAP_FAILED || m_cq_ring == MAP_FAILED || m_sqes == MAP_FAILED) {
+		release();
+		throw std::runtime_error("couldn't map io_uring");
+	}
+	m_sq_head = at<unsigned>(m_sq_ring, p.sq_off.head);
+	m_sq_tail = at<unsigned>(m_sq_ring, p.sq_off.tail);
+	m_sq_mask = *at<unsigned>(m_sq_ring, p.sq_off.ring_mask);
+	m_sq_array = at<unsigned>(m_sq_ring, p.sq_off.array);
+	m_cq_head = at<unsigned>(m_cq_ring, p.cq_off.head);
+	m_cq_tail = at<unsigned>(m_cq_ring, p.cq_off.tail);
+	m_cq_mask = *at<unsigned>(m_cq_ring, p.cq_off.ring_mask);
+	m_cqes = at<io_uring_cqe>(m_cq_ring, p.cq_off.cqes);
+}
+
+uring::~uring()
+{
+	release();
+}
+
+void uring::release()
+{
+	if (m_sqes != MAP_FAILED) {
+		munmap(m_sqes, m_sqes_len);
+	}
+	if (m_cq_ring != MAP_FAILED) {
+		munmap(m_cq_ring, m_cq_ring_len);
+	}
+	if (m_sq_ring != MAP_FAILED) {
+		munmap(m_sq_ring, m_sq_ring_len);
+	}
+	if (m_fd >= 0) {
+		close(m_fd);
+	}
+}
+
+void uring::enter(unsigned& unsubmitted)
+{
+	while (true) {
+		const int rc(syscall(__NR_io_uring_enter, m_fd, unsubmitted, 1, IORING_ENTER_GETEVENTS, NULL, 0));
+		if (rc >= 0) {
+			unsubmitted -= rc;
+			return;
+		}
+		if (errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+			throw std::runtime_error("io_uring_enter failed");
+		}
+	}
+}
+
+bool uring::reap(std::vector<read_op>& ops, size_t& i)
+{
+	const unsigned head(*m_cq_head);
+	if (head == __atomic_load_n(m_cq_tail, __ATOMIC_ACQUIRE)) {
+		return false;
+	}
+	const io_uring_cqe& cqe(m_cqes[head & m_cq_mask]);
+	i = cqe.user_data;
+	ops[i].result = cqe.res;
+	__atomic_store_n(m_cq_head, head + 1, __ATOMIC_RELEASE);
+	return true;
+}
+
+void uring::read(std::vector<read_op>& ops, read_done_func done, void *arg)
+{
+	std::vector<iovec> iovs(ops.size());
+	size_t submitted(0);
+	size_t completed(0);
+	unsigned unsubmitted(0); // queued, but not yet taken by the kernel
+	try {
+		while (completed < ops.size()) {
+			// queue as many reads as there's room for (keeping no more
+			// in flight than the queue depth, so completions can't
+			// overflow)
+			unsigned tail(*m_sq_tail);
+			while (submitted < ops.size() && submitted - completed < m_entries) {
+				read_op& op(ops[submitted]);
+				iovs[submitted].iov_base = op.buf.empty() ? NULL : &op.buf[0];
+				iovs[submitted].iov_len = op.buf.size();
+				const unsigned slot(tail & m_sq_mask);
+				io_uring_sqe& sqe(m_sqes[slot]);
+				memset(&sqe, 0, sizeof(sqe));
+				sqe.opcode = IORING_OP_READV;
+				sqe.fd = op.fd;
+				sqe.off = op.offset;
+				sqe.addr = reinterpret_cast<uintptr_t>(&iovs[submitted]);
+				sqe.len = 1;
+				sqe.user_data = submitted;
+				m_sq_array[slot] = slot;
+				tail++;
+				submitted++;
+				unsubmitted++;
+			}
+			__atomic_store_n(m_sq_tail, tail, __ATOMIC_RELEASE);
+			enter(unsubmitted);
+			size_t i(0);
+			while (reap(ops, i)) {
+				completed++;
+				done(ops, i, arg);
+			}
+		}
+	} catch (...) {
+		// the kernel may still be reading into ops
+		size_t i(0);
+		while (completed < submitted) {
+			enter(unsubmitted);
+			while (reap(ops, i)) {
+				completed++;
+			}
+		}
+		throw;
+	}
+}
+
+#endif // HAVE_IO_URING
+
+//
+// Choosing between them
+//
+
+static pthread_once_t PROBE_ONCE = PTHREAD_ONCE_INIT;
+static bool URING_AVAILABLE(false);
+static bool URING_ENABLED(false);
+
+#ifdef HAVE_IO_URING
+
+// Each thread's ring, created on its first batch.
+static pthread_key_t RING_KEY;
+
+static void delete_ring(void *ring)
+{
+	delete static_cast<uring *>(ring);
+}
+
+#endif
+
+static void probe()
+{
+#ifdef HAVE_IO_URING
+	try {
+		delete new uring(AIO_QUEUE_DEPTH);
+		URING_AVAILABLE = pthread_key_create(&RING_KEY, delete_ring) == 0;
+	} catch (const std::runtime_error& ex) {
+		URING_AVAILABLE = false;
+	}
+	const char *env(getenv("AIO"));
+	URING_ENABLED = URING_AVAILABLE && !(env && strcmp(env, "pread") == 0);
+#endif
+}
+
+void set_io_uring(bool enabled)
+{
+	pthread_once(&PROBE_ONCE, probe);
+	__atomic_store_n(&URING_ENABLED, enabled && URING_AVAILABLE, __ATOMIC_RELEASE);
+}
+
+std::string read_backend()
+{
+	pthread_once(&PROBE_ONCE, probe);
+	return __atomic_load_n(&URING_ENABLED, __ATOMIC_ACQUIRE) ? "io_uring" : "pread";
+}
+
+void read_batch(std::vector<read_op>& ops, read_done_func done, void *arg)
+{
+	if (ops.empty()) {
+		return;
+	}
+	pthread_once(&PROBE_ONCE, probe);
+#ifdef HAVE_IO_URING
+	if (__atomic_load_n(&URING_ENABLED, __ATOMIC_ACQUIRE)) {
+		uring *ring(static_cast<uring *>(pthread_getspecific(RING_KEY)));
+		if (!ring) {
+			try {
+				ring = new uring(AIO_QUEUE_DEPTH);
+				pthread_setspecific(RING_KEY, ring);
+			} catch (const std::runtime_error& ex) {
+				ring = NULL; // eg. out of locked memory; use the pool
+			}
+		}
+		if (ring) {
+			ring->read(ops, done, arg);
+			return;
+		}
+	}
+#endif
+	POOL.read(ops, done, arg);
+}
@@ -0,0 +1,57 @@
+#ifndef AIO_HH_
+#define AIO_HH_
+
+#include <string>
+#include <vector>
+#include <stdint.h>
+#include <sys/types.h>
+
+// Batches of reads, issued all at once rather than one after another, so
+// a search touching many index files keeps the disk busy.
+//
+// On Linux, every thread submitting batches gets its own io_uring (set
+// up with the raw system calls; there's no liburing dependency), and
+// completions are reaped as they arrive. Where io_uring isn't available
+// (another OS, an old kernel, or a sandbox that forbids it), a shared
+// pool of threads performs the reads with pread(2) instead.
+
+// Submission queue entries per thread; a batch bigger than this is
+// submitted as completions make room.
+#define AIO_QUEUE_DEPTH 64
+
+// Threads in the pread(2) pool.
+#define AIO_POOL_THREADS 8
+
+struct read_op {
+	read_op(int fd, uint64_t offset, size_t len)
+	: fd(fd)
+	, offset(offset)
+	, buf(len)
+	, result(0)
+	{
+		//
+	}
+
+	int fd;
+	uint64_t offset;
+	std::vector<char> buf;
+	ssize_t result; // bytes read, or -errno
+};
+
+// Called on the submitting thread as each read completes, with the
+// index of its op.
+typedef void (*read_done_func)(std::vector<read_op>& ops, size_t i, void *arg);
+
+// Perform all the reads, calling done for each as it completes, in any
+// order. Returns once they all have. Throws if the reads can't be
+// issued at all; a read that fails has a negative result.
+void read_batch(std::vector<read_op>& ops, read_done_func done, void *arg);
+
+// Use io_uring if it's available (the default, unless the AIO
+// environment variable is "pread"), or always the pread(2) pool.
+void set_io_uring(bool enabled);
+
+// The name of the mechanism reads will use: "io_uring" or "pread".
+std::string read_backend();
+
+#endif
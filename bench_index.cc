@@ -0,0 +1,223 @@
+#include <iostream>
+#include <sstream>
+#include <stdexcept>
+#include <cstdio>
+#include <cstdlib>
+#include "def.hh"
+#include "xml.hh"
+#include "idx.hh"
+
+extern "C" {
+	#include <unistd.h>
+	#include <sys/stat.h>
+}
+
+// bench_index times each stage of indexing on its own, then the whole
+// thing, reporting MB/s and articles/s for each:
+//
+//  read_until  scanning the XML for pages, as index_article does, and
+//              copying out title, contributor and text
+//  tokenize    turning article text into terms (parse_text, without
+//              the call into index_st)
+//  index       index_st::index, including the partial flushes
+//  flush       index_st::flush: header, merge, reset
+//  end-to-end  what the indexer does: regionize and one idx_thread per
+//              region
+//
+// The staged runs are single-threaded and keep the whole input in
+// memory, so pick a corpus that fits (gencorpus -m 100 is plenty).
+
+struct page {
+	std::string title;
+	std::string contrib;
+	std::string text;
+};
+
+static void copy_text(char *buf, size_t len, void *arg)
+{
+	reinterpret_cast<std::string *>(arg)->assign(buf, len);
+}
+
+// index_article, minus the indexing
+static index_result read_page(stream& s, page& p)
+{
+	if (!s.read_until("<title>", true, NULL, NULL)) {
+		return END_OF_REGION;
+	}
+	p.title.clear();
+	if (!s.read_until("<", false, parse_title, &p.title) || p.title.empty()) {
+		return NO_INDEX_BUT_CONTINUE;
+	}
+	if (
+			p.title.find("Category:") == 0 ||
+			p.title.find("Wikipedia:") == 0 ||
+			p.title.find("Template:") == 0 ||
+			p.title.find("Special:") == 0) {
+		return NO_INDEX_BUT_CONTINUE;
+	}
+	p.contrib.clear();
+	if (!s.read_until("<contributor>", true, NULL, NULL) ||
+			!s.read_until("</contributor>", false, parse_contrib, &p.contrib)) {
+		return NO_INDEX_BUT_CONTINUE;
+	}
+	p.text.clear();
+	if (!s.read_until("<text", true, NULL, NULL) ||
+			!s.read_until(">", true, NULL, NULL) ||
+			!s.read_until("</text", false, copy_text, &p.text)) {
+		return NO_INDEX_BUT_CONTINUE;
+	}
+	return INDEX_GOOD;
+}
+
+static uint64_t file_size(const std::string& filename)
+{
+	struct stat st;
+	if (stat(filename.c_str(), &st) != 0) {
+		return 0;
+	}
+	return st.st_size;
+}
+
+// Remove <basename>.1, .2, ... as left behind by index_st.
+static uint64_t remove_outputs(const std::string& basename)
+{
+	uint64_t bytes(0);
+	for (size_t i(1); ; ++i) {
+		std::ostringstream oss;
+		oss << basename << '.' << i;
+		const uint64_t sz(file_size(oss.str()));
+		if (unlink(oss.str().c_str()) != 0) {
+			break;
+		}
+		bytes += sz;
+	}
+	return bytes;
+}
+
+static void report(const char *stage, uint64_t usec, uint64_t bytes, size_t articles)
+{
+	const double sec(usec ? usec / 1e6 : 1e-6);
+	char line[256];
+	snprintf(line, sizeof(line), "%-11s %9.3fs %10.1f MB/s %12.0f articles/s",
+		stage, usec / 1e6, bytes / (1024.0 * 1024.0) / sec, articles / sec);
+	std::cout << line << std::endl;
+}
+
+static void usage(const char *argv0)
+{
+	std::cerr << "usage: " << argv0 << " [-t threads] [-o basename] <xml>" << std::endl;
+}
+
+int main(int argc, char *argv[])
+{
+	size_t threads(get_cpus());
+	std::string basename("bench_index.tmp");
+	int opt;
+	while ((opt = getopt(argc, argv, "t:o:")) != -1) {
+		switch (opt) {
+		case 't': threads = atoi(optarg); break;
+		case 'o': basename = optarg; break;
+		default: usage(argv[0]); return 1;
+		}
+	}
+	if (optind + 1 != argc || threads < 1) {
+		usage(argv[0]);
+		return 1;
+	}
+	const std::string xml(argv[optind]);
+	try {
+		const uint64_t xml_bytes(file_size(xml));
+		std::vector<page> pages;
+		uint64_t begin(now_usec());
+		{
+			stream s(xml, region(0, 0));
+			page p;
+			for (;;) {
+				index_result r(read_page(s, p));
+				if (r == END_OF_REGION) {
+					break;
+				} else if (r == INDEX_GOOD) {
+					pages.push_back(page());
+					pages.back().title.swap(p.title);
+					pages.back().contrib.swap(p.contrib);
+					pages.back().text.swap(p.text);
+				}
+			}
+		}
+		report("read_until", now_usec() - begin, xml_bytes, pages.size());
+
+		uint64_t text_bytes(0);
+		std::vector<std::vector<std::string> > terms(pages.size());
+		begin = now_usec();
+		for (size_t i(0); i < pages.size(); ++i) {
+			if (!pages[i].contrib.empty()) {
+				terms[i].push_back(pages[i].contrib);
+			}
+			tokenize(pages[i].text.data(), pages[i].text.size(), terms[i]);
+			text_bytes += pages[i].text.size();
+		}
+		report("tokenize", now_usec() - begin, text_bytes, pages.size());
+
+		// flush at ARTICLE_FLUSH_LIMIT, as idx_thread does; the flushes
+		// are timed separately
+		const std::string staged(basename + ".staged");
+		uint64_t index_usec(0), flush_usec(0);
+		{
+			index_st idx_st(staged);
+			size_t unflushed(0);
+			for (size_t i(0); i < pages.size(); ++i) {
+				begin = now_usec();
+				idx_st.index(terms[i], pages[i].title);
+				index_usec += now_usec() - begin;
+				if (++unflushed >= ARTICLE_FLUSH_LIMIT || i + 1 == pages.size()) {
+					begin = now_usec();
+					idx_st.flush(i + 1 == pages.size());
+					flush_usec += now_usec() - begin;
+					unflushed = 0;
+				}
+			}
+			if (pages.empty()) {
+				idx_st.flush(true);
+			}
+		}
+		const uint64_t idx_bytes(remove_outputs(staged));
+		report("index", index_usec, text_bytes, pages.size());
+		report("flush", flush_usec, idx_bytes, pages.size());
+		std::cout << "(" << idx_bytes / (1024 * 1024) << "MB of index from "
+		          << text_bytes / (1024 * 1024) << "MB of text)" << std::endl;
+		pages.clear();
+		terms.clear();
+
+		begin = now_usec();
+		size_t articles(0);
+		{
+			std::vector<region> regions(regionize(xml, threads));
+			std::vector<idx_thread *> workers;
+			typedef std::vector<idx_thread *>::iterator thit;
+			for (size_t i(0); i < regions.size(); ++i) {
+				std::ostringstream oss;
+				oss << basename << ".e2e." << i + 1;
+				idx_thread *t(new idx_thread(xml, regions[i], oss.str()));
+				t->start();
+				workers.push_back(t);
+			}
+			for (thit it(workers.begin()); it != workers.end(); ++it) {
+				(*it)->join();
+				articles += (*it)->article_count();
+				delete *it;
+			}
+		}
+		const uint64_t e2e_usec(now_usec() - begin);
+		for (size_t i(0); i < threads; ++i) {
+			std::ostringstream oss;
+			oss << basename << ".e2e." << i + 1;
+			remove_outputs(oss.str());
+		}
+		report("end-to-end", e2e_usec, xml_bytes, articles);
+		std::cout << "(" << threads << " threads)" << std::endl;
+	} catch (const std::runtime_error& ex) {
+		std::cerr << ex.what() << std::endl;
+		return 1;
+	}
+	return 0;
+}
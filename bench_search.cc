@@ -0,0 +1,278 @@
+#include <iostream>
+#include <fstream>
+#include <stdexcept>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include "def.hh"
+#include "thread.hh"
+#include "search.hh"
+#include "aio.hh"
+
+extern "C" {
+	#include <unistd.h>
+	#include <sys/time.h>
+	#include <sys/resource.h>
+}
+
+// bench_search loads an index set and replays queries against it
+// in-process, without HTTP in the way. Queries come from a file, one
+// per line (a query log), or are drawn from the most frequent terms of
+// the index with Zipfian popularity.
+//
+// By default each of -c threads issues its next query as soon as the
+// last one returns (fixed concurrency). With -r, queries are issued on
+// a fixed schedule instead, and latency is measured from when a query
+// was due, so a stall shows up in every query queued behind it.
+//
+// In cold mode the postings cache and the page cache for the index
+// files are dropped before every query; in warm mode each distinct
+// query is run once, untimed, before the replay.
+
+#define DEFAULT_CONCURRENCY 4
+#define DEFAULT_QUERIES 10000
+#define DEFAULT_VOCABULARY 10000
+#define DEFAULT_ZIPF_EXPONENT 1.0
+
+struct replay {
+	replay(const std::vector<std::string>& queries, double rate, bool cold)
+	: queries(queries)
+	, rate(rate)
+	, cold(cold)
+	, next(0)
+	, begin(0)
+	{
+		//
+	}
+
+	const std::vector<std::string>& queries;
+	const double rate; // queries per second, or 0 for back to back
+	const bool cold;
+	size_t next; // the next query to issue, shared by all threads
+	uint64_t begin;
+};
+
+class bench_thread : public threadbase
+{
+public:
+	bench_thread(replay& r) : m_replay(r), m_hits(0) { }
+	virtual void run();
+
+	const std::vector<uint64_t>& latencies() const { return m_latencies; }
+	size_t hits() const { return m_hits; }
+
+private:
+	replay& m_replay;
+	std::vector<uint64_t> m_latencies;
+	size_t m_hits;
+};
+
+void bench_thread::run()
+{
+	const std::vector<std::string>& queries(m_replay.queries);
+	m_latencies.reserve(queries.size());
+	for (;;) {
+		const size_t i(__sync_fetch_and_add(&m_replay.next, 1));
+		if (i >= queries.size()) {
+			break;
+		}
+		if (m_replay.cold) {
+			drop_caches();
+		}
+		uint64_t begin(now_usec());
+		if (m_replay.rate > 0) {
+			const uint64_t due(m_replay.begin + static_cast<uint64_t>(i * 1e6 / m_replay.rate));
+			if (due > begin) {
+				usleep(due - begin);
+			}
+			begin = due;
+		}
+		search_results r(search_indices(queries[i]));
+		m_latencies.push_back(now_usec() - begin);
+		m_hits += r.total;
+	}
+}
+
+static size_t resident_bytes()
+{
+#ifdef __linux__
+	std::ifstream ifs("/proc/self/statm");
+	size_t pages(0), resident(0);
+	if (ifs >> pages >> resident) {
+		return resident * sysconf(_SC_PAGESIZE);
+	}
+#endif
+	// peak, not current; bytes on Mac OS, kilobytes elsewhere
+	struct rusage ru;
+	getrusage(RUSAGE_SELF, &ru);
+#ifdef __APPLE__
+	return ru.ru_maxrss;
+#else
+	return static_cast<size_t>(ru.ru_maxrss) * 1024;
+#endif
+}
+
+// count queries over the vocabulary, popularity falling off with rank
+static std::vector<std::string> zipf_queries(size_t count, size_t vocabulary, double exponent, unsigned int seed)
+{
+	std::vector<completion> terms(complete_terms("", vocabulary));
+	std::vector<std::string> queries;
+	if (terms.empty()) {
+		return queries;
+	}
+	std::vector<double> cdf;
+	double sum(0);
+	for (size_t r(0); r < terms.size(); ++r) {
+		sum += 1.0 / std::pow(r + 1.0, exponent);
+		cdf.push_back(sum);
+	}
+	for (size_t i(0); i < count; ++i) {
+		const double x(rand_r(&seed) / (RAND_MAX + 1.0) * sum);
+		size_t r(std::upper_bound(cdf.begin(), cdf.end(), x) - cdf.begin());
+		if (r >= terms.size()) {
+			r = terms.size() - 1;
+		}
+		queries.push_back(terms[r].term);
+	}
+	return queries;
+}
+
+static void run(const char *mode, const std::vector<std::string>& queries, size_t concurrency, double rate, bool cold)
+{
+	if (!cold) {
+		std::vector<std::string> distinct(queries);
+		std::sort(distinct.begin(), distinct.end());
+		distinct.erase(std::unique(distinct.begin(), distinct.end()), distinct.end());
+		typedef std::vector<std::string>::const_iterator svcit;
+		for (svcit it(distinct.begin()); it != distinct.end(); ++it) {
+			search_indices(*it);
+		}
+	}
+	const cache_stats before(get_cache_stats());
+	const filter_stats filters_before(get_filter_stats());
+	replay r(queries, rate, cold);
+	r.begin = now_usec();
+	std::vector<bench_thread *> threads;
+	typedef std::vector<bench_thread *>::iterator btit;
+	for (size_t i(0); i < concurrency; ++i) {
+		bench_thread *t(new bench_thread(r));
+		t->start();
+		threads.push_back(t);
+	}
+	std::vector<uint64_t> latencies;
+	size_t hits(0);
+	for (btit it(threads.begin()); it != threads.end(); ++it) {
+		(*it)->join();
+		latencies.insert(latencies.end(), (*it)->latencies().begin(), (*it)->latencies().end());
+		hits += (*it)->hits();
+		delete *it;
+	}
+	const double elapsed((now_usec() - r.begin) / 1e6);
+	const cache_stats after(get_cache_stats());
+	const size_t lookups((after.hits - before.hits) + (after.misses - before.misses));
+	std::sort(latencies.begin(), latencies.end());
+	std::cout << mode << ": " << latencies.size() << " queries in " << elapsed << "s, "
+	          << hits << " hits, block cache hit rate "
+	          << (lookups ? 100 * (after.hits - before.hits) / lookups : 0) << "%" << std::endl;
+	const filter_stats filters(get_filter_stats());
+	const size_t probes(filters.probes - filters_before.probes);
+	const size_t skipped(filters.skipped - filters_before.skipped);
+	std::cout << mode << ": " << probes << " term lookups in index files, "
+	          << (probes ? 100.0 * skipped / probes : 0) << "% skipped by Bloom filters, "
+	          << filters.false_positives - filters_before.false_positives << " false positives" << std::endl;
+	std::cout << mode << ": qps " << static_cast<size_t>(latencies.size() / elapsed) << std::endl;
+	std::cout << mode << ": latency (us):"
+	          << " p50=" << percentile(latencies, 0.50)
+	          << " p90=" << percentile(latencies, 0.90)
+	          << " p99=" << percentile(latencies, 0.99)
+	          << " p999=" << percentile(latencies, 0.999)
+	          << " max=" << (latencies.empty() ? 0 : latencies.back())
+	          << std::endl;
+}
+
+static void usage(const char *argv0)
+{
+	std::cerr << "usage: " << argv0
+	          << " [-f queryfile] [-n queries] [-k vocabulary] [-z exponent] [-s seed]"
+	          << " [-c concurrency] [-r qps] [-m cold|warm|both]"
+	          << " <idx> [<idx> ...]"
+	          << std::endl;
+}
+
+int main(int argc, char *argv[])
+{
+	std::string queryfile, mode("both");
+	size_t count(0), vocabulary(DEFAULT_VOCABULARY), concurrency(DEFAULT_CONCURRENCY);
+	double exponent(DEFAULT_ZIPF_EXPONENT), rate(0);
+	unsigned int seed(1);
+	int opt;
+	while ((opt = getopt(argc, argv, "f:n:k:z:s:c:r:m:")) != -1) {
+		switch (opt) {
+		case 'f': queryfile = optarg; break;
+		case 'n': count = strtoul(optarg, NULL, 10); break;
+		case 'k': vocabulary = strtoul(optarg, NULL, 10); break;
+		case 'z': exponent = atof(optarg); break;
+		case 's': seed = strtoul(optarg, NULL, 10); break;
+		case 'c': concurrency = strtoul(optarg, NULL, 10); break;
+		case 'r': rate = atof(optarg); break;
+		case 'm': mode = optarg; break;
+		default: usage(argv[0]); return 1;
+		}
+	}
+	if (optind >= argc || concurrency < 1 || rate < 0 ||
+			(mode != "cold" && mode != "warm" && mode != "both")) {
+		usage(argv[0]);
+		return 1;
+	}
+	std::vector<std::string> filenames;
+	for (int i(optind); i < argc; i++) {
+		filenames.push_back(argv[i]);
+	}
+	try {
+		const size_t rss_before(resident_bytes());
+		const uint64_t begin(now_usec());
+		const size_t loaded(init_indices(filenames));
+		const uint64_t load_usec(now_usec() - begin);
+		if (loaded == 0) {
+			std::cerr << "no index files loaded" << std::endl;
+			return 1;
+		}
+		const size_t rss_after(resident_bytes());
+		std::cout << "loaded " << loaded << " index files in " << load_usec / 1000 << "ms, "
+		          << "resident " << rss_after / (1024 * 1024) << "MB "
+		          << "(+" << (rss_after - rss_before) / (1024 * 1024) << "MB)" << std::endl;
+		std::vector<std::string> queries;
+		if (!queryfile.empty()) {
+			std::ifstream ifs(queryfile.c_str());
+			if (!ifs.good()) {
+				throw std::runtime_error("bad query file");
+			}
+			std::string line;
+			while (std::getline(ifs, line) && (count == 0 || queries.size() < count)) {
+				if (!line.empty()) {
+					queries.push_back(line);
+				}
+			}
+		} else {
+			queries = zipf_queries(count ? count : DEFAULT_QUERIES, vocabulary, exponent, seed);
+		}
+		if (queries.empty()) {
+			std::cerr << "no queries" << std::endl;
+			return 1;
+		}
+		std::cout << queries.size() << " queries, " << concurrency << " threads, "
+		          << (rate > 0 ? "fixed rate" : "fixed concurrency") << ", "
+		          << read_backend() << " reads" << std::endl;
+		if (mode != "warm") {
+			run("cold", queries, concurrency, rate, true);
+		}
+		if (mode != "cold") {
+			run("warm", queries, concurrency, rate, false);
+		}
+		std::cout << "resident " << resident_bytes() / (1024 * 1024) << "MB" << std::endl;
+	} catch (const std::runtime_error& ex) {
+		std::cerr << ex.what() << std::endl;
+		return 1;
+	}
+	return 0;
+}
@@ -0,0 +1,137 @@
+#include <iostream>
+#include <stdexcept>
+#include <cstdio>
+#include <cstdlib>
+#include "def.hh"
+#include "xml.hh"
+#include "idx.hh"
+#include "fold.hh"
+
+extern "C" {
+	#include <unistd.h>
+}
+
+// bench_tokenize measures tokenizer throughput on the article text of
+// each XML file given, so an ASCII-heavy dump and a multilingual one
+// (eg. gencorpus -u) can be compared side by side. For each file it
+// reports the share of non-ASCII bytes, then MB/s for:
+//
+//  tokenize      tokenize() over every article, as the indexer runs it
+//  ascii simd    fold_ascii_run over the text, stepping over the bytes
+//                that end each run; the vectorized part of tokenize
+//  ascii scalar  the same with fold_ascii_run_scalar
+//
+// Text is loaded into memory first, and each stage is run -r times.
+
+#define DEFAULT_REPEATS 3
+
+static void copy_text(char *buf, size_t len, void *arg)
+{
+	reinterpret_cast<std::string *>(arg)->assign(buf, len);
+}
+
+static void load_texts(const std::string& xml, std::vector<std::string>& texts)
+{
+	stream s(xml, region(0, 0));
+	std::string text;
+	while (s.read_until("<text", true, NULL, NULL) &&
+			s.read_until(">", true, NULL, NULL) &&
+			s.read_until("</text", false, copy_text, &text)) {
+		texts.push_back(std::string());
+		texts.back().swap(text);
+	}
+}
+
+typedef size_t (*run_func)(const char *, size_t, std::string&);
+
+static size_t scan_runs(const std::string& text, run_func f)
+{
+	std::string term;
+	size_t runs(0);
+	for (size_t i(0); i < text.size(); ++i) {
+		term.clear();
+		if (f(text.data() + i, text.size() - i, term) > 0) {
+			i += term.size() - 1;
+			runs++;
+		}
+	}
+	return runs;
+}
+
+static void report(const char *stage, uint64_t usec, uint64_t bytes, const char *unit, uint64_t count)
+{
+	const double sec(usec ? usec / 1e6 : 1e-6);
+	char line[256];
+	snprintf(line, sizeof(line), "  %-13s %9.3fs %10.1f MB/s %14.0f %s/s",
+		stage, usec / 1e6, bytes / (1024.0 * 1024.0) / sec, count / sec, unit);
+	std::cout << line << std::endl;
+}
+
+static void usage(const char *argv0)
+{
+	std::cerr << "usage: " << argv0 << " [-r repeats] <xml> [<xml> ...]" << std::endl;
+}
+
+int main(int argc, char *argv[])
+{
+	size_t repeats(DEFAULT_REPEATS);
+	int opt;
+	while ((opt = getopt(argc, argv, "r:")) != -1) {
+		switch (opt) {
+		case 'r': repeats = strtoul(optarg, NULL, 10); break;
+		default: usage(argv[0]); return 1;
+		}
+	}
+	if (optind >= argc || repeats < 1) {
+		usage(argv[0]);
+		return 1;
+	}
+	try {
+		for (int f(optind); f < argc; ++f) {
+			std::vector<std::string> texts;
+			load_texts(argv[f], texts);
+			uint64_t bytes(0), non_ascii(0);
+			for (size_t i(0); i < texts.size(); ++i) {
+				bytes += texts[i].size();
+				for (size_t j(0); j < texts[i].size(); ++j) {
+					non_ascii += (texts[i][j] & 0x80) ? 1 : 0;
+				}
+			}
+			char line[256];
+			snprintf(line, sizeof(line), "%s: %lu articles, %.1fMB of text, %.1f%% non-ASCII",
+				argv[f], static_cast<unsigned long>(texts.size()), bytes / (1024.0 * 1024.0),
+				bytes ? 100.0 * non_ascii / bytes : 0.0);
+			std::cout << line << std::endl;
+
+			size_t terms(0);
+			uint64_t begin(now_usec());
+			for (size_t r(0); r < repeats; ++r) {
+				for (size_t i(0); i < texts.size(); ++i) {
+					std::vector<std::string> t;
+					tokenize(texts[i].data(), texts[i].size(), t);
+					terms += t.size();
+				}
+			}
+			report("tokenize", now_usec() - begin, bytes * repeats, "terms", terms);
+
+			static const struct { const char *name; run_func f; } RUNS[] = {
+				{ "ascii simd", fold_ascii_run },
+				{ "ascii scalar", fold_ascii_run_scalar },
+			};
+			for (size_t k(0); k < sizeof(RUNS) / sizeof(*RUNS); ++k) {
+				size_t runs(0);
+				begin = now_usec();
+				for (size_t r(0); r < repeats; ++r) {
+					for (size_t i(0); i < texts.size(); ++i) {
+						runs += scan_runs(texts[i], RUNS[k].f);
+					}
+				}
+				report(RUNS[k].name, now_usec() - begin, bytes * repeats, "runs", runs);
+			}
+		}
+	} catch (const std::runtime_error& ex) {
+		std::cerr << ex.what() << std::endl;
+		return 1;
+	}
+	return 0;
+}
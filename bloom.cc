@@ -0,0 +1,51 @@
+#include "bloom.hh"
+
+bloom_filter::bloom_filter()
+: m_hashes(0)
+{
+	//
+}
+
+bloom_filter::bloom_filter(size_t n)
+: m_hashes(BLOOM_HASHES)
+, m_words((n * BLOOM_BITS_PER_TERM + 63) / 64 + 1, 0)
+{
+	//
+}
+
+bloom_filter::bloom_filter(uint32_t hashes, const std::vector<uint64_t>& words)
+: m_hashes(words.empty() ? 0 : hashes)
+, m_words(words)
+{
+	//
+}
+
+// The second hash is the first, rotated; adding it k times walks k
+// different bits (Kirsch and Mitzenmacher).
+void bloom_filter::add(uint64_t hash)
+{
+	const uint64_t bits(m_words.size() * 64);
+	const uint64_t delta((hash >> 17) | (hash << 47));
+	for (uint32_t i(0); i < m_hashes; ++i) {
+		const uint64_t bit(hash % bits);
+		m_words[bit / 64] |= static_cast<uint64_t>(1) << (bit % 64);
+		hash += delta;
+	}
+}
+
+bool bloom_filter::may_contain(uint64_t hash) const
+{
+	if (m_words.empty()) {
+		return true;
+	}
+	const uint64_t bits(m_words.size() * 64);
+	const uint64_t delta((hash >> 17) | (hash << 47));
+	for (uint32_t i(0); i < m_hashes; ++i) {
+		const uint64_t bit(hash % bits);
+		if (!(m_words[bit / 64] & (static_cast<uint64_t>(1) << (bit % 64)))) {
+			return false;
+		}
+		hash += delta;
+	}
+	return true;
+}
@@ -0,0 +1,49 @@
+#ifndef BLOOM_HH_
+#define BLOOM_HH_
+
+#include <vector>
+#include <stdint.h>
+#include "def.hh"
+
+// A Bloom filter over the terms of an index file, so a search can skip
+// the files that can't have a term without looking it up in each.
+// Terms go in by their hash_bytes(), computed once per search however
+// many files there are; the k probe positions are derived from that one
+// hash by double hashing.
+//
+// At BLOOM_BITS_PER_TERM bits per term and BLOOM_HASHES probes, about
+// 1% of the terms a file doesn't have get through.
+
+#define BLOOM_BITS_PER_TERM 10
+#define BLOOM_HASHES 7
+
+// Filters read from a file with more probes than this are malformed.
+#define BLOOM_MAX_HASHES 32
+
+class bloom_filter
+{
+public:
+	// An empty filter, which lets everything through.
+	bloom_filter();
+
+	// A filter sized for n terms.
+	explicit bloom_filter(size_t n);
+
+	// From the words of a filter written out earlier.
+	bloom_filter(uint32_t hashes, const std::vector<uint64_t>& words);
+
+	void add(uint64_t hash);
+
+	// False only if hash was never added.
+	bool may_contain(uint64_t hash) const;
+
+	bool empty() const { return m_words.empty(); }
+	uint32_t hashes() const { return m_hashes; }
+	const std::vector<uint64_t>& words() const { return m_words; }
+
+private:
+	uint32_t m_hashes;
+	std::vector<uint64_t> m_words;
+};
+
+#endif
@@ -0,0 +1,258 @@
+#include <stdexcept>
+#include <algorithm>
+#include <iterator>
+#include <cstring>
+#include <cstdlib>
+#include "bz2.hh"
+
+extern "C" {
+	#include <unistd.h>
+	#include <fcntl.h>
+	#include <sys/stat.h>
+}
+
+#define BZ2_INPUT_SIZE (1024 * 1024)
+#define BZ2_OUTPUT_SIZE (64 * 1024)
+
+// "BZh", a block size digit, and the block magic (pi in BCD)
+static const char BLOCK_MAGIC[] = { 0x31, 0x41, 0x59, 0x26, 0x53, 0x59 };
+static const size_t HEADER_SIZE(4 + sizeof(BLOCK_MAGIC));
+
+static bool is_header(const char *p)
+{
+	return p[0] == 'B' && p[1] == 'Z' && p[2] == 'h' && p[3] >= '1' && p[3] <= '9' &&
+		memcmp(p + 4, BLOCK_MAGIC, sizeof(BLOCK_MAGIC)) == 0;
+}
+
+bool is_bz2(const std::string& filename)
+{
+	const int fd(open(filename.c_str(), O_RDONLY));
+	if (fd < 0) {
+		return false;
+	}
+	char buf[HEADER_SIZE];
+	const ssize_t n(pread(fd, buf, sizeof(buf), 0));
+	close(fd);
+	return n == static_cast<ssize_t>(sizeof(buf)) && is_header(buf);
+}
+
+static bool file_exists(const std::string& filename)
+{
+	struct stat st;
+	return stat(filename.c_str(), &st) == 0;
+}
+
+std::string bz2_default_index(const std::string& filename)
+{
+	static const std::string SUFFIX("multistream.xml.bz2");
+	if (filename.size() < SUFFIX.size() ||
+			filename.compare(filename.size() - SUFFIX.size(), SUFFIX.size(), SUFFIX) != 0) {
+		return "";
+	}
+	const std::string index(filename.substr(0, filename.size() - SUFFIX.size()) + "multistream-index.txt.bz2");
+	return file_exists(index) ? index : "";
+}
+
+static void index_offsets(const std::string& text, std::vector<uint64_t>& offsets)
+{
+	size_t line(0);
+	while (line < text.size()) {
+		size_t eol(text.find('\n', line));
+		if (eol == std::string::npos) {
+			eol = text.size();
+		}
+		if (text.find(':', line) < eol) {
+			offsets.push_back(strtoull(text.c_str() + line, NULL, 10));
+		}
+		line = eol + 1;
+	}
+}
+
+std::vector<uint64_t> bz2_index_offsets(const std::string& index_filename)
+{
+	std::string text;
+	if (is_bz2(index_filename)) {
+		bz2_decoder dec(index_filename);
+		while (!dec.eof()) {
+			dec.read(text, BZ2_CHUNK_SIZE);
+		}
+	} else {
+		std::ifstream ifs(index_filename.c_str(), std::ios::binary);
+		if (!ifs.good()) {
+			throw std::runtime_error("bad multistream index " + index_filename);
+		}
+		text.assign(std::istreambuf_iterator<char>(ifs), std::istreambuf_iterator<char>());
+	}
+	std::vector<uint64_t> offsets;
+	index_offsets(text, offsets);
+	std::sort(offsets.begin(), offsets.end());
+	offsets.erase(std::unique(offsets.begin(), offsets.end()), offsets.end());
+	return offsets;
+}
+
+// Can a stream be decoded from offset? Decoding the first block is
+// enough to rule out a chance match of the header bytes.
+static bool valid_stream(const std::string& filename, uint64_t offset)
+{
+	try {
+		bz2_decoder dec(filename, offset);
+		std::string probe;
+		dec.read(probe, 1);
+		return !probe.empty();
+	} catch (const std::runtime_error& ex) {
+		return false;
+	}
+}
+
+// The first stream header at or after from, within BZ2_SCAN_LIMIT,
+// or 0 if there isn't one.
+static uint64_t scan_for_stream(const std::string& filename, int fd, uint64_t from, uint64_t size)
+{
+	std::vector<char> buf(BZ2_INPUT_SIZE + HEADER_SIZE);
+	for (uint64_t at(from); at < size && at < from + BZ2_SCAN_LIMIT; at += BZ2_INPUT_SIZE) {
+		const ssize_t n(pread(fd, &buf[0], buf.size(), at));
+		if (n < static_cast<ssize_t>(HEADER_SIZE)) {
+			break;
+		}
+		for (size_t i(0); i + HEADER_SIZE <= static_cast<size_t>(n); ++i) {
+			if (buf[i] == 'B' && is_header(&buf[i]) && valid_stream(filename, at + i)) {
+				return at + i;
+			}
+		}
+	}
+	return 0;
+}
+
+std::vector<region> regionize_bz2(
+		const std::string& filename,
+		size_t count,
+		const std::string& index_filename)
+{
+	if (count == 0) {
+		throw std::runtime_error("regionize count out of range");
+	}
+	const int fd(open(filename.c_str(), O_RDONLY));
+	struct stat st;
+	if (fd < 0 || fstat(fd, &st) != 0) {
+		if (fd >= 0) {
+			close(fd);
+		}
+		throw std::runtime_error("bad input file");
+	}
+	const uint64_t size(st.st_size);
+	std::vector<uint64_t> offsets;
+	if (!index_filename.empty()) {
+		offsets = bz2_index_offsets(index_filename);
+	}
+	std::vector<uint64_t> starts(1, 0);
+	for (size_t i(1); i < count; ++i) {
+		const uint64_t target(size / count * i);
+		if (target <= starts.back()) {
+			continue;
+		}
+		uint64_t start(0);
+		if (!index_filename.empty()) {
+			std::vector<uint64_t>::const_iterator it(std::lower_bound(offsets.begin(), offsets.end(), target));
+			start = it == offsets.end() ? 0 : *it;
+		} else {
+			start = scan_for_stream(filename, fd, target, size);
+		}
+		if (start == 0 || start >= size) {
+			break; // no more streams to split at
+		}
+		if (start > starts.back()) {
+			starts.push_back(start);
+		}
+	}
+	close(fd);
+	std::vector<region> regions;
+	for (size_t i(0); i < starts.size(); ++i) {
+		regions.push_back(region(starts[i], i + 1 < starts.size() ? starts[i+1] : size));
+	}
+	return regions;
+}
+
+bz2_decoder::bz2_decoder(const std::string& filename, uint64_t offset)
+: m_fd(open(filename.c_str(), O_RDONLY))
+, m_pos(offset)
+, m_in(BZ2_INPUT_SIZE)
+, m_open(false)
+, m_stream_end(false)
+, m_eof(false)
+{
+	if (m_fd < 0) {
+		throw std::runtime_error("bad input file " + filename);
+	}
+	memset(&m_bz, 0, sizeof(m_bz));
+}
+
+bz2_decoder::~bz2_decoder()
+{
+	if (m_open) {
+		BZ2_bzDecompressEnd(&m_bz);
+	}
+	close(m_fd);
+}
+
+bool bz2_decoder::fill(size_t n)
+{
+	while (m_bz.avail_in < n) {
+		// keep what's left, then top up from the file
+		if (m_bz.avail_in > 0 && m_bz.next_in != &m_in[0]) {
+			memmove(&m_in[0], m_bz.next_in, m_bz.avail_in);
+		}
+		m_bz.next_in = &m_in[0];
+		const ssize_t got(pread(m_fd, &m_in[m_bz.avail_in], m_in.size() - m_bz.avail_in, m_pos));
+		if (got < 0) {
+			throw std::runtime_error("failed to read compressed input");
+		}
+		if (got == 0) {
+			return false;
+		}
+		m_bz.avail_in += got;
+		m_pos += got;
+	}
+	return true;
+}
+
+size_t bz2_decoder::read(std::string& dst, size_t n)
+{
+	m_stream_end = false;
+	size_t appended(0);
+	char out[BZ2_OUTPUT_SIZE];
+	while (appended < n && !m_eof) {
+		if (!m_open) {
+			// anything after the last stream that isn't another is padding
+			if (!fill(HEADER_SIZE) || !is_header(m_bz.next_in)) {
+				m_eof = true;
+				break;
+			}
+			if (BZ2_bzDecompressInit(&m_bz, 0, 0) != BZ_OK) {
+				throw std::runtime_error("BZ2_bzDecompressInit failed");
+			}
+			m_open = true;
+		}
+		if (m_bz.avail_in == 0 && !fill(1)) {
+			throw std::runtime_error("truncated bzip2 stream");
+		}
+		m_bz.next_out = out;
+		m_bz.avail_out = sizeof(out);
+		const int rc(BZ2_bzDecompress(&m_bz));
+		const size_t len(sizeof(out) - m_bz.avail_out);
+		dst.append(out, len);
+		appended += len;
+		if (rc == BZ_STREAM_END) {
+			BZ2_bzDecompressEnd(&m_bz);
+			m_open = false;
+			m_stream_end = true;
+			if (!fill(HEADER_SIZE) || !is_header(m_bz.next_in)) {
+				m_eof = true;
+			}
+			break;
+		}
+		if (rc != BZ_OK) {
+			throw std::runtime_error("corrupt bzip2 stream");
+		}
+	}
+	return appended;
+}
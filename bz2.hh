@@ -0,0 +1,90 @@
+#ifndef BZ2_HH_
+#define BZ2_HH_
+
+#include <string>
+#include <vector>
+#include <bzlib.h>
+#include "thread.hh"
+#include "def.hh"
+#include "xml.hh"
+
+// Wikimedia dumps come bzip2-compressed. The multistream flavour is a
+// concatenation of independent bzip2 streams of about 100 pages each,
+// and ships with an index of "<stream offset>:<page id>:<title>" lines,
+// so a file can be split into regions at stream boundaries and each
+// region decompressed by its own thread. Without the index, regions are
+// found by scanning near each split point for a byte-aligned stream
+// header ("BZh" <level> <block magic>), which is how parallel
+// compressors like pbzip2 lay out their output too.
+//
+// A dump written as a single bzip2 stream can't be split this way; it
+// comes out as one region, decompressed by one thread.
+//
+// Regions of a compressed file are in compressed bytes. Pages needn't
+// be aligned to streams: the thread owning the stream where a page
+// starts reads on into the next region to finish it, and every thread
+// skips ahead to the first page start in its region.
+
+// How much input to decompress before handing complete pages on.
+#define BZ2_CHUNK_SIZE (8 * 1024 * 1024)
+
+// How far past a split point to look for a stream header.
+#define BZ2_SCAN_LIMIT (64 * 1024 * 1024)
+
+// Does the file start with a bzip2 header?
+bool is_bz2(const std::string& filename);
+
+// The multistream index conventionally next to a dump, ie.
+// "...-multistream-index.txt.bz2" for "...-multistream.xml.bz2";
+// empty if there is no such file.
+std::string bz2_default_index(const std::string& filename);
+
+// Sorted, distinct stream offsets from a multistream index, which may
+// itself be bzip2-compressed or plain text.
+std::vector<uint64_t> bz2_index_offsets(const std::string& index_filename);
+
+// Split a bzip2 file into at most count regions, each a run of whole
+// streams, using the index if one is given.
+std::vector<region> regionize_bz2(
+		const std::string& filename,
+		size_t count,
+		const std::string& index_filename="");
+
+// Decompresses a bzip2 file from a stream boundary onwards, across
+// however many concatenated streams follow.
+class bz2_decoder : private noncopyable
+{
+public:
+	bz2_decoder(const std::string& filename, uint64_t offset=0);
+	~bz2_decoder();
+
+	// Append about n decompressed bytes to dst, stopping early at the end
+	// of a stream (see at_stream_end) or of the file. Returns the number
+	// of bytes appended. Throws on corrupt or truncated input.
+	size_t read(std::string& dst, size_t n);
+
+	// Did the last read end exactly at the end of a stream?
+	bool at_stream_end() const { return m_stream_end; }
+
+	// Has the last stream in the file been read?
+	bool eof() const { return m_eof; }
+
+	// Offset in the file of the next compressed byte to decode; at a
+	// stream end, where the next stream starts.
+	uint64_t offset() const { return m_pos - m_bz.avail_in; }
+
+private:
+	// Make sure at least n bytes of input are buffered, if the file has
+	// them. Returns false if it doesn't.
+	bool fill(size_t n);
+
+	int m_fd;
+	uint64_t m_pos; // file offset just past the buffered input
+	std::vector<char> m_in;
+	bz_stream m_bz;
+	bool m_open; // inside a stream
+	bool m_stream_end;
+	bool m_eof;
+};
+
+#endif
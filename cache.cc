@@ -0,0 +1,121 @@
+#include <cassert>
+#include "cache.hh"
+
+postings_cache::postings_cache(size_t budget)
+: m_budget(budget)
+, m_probation_bytes(0)
+, m_protected_bytes(0)
+{
+	//
+}
+
+size_t postings_cache::cost(const id_vector& postings)
+{
+	return postings.size() * sizeof(uint32_t) + CACHE_ENTRY_OVERHEAD;
+}
+
+bool postings_cache::get(const block_key& k, id_vector& dst)
+{
+	scoped_lock sync(monitor_mutex);
+	entry_map::iterator tgt(m_entries.find(k));
+	if (tgt == m_entries.end()) {
+		m_stats.misses++;
+		return false;
+	}
+	m_stats.hits++;
+	entry_list::iterator it(tgt->second);
+	dst.insert(dst.end(), it->postings.begin(), it->postings.end());
+	if (it->protect) {
+		m_protected.splice(m_protected.begin(), m_protected, it);
+	} else {
+		// second hit: promote out of probation
+		const size_t c(cost(it->postings));
+		it->protect = true;
+		m_probation_bytes -= c;
+		m_protected_bytes += c;
+		m_protected.splice(m_protected.begin(), m_probation, it);
+		rebalance();
+	}
+	return true;
+}
+
+void postings_cache::put(const block_key& k, const id_vector& postings)
+{
+	scoped_lock sync(monitor_mutex);
+	const size_t c(cost(postings));
+	if (c > m_budget - (m_budget * CACHE_PROTECTED_PERCENT / 100)) {
+		return;
+	}
+	if (m_entries.find(k) != m_entries.end()) {
+		return; // raced with another searcher; keep the existing one
+	}
+	m_probation.push_front(entry(k, postings, false));
+	m_entries.insert(std::make_pair(k, m_probation.begin()));
+	m_probation_bytes += c;
+	rebalance();
+}
+
+void postings_cache::purge(uint32_t segment)
+{
+	scoped_lock sync(monitor_mutex);
+	entry_map::iterator it(m_entries.lower_bound(block_key(segment, 0)));
+	while (it != m_entries.end() && it->first.segment == segment) {
+		entry_list::iterator victim(it->second);
+		++it;
+		erase(victim);
+	}
+}
+
+void postings_cache::set_budget(size_t budget)
+{
+	scoped_lock sync(monitor_mutex);
+	m_budget = budget;
+	rebalance();
+}
+
+size_t postings_cache::budget() const
+{
+	scoped_lock sync(monitor_mutex);
+	return m_budget;
+}
+
+cache_stats postings_cache::stats() const
+{
+	scoped_lock sync(monitor_mutex);
+	cache_stats s(m_stats);
+	s.bytes = m_probation_bytes + m_protected_bytes;
+	s.blocks = m_entries.size();
+	return s;
+}
+
+void postings_cache::rebalance()
+{
+	const size_t protected_budget(m_budget * CACHE_PROTECTED_PERCENT / 100);
+	while (m_protected_bytes > protected_budget) {
+		assert(!m_protected.empty());
+		entry_list::iterator it(--m_protected.end());
+		const size_t c(cost(it->postings));
+		it->protect = false;
+		m_protected_bytes -= c;
+		m_probation_bytes += c;
+		m_probation.splice(m_probation.begin(), m_protected, it);
+	}
+	while (m_probation_bytes + m_protected_bytes > m_budget) {
+		assert(!m_probation.empty());
+		erase(--m_probation.end());
+		m_stats.evictions++;
+	}
+}
+
+void postings_cache::erase(entry_list::iterator it)
+{
+	const size_t c(cost(it->postings));
+	m_entries.erase(it->key);
+	if (it->protect) {
+		m_protected_bytes -= c;
+		m_protected.erase(it);
+	} else {
+		m_probation_bytes -= c;
+		m_probation.erase(it);
+	}
+}
@@ -0,0 +1,112 @@
+#ifndef CACHE_HH_
+#define CACHE_HH_
+
+#include <list>
+#include <map>
+#include "thread.hh"
+#include "def.hh"
+
+// The postings_cache holds decoded postings blocks (the sequence of
+// article IDs found at a given offset in the inverted index portion of
+// an index file), keyed by the segment (index file) they came from and
+// their offset within it. It is shared by every searcher, so it's
+// synchronized.
+//
+// Memory is bounded by a budget in bytes. Eviction is segmented-LRU:
+// new blocks enter a probationary segment, and are only promoted to the
+// protected segment when they're hit again. A scan over lots of
+// one-off blocks (a rare term, a batch job) therefore only churns the
+// probationary segment, and can't flush out the popular blocks.
+
+// Fraction (in percent) of the budget reserved for protected blocks.
+#define CACHE_PROTECTED_PERCENT 80
+
+// Approximate bookkeeping cost of a single cached block.
+#define CACHE_ENTRY_OVERHEAD 96
+
+struct block_key {
+	block_key(uint32_t segment, uint64_t offset)
+	: segment(segment)
+	, offset(offset)
+	{
+		//
+	}
+
+	bool operator<(const block_key& rhs) const
+	{
+		if (segment != rhs.segment) {
+			return segment < rhs.segment;
+		}
+		return offset < rhs.offset;
+	}
+
+	uint32_t segment;
+	uint64_t offset;
+};
+
+struct cache_stats {
+	cache_stats() : hits(0), misses(0), evictions(0), bytes(0), blocks(0) { }
+
+	size_t hits;
+	size_t misses;
+	size_t evictions;
+	size_t bytes;
+	size_t blocks;
+};
+
+class postings_cache : public monitor
+{
+public:
+	postings_cache(size_t budget);
+
+	// If the block is cached, append its postings to dst and return true.
+	bool get(const block_key& k, id_vector& dst);
+
+	// Cache a copy of the postings for the block. Blocks bigger than
+	// the probationary segment are silently not cached.
+	void put(const block_key& k, const id_vector& postings);
+
+	// Drop every block belonging to the segment.
+	void purge(uint32_t segment);
+
+	// Change the memory budget, evicting as necessary. 0 disables caching.
+	void set_budget(size_t budget);
+	size_t budget() const;
+
+	cache_stats stats() const;
+
+private:
+	struct entry {
+		entry(const block_key& k, const id_vector& p, bool prot)
+		: key(k)
+		, postings(p)
+		, protect(prot)
+		{
+			//
+		}
+
+		block_key key;
+		id_vector postings;
+		bool protect;
+	};
+
+	typedef std::list<entry> entry_list;
+	typedef std::map<block_key, entry_list::iterator> entry_map;
+
+	static size_t cost(const id_vector& postings);
+
+	// Move protected blocks back to probation until the protected
+	// segment fits, then evict from probation until everything fits.
+	void rebalance();
+	void erase(entry_list::iterator it);
+
+	size_t m_budget;
+	size_t m_probation_bytes;
+	size_t m_protected_bytes;
+	entry_list m_probation; // most recently used at front
+	entry_list m_protected; // most recently used at front
+	entry_map m_entries;
+	cache_stats m_stats;
+};
+
+#endif
@@ -3,8 +3,10 @@
 extern "C" {
 	#include <unistd.h>
 	#include <stdlib.h>
+	#include <fcntl.h>
 	#include <sys/types.h>
 	#include <sys/sysctl.h>
+	#include <sys/time.h>
 }
 
 size_t get_cpus()
@@ -44,3 +46,71 @@ size_t get_cpus()
 	return 1;
 }
 
+uint64_t now_usec()
+{
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return static_cast<uint64_t>(tv.tv_sec) * 1000000 + tv.tv_usec;
+}
+
+uint64_t percentile(const std::vector<uint64_t>& sorted, double p)
+{
+	if (sorted.empty()) {
+		return 0;
+	}
+	size_t i(static_cast<size_t>(p * sorted.size()));
+	if (i >= sorted.size()) {
+		i = sorted.size() - 1;
+	}
+	return sorted[i];
+}
+
+bool sync_parent_dir(const std::string& filename)
+{
+	const std::string::size_type slash(filename.rfind('/'));
+	const std::string dir(
+		slash == std::string::npos ? "." :
+		slash == 0 ? "/" :
+		filename.substr(0, slash)
+	);
+	const int fd(open(dir.c_str(), O_RDONLY));
+	if (fd < 0) {
+		return false;
+	}
+	const int rc(fsync(fd));
+	close(fd);
+	return rc == 0;
+}
+
+uint64_t hash_bytes(const char *s, size_t len)
+{
+	uint64_t h(14695981039346656037ULL);
+	for (size_t i(0); i < len; ++i) {
+		h = (h ^ static_cast<unsigned char>(s[i])) * 1099511628211ULL;
+	}
+	return h;
+}
+
+size_t encode_varint(uint64_t v, char *dst)
+{
+	size_t n(0);
+	while (v >= 0x80) {
+		dst[n++] = static_cast<char>((v & 0x7f) | 0x80);
+		v >>= 7;
+	}
+	dst[n++] = static_cast<char>(v);
+	return n;
+}
+
+size_t decode_varint(const char *p, const char *end, uint64_t& v)
+{
+	v = 0;
+	for (size_t n(0); n < VARINT_MAX_SIZE && p + n < end; ++n) {
+		const unsigned char b(p[n]);
+		v |= static_cast<uint64_t>(b & 0x7f) << (7 * n);
+		if (!(b & 0x80)) {
+			return n + 1;
+		}
+	}
+	return 0;
+}
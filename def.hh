@@ -16,13 +16,25 @@
 
 static const char END_DELIM(0x03);
 
+// Index files begin with INDEX_MAGIC, a format version byte and '\n'
+// (see index_st::write_header). Files from before the format had a
+// version begin with their 32-bit header length instead, followed by
+// a '\n' where the version byte would be; they're version 1.
+#define INDEX_MAGIC "\x7fIDX"
+#define INDEX_MAGIC_SIZE 4
+#define INDEX_FORMAT_VERSION 2
+
+// Tags of the optional sections after the term block of a version 2
+// header.
+#define INDEX_SECTION_BLOOM 'B' // a bloom_filter over the file's terms
+#define INDEX_SECTION_TITLES 'T' // article IDs by the terms of their titles
+
 //
 // Typedefs
 //
 
 typedef std::vector<uint32_t> id_vector;
-typedef std::vector<uint32_t> offset_vector; // in index portion
-typedef std::vector<uint32_t> header_offset_vector;
+typedef std::vector<uint64_t> offset_vector; // in index portion
 
 struct search_result {
 	search_result(const std::string& article, size_t weight)
@@ -48,16 +60,50 @@ struct search_result {
 };
 
 struct search_results {
-	search_results() : total(0) { }
+	search_results() : total(0), partial(false) { }
 	
 	size_t total;
 	std::vector<search_result> top;
 	
+	// Some of the index files couldn't be searched (their shard didn't
+	// answer), so these are the results of the rest.
+	bool partial;
+	
+	// The terms actually searched for, if the query was expanded
+	// (wildcard or fuzzy); empty otherwise.
+	std::vector<std::string> expanded;
+	
+	// Opaque cursor for the next page of results, from search_page;
+	// empty if there (probably) are no more.
+	std::string cursor;
+	
 	void sort() { std::sort(top.begin(), top.end()); }
 };
 
 size_t get_cpus();
 
+// Wall-clock time in microseconds, for measuring intervals.
+uint64_t now_usec();
+
+// The p-th (0.0 - 1.0) percentile of an ascending sequence, or 0 if empty.
+uint64_t percentile(const std::vector<uint64_t>& sorted, double p);
+
+// fsync the directory holding filename, so a file just renamed into it
+// stays renamed after a crash. False if that failed.
+bool sync_parent_dir(const std::string& filename);
+
+// FNV-1a over len bytes, for our own hash tables.
+uint64_t hash_bytes(const char *s, size_t len);
+
+// Varints, as in LEB128: 7 bits per byte, lowest first, with the top
+// bit set on every byte but the last. encode_varint writes at most
+// VARINT_MAX_SIZE bytes to dst, returning how many. decode_varint
+// reads from p, never past end, returning the bytes consumed, or 0 if
+// the varint is truncated or too long.
+#define VARINT_MAX_SIZE 10
+size_t encode_varint(uint64_t v, char *dst);
+size_t decode_varint(const char *p, const char *end, uint64_t& v);
+
 //
 // Use hash-semantic maps.
 //
@@ -77,8 +123,6 @@ size_t get_cpus();
 typedef std::unordered_map<std::string, uint32_t> str_id_map;
 typedef std::unordered_map<uint32_t, id_vector> tid_aids_map;
 typedef std::unordered_map<uint32_t, offset_vector> tid_offsets_map;
-typedef std::unordered_map<uint32_t, std::string> aid_title_map;
-typedef std::unordered_map<std::string, header_offset_vector> term_hov_map;
 
 #  else
 
@@ -103,8 +147,6 @@ namespace __gnu_cxx
 typedef __gnu_cxx::hash_map<std::string, uint32_t> str_id_map;
 typedef __gnu_cxx::hash_map<uint32_t, id_vector> tid_aids_map;
 typedef __gnu_cxx::hash_map<uint32_t, offset_vector> tid_offsets_map;
-typedef __gnu_cxx::hash_map<uint32_t, std::string> aid_title_map;
-typedef __gnu_cxx::hash_map<std::string, header_offset_vector> term_hov_map;
 
 #  endif
 # elif __GNUC_MINOR__ > 2
@@ -118,8 +160,6 @@ typedef __gnu_cxx::hash_map<std::string, header_offset_vector> term_hov_map;
 typedef std::tr1::unordered_map<std::string, uint32_t> str_id_map;
 typedef std::tr1::unordered_map<uint32_t, id_vector> tid_aids_map;
 typedef std::tr1::unordered_map<uint32_t, offset_vector> tid_offsets_map;
-typedef std::tr1::unordered_map<uint32_t, std::string> aid_title_map;
-typedef std::tr1::unordered_map<std::string, header_offset_vector> term_hov_map;
 
 # endif
 #else
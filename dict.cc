@@ -0,0 +1,224 @@
+#include <algorithm>
+#include <cassert>
+#include "dict.hh"
+
+sorted_terms::sorted_terms()
+: m_leaves(0)
+{
+	//
+}
+
+void sorted_terms::clear()
+{
+	m_terms.clear();
+	m_freqs.clear();
+	m_tree.clear();
+	m_leaves = 0;
+}
+
+void sorted_terms::build(std::vector<term_frequency>& terms)
+{
+	clear();
+	std::sort(terms.begin(), terms.end());
+	size_t distinct(0);
+	for (size_t i(0); i < terms.size(); ++i) {
+		distinct += i == 0 || strcmp(terms[i-1].term, terms[i].term) != 0;
+	}
+	m_terms.reserve(distinct);
+	m_freqs.reserve(distinct);
+	typedef std::vector<term_frequency>::const_iterator tfcit;
+	for (tfcit it(terms.begin()); it != terms.end(); ++it) {
+		if (!m_terms.empty() && m_terms.back() == it->term) {
+			const uint64_t sum(static_cast<uint64_t>(m_freqs.back()) + it->frequency);
+			m_freqs.back() = sum > UINT32_MAX ? UINT32_MAX : sum;
+		} else {
+			m_terms.push_back(it->term);
+			m_freqs.push_back(it->frequency);
+		}
+	}
+	// bottom-up segment tree; leaf i lives at m_leaves + i
+	m_leaves = 1;
+	while (m_leaves < m_terms.size()) {
+		m_leaves *= 2;
+	}
+	m_tree.assign(2 * m_leaves, 0);
+	for (size_t i(0); i < m_terms.size(); ++i) {
+		m_tree[m_leaves + i] = i;
+	}
+	for (size_t i(m_terms.size()); i < m_leaves; ++i) {
+		m_tree[m_leaves + i] = m_terms.empty() ? 0 : m_terms.size() - 1;
+	}
+	for (size_t i(m_leaves - 1); i > 0; --i) {
+		const uint32_t l(m_tree[2*i]), r(m_tree[2*i+1]);
+		m_tree[i] = m_freqs.empty() || m_freqs[l] >= m_freqs[r] ? l : r;
+	}
+}
+
+size_t sorted_terms::argmax(size_t first, size_t last) const
+{
+	assert(first < last && last <= m_terms.size());
+	size_t best(first);
+	for (size_t l(first + m_leaves), r(last + m_leaves); l < r; l /= 2, r /= 2) {
+		if (l & 1) {
+			const uint32_t c(m_tree[l++]);
+			if (m_freqs[c] > m_freqs[best]) {
+				best = c;
+			}
+		}
+		if (r & 1) {
+			const uint32_t c(m_tree[--r]);
+			if (m_freqs[c] > m_freqs[best]) {
+				best = c;
+			}
+		}
+	}
+	return best;
+}
+
+// The smallest string greater than every string starting with prefix,
+// or the empty string if there is no such thing.
+static std::string successor(const std::string& prefix)
+{
+	std::string s(prefix);
+	while (!s.empty() && static_cast<unsigned char>(s[s.size()-1]) == 0xFF) {
+		s.erase(s.size()-1);
+	}
+	if (!s.empty()) {
+		s[s.size()-1]++;
+	}
+	return s;
+}
+
+size_t sorted_terms::skip_prefix(size_t i, const std::string& prefix) const
+{
+	const std::string upper(successor(prefix));
+	if (upper.empty()) {
+		return m_terms.size();
+	}
+	return std::lower_bound(m_terms.begin() + i, m_terms.end(), upper) - m_terms.begin();
+}
+
+std::pair<size_t, size_t> sorted_terms::prefix_range(const std::string& prefix) const
+{
+	typedef std::vector<std::string>::const_iterator tcit;
+	tcit first(std::lower_bound(m_terms.begin(), m_terms.end(), prefix));
+	const size_t i(first - m_terms.begin());
+	return std::make_pair(i, skip_prefix(i, prefix));
+}
+
+std::vector<fuzzy_match> sorted_terms::fuzzy(
+		const std::string& term,
+		size_t max_distance,
+		size_t n) const
+{
+	if (max_distance > MAX_FUZZY_DISTANCE) {
+		max_distance = MAX_FUZZY_DISTANCE;
+	}
+	typedef std::vector<unsigned char> dp_row;
+	const size_t qlen(term.size());
+	const unsigned char cap(max_distance + 1);
+	// rows[d] is the automaton state after the first d bytes of prev
+	std::vector<dp_row> rows(1, dp_row(qlen + 1));
+	for (size_t j(0); j <= qlen; ++j) {
+		rows[0][j] = j < cap ? j : cap;
+	}
+	std::string prev;
+	std::vector<fuzzy_match> matches;
+	size_t i(0);
+	while (i < m_terms.size()) {
+		const std::string& t(m_terms[i]);
+		size_t shared(0);
+		while (shared < t.size() && shared < prev.size() && t[shared] == prev[shared]) {
+			shared++;
+		}
+		if (shared > rows.size() - 1) {
+			shared = rows.size() - 1;
+		}
+		rows.resize(shared + 1);
+		bool dead(false);
+		for (size_t d(shared); d < t.size() && !dead; ++d) {
+			const dp_row& above(rows[d]);
+			dp_row row(qlen + 1);
+			row[0] = above[0] + 1 < cap ? above[0] + 1 : cap;
+			unsigned char best(row[0]);
+			for (size_t j(1); j <= qlen; ++j) {
+				unsigned char v(above[j-1] + (term[j-1] == t[d] ? 0 : 1)); // substitute
+				if (above[j] + 1 < v) {
+					v = above[j] + 1; // insert
+				}
+				if (row[j-1] + 1 < v) {
+					v = row[j-1] + 1; // delete
+				}
+				row[j] = v < cap ? v : cap;
+				if (row[j] < best) {
+					best = row[j];
+				}
+			}
+			rows.push_back(row);
+			dead = best >= cap;
+		}
+		prev = t;
+		if (dead) {
+			// nothing starting with this prefix can match
+			i = skip_prefix(i, t.substr(0, rows.size() - 1));
+			continue;
+		}
+		if (rows.back()[qlen] <= max_distance) {
+			matches.push_back(fuzzy_match(i, rows.back()[qlen], m_freqs[i]));
+		}
+		i++;
+	}
+	std::sort(matches.begin(), matches.end());
+	if (matches.size() > n) {
+		matches.erase(matches.begin() + n, matches.end());
+	}
+	return matches;
+}
+
+struct collect_completions {
+	collect_completions(const sorted_terms& terms, size_t n) : terms(terms), n(n) { }
+
+	bool operator()(size_t i)
+	{
+		out.push_back(completion(terms.term(i), terms.frequency(i)));
+		return out.size() < n;
+	}
+
+	const sorted_terms& terms;
+	const size_t n;
+	std::vector<completion> out;
+};
+
+std::vector<completion> sorted_terms::complete(const std::string& prefix, size_t n) const
+{
+	collect_completions c(*this, n);
+	if (n > 0) {
+		std::pair<size_t, size_t> range(prefix_range(prefix));
+		by_frequency(range.first, range.second, c);
+	}
+	return c.out;
+}
+
+bool wildcard_match(const std::string& pattern, const std::string& term)
+{
+	// iterative glob match with backtracking to the last '*'
+	size_t p(0), t(0), star(std::string::npos), mark(0);
+	while (t < term.size()) {
+		if (p < pattern.size() && pattern[p] == '*') {
+			star = p++;
+			mark = t;
+		} else if (p < pattern.size() && pattern[p] == term[t]) {
+			p++;
+			t++;
+		} else if (star != std::string::npos) {
+			p = star + 1;
+			t = ++mark;
+		} else {
+			return false;
+		}
+	}
+	while (p < pattern.size() && pattern[p] == '*') {
+		p++;
+	}
+	return p == pattern.size();
+}
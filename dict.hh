@@ -0,0 +1,173 @@
+#ifndef DICT_HH_
+#define DICT_HH_
+
+#include <string>
+#include <vector>
+#include <queue>
+#include <cstring>
+#include "def.hh"
+
+// A sorted_terms is an ordered view of the vocabulary of an index set,
+// for the lookups a hash map can't answer: prefix enumeration and
+// completion. Every term carries its frequency, the number of postings
+// for it across the set.
+//
+// Fuzzy lookups walk the sorted array as if it were a trie, running a
+// Levenshtein automaton (the edit distance DP row, capped at the maximum
+// distance) over the bytes of each term. Rows are shared between terms
+// with a common prefix, and as soon as a prefix can't lead to a match,
+// every term with that prefix is skipped with a binary search.
+//
+// Completions are ranked by frequency. A max-segment-tree over the
+// frequencies lets us pull the top n terms of any prefix range in
+// O(n log N), so even a one-letter prefix over millions of terms is
+// cheap.
+
+#define MAX_FUZZY_DISTANCE 3
+
+struct term_frequency {
+	term_frequency(const char *term, uint32_t frequency)
+	: term(term)
+	, frequency(frequency)
+	{
+		//
+	}
+
+	bool operator<(const term_frequency& rhs) const
+	{
+		return strcmp(term, rhs.term) < 0;
+	}
+
+	const char *term;
+	uint32_t frequency;
+};
+
+struct fuzzy_match {
+	fuzzy_match(size_t index, size_t distance, uint32_t frequency)
+	: index(index)
+	, distance(distance)
+	, frequency(frequency)
+	{
+		//
+	}
+
+	// closest first, then most frequent
+	bool operator<(const fuzzy_match& rhs) const
+	{
+		if (distance != rhs.distance) {
+			return distance < rhs.distance;
+		}
+		return frequency > rhs.frequency;
+	}
+
+	size_t index;
+	size_t distance;
+	uint32_t frequency;
+};
+
+struct completion {
+	completion(const std::string& term, size_t frequency)
+	: term(term)
+	, frequency(frequency)
+	{
+		//
+	}
+
+	std::string term;
+	size_t frequency;
+};
+
+class sorted_terms
+{
+public:
+	sorted_terms();
+
+	// Replace the contents with the given terms, which needn't be sorted
+	// or unique; frequencies of duplicate terms are summed. The strings
+	// are copied, once per distinct term.
+	void build(std::vector<term_frequency>& terms);
+	void clear();
+
+	size_t size() const { return m_terms.size(); }
+	const std::string& term(size_t i) const { return m_terms[i]; }
+	uint32_t frequency(size_t i) const { return m_freqs[i]; }
+
+	// The half-open range [first, second) of terms starting with prefix.
+	std::pair<size_t, size_t> prefix_range(const std::string& prefix) const;
+
+	// Visit terms in [first, last) in descending order of frequency,
+	// until the visitor returns false or every term has been visited.
+	// Cost is O(log N) per visited term.
+	template<typename visitor>
+	void by_frequency(size_t first, size_t last, visitor& v) const;
+
+	// Up to n terms starting with prefix, most frequent first.
+	std::vector<completion> complete(const std::string& prefix, size_t n) const;
+
+	// Up to n terms within max_distance (at most MAX_FUZZY_DISTANCE)
+	// edits of term, closest and then most frequent first.
+	std::vector<fuzzy_match> fuzzy(const std::string& term, size_t max_distance, size_t n) const;
+
+private:
+	// Index of the first term after i which doesn't start with prefix.
+	size_t skip_prefix(size_t i, const std::string& prefix) const;
+
+	// Index of the most frequent term in [first, last), which is not empty.
+	size_t argmax(size_t first, size_t last) const;
+
+	std::vector<std::string> m_terms;
+	std::vector<uint32_t> m_freqs;
+	std::vector<uint32_t> m_tree; // argmax for each segment tree node
+	size_t m_leaves;
+};
+
+// Does term match pattern, in which '*' matches any sequence of bytes?
+bool wildcard_match(const std::string& pattern, const std::string& term);
+
+struct range_candidate {
+	range_candidate(uint32_t frequency, size_t best, size_t first, size_t last)
+	: frequency(frequency)
+	, best(best)
+	, first(first)
+	, last(last)
+	{
+		//
+	}
+
+	bool operator<(const range_candidate& rhs) const
+	{
+		return frequency < rhs.frequency;
+	}
+
+	uint32_t frequency;
+	size_t best;
+	size_t first;
+	size_t last;
+};
+
+template<typename visitor>
+void sorted_terms::by_frequency(size_t first, size_t last, visitor& v) const
+{
+	std::priority_queue<range_candidate> q;
+	if (first < last) {
+		const size_t m(argmax(first, last));
+		q.push(range_candidate(m_freqs[m], m, first, last));
+	}
+	while (!q.empty()) {
+		const range_candidate c(q.top());
+		q.pop();
+		if (!v(c.best)) {
+			return;
+		}
+		if (c.first < c.best) {
+			const size_t m(argmax(c.first, c.best));
+			q.push(range_candidate(m_freqs[m], m, c.first, c.best));
+		}
+		if (c.best + 1 < c.last) {
+			const size_t m(argmax(c.best + 1, c.last));
+			q.push(range_candidate(m_freqs[m], m, c.best + 1, c.last));
+		}
+	}
+}
+
+#endif
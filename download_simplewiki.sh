@@ -1,3 +1,6 @@
 #!/bin/sh
 
-wget https://dumps.wikimedia.org/simplewiki/latest/simplewiki-latest-pages-articles.xml.bz2
+# The multistream dump can be indexed in parallel without decompressing it
+# first; the index next to it lists where each stream starts.
+wget https://dumps.wikimedia.org/simplewiki/latest/simplewiki-latest-pages-articles-multistream.xml.bz2
+wget https://dumps.wikimedia.org/simplewiki/latest/simplewiki-latest-pages-articles-multistream-index.txt.bz2
@@ -0,0 +1,137 @@
+#include <cstring>
+#include <cassert>
+#include "flat.hh"
+
+// Tables are kept at most half full, and are a power of two in size.
+#define FLAT_INITIAL_SLOTS 16
+
+static uint64_t mix(uint32_t key)
+{
+	return key * 0x9E3779B97F4A7C15ULL;
+}
+
+string_table::string_table()
+{
+	//
+}
+
+uint32_t string_table::probe(const char *s, size_t len, uint64_t hash) const
+{
+	const size_t mask(m_slots.size() - 1);
+	for (size_t i(hash & mask); ; i = (i + 1) & mask) {
+		const uint32_t n(m_slots[i]);
+		if (n == 0) {
+			return i;
+		}
+		const char *t(&m_chars[m_begin[n - 1]]);
+		if (strncmp(t, s, len) == 0 && t[len] == '\0') {
+			return i;
+		}
+	}
+}
+
+uint32_t string_table::insert(const char *s, size_t len)
+{
+	assert(memchr(s, '\0', len) == NULL);
+	if ((m_begin.size() + 1) * 2 > m_slots.size()) {
+		grow();
+	}
+	const uint32_t i(probe(s, len, hash_bytes(s, len)));
+	if (m_slots[i] != 0) {
+		return m_slots[i] - 1;
+	}
+	const uint32_t n(m_begin.size());
+	m_begin.push_back(m_chars.size());
+	m_chars.insert(m_chars.end(), s, s + len);
+	m_chars.push_back('\0');
+	m_slots[i] = n + 1;
+	return n;
+}
+
+uint32_t string_table::find(const std::string& s) const
+{
+	if (m_slots.empty() || s.find('\0') != std::string::npos) {
+		return FLAT_NOT_FOUND;
+	}
+	const uint32_t n(m_slots[probe(s.data(), s.size(), hash_bytes(s.data(), s.size()))]);
+	return n == 0 ? FLAT_NOT_FOUND : n - 1;
+}
+
+void string_table::grow()
+{
+	std::vector<uint32_t> slots(m_slots.empty() ? FLAT_INITIAL_SLOTS : m_slots.size() * 2, 0);
+	const size_t mask(slots.size() - 1);
+	for (size_t n(0); n < m_begin.size(); ++n) {
+		const char *s(&m_chars[m_begin[n]]);
+		size_t i(hash_bytes(s, strlen(s)) & mask);
+		while (slots[i] != 0) {
+			i = (i + 1) & mask;
+		}
+		slots[i] = n + 1;
+	}
+	m_slots.swap(slots);
+}
+
+void string_table::shrink()
+{
+	shrink_to_fit(m_chars);
+	shrink_to_fit(m_begin);
+}
+
+id_table::id_table()
+: m_used(0)
+{
+	//
+}
+
+void id_table::reserve(size_t n)
+{
+	size_t slots(FLAT_INITIAL_SLOTS);
+	while (slots < n * 2) {
+		slots *= 2;
+	}
+	if (slots <= m_slots.size()) {
+		return;
+	}
+	std::vector<slot> old(slots, slot(FLAT_NOT_FOUND, 0));
+	old.swap(m_slots);
+	m_used = 0;
+	typedef std::vector<slot>::const_iterator scit;
+	for (scit it(old.begin()); it != old.end(); ++it) {
+		if (it->first != FLAT_NOT_FOUND) {
+			insert(it->first, it->second);
+		}
+	}
+}
+
+void id_table::insert(uint32_t key, uint32_t value)
+{
+	assert(key != FLAT_NOT_FOUND);
+	if ((m_used + 1) * 2 > m_slots.size()) {
+		reserve(m_slots.empty() ? 1 : m_slots.size());
+	}
+	const size_t mask(m_slots.size() - 1);
+	size_t i(mix(key) & mask);
+	while (m_slots[i].first != FLAT_NOT_FOUND) {
+		assert(m_slots[i].first != key);
+		i = (i + 1) & mask;
+	}
+	m_slots[i] = slot(key, value);
+	m_used++;
+}
+
+uint32_t id_table::find(uint32_t key) const
+{
+	if (m_slots.empty()) {
+		return FLAT_NOT_FOUND;
+	}
+	const size_t mask(m_slots.size() - 1);
+	for (size_t i(mix(key) & mask); ; i = (i + 1) & mask) {
+		if (m_slots[i].first == key) {
+			return m_slots[i].second;
+		}
+		if (m_slots[i].first == FLAT_NOT_FOUND) {
+			return FLAT_NOT_FOUND;
+		}
+	}
+}
@@ -0,0 +1,77 @@
+#ifndef FLAT_HH_
+#define FLAT_HH_
+
+#include <string>
+#include <vector>
+#include <stdint.h>
+#include "def.hh"
+
+// Flat containers for the reader, which keeps the titles and terms of
+// every index file in memory. A std::string or std::vector per title or
+// term costs a heap block, and a hash map node, apiece; these keep the
+// same data in a few big arrays instead.
+
+#define FLAT_NOT_FOUND UINT32_MAX
+
+// Strings stored back to back in one arena, NUL-terminated, numbered
+// in the order they were added, and found by content with an
+// open-addressing table of their numbers. Strings can't contain NULs.
+class string_table
+{
+public:
+	string_table();
+
+	// The number of s, adding it if it's new.
+	uint32_t insert(const char *s, size_t len);
+
+	// The number of s, or FLAT_NOT_FOUND.
+	uint32_t find(const std::string& s) const;
+
+	const char *at(uint32_t i) const { return &m_chars[m_begin[i]]; }
+	uint32_t size() const { return m_begin.size(); }
+
+	// Give back the spare capacity left by insert(), once done.
+	void shrink();
+
+private:
+	uint32_t probe(const char *s, size_t len, uint64_t hash) const;
+	void grow();
+
+	std::vector<char> m_chars;
+	std::vector<uint32_t> m_begin; // of each string in m_chars
+	std::vector<uint32_t> m_slots; // string number + 1, or 0 if empty
+};
+
+// A map from 32 bit keys (anything but FLAT_NOT_FOUND) to 32 bit values,
+// in one open-addressing array.
+class id_table
+{
+public:
+	id_table();
+
+	// Size for n keys, to save growing while inserting them.
+	void reserve(size_t n);
+
+	// Map key to value; key must be new.
+	void insert(uint32_t key, uint32_t value);
+
+	// The value for key, or FLAT_NOT_FOUND.
+	uint32_t find(uint32_t key) const;
+
+	size_t size() const { return m_used; }
+
+private:
+	typedef std::pair<uint32_t, uint32_t> slot; // key, value
+
+	std::vector<slot> m_slots; // key FLAT_NOT_FOUND if empty
+	size_t m_used;
+};
+
+// Shrink a vector's capacity to its size, once it's done growing.
+template<typename T>
+void shrink_to_fit(std::vector<T>& v)
+{
+	std::vector<T>(v).swap(v);
+}
+
+#endif
@@ -0,0 +1,191 @@
+#include "fold.hh"
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+static bool is_ascii_term_byte(char c)
+{
+	return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9');
+}
+
+static char fold_ascii(char c)
+{
+	return c >= 'A' && c <= 'Z' ? c + ('a' - 'A') : c;
+}
+
+size_t fold_ascii_run_scalar(const char *buf, size_t len, std::string& term)
+{
+	size_t i(0);
+	for ( ; i < len && is_ascii_term_byte(buf[i]); ++i) {
+		term += fold_ascii(buf[i]);
+	}
+	return i;
+}
+
+#ifdef __SSE2__
+
+// 0xFF in each byte of x between lo and hi inclusive. SSE2 compares
+// are signed, so shift [lo, hi] down to the bottom of the signed range
+// and compare once.
+static inline __m128i in_range(__m128i x, char lo, char hi)
+{
+	const __m128i shifted(_mm_add_epi8(x, _mm_set1_epi8(static_cast<char>(-128 - lo))));
+	return _mm_cmplt_epi8(shifted, _mm_set1_epi8(static_cast<char>(-128 + (hi - lo + 1))));
+}
+
+size_t fold_ascii_run(const char *buf, size_t len, std::string& term)
+{
+	const __m128i case_bit(_mm_set1_epi8('a' - 'A'));
+	char folded[16];
+	size_t i(0);
+	for ( ; i + sizeof(folded) <= len; i += sizeof(folded)) {
+		const __m128i x(_mm_loadu_si128(reinterpret_cast<const __m128i *>(buf + i)));
+		const __m128i upper(in_range(x, 'A', 'Z'));
+		const __m128i term_bytes(_mm_or_si128(
+			_mm_or_si128(upper, in_range(x, 'a', 'z')),
+			in_range(x, '0', '9')));
+		const unsigned int mask(_mm_movemask_epi8(term_bytes));
+		_mm_storeu_si128(reinterpret_cast<__m128i *>(folded), _mm_add_epi8(x, _mm_and_si128(upper, case_bit)));
+		if (mask != 0xFFFF) {
+			const size_t n(__builtin_ctz(~mask));
+			term.append(folded, n);
+			return i + n;
+		}
+		term.append(folded, sizeof(folded));
+	}
+	return i + fold_ascii_run_scalar(buf + i, len - i, term);
+}
+
+#else
+
+size_t fold_ascii_run(const char *buf, size_t len, std::string& term)
+{
+	return fold_ascii_run_scalar(buf, len, term);
+}
+
+#endif
+
+uint32_t fold_code_point(uint32_t cp)
+{
+	if (cp < 0x80) {
+		return fold_ascii(cp);
+	}
+	// Latin-1 Supplement, less the multiplication sign
+	if (cp >= 0xC0 && cp <= 0xDE && cp != 0xD7) {
+		return cp + 0x20;
+	}
+	// Latin Extended-A, mostly upper/lower pairs
+	if (cp == 0x130) {
+		return 'i';
+	}
+	if (cp == 0x178) {
+		return 0xFF;
+	}
+	if ((cp >= 0x100 && cp <= 0x137) || (cp >= 0x14A && cp <= 0x177)) {
+		return cp | 1;
+	}
+	if ((cp >= 0x139 && cp <= 0x148) || (cp >= 0x179 && cp <= 0x17E)) {
+		return cp & 1 ? cp + 1 : cp;
+	}
+	// Greek
+	if (cp >= 0x391 && cp <= 0x3AB && cp != 0x3A2) {
+		return cp + 0x20;
+	}
+	if (cp == 0x386) {
+		return 0x3AC;
+	}
+	if (cp >= 0x388 && cp <= 0x38A) {
+		return cp + 0x25;
+	}
+	if (cp == 0x38C) {
+		return 0x3CC;
+	}
+	if (cp == 0x38E || cp == 0x38F) {
+		return cp + 0x3F;
+	}
+	// Cyrillic
+	if (cp >= 0x400 && cp <= 0x40F) {
+		return cp + 0x50;
+	}
+	if (cp >= 0x410 && cp <= 0x42F) {
+		return cp + 0x20;
+	}
+	if ((cp >= 0x460 && cp <= 0x481) || (cp >= 0x48A && cp <= 0x4BF) || (cp >= 0x4D0 && cp <= 0x52F)) {
+		return cp | 1;
+	}
+	// Armenian
+	if (cp >= 0x531 && cp <= 0x556) {
+		return cp + 0x30;
+	}
+	// Latin Extended Additional, eg. Vietnamese
+	if ((cp >= 0x1E00 && cp <= 0x1E95) || (cp >= 0x1EA0 && cp <= 0x1EFF)) {
+		return cp | 1;
+	}
+	// fullwidth Latin
+	if (cp >= 0xFF21 && cp <= 0xFF3A) {
+		return cp + 0x20;
+	}
+	return cp;
+}
+
+static void append_utf8(uint32_t cp, std::string& s)
+{
+	if (cp < 0x80) {
+		s += static_cast<char>(cp);
+	} else if (cp < 0x800) {
+		s += static_cast<char>(0xC0 | (cp >> 6));
+		s += static_cast<char>(0x80 | (cp & 0x3F));
+	} else if (cp < 0x10000) {
+		s += static_cast<char>(0xE0 | (cp >> 12));
+		s += static_cast<char>(0x80 | ((cp >> 6) & 0x3F));
+		s += static_cast<char>(0x80 | (cp & 0x3F));
+	} else {
+		s += static_cast<char>(0xF0 | (cp >> 18));
+		s += static_cast<char>(0x80 | ((cp >> 12) & 0x3F));
+		s += static_cast<char>(0x80 | ((cp >> 6) & 0x3F));
+		s += static_cast<char>(0x80 | (cp & 0x3F));
+	}
+}
+
+size_t fold_utf8(const char *buf, size_t len, std::string& term)
+{
+	const unsigned char *b(reinterpret_cast<const unsigned char *>(buf));
+	if (len == 0) {
+		return 0;
+	}
+	if (b[0] < 0x80) {
+		term += fold_ascii(buf[0]);
+		return 1;
+	}
+	size_t n(0);
+	uint32_t cp(0), min(0);
+	if ((b[0] & 0xE0) == 0xC0) {
+		n = 2; cp = b[0] & 0x1F; min = 0x80;
+	} else if ((b[0] & 0xF0) == 0xE0) {
+		n = 3; cp = b[0] & 0x0F; min = 0x800;
+	} else if ((b[0] & 0xF8) == 0xF0) {
+		n = 4; cp = b[0] & 0x07; min = 0x10000;
+	}
+	bool valid(n > 0 && n <= len);
+	for (size_t i(1); valid && i < n; ++i) {
+		valid = (b[i] & 0xC0) == 0x80;
+		cp = (cp << 6) | (b[i] & 0x3F);
+	}
+	if (!valid || cp < min || cp > 0x10FFFF || (cp >= 0xD800 && cp <= 0xDFFF)) {
+		term += buf[0];
+		return 1;
+	}
+	append_utf8(fold_code_point(cp), term);
+	return n;
+}
+
+std::string fold_case(const std::string& s)
+{
+	std::string folded;
+	folded.reserve(s.size());
+	for (size_t i(0); i < s.size(); ) {
+		i += fold_utf8(s.data() + i, s.size() - i, folded);
+	}
+	return folded;
+}
@@ -0,0 +1,38 @@
+#ifndef FOLD_HH_
+#define FOLD_HH_
+
+#include <string>
+#include <stdint.h>
+
+// Case folding for the tokenizer, and for queries, which have to be
+// folded the same way to match.
+//
+// Most article text is runs of ASCII letters and digits, which go
+// straight into the term, lowercased. fold_ascii_run finds and folds
+// such a run 16 bytes at a time with SSE2 (the x86-64 baseline, so no
+// special build flags), leaving punctuation, markup and non-ASCII
+// bytes to the tokenizer's switch; fold_ascii_run_scalar is the same
+// thing a byte at a time, for other targets and for testing.
+//
+// Non-ASCII text is lowercased a UTF-8 sequence at a time, by code
+// point, for the Latin, Greek, Cyrillic and Armenian alphabets and
+// fullwidth Latin. That isn't full Unicode case folding, but covers
+// most of what Wikipedia's languages capitalize. Malformed UTF-8 is
+// passed through a byte at a time, unchanged.
+
+// Append the run of ASCII letters and digits at the start of buf to
+// term, lowercased. Returns the length of the run.
+size_t fold_ascii_run(const char *buf, size_t len, std::string& term);
+size_t fold_ascii_run_scalar(const char *buf, size_t len, std::string& term);
+
+// Append the UTF-8 sequence at the start of buf to term, lowercased.
+// Returns the number of bytes used, at least 1.
+size_t fold_utf8(const char *buf, size_t len, std::string& term);
+
+// The lowercase of a code point, or the code point itself.
+uint32_t fold_code_point(uint32_t cp);
+
+// s lowercased as the tokenizer would, ASCII and UTF-8 alike.
+std::string fold_case(const std::string& s);
+
+#endif
@@ -0,0 +1,493 @@
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+#include <set>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include "def.hh"
+
+extern "C" {
+	#include <unistd.h>
+}
+
+// gencorpus writes a synthetic MediaWiki export of any size, for
+// benchmarking without a real dump. Output is a function of the seed
+// only, so runs on different machines index the same bytes.
+//
+// The vocabulary is made of pronounceable pseudo-words, led by real
+// stop words, and drawn from a Zipf distribution. Article lengths are
+// log-normal, like Wikipedia's: most are short, a few are huge. Text
+// carries the markup the tokenizer has to deal with: templates (some
+// nested), internal and piped links, external links, refs, entities,
+// headings, bold and italics, categories and interlanguage links. A
+// few pages are in special namespaces, and some revisions are by IP
+// addresses, both of which the indexer skips.
+
+#define DEFAULT_ARTICLES 10000
+#define DEFAULT_VOCABULARY 100000
+#define DEFAULT_SEED 1
+#define ZIPF_EXPONENT 1.07
+#define LENGTH_MU 5.3     // log-normal article length in words;
+#define LENGTH_SIGMA 1.1  // median ~200, mean ~370
+#define MIN_WORDS 8
+#define MAX_WORDS 40000
+
+// xorshift64*, so the stream doesn't depend on the platform's rand()
+class prng
+{
+public:
+	explicit prng(uint64_t seed) : m_state(seed ? seed : 0x9E3779B97F4A7C15ULL) { }
+
+	uint64_t next()
+	{
+		m_state ^= m_state >> 12;
+		m_state ^= m_state << 25;
+		m_state ^= m_state >> 27;
+		return m_state * 0x2545F4914F6CDD1DULL;
+	}
+
+	// uniform in [0, 1)
+	double uniform() { return (next() >> 11) * (1.0 / 9007199254740992.0); }
+
+	// uniform in [0, n)
+	size_t below(size_t n) { return n ? next() % n : 0; }
+
+	bool chance(double p) { return uniform() < p; }
+
+	// standard normal, by Box-Muller
+	double normal()
+	{
+		double u(uniform());
+		while (u <= 0.0) {
+			u = uniform();
+		}
+		return std::sqrt(-2.0 * std::log(u)) * std::cos(2.0 * M_PI * uniform());
+	}
+
+private:
+	uint64_t m_state;
+};
+
+static const char *STOP_WORDS[] = {
+	"the", "of", "and", "in", "is", "a", "to", "was", "it", "for",
+	"on", "as", "by", "with", "he", "that", "from", "at", "his", "are",
+	"an", "be", "or", "which", "has", "also", "its", "were", "this", "one",
+	NULL
+};
+
+static const char *ONSETS[] = {
+	"", "b", "c", "d", "f", "g", "h", "k", "l", "m", "n", "p", "r", "s",
+	"t", "v", "w", "z", "br", "ch", "cl", "dr", "fr", "gr", "pl", "sh",
+	"st", "str", "th", "tr", NULL
+};
+
+static const char *NUCLEI[] = {
+	"a", "e", "i", "o", "u", "ai", "ea", "ie", "ou", "y", NULL
+};
+
+static const char *CODAS[] = {
+	"", "", "", "n", "r", "s", "l", "m", "t", "nd", "ng", "rt", "st", "x", NULL
+};
+
+// With -u, some words are Cyrillic, Greek or accented Latin instead,
+// for benchmarking the tokenizer on multilingual text.
+struct letter {
+	const char *lower;
+	const char *upper;
+};
+
+static const letter CYRILLIC_ONSETS[] = {
+	{ "б", "Б" }, { "в", "В" }, { "г", "Г" }, { "д", "Д" }, { "ж", "Ж" },
+	{ "к", "К" }, { "л", "Л" }, { "м", "М" }, { "н", "Н" }, { "п", "П" },
+	{ "р", "Р" }, { "с", "С" }, { "т", "Т" }, { "ш", "Ш" }, { NULL, NULL }
+};
+
+static const char *CYRILLIC_NUCLEI[] = {
+	"а", "е", "и", "о", "у", "ы", "я", NULL
+};
+
+static const letter GREEK_ONSETS[] = {
+	{ "β", "Β" }, { "γ", "Γ" }, { "δ", "Δ" }, { "κ", "Κ" }, { "λ", "Λ" },
+	{ "μ", "Μ" }, { "ν", "Ν" }, { "π", "Π" }, { "ρ", "Ρ" }, { "σ", "Σ" },
+	{ "τ", "Τ" }, { "φ", "Φ" }, { "χ", "Χ" }, { NULL, NULL }
+};
+
+static const char *GREEK_NUCLEI[] = {
+	"α", "ε", "η", "ι", "ο", "υ", "ω", NULL
+};
+
+static const char *ACCENTED_NUCLEI[] = {
+	"é", "è", "ê", "ü", "ö", "ä", "å", "ø", "í", "ó", "a", "e", "o", NULL
+};
+
+static size_t count_of(const letter *letters)
+{
+	size_t n(0);
+	while (letters[n].lower) {
+		n++;
+	}
+	return n;
+}
+
+static size_t count_of(const char **words)
+{
+	size_t n(0);
+	while (words[n]) {
+		n++;
+	}
+	return n;
+}
+
+class corpus
+{
+public:
+	corpus(uint64_t seed, size_t vocabulary, double multilingual);
+
+	// Append one <page> element to out.
+	void page(size_t id, std::string& out);
+
+private:
+	std::string foreign_word(size_t syllables);
+	const std::string& word();
+	std::string capitalized(const std::string& w);
+	std::string title();
+	void paragraph(std::string& out, size_t words);
+	void infobox(std::string& out);
+	void ref(std::string& out);
+
+	prng m_rng;
+	std::vector<std::string> m_words;
+	std::vector<double> m_cdf; // cumulative Zipf weights, by rank
+	std::set<std::string> m_titles;
+	uint64_t m_revision;
+};
+
+corpus::corpus(uint64_t seed, size_t vocabulary, double multilingual)
+: m_rng(seed)
+, m_revision(1000000)
+{
+	std::set<std::string> seen;
+	for (const char **w(STOP_WORDS); *w; ++w) {
+		m_words.push_back(*w);
+		seen.insert(*w);
+	}
+	const size_t onsets(count_of(ONSETS)), nuclei(count_of(NUCLEI)), codas(count_of(CODAS));
+	while (m_words.size() < vocabulary) {
+		// shorter words are more common, as in natural language
+		const size_t syllables(1 + m_rng.below(2 + m_words.size() * 3 / vocabulary));
+		std::string w;
+		if (multilingual > 0 && m_rng.chance(multilingual)) {
+			w = foreign_word(syllables);
+		} else {
+			for (size_t i(0); i < syllables; ++i) {
+				w += ONSETS[m_rng.below(onsets)];
+				w += NUCLEI[m_rng.below(nuclei)];
+				w += CODAS[m_rng.below(codas)];
+			}
+		}
+		if (w.size() > 1 && seen.insert(w).second) {
+			m_words.push_back(w);
+		}
+	}
+	double sum(0);
+	m_cdf.reserve(m_words.size());
+	for (size_t r(0); r < m_words.size(); ++r) {
+		sum += 1.0 / std::pow(r + 1.0, ZIPF_EXPONENT);
+		m_cdf.push_back(sum);
+	}
+}
+
+std::string corpus::foreign_word(size_t syllables)
+{
+	std::string w;
+	switch (m_rng.below(3)) {
+	case 0:
+		for (size_t i(0); i < syllables; ++i) {
+			w += CYRILLIC_ONSETS[m_rng.below(count_of(CYRILLIC_ONSETS))].lower;
+			w += CYRILLIC_NUCLEI[m_rng.below(count_of(CYRILLIC_NUCLEI))];
+		}
+		break;
+	case 1:
+		for (size_t i(0); i < syllables; ++i) {
+			w += GREEK_ONSETS[m_rng.below(count_of(GREEK_ONSETS))].lower;
+			w += GREEK_NUCLEI[m_rng.below(count_of(GREEK_NUCLEI))];
+		}
+		break;
+	default:
+		for (size_t i(0); i < syllables; ++i) {
+			w += ONSETS[m_rng.below(count_of(ONSETS))];
+			w += ACCENTED_NUCLEI[m_rng.below(count_of(ACCENTED_NUCLEI))];
+			w += CODAS[m_rng.below(count_of(CODAS))];
+		}
+		break;
+	}
+	return w;
+}
+
+const std::string& corpus::word()
+{
+	const double x(m_rng.uniform() * m_cdf.back());
+	size_t r(std::upper_bound(m_cdf.begin(), m_cdf.end(), x) - m_cdf.begin());
+	if (r >= m_words.size()) {
+		r = m_words.size() - 1;
+	}
+	return m_words[r];
+}
+
+std::string corpus::capitalized(const std::string& w)
+{
+	std::string s(w);
+	if (!s.empty() && s[0] >= 'a' && s[0] <= 'z') {
+		s[0] = s[0] - 'a' + 'A';
+		return s;
+	}
+	const letter *alphabets[] = { CYRILLIC_ONSETS, GREEK_ONSETS };
+	for (size_t i(0); i < sizeof(alphabets) / sizeof(*alphabets); ++i) {
+		for (const letter *l(alphabets[i]); l->lower; ++l) {
+			const size_t n(strlen(l->lower));
+			if (s.compare(0, n, l->lower) == 0) {
+				return l->upper + s.substr(n);
+			}
+		}
+	}
+	return s;
+}
+
+std::string corpus::title()
+{
+	for (;;) {
+		std::string t(capitalized(word()));
+		const size_t extra(m_rng.below(3));
+		for (size_t i(0); i < extra; ++i) {
+			t += ' ';
+			t += m_rng.chance(0.5) ? capitalized(word()) : word();
+		}
+		if (m_titles.size() > m_words.size() / 2 || m_rng.chance(0.1)) {
+			// disambiguated, as Wikipedia does
+			std::ostringstream oss;
+			oss << t << " (" << m_rng.below(2100) << ')';
+			t = oss.str();
+		}
+		if (m_titles.insert(t).second) {
+			return t;
+		}
+	}
+}
+
+void corpus::ref(std::string& out)
+{
+	out += "&lt;ref&gt;{{cite web|url=http://www.example.org/";
+	out += word();
+	out += "|title=";
+	out += capitalized(word());
+	out += ' ';
+	out += word();
+	out += "|accessdate=2011-";
+	out += static_cast<char>('0' + m_rng.below(10));
+	out += "-1}}&lt;/ref&gt;";
+}
+
+void corpus::infobox(std::string& out)
+{
+	out += "{{Infobox ";
+	out += word();
+	out += '\n';
+	const size_t fields(3 + m_rng.below(8));
+	for (size_t i(0); i < fields; ++i) {
+		out += "| ";
+		out += word();
+		out += " = ";
+		if (m_rng.chance(0.3)) {
+			out += "{{convert|";
+			out += static_cast<char>('1' + m_rng.below(9));
+			out += "|km|mi}}";
+		} else {
+			out += "[[";
+			out += capitalized(word());
+			out += "]] ";
+			out += word();
+		}
+		out += '\n';
+	}
+	out += "}}\n";
+}
+
+void corpus::paragraph(std::string& out, size_t words)
+{
+	bool sentence_start(true);
+	for (size_t i(0); i < words; ++i) {
+		const std::string& w(word());
+		const std::string text(sentence_start ? capitalized(w) : w);
+		sentence_start = false;
+		const double x(m_rng.uniform());
+		if (x < 0.06) {
+			out += "[[" + text + "]]";
+		} else if (x < 0.08) {
+			out += "[[" + capitalized(word()) + '|' + text + "]]";
+		} else if (x < 0.085) {
+			out += "[http://www." + word() + ".org/" + word() + ' ' + text + ']';
+		} else if (x < 0.095) {
+			out += "'''" + text + "'''";
+		} else if (x < 0.105) {
+			out += "''" + text + "''";
+		} else if (x < 0.11) {
+			out += "&quot;" + text + "&quot;";
+		} else {
+			out += text;
+		}
+		if (m_rng.chance(0.08)) {
+			out += '.';
+			if (m_rng.chance(0.15)) {
+				ref(out);
+			}
+			sentence_start = true;
+		} else if (m_rng.chance(0.07)) {
+			out += ',';
+		}
+		out += ' ';
+	}
+	out += ".\n\n";
+}
+
+static std::string ip_address(prng& rng)
+{
+	std::ostringstream oss;
+	oss << 1 + rng.below(223) << '.' << rng.below(256) << '.'
+	    << rng.below(256) << '.' << 1 + rng.below(254);
+	return oss.str();
+}
+
+void corpus::page(size_t id, std::string& out)
+{
+	std::string t(title());
+	const double ns(m_rng.uniform());
+	if (ns < 0.01) {
+		t = "Category:" + t;
+	} else if (ns < 0.02) {
+		t = "Template:" + t;
+	} else if (ns < 0.025) {
+		t = "Wikipedia:" + t;
+	}
+	std::ostringstream head;
+	head << "  <page>\n"
+	     << "    <title>" << t << "</title>\n"
+	     << "    <id>" << id << "</id>\n"
+	     << "    <revision>\n"
+	     << "      <id>" << m_revision++ << "</id>\n"
+	     << "      <timestamp>2011-11-28T01:33:32Z</timestamp>\n"
+	     << "      <contributor>\n";
+	if (m_rng.chance(0.8)) {
+		head << "        <username>" << capitalized(word()) << "Bot" << m_rng.below(100) << "</username>\n"
+		     << "        <id>" << 1 + m_rng.below(1000000) << "</id>\n";
+	} else {
+		head << "        <ip>" << ip_address(m_rng) << "</ip>\n";
+	}
+	head << "      </contributor>\n"
+	     << "      <comment>" << word() << ' ' << word() << "</comment>\n"
+	     << "      <text xml:space=\"preserve\">";
+	out += head.str();
+
+	double n(std::exp(LENGTH_MU + LENGTH_SIGMA * m_rng.normal()));
+	size_t words(n < MIN_WORDS ? MIN_WORDS : n > MAX_WORDS ? MAX_WORDS : static_cast<size_t>(n));
+	if (m_rng.chance(0.3)) {
+		infobox(out);
+	}
+	out += "'''" + t + "''' ";
+	bool first(true);
+	while (words > 0) {
+		const size_t p(std::min(words, 20 + m_rng.below(100)));
+		if (!first && m_rng.chance(0.3)) {
+			out += "== " + capitalized(word()) + ' ' + word() + " ==\n";
+		}
+		paragraph(out, p);
+		words -= p;
+		first = false;
+	}
+	if (m_rng.chance(0.4)) {
+		out += "{{Stub}}\n\n";
+	}
+	const size_t categories(m_rng.below(4));
+	for (size_t i(0); i < categories; ++i) {
+		out += "[[Category:" + capitalized(word()) + ' ' + word() + "]]\n";
+	}
+	static const char *LANGUAGES[] = { "de", "fr", "es", "it", "nl", "pl", "ru", "sv", "zh-min-nan", NULL };
+	const size_t languages(m_rng.below(count_of(LANGUAGES) + 1));
+	for (size_t i(0); i < languages; ++i) {
+		out += std::string("[[") + LANGUAGES[i] + ':' + capitalized(word()) + "]]\n";
+	}
+	out += "</text>\n"
+	       "    </revision>\n"
+	       "  </page>\n";
+}
+
+static const char *HEADER =
+	"<mediawiki xmlns=\"http://www.mediawiki.org/xml/export-0.5/\" version=\"0.5\" xml:lang=\"en\">\n"
+	"  <siteinfo>\n"
+	"    <sitename>Wikipedia</sitename>\n"
+	"    <generator>gencorpus</generator>\n"
+	"    <case>first-letter</case>\n"
+	"  </siteinfo>\n";
+
+static const char *FOOTER = "</mediawiki>\n";
+
+static void usage(const char *argv0)
+{
+	std::cerr << "usage: " << argv0
+	          << " [-n articles | -m megabytes] [-v vocabulary] [-u multilingual share] [-s seed] <xml | ->"
+	          << std::endl;
+}
+
+int main(int argc, char *argv[])
+{
+	size_t articles(DEFAULT_ARTICLES), megabytes(0), vocabulary(DEFAULT_VOCABULARY);
+	uint64_t seed(DEFAULT_SEED);
+	double multilingual(0);
+	int opt;
+	while ((opt = getopt(argc, argv, "n:m:v:u:s:")) != -1) {
+		switch (opt) {
+		case 'n': articles = strtoul(optarg, NULL, 10); break;
+		case 'm': megabytes = strtoul(optarg, NULL, 10); break;
+		case 'v': vocabulary = strtoul(optarg, NULL, 10); break;
+		case 'u': multilingual = atof(optarg); break;
+		case 's': seed = strtoull(optarg, NULL, 10); break;
+		default: usage(argv[0]); return 1;
+		}
+	}
+	if (optind + 1 != argc || vocabulary < 100 || multilingual < 0 || multilingual > 1) {
+		usage(argv[0]);
+		return 1;
+	}
+	const std::string filename(argv[optind]);
+	std::ofstream ofs;
+	if (filename != "-") {
+		ofs.open(filename.c_str(), std::ios::out | std::ios::binary);
+		if (!ofs.good()) {
+			std::cerr << "failed to create " << filename << std::endl;
+			return 1;
+		}
+	}
+	std::ostream& out(filename == "-" ? std::cout : ofs);
+	corpus c(seed, vocabulary, multilingual);
+	const uint64_t limit(static_cast<uint64_t>(megabytes) * 1024 * 1024);
+	uint64_t bytes(0);
+	size_t id(1);
+	std::string buf;
+	out << HEADER;
+	for ( ; megabytes ? bytes < limit : id <= articles; ++id) {
+		buf.clear();
+		c.page(id, buf);
+		out.write(buf.data(), buf.size());
+		bytes += buf.size();
+	}
+	out << FOOTER;
+	out.flush();
+	if (!out.good()) {
+		std::cerr << "write failed" << std::endl;
+		return 1;
+	}
+	std::cerr << id - 1 << " articles, " << bytes / (1024 * 1024) << "MB" << std::endl;
+	return 0;
+}
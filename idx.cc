@@ -1,8 +1,18 @@
 #include <cassert>
+#include <algorithm>
 #include <sstream>
 #include <stdexcept>
+#include <cstdio>
 #include <cstring>
 #include "idx.hh"
+#include "bz2.hh"
+#include "fold.hh"
+#include "bloom.hh"
+
+extern "C" {
+	#include <unistd.h>
+	#include <fcntl.h>
+}
 
 template<typename T>
 static void write(std::ofstream& ofs, const T& t)
@@ -15,6 +25,20 @@ static void write(std::ofstream& ofs, const T& t)
 	);
 }
 
+// Make sure a finished file is on disk before we say so in a checkpoint.
+static void sync_file(const std::string& filename)
+{
+	const int fd(open(filename.c_str(), O_RDONLY));
+	if (fd < 0) {
+		throw std::runtime_error("failed to open " + filename + " to sync");
+	}
+	const int rc(fsync(fd));
+	close(fd);
+	if (rc != 0) {
+		throw std::runtime_error("failed to sync " + filename);
+	}
+}
+
 static void merge(const std::string& idx_fn, const std::string& hdr_fn)
 {
 	// :(
@@ -30,11 +54,57 @@ static void merge(const std::string& idx_fn, const std::string& hdr_fn)
 	}
 }
 
-index_st::index_st(const std::string& basename)
+idx_stats::idx_stats()
+: bytes(0)
+, articles(0)
+, terms(0)
+, postings(0)
+, read_usec(0)
+, tokenize_usec(0)
+, index_usec(0)
+, flush_usec(0)
+{
+	//
+}
+
+static uint64_t atomic_read(const uint64_t& counter)
+{
+	return __sync_fetch_and_add(const_cast<uint64_t *>(&counter), 0);
+}
+
+idx_stats idx_stats::snapshot() const
+{
+	idx_stats s;
+	s.bytes = atomic_read(bytes);
+	s.articles = atomic_read(articles);
+	s.terms = atomic_read(terms);
+	s.postings = atomic_read(postings);
+	s.read_usec = atomic_read(read_usec);
+	s.tokenize_usec = atomic_read(tokenize_usec);
+	s.index_usec = atomic_read(index_usec);
+	s.flush_usec = atomic_read(flush_usec);
+	return s;
+}
+
+void idx_stats::add(const idx_stats& rhs)
+{
+	bytes += rhs.bytes;
+	articles += rhs.articles;
+	terms += rhs.terms;
+	postings += rhs.postings;
+	read_usec += rhs.read_usec;
+	tokenize_usec += rhs.tokenize_usec;
+	index_usec += rhs.index_usec;
+	flush_usec += rhs.flush_usec;
+}
+
+index_st::index_st(const std::string& basename, size_t first_flush, term_dictionary *terms)
 : m_basename(basename)
-, m_flush_count(0)
+, m_flush_count(first_flush)
+, m_dictionary(terms)
 , m_aid(1)
 , m_tid(1)
+, m_postings(0)
 , m_ofs_idx(NULL)
 , m_ofs_hdr(NULL)
 {
@@ -53,6 +123,30 @@ void index_st::index(const std::vector<std::string>& terms, const std::string& a
 	}
 }
 
+void index_st::index_title(const std::vector<std::string>& terms, const std::string& article)
+{
+	scoped_lock sync(monitor_mutex);
+	const uint32_t aid(article_id(article));
+	typedef std::vector<std::string>::const_iterator svcit;
+	for (svcit it(terms.begin()); it != terms.end(); ++it) {
+		assert(!it->empty());
+		str_id_map::const_iterator tgt(m_title_terms.find(*it));
+		uint32_t n(0);
+		if (tgt == m_title_terms.end()) {
+			n = m_title_index.size();
+			m_title_terms.insert(std::make_pair(*it, n));
+			m_title_index.push_back(id_vector());
+		} else {
+			n = tgt->second;
+		}
+		// a word repeated in the title counts once
+		id_vector& aids(m_title_index[n]);
+		if (aids.empty() || aids.back() != aid) {
+			aids.push_back(aid);
+		}
+	}
+}
+
 void index_st::flush(bool last_flush)
 {
 	scoped_lock sync(monitor_mutex);
@@ -67,7 +161,11 @@ void index_st::flush(bool last_flush)
 	write_header();
 	m_ofs_idx->close();
 	m_ofs_hdr->close();
+	if (m_dictionary) {
+		m_dictionary->sync();
+	}
 	merge(idx_filename(), hdr_filename());
+	sync_file(idx_filename());
 	reset_state();
 	m_flush_count++;
 	if (!last_flush) {
@@ -81,6 +179,17 @@ size_t index_st::article_count() const
 	return m_articles.size();
 }
 
+size_t index_st::flush_count() const
+{
+	scoped_lock sync(monitor_mutex);
+	return m_flush_count;
+}
+
+uint64_t index_st::postings_written() const
+{
+	return atomic_read(m_postings);
+}
+
 bool index_st::has_article(const std::string& article)
 {
 	scoped_lock sync(monitor_mutex);
@@ -94,11 +203,17 @@ bool index_st::is_associated(const std::string& article, const std::string& term
 	if (atgt == m_articles.end()) {
 		return false;
 	}
-	str_id_map::iterator ttgt(m_terms.find(term));
-	if (ttgt == m_terms.end()) {
+	uint32_t tid(0);
+	if (m_dictionary) {
+		tid = m_dictionary->find(term);
+	} else {
+		str_id_map::iterator ttgt(m_terms.find(term));
+		tid = ttgt == m_terms.end() ? 0 : ttgt->second;
+	}
+	if (tid == 0) {
 		return false;
 	}
-	const uint32_t tid(ttgt->second), aid(atgt->second);
+	const uint32_t aid(atgt->second);
 	tid_aids_map::iterator tgt(m_inverted_index.find(tid));
 	if (tgt == m_inverted_index.end()) {
 		return false;
@@ -112,6 +227,18 @@ bool index_st::is_associated(const std::string& article, const std::string& term
 	return false;
 }
 
+bool index_st::in_title(const std::string& article, const std::string& term)
+{
+	scoped_lock sync(monitor_mutex);
+	str_id_map::iterator atgt(m_articles.find(article));
+	str_id_map::iterator ttgt(m_title_terms.find(term));
+	if (atgt == m_articles.end() || ttgt == m_title_terms.end()) {
+		return false;
+	}
+	const id_vector& aids(m_title_index[ttgt->second]);
+	return std::find(aids.begin(), aids.end(), atgt->second) != aids.end();
+}
+
 static uint32_t generic_id(const std::string& s, str_id_map& m, uint32_t& id)
 {
 	str_id_map::const_iterator it(m.find(s));
@@ -134,6 +261,9 @@ uint32_t index_st::article_id(const std::string& s)
 
 uint32_t index_st::term_id(const std::string& s)
 {
+	if (m_dictionary) {
+		return m_dictionary->intern(s);
+	}
 	return generic_id(s, m_terms, m_tid);
 }
 
@@ -154,11 +284,12 @@ void index_st::partial_flush(uint32_t tid, id_vector& aids)
 	const uint32_t max(UINT32_MAX);
 	write<uint32_t>(idx, max);
 	write<char>(idx, '\n');
-	register_tid_offset(tid, pos);
+	register_tid_offset(tid, static_cast<uint64_t>(pos));
+	idx_stats::bump(m_postings, aids.size());
 	aids.clear();
 }
 
-void index_st::register_tid_offset(uint32_t tid, uint32_t offset)
+void index_st::register_tid_offset(uint32_t tid, uint64_t offset)
 {
 	assert(tid > 0); // offset can be 0
 	tid_offsets_map::iterator tgt(m_tid_offsets.find(tid));
@@ -219,32 +350,78 @@ std::string index_st::hdr_filename()
 	return std::string(idx_filename() + ".hdr");
 }
 
+// Offsets (or article IDs) are varints, each one the distance from
+// the last.
+static void write_offsets(std::ofstream& ofs, const offset_vector& offsets)
+{
+	char buf[VARINT_MAX_SIZE];
+	ofs.write(buf, encode_varint(offsets.size(), buf));
+	uint64_t last(0);
+	typedef offset_vector::const_iterator ovcit;
+	for (ovcit it(offsets.begin()); it != offsets.end(); ++it) {
+		// this offset can be 0
+		assert(*it >= last);
+		ofs.write(buf, encode_varint(*it - last, buf));
+		last = *it;
+	}
+}
+
 void index_st::write_header()
 {
-	// <uint32 offset where header ends and inverted index begins> '\n'
+	// INDEX_MAGIC <uint8 format version> '\n'
+	// <uint64 offset where header ends and inverted index begins> '\n'
 	// <uint32 number of articles> '\n'
 	// <uint32 article ID> <article name as text> '\n'
 	//  . . .
 	// <uint32 number of terms> '\n'
-	// <uint32 term ID> <term as text> END_DELIM <uint32 offset 1> ... 
-	//    <uint32 UINT32_MAX> '\n'
+	// <uint32 term ID> <term as text> END_DELIM <varint number of offsets>
+	//    <varint offset 1> <varint offset 2 - offset 1> . . . '\n'
 	//  . . .
 	
+	// With a term_dictionary, the first term is a stand-in naming it,
+	// <uint32 0> <dictionary filename, without the directory> END_DELIM
+	//    <varint 0> '\n'
+	// and the rest are IDs from it, without their text,
+	// <uint32 term ID> END_DELIM <varint number of offsets> . . . '\n'
+	
 	// The term offsets in the header is a complete list of all offsets within
 	// the "inverted index" portion of the index file, which represent a
 	// sequence of uint32_t article IDs (terminated by a '\n') in which that
 	// term appears. Each such offset begins with a uint32_t representing the
 	// term ID for all uint32_t article IDs that follow.
 	
+	// Any number of optional sections follow, each
+	// <uint8 tag> <uint64 length> <length bytes>
+	// which readers skip if they don't know the tag. They are
+	// INDEX_SECTION_BLOOM, a bloom_filter over the terms of the file,
+	//    <uint32 number of hashes> <uint64 word> . . .
+	// INDEX_SECTION_TITLES, the title index, small enough for readers
+	// to keep in memory,
+	//    <uint32 number of title terms>
+	//    <term as text> END_DELIM <varint number of articles>
+	//       <varint article ID 1> <varint ID 2 - ID 1> . . .
+	//     . . .
+	
+	// Version 1 files have a uint32 header length, list each term's
+	// offsets as uint32s ending with UINT32_MAX, and have no sections.
+	
 	typedef str_id_map::const_iterator sidcit;
-	typedef offset_vector::const_iterator ovcit;
 	typedef tid_offsets_map::const_iterator tocit;
-	uint32_t asz(m_articles.size()), tsz(m_terms.size()), offset(0);
+	uint32_t asz(m_articles.size()), tsz(m_terms.size());
+	uint64_t offset(0);
+	if (m_dictionary) {
+		tsz = m_tid_offsets.size() + 1;
+	}
 	assert(m_ofs_hdr && m_ofs_hdr->good());
 	std::ofstream& hdr(*m_ofs_hdr);
 	
-	// write initial offset position (will put correct value later)
-	write<uint32_t>(hdr, offset);
+	// write the format, and initial offset position (will put correct
+	// value later)
+	hdr.write(INDEX_MAGIC, INDEX_MAGIC_SIZE);
+	write<char>(hdr, INDEX_FORMAT_VERSION);
+	write<char>(hdr, '\n');
+	const std::ofstream::pos_type offset_at(hdr.tellp());
+	write<uint64_t>(hdr, offset);
 	write<char>(hdr, '\n');
 	
 	// write article block
@@ -258,33 +435,68 @@ void index_st::write_header()
 	}
 	
 	// write term block
+	bloom_filter filter(tsz);
 	write<uint32_t>(hdr, tsz);
 	write<char>(hdr, '\n');
-	uint32_t max(UINT32_MAX);
+	if (m_dictionary) {
+		const std::string& dict(m_dictionary->filename());
+		write<uint32_t>(hdr, 0);
+		hdr << dict.substr(dict.rfind('/') + 1) << END_DELIM;
+		write_offsets(hdr, offset_vector());
+		write<char>(hdr, '\n');
+		for (tocit it(m_tid_offsets.begin()); it != m_tid_offsets.end(); ++it) {
+			const std::string term(m_dictionary->term(it->first));
+			assert(!term.empty());
+			filter.add(hash_bytes(term.data(), term.size()));
+			write<uint32_t>(hdr, it->first);
+			hdr << END_DELIM;
+			write_offsets(hdr, it->second);
+			write<char>(hdr, '\n');
+		}
+	}
 	for (sidcit it(m_terms.begin()); it != m_terms.end(); ++it) {
 		assert(it->second > 0);
 		write<uint32_t>(hdr, it->second);
 		assert(!it->first.empty());
 		assert(it->first.find(END_DELIM) == std::string::npos);
 		hdr << it->first << END_DELIM;
+		filter.add(hash_bytes(it->first.data(), it->first.size()));
 		tocit tgt(m_tid_offsets.find(it->second));
 		assert(tgt != m_tid_offsets.end());
-		const offset_vector& offsets(tgt->second);
-		assert(!offsets.empty());
-		for (ovcit it2(offsets.begin()); it2 != offsets.end(); ++it2) {
-			// this offset can be 0
-			assert(*it2 < max);
-			write<uint32_t>(hdr, *it2);
-		}
-		write<uint32_t>(hdr, max);
+		assert(!tgt->second.empty());
+		write_offsets(hdr, tgt->second);
 		write<char>(hdr, '\n');
 	}
 	
+	// write sections
+	const std::vector<uint64_t>& words(filter.words());
+	write<char>(hdr, INDEX_SECTION_BLOOM);
+	write<uint64_t>(hdr, sizeof(uint32_t) + words.size() * sizeof(uint64_t));
+	write<uint32_t>(hdr, filter.hashes());
+	hdr.write(reinterpret_cast<const char *>(&words[0]), words.size() * sizeof(uint64_t));
+	write<char>(hdr, INDEX_SECTION_TITLES);
+	const std::ofstream::pos_type titles_at(hdr.tellp());
+	write<uint64_t>(hdr, 0); // back-filled, like the offset
+	write<uint32_t>(hdr, m_title_terms.size());
+	for (sidcit it(m_title_terms.begin()); it != m_title_terms.end(); ++it) {
+		assert(it->first.find(END_DELIM) == std::string::npos);
+		hdr << it->first << END_DELIM;
+		// an article seen again (a duplicate title) reuses its ID
+		id_vector aids(m_title_index[it->second]);
+		std::sort(aids.begin(), aids.end());
+		aids.erase(std::unique(aids.begin(), aids.end()), aids.end());
+		write_offsets(hdr, offset_vector(aids.begin(), aids.end()));
+	}
+	const std::ofstream::pos_type titles_end(hdr.tellp());
+	hdr.seekp(titles_at);
+	write<uint64_t>(hdr, static_cast<uint64_t>(titles_end - titles_at) - sizeof(uint64_t));
+	hdr.seekp(titles_end);
+	
 	// back-fill the offset position
 	offset = hdr.tellp();
 	assert(offset > 0);
-	hdr.seekp(0);
-	write<uint32_t>(hdr, offset);
+	hdr.seekp(offset_at);
+	write<uint64_t>(hdr, offset);
 	hdr.seekp(offset);
 }
 
@@ -296,16 +508,193 @@ void index_st::reset_state()
 	m_terms.clear();
 	m_inverted_index.clear();
 	m_tid_offsets.clear();
+	m_title_terms.clear();
+	m_title_index.clear();
+}
+
+checkpoint::checkpoint()
+: begin(0)
+, end(0)
+, offset(0)
+, flushes(0)
+, done(false)
+{
+	//
+}
+
+checkpoint::checkpoint(const region& r)
+: begin(r.begin)
+, end(r.end)
+, offset(r.begin)
+, flushes(0)
+, done(false)
+{
+	//
+}
+
+void checkpoint::read(const std::string& filename)
+{
+	std::ifstream ifs(filename.c_str());
+	int d(0);
+	if (!(ifs >> begin >> end >> offset >> flushes >> d) ||
+			offset < begin || offset > end) {
+		throw std::runtime_error("bad checkpoint " + filename);
+	}
+	done = d != 0;
+}
+
+void checkpoint::write(const std::string& filename) const
+{
+	const std::string tmp(filename + ".tmp");
+	FILE *f(fopen(tmp.c_str(), "w"));
+	if (!f) {
+		throw std::runtime_error("failed to create " + tmp);
+	}
+	const bool ok(
+		fprintf(f, "%llu %llu %llu %lu %d\n",
+			static_cast<unsigned long long>(begin),
+			static_cast<unsigned long long>(end),
+			static_cast<unsigned long long>(offset),
+			static_cast<unsigned long>(flushes),
+			done ? 1 : 0) > 0 &&
+		fflush(f) == 0 &&
+		fsync(fileno(f)) == 0
+	);
+	fclose(f);
+	if (!ok || rename(tmp.c_str(), filename.c_str()) != 0 || !sync_parent_dir(filename)) {
+		throw std::runtime_error("failed to write checkpoint " + filename);
+	}
+}
+
+static const std::string PAGE_BEGIN("<page");
+static const std::string PAGE_END("</page>");
+
+page_queue::page_queue(size_t capacity)
+: m_capacity(capacity)
+, m_closed(false)
+{
+	//
+}
+
+void page_queue::push(std::string& batch)
+{
+	scoped_lock sync(monitor_mutex);
+	while (m_batches.size() >= m_capacity) {
+		wait();
+	}
+	m_batches.push_back(std::string());
+	m_batches.back().swap(batch);
+	notify_all();
+}
+
+bool page_queue::pop(std::string& batch)
+{
+	scoped_lock sync(monitor_mutex);
+	while (m_batches.empty() && !m_closed) {
+		wait();
+	}
+	if (m_batches.empty()) {
+		return false;
+	}
+	batch.swap(m_batches.front());
+	m_batches.pop_front();
+	notify_all();
+	return true;
+}
+
+void page_queue::close()
+{
+	scoped_lock sync(monitor_mutex);
+	m_closed = true;
+	notify_all();
+}
+
+page_reader::page_reader(int fd, page_queue& q)
+: m_ps(fd)
+, m_queue(q)
+, m_bytes(0)
+{
+	//
+}
+
+static void append_page(char *buf, size_t len, void *arg)
+{
+	reinterpret_cast<std::string *>(arg)->append(buf, len).push_back('\n');
+}
+
+void page_reader::run()
+{
+	std::string batch;
+	// anything outside a page (the preamble, the closing tag, or a page
+	// cut short by the end of input) isn't indexed anyway
+	while (m_ps.read_until(PAGE_BEGIN, false, NULL, NULL) &&
+			m_ps.read_until(PAGE_END, true, append_page, &batch)) {
+		__sync_lock_test_and_set(&m_bytes, m_ps.tell());
+		if (batch.size() >= PAGE_BATCH_SIZE) {
+			m_queue.push(batch);
+		}
+	}
+	__sync_lock_test_and_set(&m_bytes, m_ps.tell());
+	if (!batch.empty()) {
+		m_queue.push(batch);
+	}
+	m_queue.close();
+}
+
+uint64_t page_reader::bytes() const
+{
+	return atomic_read(m_bytes);
 }
 
 idx_thread::idx_thread(
 		const std::string& xml_filename,
 		const region& r,
-		const std::string& idx_filename)
+		const std::string& idx_filename,
+		term_dictionary *terms)
 : m_started(false)
+, m_xml_filename(xml_filename)
+, m_bz2(is_bz2(xml_filename))
+, m_queue(NULL)
 , m_s(xml_filename, r)
-, m_idx_st(idx_filename)
-, m_article_count(0)
+, m_idx_st(idx_filename, 0, terms)
+, m_region_begin(r.begin)
+, m_region_bytes((r.end == 0 ? m_s.size() : r.end) - r.begin)
+, m_checkpoint(r)
+, m_flush_limit(ARTICLE_FLUSH_LIMIT)
+{
+	//
+}
+
+idx_thread::idx_thread(
+		const std::string& xml_filename,
+		const checkpoint& ckpt,
+		const std::string& idx_filename,
+		const std::string& checkpoint_filename,
+		term_dictionary *terms)
+: m_started(false)
+, m_xml_filename(xml_filename)
+, m_bz2(is_bz2(xml_filename))
+, m_queue(NULL)
+, m_s(xml_filename, region(ckpt.offset, ckpt.end))
+, m_idx_st(idx_filename, ckpt.flushes, terms)
+, m_region_begin(ckpt.offset)
+, m_region_bytes(ckpt.end - ckpt.offset)
+, m_checkpoint_filename(checkpoint_filename)
+, m_checkpoint(ckpt)
+, m_flush_limit(ARTICLE_FLUSH_LIMIT)
+{
+	//
+}
+
+idx_thread::idx_thread(page_queue& q, const std::string& idx_filename, term_dictionary *terms)
+: m_started(false)
+, m_bz2(false)
+, m_queue(&q)
+, m_s(new std::istringstream(), region(0, 0)) // unused
+, m_idx_st(idx_filename, 0, terms)
+, m_region_begin(0)
+, m_region_bytes(0)
+, m_flush_limit(ARTICLE_FLUSH_LIMIT)
 {
 	//
 }
@@ -319,20 +708,50 @@ void idx_thread::run()
 {
 	scoped_lock sync(monitor_mutex);
 	size_t unflushed_article_count(0);
+	uint64_t consumed(0);
 	synchronized_thread_running = true;
 	m_started = true;
+	if (m_checkpoint.done) {
+		synchronized_thread_running = false;
+		return;
+	}
+	if (m_bz2) {
+		run_bz2(sync);
+		synchronized_thread_running = false;
+		return;
+	}
+	if (m_queue) {
+		run_queue(sync);
+		synchronized_thread_running = false;
+		return;
+	}
 	while (synchronized_thread_running) {
 		sync.unlock();
-		index_result r(index_article(m_s, m_idx_st));
+		index_result r(index_article(m_s, m_idx_st, &m_stats));
+		const stream_pos at(m_s.tell());
+		const uint64_t pos(static_cast<uint64_t>(m_s.tell() - m_region_begin));
+		if (pos > consumed && pos <= m_region_bytes) {
+			idx_stats::bump(m_stats.bytes, pos - consumed);
+			consumed = pos;
+		}
 		if (r == END_OF_REGION) {
+			idx_stats::bump(m_stats.bytes, m_region_bytes - consumed);
+			const uint64_t begin(now_usec());
 			m_idx_st.flush(true);
+			idx_stats::bump(m_stats.flush_usec, now_usec() - begin);
+			m_checkpoint.offset = m_checkpoint.end;
+			m_checkpoint.done = true;
+			save_checkpoint();
 			sync.lock();
 			break;
 		} else if (r == INDEX_GOOD) {
-			++m_article_count; // TODO atomic
-			if (++unflushed_article_count >= ARTICLE_FLUSH_LIMIT) {
+			if (++unflushed_article_count >= m_flush_limit) {
+				const uint64_t begin(now_usec());
 				m_idx_st.flush();
+				idx_stats::bump(m_stats.flush_usec, now_usec() - begin);
 				unflushed_article_count = 0;
+				m_checkpoint.offset = static_cast<uint64_t>(at);
+				save_checkpoint();
 			}
 		}
 		sync.lock();
@@ -340,6 +759,128 @@ void idx_thread::run()
 	synchronized_thread_running = false;
 }
 
+void idx_thread::run_bz2(scoped_lock& sync)
+{
+	bz2_decoder dec(m_xml_filename, m_checkpoint.offset);
+	const uint64_t region_end(m_checkpoint.end);
+	uint64_t consumed(m_checkpoint.offset);
+	size_t unflushed_article_count(0);
+	std::string buf;
+	// before the first page of the region, anything decoded belongs to
+	// a page the previous region finishes (or is the dump's preamble)
+	bool in_page(false);
+	// past the region end, only the page straddling it is finished
+	bool past_end(false);
+	while (synchronized_thread_running) {
+		sync.unlock();
+		uint64_t begin(now_usec());
+		dec.read(buf, BZ2_CHUNK_SIZE);
+		idx_stats::bump(m_stats.read_usec, now_usec() - begin);
+		const uint64_t at(std::min(dec.offset(), region_end));
+		if (at > consumed) {
+			idx_stats::bump(m_stats.bytes, at - consumed);
+			consumed = at;
+		}
+		if (!in_page) {
+			const std::string::size_type pos(buf.find(PAGE_BEGIN));
+			if (pos != std::string::npos) {
+				buf.erase(0, pos);
+				in_page = true;
+			} else if (buf.size() > PAGE_BEGIN.size()) {
+				buf.erase(0, buf.size() - PAGE_BEGIN.size());
+			}
+		}
+		bool done(dec.eof());
+		if (in_page) {
+			std::string::size_type cut(past_end ? buf.find(PAGE_END) : buf.rfind(PAGE_END));
+			if (cut != std::string::npos) {
+				cut += PAGE_END.size();
+				index_pages(buf.substr(0, cut), unflushed_article_count);
+				buf.erase(0, cut);
+				done = done || past_end;
+			}
+		}
+		// a checkpoint can only resume at a stream boundary with no page
+		// left half-read
+		const bool aligned(dec.at_stream_end() && buf.find('<') == std::string::npos);
+		if (!done && dec.at_stream_end() && dec.offset() >= region_end) {
+			past_end = true;
+			done = !in_page || aligned;
+		}
+		if (done) {
+			begin = now_usec();
+			m_idx_st.flush(true);
+			idx_stats::bump(m_stats.flush_usec, now_usec() - begin);
+			m_checkpoint.offset = m_checkpoint.end;
+			m_checkpoint.done = true;
+			save_checkpoint();
+			sync.lock();
+			break;
+		}
+		if (unflushed_article_count >= m_flush_limit && aligned && !past_end) {
+			begin = now_usec();
+			m_idx_st.flush();
+			idx_stats::bump(m_stats.flush_usec, now_usec() - begin);
+			unflushed_article_count = 0;
+			m_checkpoint.offset = dec.offset();
+			save_checkpoint();
+		}
+		sync.lock();
+	}
+}
+
+void idx_thread::run_queue(scoped_lock& sync)
+{
+	size_t unflushed_article_count(0);
+	std::string batch;
+	while (synchronized_thread_running) {
+		sync.unlock();
+		// waiting for input is time spent reading
+		uint64_t begin(now_usec());
+		const bool more(m_queue->pop(batch));
+		idx_stats::bump(m_stats.read_usec, now_usec() - begin);
+		if (!more) {
+			begin = now_usec();
+			m_idx_st.flush(true);
+			idx_stats::bump(m_stats.flush_usec, now_usec() - begin);
+			sync.lock();
+			break;
+		}
+		idx_stats::bump(m_stats.bytes, batch.size());
+		index_pages(batch, unflushed_article_count);
+		if (unflushed_article_count >= m_flush_limit) {
+			begin = now_usec();
+			m_idx_st.flush();
+			idx_stats::bump(m_stats.flush_usec, now_usec() - begin);
+			unflushed_article_count = 0;
+		}
+		sync.lock();
+	}
+}
+
+void idx_thread::index_pages(const std::string& buf, size_t& unflushed_article_count)
+{
+	// stream reads by lines, and needs the last one ended to see the end
+	stream s(new std::istringstream(buf + '\n'), region(0, 0));
+	for (;;) {
+		index_result r(index_article(s, m_idx_st, &m_stats));
+		if (r == END_OF_REGION) {
+			break;
+		} else if (r == INDEX_GOOD) {
+			++unflushed_article_count;
+		}
+	}
+}
+
+void idx_thread::save_checkpoint()
+{
+	if (m_checkpoint_filename.empty()) {
+		return;
+	}
+	m_checkpoint.flushes = m_idx_st.flush_count();
+	m_checkpoint.write(m_checkpoint_filename);
+}
+
 bool idx_thread::finished() const
 {
 	scoped_lock sync(monitor_mutex);
@@ -348,18 +889,20 @@ bool idx_thread::finished() const
 
 size_t idx_thread::article_count() const
 {
-	return m_article_count;
+	return atomic_read(m_stats.articles);
+}
+
+idx_stats idx_thread::stats() const
+{
+	idx_stats s(m_stats.snapshot());
+	s.postings = m_idx_st.postings_written();
+	return s;
 }
 
 //
 //
 //
 
-static void buf_read_until(const char *buf, size_t& i, size_t len, char c)
-{
-	for ( ; i < len && buf[i] != c; ++i);
-}
-
 static void buf_read_until(
 		const char *buf,
 		size_t& i,
@@ -422,8 +965,7 @@ void parse_contrib(char *buf, size_t len, void *arg)
 		const size_t from(i);
 		buf_read_until(buf, i, len, USERNAME_END);
 		if (i < len) {
-			*s = std::string(buf+from, i-from-USERNAME_END_SZ);
-			std::transform(s->begin(), s->end(), s->begin(), tolower);
+			*s = fold_case(std::string(buf+from, i-from-USERNAME_END_SZ));
 		}
 	}
 }
@@ -446,7 +988,7 @@ static bool add_to(char c, std::string& term)
 	case ':': case '.':
 		return true;
 	
-	// otherwise, just add to the term
+	// otherwise, just add to the term (non-ASCII is folded by the caller)
 	default:
 		term += tolower(c);
 		return false;
@@ -482,57 +1024,222 @@ static bool term_passes(const std::string& term)
 	return true;
 }
 
-static void skip_interior(
+#define TERM_RESERVE 64 // a guess at the average term size
+
+// markup which is skipped entirely, if it starts at i
+static const std::string REF_BEGIN("&lt;ref"), CLOSE_BEGIN("&lt;/"), MARKUP_END("&gt;");
+
+// the most bytes a single step of the tokenizer looks at: a markup
+// prefix, or a UTF-8 sequence
+#define TOKENIZER_LOOKAHEAD 7
+
+// held back bytes are tokenized with at most this much of the next
+// piece after them; more than enough to make out what they start
+#define TOKENIZER_SEAM 16
+
+tokenizer::tokenizer()
+: m_square_stack(0)
+, m_skip(SKIP_NONE)
+, m_begin(0)
+, m_end(0)
+, m_depth(0)
+, m_matched(0)
+, m_skip_next(false)
+{
+	m_term.reserve(TERM_RESERVE);
+}
+
+void tokenizer::feed(const char *buf, size_t len, std::vector<std::string>& terms)
+{
+	size_t from(0);
+	if (!m_held.empty()) {
+		if (len <= TOKENIZER_SEAM) {
+			std::string text;
+			text.swap(m_held);
+			text.append(buf, len);
+			const size_t i(scan(text.data(), text.size(), text.size(), false, terms));
+			m_held.assign(text, i, std::string::npos);
+			return;
+		}
+		// finish off what the held back bytes start; that may run on
+		// into this piece, which picks up from wherever it ends
+		std::string seam(m_held);
+		seam.append(buf, TOKENIZER_SEAM);
+		const size_t held(m_held.size());
+		m_held.clear();
+		from = scan(seam.data(), seam.size(), held, false, terms) - held;
+	}
+	const size_t i(from + scan(buf + from, len - from, len - from, false, terms));
+	m_held.assign(buf + i, len - i);
+}
+
+void tokenizer::finish(std::vector<std::string>& terms)
+{
+	if (!m_held.empty()) {
+		scan(m_held.data(), m_held.size(), m_held.size(), true, terms);
+	}
+	// a term nothing ended isn't taken
+	m_term.clear();
+	m_square_stack = 0;
+	m_skip = SKIP_NONE;
+	m_skip_next = false;
+	m_held.clear();
+}
+
+size_t tokenizer::scan(
 		const char *buf,
-		size_t& i,
 		size_t len,
-		char begin,
-		char end)
+		size_t stop,
+		bool last,
+		std::vector<std::string>& terms)
 {
-	if (buf[i] != begin) {
-		return;
-	}
-	int stack(0);
-	for ( ; i < len; ++i) {
-		const char& c(buf[i]);
-		if (c == begin) {
-			stack++;
-		} else if (c == end) {
-			stack--;
+	size_t i(0);
+	while (i < stop) {
+		if (m_skip_next) {
+			m_skip_next = false;
+			++i;
+			continue;
 		}
-		if (stack <= 0) {
+		switch (m_skip) {
+		case SKIP_NONE:
+			break;
+		case SKIP_INTERIOR:
+			while (i < len) {
+				const char& c(buf[i++]);
+				if (c == m_begin) {
+					m_depth++;
+				} else if (c == m_end) {
+					m_depth--;
+				}
+				if (m_depth <= 0) {
+					m_skip = SKIP_NONE;
+					m_skip_next = true;
+					break;
+				}
+			}
+			continue;
+		case SKIP_MARKUP:
+			// no backtracking: &&gt; isn't seen as the end
+			while (i < len) {
+				if (buf[i++] == MARKUP_END[m_matched]) {
+					++m_matched;
+				} else {
+					m_matched = 0;
+				}
+				if (m_matched == MARKUP_END.size()) {
+					m_skip = SKIP_NONE;
+					m_skip_next = true;
+					break;
+				}
+			}
+			continue;
+		case SKIP_ENTITY:
+			for ( ; i < len && buf[i] != ';'; ++i);
 			if (i < len) {
-				i++;
+				m_skip = SKIP_NONE;
+				++i;
+			}
+			continue;
+		}
+		// plain letters and digits go straight into the term, wherever
+		// we are; only the bytes after them need the switch
+		const size_t run(fold_ascii_run(buf + i, len - i, m_term));
+		if (run > 0) {
+			i += run;
+			continue;
+		}
+		const char& c(buf[i]);
+		if (!last && (c == '&' || (c & 0x80)) && len - i < TOKENIZER_LOOKAHEAD) {
+			return i;
+		}
+		if (c == '&' && (
+				(i + REF_BEGIN.size() <= len && strncmp(buf + i, REF_BEGIN.c_str(), REF_BEGIN.size()) == 0) ||
+				(i + CLOSE_BEGIN.size() <= len && strncmp(buf + i, CLOSE_BEGIN.c_str(), CLOSE_BEGIN.size()) == 0))) {
+			m_skip = SKIP_MARKUP;
+			m_matched = 0;
+			continue;
+		}
+		bool term_complete(false);
+		switch (c) {
+		case '<':
+			// a tag counts as an opening bracket too
+			m_square_stack++;
+		case '{':
+			m_skip = SKIP_INTERIOR;
+			m_begin = c;
+			m_end = c == '{' ? '}' : '>';
+			m_depth = 0;
+			continue;
+		case '[':
+			m_square_stack++;
+			break;
+		case ']':
+			m_square_stack--;
+			if (m_square_stack <= 0) {
+				m_square_stack = 0;
+			}
+			break;
+		case '&':
+			m_skip = SKIP_ENTITY;
+			continue;
+		default:
+			if (c & 0x80) {
+				i += fold_utf8(buf + i, len - i, m_term) - 1;
+				break;
+			}
+			if (m_square_stack > 0) {
+				// [[abc]]          => abc
+				// [[abc|def]]      => def
+				// [http://xyz foo] => foo
+				// [[abc:def]]      => def
+				if (
+						c == '|' ||
+						c == ' ' ||
+						(m_square_stack > 1 && c == ':') // [[abc:def]]
+						) {
+					m_term.clear();
+					break;
+				}
 			}
+			term_complete = add_to(c, m_term) && m_square_stack <= 0;
 			break;
 		}
+		if (term_complete) {
+			if (term_passes(m_term)) {
+				terms.push_back(m_term);
+			}
+			m_term.clear();
+		}
+		++i;
 	}
+	return i;
 }
 
-static bool lookahead(const char *buf, size_t& i, size_t len)
+void tokenize(const char *buf, size_t len, std::vector<std::string>& terms)
 {
-	// special cases
-	static const std::string t0("&lt;ref"), t0x("&gt;");
-	static const std::string t1("&lt;/"), t1x("&gt;");
-	if (i+t0.size() <= len && strncmp(buf+i, t0.c_str(), t0.size()) == 0) {
-		buf_read_until(buf, i, len, t0x);
-		return true;
-	}
-	if (i+t1.size() <= len && strncmp(buf+i, t1.c_str(), t1.size()) == 0) {
-		buf_read_until(buf, i, len, t1x);
-		return true;
-	}
-	return false;
+	tokenizer t;
+	t.feed(buf, len, terms);
+	t.finish(terms);
+}
+
+void tokenize_title(const std::string& title, std::vector<std::string>& terms)
+{
+	// tokenize only takes a term once something ends it
+	const std::string text(title + ' ');
+	tokenize(text.data(), text.size(), terms);
 }
 
 struct parse_text_context {
 	parse_text_context(
 			const std::string& article,
 			const std::string& contrib,
-			index_st& idx_st)
+			index_st& idx_st,
+			idx_stats *stats)
 	: article(article)
 	, contrib(contrib)
 	, idx_st(idx_st)
+	, stats(stats)
+	, started(false)
 	{
 		//
 	}
@@ -540,10 +1247,30 @@ struct parse_text_context {
 	const std::string& article;
 	const std::string& contrib;
 	index_st& idx_st;
+	idx_stats *stats;
+	tokenizer tok;
+	bool started;
 };
 
-#define MAX_TEXT_SIZE (1024*1024*100) // 100 MB
-#define TERM_RESERVE 64 // a guess at the average term size
+static void index_terms(
+		parse_text_context& ctx,
+		const std::vector<std::string>& terms,
+		const std::vector<std::string>& title_terms,
+		uint64_t begin)
+{
+	const uint64_t tokenized(ctx.stats ? now_usec() : 0);
+	ctx.idx_st.index(terms, ctx.article);
+	ctx.idx_st.index_title(title_terms, ctx.article);
+	if (ctx.stats) {
+		idx_stats::bump(ctx.stats->tokenize_usec, tokenized - begin);
+		idx_stats::bump(ctx.stats->index_usec, now_usec() - tokenized);
+		idx_stats::bump(ctx.stats->terms, terms.size());
+	}
+}
+
+// Called with each piece of the text as it's read. The terms are indexed
+// a piece at a time too, so neither the text nor its terms are ever held
+// in memory whole, however big the article.
 void parse_text(char *buf, size_t len, void *arg)
 {
 	parse_text_context *ctx(reinterpret_cast<parse_text_context *>(arg));
@@ -551,70 +1278,32 @@ void parse_text(char *buf, size_t len, void *arg)
 		return;
 	}
 	assert(!ctx->article.empty());
-	if (len > MAX_TEXT_SIZE) {
-		throw std::runtime_error("parse_text buffer too big");
-	}
+	const uint64_t begin(ctx->stats ? now_usec() : 0);
 	std::vector<std::string> terms;
-	if (!ctx->contrib.empty()) {
+	if (!ctx->started && !ctx->contrib.empty()) {
 		terms.push_back(ctx->contrib);
 	}
-	std::string term;
-	term.reserve(TERM_RESERVE);
-	int square_stack(0);
-	bool term_complete(false);
-	for (size_t i(0); i < len; ++i) {
-		if (lookahead(buf, i, len)) {
-			continue;
-		}
-		const char& c(buf[i]);
-		switch (c) {
-		case '{':
-			skip_interior(buf, i, len, '{', '}');
-			break;
-		case '<':
-			skip_interior(buf, i, len, '<', '>');
-		case '[':
-			square_stack++;
-			break;
-		case ']':
-			square_stack--;
-			if (square_stack <= 0) {
-				square_stack = 0;
-			}
-			break;
-		case '&':
-			buf_read_until(buf, i, len, ';');
-			break;
-		default:
-			if (square_stack > 0) {
-				// [[abc]]          => abc
-				// [[abc|def]]      => def
-				// [http://xyz foo] => foo
-				// [[abc:def]]      => def
-				if (
-						c == '|' ||
-						c == ' ' ||
-						(square_stack > 1 && c == ':') // [[abc:def]]
-						) {
-					term.clear();
-					break;
-				}
-			}
-			term_complete = add_to(c, term) && square_stack <= 0;
-			break;
-		}
-		if (term_complete) {
-			if (term_passes(term)) {
-				terms.push_back(term);
-			}
-			term.clear();
-			term_complete = false;
-		}
+	ctx->started = true;
+	ctx->tok.feed(buf, len, terms);
+	index_terms(*ctx, terms, std::vector<std::string>(), begin);
+}
+
+// After the last piece: the end of the text, and the title, which goes
+// into the title index, apart from the body. An article with no text
+// isn't indexed at all.
+static void finish_text(parse_text_context& ctx)
+{
+	if (!ctx.started) {
+		return;
 	}
-	ctx->idx_st.index(terms, ctx->article);
+	const uint64_t begin(ctx.stats ? now_usec() : 0);
+	std::vector<std::string> terms, title_terms;
+	ctx.tok.finish(terms);
+	tokenize_title(ctx.article, title_terms);
+	index_terms(ctx, terms, title_terms, begin);
 }
 
-index_result index_article(stream& s, index_st& idx_st)
+static index_result read_article(stream& s, index_st& idx_st, idx_stats *stats)
 {
 	if (!s.read_until("<title>", true, NULL, NULL)) {
 		return END_OF_REGION;
@@ -649,9 +1338,29 @@ index_result index_article(stream& s, index_st& idx_st)
 	if (!s.read_until(">", true, NULL, NULL)) {
 		return NO_INDEX_BUT_CONTINUE;
 	}
-	parse_text_context ctx(title, contrib, idx_st);
-	if (!s.read_until("</text", false, parse_text, &ctx)) {
+	parse_text_context ctx(title, contrib, idx_st, stats);
+	if (!s.read_chunks_until("</text", false, parse_text, &ctx)) {
 		return NO_INDEX_BUT_CONTINUE;
 	}
+	finish_text(ctx);
 	return INDEX_GOOD;
 }
+
+index_result index_article(stream& s, index_st& idx_st, idx_stats *stats)
+{
+	if (!stats) {
+		return read_article(s, idx_st, NULL);
+	}
+	// whatever wasn't spent in parse_text was spent reading;
+	// we're the only writer, so plain reads of our own counters are fine
+	const uint64_t begin(now_usec());
+	const uint64_t busy(stats->tokenize_usec + stats->index_usec);
+	index_result r(read_article(s, idx_st, stats));
+	const uint64_t elapsed(now_usec() - begin);
+	const uint64_t spent(stats->tokenize_usec + stats->index_usec - busy);
+	idx_stats::bump(stats->read_usec, elapsed > spent ? elapsed - spent : 0);
+	if (r == INDEX_GOOD) {
+		idx_stats::bump(stats->articles, 1);
+	}
+	return r;
+}
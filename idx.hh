@@ -2,9 +2,11 @@
 #define IDX_HH_
 
 #include <fstream>
+#include <deque>
 #include "thread.hh"
 #include "def.hh"
 #include "xml.hh"
+#include "termdict.hh"
 
 // The index_st accepts index() calls, and stores those associations
 // to an inverted index, in memory.
@@ -19,19 +21,53 @@
 //  - write out all partial index metadata to a header file
 //  - merge the header and index files to a single file
 //  - reset the internal state (ie. so that article_count() returns 0)
+//
+// Given a term_dictionary, shared with other index_sts, terms get their
+// IDs from it instead, which stay the same from one file to the next,
+// and headers list the IDs without the terms.
 
 // How many articles need to be linked to a term
 // before we perform a partial_flush().
 #define PARTIAL_FLUSH_LIMIT 256
 
+// Counters for one indexing thread. The thread bumps them atomically
+// as it goes, so they can be read from another thread at any time
+// with snapshot(). Times are wall-clock microseconds.
+struct idx_stats {
+	idx_stats();
+	
+	// A consistent-enough copy of counters being updated elsewhere.
+	idx_stats snapshot() const;
+	
+	// Accumulate rhs, for totals over several threads.
+	void add(const idx_stats& rhs);
+	
+	static void bump(uint64_t& counter, uint64_t n) { __sync_fetch_and_add(&counter, n); }
+	
+	uint64_t bytes;         // of the input region consumed
+	uint64_t articles;      // indexed
+	uint64_t terms;         // emitted by the tokenizer
+	uint64_t postings;      // term/article pairs written to disk
+	uint64_t read_usec;     // in stream::read_until, outside callbacks
+	uint64_t tokenize_usec;
+	uint64_t index_usec;    // in index_st::index
+	uint64_t flush_usec;    // in index_st::flush
+};
+
 class index_st : public monitor
 {
 public:
-	index_st(const std::string& basename);
+	// Index files are named <basename>.1, .2, ... by flush; a resumed
+	// index_st starts numbering after the first_flush files it has.
+	index_st(const std::string& basename, size_t first_flush=0, term_dictionary *terms=NULL);
 	
 	// Associate terms to article in the inverted index.
 	void index(const std::vector<std::string>& terms, const std::string& article);
 	
+	// Associate the terms of its title to article, in the title index
+	// (see write_header), which is kept apart from the body postings.
+	void index_title(const std::vector<std::string>& terms, const std::string& article);
+	
 	// Flush all collected state to disk, in a new index file.
 	// Should be triggered by whoever calls index(),
 	// after article_count() has reached some threshold.
@@ -41,9 +77,17 @@ public:
 	// Articles in memory, ie. since last flush.
 	size_t article_count() const;
 	
+	// Index files completely written so far.
+	size_t flush_count() const;
+	
+	// Term/article pairs written to disk so far, over all flushes.
+	// Doesn't take the lock, so it can be polled during a flush.
+	uint64_t postings_written() const;
+	
 	// Introspection methods for tests.
 	bool has_article(const std::string& article);
 	bool is_associated(const std::string& article, const std::string& term);
+	bool in_title(const std::string& article, const std::string& term);
 	
 protected:
 	// Associate term to article in the inverted index.
@@ -60,7 +104,7 @@ protected:
 	
 	// Registers the offset of the partially-flushed term ID
 	// into the tid_offsets_map, for use in the header.
-	void register_tid_offset(uint32_t tid, uint32_t offset);
+	void register_tid_offset(uint32_t tid, uint64_t offset);
 	
 	// Deletes the two member ofstream pointers,
 	// and recreates them using idx_ and hdr_filename().
@@ -83,15 +127,22 @@ protected:
 private:
 	const std::string m_basename;
 	size_t m_flush_count;
+	term_dictionary *m_dictionary; // NULL for per-file term IDs
 	
 	uint32_t m_aid;
 	uint32_t m_tid;
+	uint64_t m_postings;
 	
 	str_id_map m_articles;
 	str_id_map m_terms;
 	tid_aids_map m_inverted_index;
 	tid_offsets_map m_tid_offsets;
 	
+	// The title index: article IDs by title term, the terms numbered
+	// in the order they were first seen.
+	str_id_map m_title_terms;
+	std::vector<id_vector> m_title_index;
+	
 	// The index and header portions of the currently active index file.
 	// These should be maintained by flush().
 	std::ofstream *m_ofs_idx;
@@ -101,29 +152,145 @@ private:
 
 // How many articles need to be indexed (in memory)
 // before we flush the entire index (including header)
-// to disk and start fresh.
+// to disk and start fresh, unless an idx_thread is
+// given another limit. Offsets are 64-bit, so there's
+// no limit on the size of an index file.
 #define ARTICLE_FLUSH_LIMIT 100000
 
+// A checkpoint is the durable progress of one indexing thread: input
+// up to offset is in index files 1..flushes, which are synced to disk
+// before the checkpoint is written. A resumed thread starts reading at
+// offset, and anything past the last flush is discarded.
+//
+// On disk it's a single text line,
+// <region begin> <region end> <offset> <flushes> <done> '\n'
+// replaced atomically with a rename, and its directory synced after.
+struct checkpoint {
+	checkpoint();
+	checkpoint(const region& r);
+	
+	// Throws if the file is missing or malformed.
+	void read(const std::string& filename);
+	void write(const std::string& filename) const;
+	
+	uint64_t begin; // of the thread's region
+	uint64_t end;
+	uint64_t offset;
+	size_t flushes;
+	bool done;
+};
+
+// When input can only be read forward, eg. from a pipe, a page_reader
+// thread splits it into batches of whole pages as it arrives, and
+// idx_threads take the batches from a page_queue. The queue holds at
+// most a few batches per thread, so a slow indexer holds up the reader
+// rather than buffering the input.
+
+#define PAGE_BATCH_SIZE (1024 * 1024)
+#define PAGE_QUEUE_BATCHES_PER_THREAD 2
+
+class page_queue : public monitor
+{
+public:
+	explicit page_queue(size_t capacity); // in batches
+	
+	// Blocks while the queue is full. Takes the batch, leaving it empty.
+	void push(std::string& batch);
+	
+	// Blocks while the queue is empty and open. False once it's closed
+	// and drained.
+	bool pop(std::string& batch);
+	
+	// No more batches are coming.
+	void close();
+	
+private:
+	std::deque<std::string> m_batches;
+	const size_t m_capacity;
+	bool m_closed;
+};
+
+class page_reader : public threadbase
+{
+public:
+	page_reader(int fd, page_queue& q);
+	virtual void run();
+	
+	// Input read so far.
+	uint64_t bytes() const;
+	
+private:
+	pipe_stream m_ps;
+	page_queue& m_queue;
+	uint64_t m_bytes;
+};
+
 class idx_thread : public synchronized_threadbase
 {
 public:
+	// All the constructors take an optional term_dictionary,
+	// shared by all the threads.
 	idx_thread(
 			const std::string& xml_filename,
 			const region& r,
-			const std::string& idx_filename); // should already be per-thread
+			const std::string& idx_filename, // should already be per-thread
+			term_dictionary *terms=NULL);
+	
+	// Index from ckpt, recording progress in checkpoint_filename
+	// after every flush.
+	idx_thread(
+			const std::string& xml_filename,
+			const checkpoint& ckpt,
+			const std::string& idx_filename,
+			const std::string& checkpoint_filename,
+			term_dictionary *terms=NULL);
+	
+	// Index batches of pages from q until it's closed. There's no
+	// checkpointing; a pipe can't be rewound.
+	idx_thread(page_queue& q, const std::string& idx_filename, term_dictionary *terms=NULL);
 	virtual ~idx_thread();
 	virtual void run();
 	bool finished() const;
 	size_t article_count() const;
 	
+	// Current counters, safe to call while the thread is running.
+	idx_stats stats() const;
+	
+	// Size of the input region, for estimating progress.
+	uint64_t region_bytes() const { return m_region_bytes; }
+	
+	// Articles per index file, instead of ARTICLE_FLUSH_LIMIT.
+	// Call before start().
+	void set_flush_limit(size_t articles) { m_flush_limit = articles; }
+	
 	const stream& get_stream() const { return m_s; }
 	const index_st& get_index_st() const { return m_idx_st; }
 	
 private:
+	void save_checkpoint();
+	
+	// run() for bzip2 input, decompressing the region stream by stream
+	// and indexing whole pages from memory; see bz2.hh.
+	void run_bz2(scoped_lock& sync);
+	
+	// run() for pages from a page_queue.
+	void run_queue(scoped_lock& sync);
+	
+	// Index the pages in buf, flushing as run() does.
+	void index_pages(const std::string& buf, size_t& unflushed_article_count);
+	
 	bool m_started;
+	const std::string m_xml_filename;
+	const bool m_bz2;
+	page_queue *m_queue; // NULL unless reading from one
 	stream m_s;
 	index_st m_idx_st;
-	size_t m_article_count;
+	const stream_pos m_region_begin;
+	const uint64_t m_region_bytes;
+	idx_stats m_stats;
+	const std::string m_checkpoint_filename; // empty for none
+	checkpoint m_checkpoint;
+	size_t m_flush_limit;
 };
 
 enum index_result {
@@ -132,6 +299,61 @@ enum index_result {
 	END_OF_REGION
 };
 
-index_result index_article(stream& s, index_st& idx_st);
+// Index the next article in the stream. If stats is given, the time
+// spent and the articles and terms indexed are added to it.
+index_result index_article(stream& s, index_st& idx_st, idx_stats *stats=NULL);
+
+// The pieces of index_article, exposed for the benchmarks.
+// parse_title and parse_contrib are rfuncs writing to a std::string;
+// tokenize appends the indexable terms of article text to terms.
+void parse_title(char *buf, size_t len, void *arg);
+void parse_contrib(char *buf, size_t len, void *arg);
+void tokenize(const char *buf, size_t len, std::vector<std::string>& terms);
+
+// A tokenizer takes article text a piece at a time, as read_chunks_until
+// passes it, so an article of any size is tokenized in the same small
+// amount of memory. The terms come out as tokenize would give them for
+// the whole text: a template, tag, entity or term cut off by the end of
+// one piece carries on into the next.
+class tokenizer
+{
+public:
+	tokenizer();
+	
+	// Append the terms of the next piece of text. The last few bytes
+	// may be held back, until there's enough text after them to tell
+	// what they start.
+	void feed(const char *buf, size_t len, std::vector<std::string>& terms);
+	
+	// The text has ended: append the terms of whatever was held back,
+	// and get ready for the next text.
+	void finish(std::vector<std::string>& terms);
+	
+private:
+	// Tokenize buf from the start to stop, or further if the last step
+	// runs on; unless last, stop early at anything that needs more of
+	// buf than there is to make out. Returns where it got to.
+	size_t scan(const char *buf, size_t len, size_t stop, bool last, std::vector<std::string>& terms);
+	
+	enum skip_mode {
+		SKIP_NONE,
+		SKIP_INTERIOR, // to the end of a (nested) {{template}} or <tag>
+		SKIP_MARKUP,   // to the next &gt;, after &lt;ref or &lt;/
+		SKIP_ENTITY    // past the next ;
+	};
+	
+	std::string m_term;
+	int m_square_stack;
+	skip_mode m_skip;
+	char m_begin, m_end; // SKIP_INTERIOR
+	int m_depth;
+	size_t m_matched;    // of the &gt; of SKIP_MARKUP
+	bool m_skip_next;    // the byte after a skipped span is passed over too
+	std::string m_held;
+};
+
+// Append the terms of a title (or of a query for titles) to terms,
+// the same way tokenize does for text.
+void tokenize_title(const std::string& title, std::vector<std::string>& terms);
 
 #endif
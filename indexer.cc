@@ -5,59 +5,399 @@
 #include <cstdio>
 #include <cstdlib>
 #include <cassert>
+#include <cstring>
+#include <set>
 #include "def.hh"
 #include "xml.hh"
 #include "idx.hh"
+#include "tombstone.hh"
+#include "bz2.hh"
+#include "termdict.hh"
 
 extern "C" {
 	#include "unistd.h"
+	#include <getopt.h>
+	#include <fcntl.h>
+	#include <sys/stat.h>
+}
+
+// Progress is reported every interval: totals, rates over the last
+// interval, where the time went, and an ETA from the bytes left in the
+// regions at the current rate. With -j, the same is appended to a file
+// as one JSON object per line, with a per-thread breakdown.
+
+#define DEFAULT_INTERVAL_SEC 1
+
+static std::string format_duration(uint64_t sec)
+{
+	std::ostringstream oss;
+	if (sec >= 3600) {
+		oss << sec / 3600 << 'h';
+	}
+	if (sec >= 60) {
+		oss << (sec % 3600) / 60 << 'm';
+	}
+	oss << sec % 60 << 's';
+	return oss.str();
+}
+
+static void json_stats(std::ostream& os, const idx_stats& s)
+{
+	os << "\"bytes\": " << s.bytes
+	   << ", \"articles\": " << s.articles
+	   << ", \"terms\": " << s.terms
+	   << ", \"postings\": " << s.postings
+	   << ", \"read_usec\": " << s.read_usec
+	   << ", \"tokenize_usec\": " << s.tokenize_usec
+	   << ", \"index_usec\": " << s.index_usec
+	   << ", \"flush_usec\": " << s.flush_usec;
+}
+
+static size_t percent(uint64_t part, uint64_t whole)
+{
+	return whole ? static_cast<size_t>(100 * part / whole) : 0;
+}
+
+// Each thread checkpoints to <idx>.<thread>.ckpt after every flush.
+// --resume picks up from those instead of starting over: files written
+// after a thread's last checkpoint are removed, and the thread restarts
+// from the input offset it recorded. The checkpoints are removed once
+// indexing completes.
+//
+// All threads share one term_dictionary, <idx>.dict, which each index
+// file refers to; it's appended to as threads flush, so a resumed run
+// carries on with the same term IDs.
+
+static std::string thread_basename(const std::string& basename, size_t thread_id)
+{
+	std::ostringstream oss;
+	oss << basename << "." << thread_id;
+	return oss.str();
+}
+
+static bool exists(const std::string& filename)
+{
+	return access(filename.c_str(), F_OK) == 0;
+}
+
+// Remove index files (and their pieces) numbered after the checkpoint.
+static void remove_partial(const std::string& thread_base, const checkpoint& ckpt)
+{
+	for (size_t i(ckpt.flushes + 1); ; ++i) {
+		std::ostringstream oss;
+		oss << thread_base << '.' << i;
+		const std::string idx(oss.str()), hdr(idx + ".hdr");
+		if (!exists(idx) && !exists(hdr)) {
+			break;
+		}
+		std::cout << "removing partial " << idx << std::endl;
+		unlink(idx.c_str());
+		unlink(hdr.c_str());
+	}
+}
+
+// --update indexes a dump of changed and new articles into new
+// segments, then masks the old versions of those articles in the
+// existing segments given after <idx>, with tombstones. Titles listed
+// in a -d file (one per line) are masked without replacement.
+
+static bool ends_with(const std::string& s, const std::string& suffix)
+{
+	return s.size() >= suffix.size() && s.compare(s.size() - suffix.size(), suffix.size(), suffix) == 0;
+}
+
+static void mask_superseded(
+		const std::vector<idx_thread *>& threads,
+		const std::string& basename,
+		const std::vector<std::string>& segments,
+		std::set<std::string>& titles)
+{
+	for (size_t i(0); i < threads.size(); ++i) {
+		const size_t files(threads[i]->get_index_st().flush_count());
+		for (size_t j(1); j <= files; ++j) {
+			std::ostringstream oss;
+			oss << thread_basename(basename, i + 1) << '.' << j;
+			std::vector<aid_title> fresh(read_titles(oss.str()));
+			typedef std::vector<aid_title>::const_iterator atcit;
+			for (atcit it(fresh.begin()); it != fresh.end(); ++it) {
+				titles.insert(it->second);
+			}
+		}
+	}
+	typedef std::vector<std::string>::const_iterator svcit;
+	for (svcit it(segments.begin()); it != segments.end(); ++it) {
+		tombstones t;
+		t.load(*it);
+		const size_t before(t.count());
+		std::vector<aid_title> old(read_titles(*it));
+		typedef std::vector<aid_title>::const_iterator atcit;
+		for (atcit it2(old.begin()); it2 != old.end(); ++it2) {
+			if (titles.find(it2->second) != titles.end()) {
+				t.mark(it2->first);
+			}
+		}
+		if (t.count() > before) {
+			t.save(*it);
+		}
+		std::cout << *it << ": " << t.count() - before << " articles superseded, "
+		          << t.count() << " of " << old.size() << " masked" << std::endl;
+	}
+}
+
+// An xml of "-" is stdin. It, and any other input that isn't a regular
+// file (a pipe, a FIFO, a socket), is read forward only by a page_reader
+// feeding the idx_threads, without regions or checkpoints.
+
+static bool is_stream(const char *xml)
+{
+	struct stat st;
+	return strcmp(xml, "-") == 0 || (stat(xml, &st) == 0 && !S_ISREG(st.st_mode));
+}
+
+static void usage(const char *argv0)
+{
+	std::cerr << "usage: " << argv0 << " [-i seconds] [-j progress.json] [-x multistream-index]"
+	          << " [-a articles per file] [--resume]"
+	          << " [--update [-d deleted.txt]] <xml|-> <idx> [<old segment> ...]" << std::endl;
 }
 
 int main(int argc, char *argv[])
 {
-	if (argc < 3) {
-		std::cerr << "usage: " << argv[0] << " <xml> <idx>" << std::endl;
+	size_t interval(DEFAULT_INTERVAL_SEC);
+	size_t flush_limit(ARTICLE_FLUSH_LIMIT);
+	std::string json_filename;
+	std::string deleted_filename;
+	std::string bz2_index_filename;
+	bool resume(false), update(false);
+	static const struct option longopts[] = {
+		{ "resume", no_argument, NULL, 'r' },
+		{ "update", no_argument, NULL, 'u' },
+		{ NULL, 0, NULL, 0 }
+	};
+	int opt;
+	while ((opt = getopt_long(argc, argv, "i:j:x:a:rud:", longopts, NULL)) != -1) {
+		switch (opt) {
+		case 'i': interval = atoi(optarg); break;
+		case 'j': json_filename = optarg; break;
+		case 'x': bz2_index_filename = optarg; break;
+		case 'a': flush_limit = strtoul(optarg, NULL, 10); break;
+		case 'r': resume = true; break;
+		case 'u': update = true; break;
+		case 'd': deleted_filename = optarg; break;
+		default: usage(argv[0]); return 1;
+		}
+	}
+	if (argc - optind < 2 || interval < 1 || flush_limit < 1 || (!update && argc - optind > 2)) {
+		usage(argv[0]);
+		return 1;
+	}
+	const char *xml(argv[optind]), *basename(argv[optind + 1]);
+	const bool streaming(is_stream(xml));
+	if (streaming && resume) {
+		std::cerr << "can't resume from " << xml << "; it can only be read once" << std::endl;
 		return 1;
 	}
+	// old segments, ignoring the files that live next to them
+	std::vector<std::string> segments;
+	for (int i(optind + 2); i < argc; ++i) {
+		const std::string segment(argv[i]);
+		if (ends_with(segment, TOMBSTONE_SUFFIX) || ends_with(segment, TERM_DICTIONARY_SUFFIX) ||
+				ends_with(segment, ".ckpt") || ends_with(segment, ".hdr") || ends_with(segment, ".tmp")) {
+			continue;
+		}
+		if (segment.compare(0, strlen(basename) + 1, std::string(basename) + ".") == 0) {
+			std::cerr << segment << " would be overwritten; pick a new basename for the update" << std::endl;
+			return 1;
+		}
+		segments.push_back(segment);
+	}
 	int rc(0);
 	try {
-		// compute regions
-		std::vector<region> regions(regionize(argv[1], get_cpus()));
+		std::set<std::string> deleted;
+		if (!deleted_filename.empty()) {
+			std::ifstream ifs(deleted_filename.c_str());
+			if (!ifs.good()) {
+				throw std::runtime_error("bad deleted titles file");
+			}
+			std::string line;
+			while (std::getline(ifs, line)) {
+				if (!line.empty()) {
+					deleted.insert(line);
+				}
+			}
+		}
+		std::ofstream json;
+		if (!json_filename.empty()) {
+			json.open(json_filename.c_str(), std::ios::out | std::ios::app);
+			if (!json.good()) {
+				throw std::runtime_error("failed to open progress file");
+			}
+		}
+		// compute regions, or recover them from the checkpoints
+		std::vector<checkpoint> checkpoints;
+		int input_fd(-1);
+		if (streaming) {
+			input_fd = strcmp(xml, "-") == 0 ? STDIN_FILENO : open(xml, O_RDONLY);
+			if (input_fd < 0) {
+				throw std::runtime_error("bad input file");
+			}
+		} else if (resume) {
+			for (size_t i(1); exists(thread_basename(basename, i) + ".ckpt"); ++i) {
+				checkpoint ckpt;
+				ckpt.read(thread_basename(basename, i) + ".ckpt");
+				remove_partial(thread_basename(basename, i), ckpt);
+				checkpoints.push_back(ckpt);
+			}
+			if (checkpoints.empty()) {
+				throw std::runtime_error("no checkpoints to resume from");
+			}
+		} else {
+			std::vector<region> regions;
+			if (is_bz2(xml)) {
+				if (bz2_index_filename.empty()) {
+					bz2_index_filename = bz2_default_index(xml);
+				}
+				regions = regionize_bz2(xml, get_cpus(), bz2_index_filename);
+			} else {
+				regions = regionize(xml, get_cpus());
+			}
+			typedef std::vector<region>::const_iterator rcit;
+			for (rcit it(regions.begin()); it != regions.end(); ++it) {
+				checkpoints.push_back(checkpoint(*it));
+				checkpoints.back().write(thread_basename(basename, checkpoints.size()) + ".ckpt");
+			}
+		}
+		if (!resume) {
+			// stale checkpoints from an earlier run with more threads
+			for (size_t i(checkpoints.size() + 1); exists(thread_basename(basename, i) + ".ckpt"); ++i) {
+				unlink((thread_basename(basename, i) + ".ckpt").c_str());
+			}
+		}
+		term_dictionary terms(std::string(basename) + TERM_DICTIONARY_SUFFIX, resume);
 		// start threads
 		std::vector<idx_thread *> threads;
-		size_t thread_id(1);
-		typedef std::vector<region>::const_iterator rcit;
 		typedef std::vector<idx_thread *>::iterator thit;
-		for (rcit it(regions.begin()); it != regions.end(); ++it) {
-			std::cout << "region: " << it->begin << '-' << it->end << std::endl;
-			std::ostringstream oss;
-			oss << argv[2] << "." << thread_id++;
-			idx_thread *t(new idx_thread(argv[1], *it, oss.str()));
+		const uint64_t begin(now_usec());
+		uint64_t total_bytes(0); // unknown when streaming
+		page_queue queue(get_cpus() * PAGE_QUEUE_BATCHES_PER_THREAD);
+		page_reader *reader(NULL);
+		if (streaming) {
+			std::cout << "streaming " << (input_fd == STDIN_FILENO ? "stdin" : xml)
+			          << " to " << get_cpus() << " threads" << std::endl;
+			reader = new page_reader(input_fd, queue);
+			reader->start();
+			for (size_t i(0); i < get_cpus(); ++i) {
+				idx_thread *t(new idx_thread(queue, thread_basename(basename, i + 1), &terms));
+				t->set_flush_limit(flush_limit);
+				t->start();
+				threads.push_back(t);
+			}
+		}
+		for (size_t i(0); i < checkpoints.size(); ++i) {
+			const checkpoint& ckpt(checkpoints[i]);
+			const std::string thread_base(thread_basename(basename, i + 1));
+			std::cout << "region: " << ckpt.begin << '-' << ckpt.end;
+			if (resume) {
+				std::cout << (ckpt.done ? " (done)" : "") << " from " << ckpt.offset
+				          << " after " << ckpt.flushes << " files";
+			}
+			std::cout << std::endl;
+			idx_thread *t(new idx_thread(xml, ckpt, thread_base, thread_base + ".ckpt", &terms));
+			total_bytes += t->region_bytes();
+			t->set_flush_limit(flush_limit);
 			t->start();
 			threads.push_back(t);
 		}
-		// wait for completion + calculate statistics
-		for (size_t i(1); ; i++) {
-			size_t finished_count(0), articles(0);
+		// wait for completion, reporting progress
+		idx_stats last;
+		uint64_t last_usec(begin);
+		for (;;) {
+			size_t finished_count(0);
+			idx_stats total;
+			std::vector<idx_stats> per_thread;
 			for (thit it(threads.begin()); it != threads.end(); ++it) {
 				if ((*it)->finished()) {
 					finished_count++;
 				}
-				articles += (*it)->article_count();
+				per_thread.push_back((*it)->stats());
+				total.add(per_thread.back());
+			}
+			const uint64_t now(now_usec());
+			const double dt((now - last_usec) / 1e6), elapsed((now - begin) / 1e6);
+			const double bps(dt > 0 ? (total.bytes - last.bytes) / dt : 0);
+			const double aps(dt > 0 ? (total.articles - last.articles) / dt : 0);
+			const double tps(dt > 0 ? (total.terms - last.terms) / dt : 0);
+			const double pps(dt > 0 ? (total.postings - last.postings) / dt : 0);
+			const uint64_t busy(
+				(total.read_usec - last.read_usec) +
+				(total.tokenize_usec - last.tokenize_usec) +
+				(total.index_usec - last.index_usec) +
+				(total.flush_usec - last.flush_usec));
+			const bool done(finished_count >= threads.size());
+			const uint64_t left(total_bytes > total.bytes ? total_bytes - total.bytes : 0);
+			const int64_t eta(done ? 0 : bps > 0 && total_bytes > 0 ? static_cast<int64_t>(left / bps) : -1);
+			std::cout << "indexed " << total.articles << " articles "
+			          << "(" << static_cast<size_t>(aps) << "/s, "
+			          << static_cast<size_t>(bps / (1024 * 1024)) << "MB/s";
+			if (total_bytes > 0) {
+				std::cout << ", " << percent(total.bytes, total_bytes) << "%";
+			}
+			std::cout << ") "
+			          << "read " << percent(total.read_usec - last.read_usec, busy) << "% "
+			          << "tokenize " << percent(total.tokenize_usec - last.tokenize_usec, busy) << "% "
+			          << "index " << percent(total.index_usec - last.index_usec, busy) << "% "
+			          << "flush " << percent(total.flush_usec - last.flush_usec, busy) << "%";
+			if (eta >= 0) {
+				std::cout << ", ETA " << format_duration(eta);
+			}
+			std::cout << std::endl;
+			if (json.is_open()) {
+				json << "{\"time\": " << now / 1000000
+				     << ", \"elapsed\": " << elapsed
+				     << ", \"total_bytes\": " << total_bytes
+				     << ", \"threads\": " << threads.size()
+				     << ", \"finished\": " << finished_count
+				     << ", ";
+				json_stats(json, total);
+				json << ", \"rates\": {\"bytes\": " << static_cast<uint64_t>(bps)
+				     << ", \"articles\": " << static_cast<uint64_t>(aps)
+				     << ", \"terms\": " << static_cast<uint64_t>(tps)
+				     << ", \"postings\": " << static_cast<uint64_t>(pps)
+				     << "}, \"eta\": " << eta
+				     << ", \"per_thread\": [";
+				for (size_t i(0); i < per_thread.size(); ++i) {
+					json << (i ? ", {" : "{") << "\"region_bytes\": " << threads[i]->region_bytes() << ", ";
+					json_stats(json, per_thread[i]);
+					json << '}';
+				}
+				json << "]}" << std::endl;
 			}
-			const size_t aps(articles/i);
-			std::cout << "indexed " << articles << " articles "
-			          << "(~" << aps << "/s)"
-			          << std::endl;
-			if (finished_count >= threads.size()) {
+			if (done) {
 				break;
 			}
-			sleep(1);
+			last = total;
+			last_usec = now;
+			sleep(interval);
 		}
 		std::cout << "all indexing complete; finalizing" << std::endl;
 		for (thit it(threads.begin()); it != threads.end(); ++it) {
 			(*it)->join();
-			delete *it;
+		}
+		if (reader) {
+			reader->join();
+			std::cout << "read " << reader->bytes() / (1024 * 1024) << "MB" << std::endl;
+			delete reader;
+			if (input_fd != STDIN_FILENO) {
+				close(input_fd);
+			}
+		}
+		std::cout << terms.size() << " distinct terms in " << terms.filename() << std::endl;
+		if (update) {
+			mask_superseded(threads, basename, segments, deleted);
+		}
+		for (size_t i(0); i < threads.size(); ++i) {
+			unlink((thread_basename(basename, i + 1) + ".ckpt").c_str());
+			delete threads[i];
 		}
 	} catch (const std::runtime_error& ex) {
 		std::cerr << ex.what() << std::endl;
@@ -0,0 +1,242 @@
+#include <iostream>
+#include <sstream>
+#include <fstream>
+#include <stdexcept>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include "def.hh"
+#include "thread.hh"
+
+extern "C" {
+	#include <unistd.h>
+	#include <errno.h>
+	#include <signal.h>
+	#include <sys/socket.h>
+	#include <netinet/in.h>
+	#include <netinet/tcp.h>
+	#include <arpa/inet.h>
+}
+
+// loadgen drives searchd over keep-alive connections, one thread per
+// connection, each issuing /query/<term> requests back to back for a
+// fixed duration. It reports throughput and latency percentiles.
+
+#define DEFAULT_CONNECTIONS 8
+#define DEFAULT_DURATION_SEC 10
+
+class load_thread : public threadbase
+{
+public:
+	load_thread(
+			const std::string& host,
+			int port,
+			const std::vector<std::string>& terms,
+			uint64_t deadline_usec,
+			unsigned int seed);
+	virtual ~load_thread();
+	virtual void run();
+
+	const std::vector<uint64_t>& latencies() const { return m_latencies; }
+	size_t errors() const { return m_errors; }
+
+private:
+	bool connect_to();
+	bool round_trip(const std::string& request);
+
+	const std::string m_host;
+	const int m_port;
+	const std::vector<std::string>& m_terms;
+	const uint64_t m_deadline;
+	unsigned int m_seed;
+	int m_fd;
+	std::string m_buf;
+	std::vector<uint64_t> m_latencies;
+	size_t m_errors;
+};
+
+load_thread::load_thread(
+		const std::string& host,
+		int port,
+		const std::vector<std::string>& terms,
+		uint64_t deadline_usec,
+		unsigned int seed)
+: m_host(host)
+, m_port(port)
+, m_terms(terms)
+, m_deadline(deadline_usec)
+, m_seed(seed)
+, m_fd(-1)
+, m_errors(0)
+{
+	//
+}
+
+load_thread::~load_thread()
+{
+	if (m_fd >= 0) {
+		close(m_fd);
+	}
+}
+
+bool load_thread::connect_to()
+{
+	if (m_fd >= 0) {
+		close(m_fd);
+	}
+	m_buf.clear();
+	m_fd = socket(AF_INET, SOCK_STREAM, 0);
+	if (m_fd < 0) {
+		return false;
+	}
+	int one(1);
+	setsockopt(m_fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+	struct sockaddr_in addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(m_port);
+	if (inet_pton(AF_INET, m_host.c_str(), &addr.sin_addr) != 1) {
+		return false;
+	}
+	return connect(m_fd, reinterpret_cast<struct sockaddr *>(&addr), sizeof(addr)) == 0;
+}
+
+bool load_thread::round_trip(const std::string& request)
+{
+	size_t sent(0);
+	while (sent < request.size()) {
+		ssize_t n(write(m_fd, request.data() + sent, request.size() - sent));
+		if (n <= 0) {
+			return false;
+		}
+		sent += n;
+	}
+	// read the head, then exactly Content-Length bytes of body
+	char buf[16384];
+	std::string::size_type head_end;
+	while ((head_end = m_buf.find("\r\n\r\n")) == std::string::npos) {
+		ssize_t n(read(m_fd, buf, sizeof(buf)));
+		if (n <= 0) {
+			return false;
+		}
+		m_buf.append(buf, n);
+	}
+	const std::string head(m_buf.substr(0, head_end));
+	if (head.compare(0, 12, "HTTP/1.1 200") != 0) {
+		return false;
+	}
+	static const std::string CL("Content-Length: ");
+	const std::string::size_type cl(head.find(CL));
+	if (cl == std::string::npos) {
+		return false;
+	}
+	const size_t body(atoi(head.c_str() + cl + CL.size()));
+	const size_t total(head_end + 4 + body);
+	while (m_buf.size() < total) {
+		ssize_t n(read(m_fd, buf, sizeof(buf)));
+		if (n <= 0) {
+			return false;
+		}
+		m_buf.append(buf, n);
+	}
+	m_buf.erase(0, total);
+	return head.find("Connection: close") == std::string::npos;
+}
+
+void load_thread::run()
+{
+	bool connected(connect_to());
+	while (now_usec() < m_deadline) {
+		if (!connected) {
+			m_errors++;
+			connected = connect_to();
+			continue;
+		}
+		const std::string& term(m_terms[rand_r(&m_seed) % m_terms.size()]);
+		const std::string request(
+			"GET /query/" + term + " HTTP/1.1\r\n"
+			"Host: " + m_host + "\r\n"
+			"\r\n"
+		);
+		const uint64_t begin(now_usec());
+		if (round_trip(request)) {
+			m_latencies.push_back(now_usec() - begin);
+		} else {
+			m_errors++;
+			connected = connect_to();
+		}
+	}
+}
+
+static void usage(const char *argv0)
+{
+	std::cerr << "usage: " << argv0
+	          << " [-h host] [-p port] [-c connections] [-s seconds]"
+	          << " (-f termfile | <term> [<term> ...])"
+	          << std::endl;
+}
+
+int main(int argc, char *argv[])
+{
+	std::string host("127.0.0.1"), termfile;
+	int port(8080), connections(DEFAULT_CONNECTIONS), seconds(DEFAULT_DURATION_SEC);
+	int opt;
+	while ((opt = getopt(argc, argv, "h:p:c:s:f:")) != -1) {
+		switch (opt) {
+		case 'h': host = optarg; break;
+		case 'p': port = atoi(optarg); break;
+		case 'c': connections = atoi(optarg); break;
+		case 's': seconds = atoi(optarg); break;
+		case 'f': termfile = optarg; break;
+		default: usage(argv[0]); return 1;
+		}
+	}
+	std::vector<std::string> terms;
+	for (int i(optind); i < argc; i++) {
+		terms.push_back(argv[i]);
+	}
+	if (!termfile.empty()) {
+		std::ifstream ifs(termfile.c_str());
+		std::string line;
+		while (std::getline(ifs, line)) {
+			if (!line.empty()) {
+				terms.push_back(line);
+			}
+		}
+	}
+	if (terms.empty() || connections < 1 || seconds < 1) {
+		usage(argv[0]);
+		return 1;
+	}
+	signal(SIGPIPE, SIG_IGN);
+	const uint64_t begin(now_usec());
+	const uint64_t deadline(begin + static_cast<uint64_t>(seconds) * 1000000);
+	std::vector<load_thread *> threads;
+	typedef std::vector<load_thread *>::iterator ltit;
+	for (int i(0); i < connections; ++i) {
+		load_thread *t(new load_thread(host, port, terms, deadline, i + 1));
+		t->start();
+		threads.push_back(t);
+	}
+	std::vector<uint64_t> latencies;
+	size_t errors(0);
+	for (ltit it(threads.begin()); it != threads.end(); ++it) {
+		(*it)->join();
+		latencies.insert(latencies.end(), (*it)->latencies().begin(), (*it)->latencies().end());
+		errors += (*it)->errors();
+		delete *it;
+	}
+	const double elapsed((now_usec() - begin) / 1e6);
+	std::sort(latencies.begin(), latencies.end());
+	std::cout << latencies.size() << " requests, " << errors << " errors in "
+	          << elapsed << "s over " << connections << " connections" << std::endl;
+	std::cout << "qps: " << static_cast<size_t>(latencies.size() / elapsed) << std::endl;
+	std::cout << "latency (us):"
+	          << " p50=" << percentile(latencies, 0.50)
+	          << " p90=" << percentile(latencies, 0.90)
+	          << " p99=" << percentile(latencies, 0.99)
+	          << " p999=" << percentile(latencies, 0.999)
+	          << " max=" << (latencies.empty() ? 0 : latencies.back())
+	          << std::endl;
+	return errors > 0 && latencies.empty() ? 1 : 0;
+}
@@ -1,63 +1,342 @@
-#include <python2.7/Python.h>
-#include <sstream>
-#include <iostream>
+#define PY_SSIZE_T_CLEAN
+#include <Python.h>
+#include <stdexcept>
 #include "search.hh"
+#include "fold.hh"
+
+// Searches run with the GIL released, so multi-threaded Python
+// frontends can search in parallel. Results are returned as native
+// objects: {"hits": <int>, "top": [{"article": <str>, "weight": <int>}],
+// "expanded": [<str>], "cursor": <str or None>}, where expanded lists the
+// terms searched for if the query was a wildcard or fell back to fuzzy
+// matching, and cursor may be passed to search_page for the next page.
+// search(term, trace=True) adds "trace": {"total_usec": <int>, ...,
+// "segments": [{"file": <str>, "lookup_usec": <int>, ...}]}, where the
+// time went, for slow-query logs (see search_trace).
+//
+// Terms and prefixes are lowercased with fold_case, as the tokenizer
+// lowercases text, rather than with Python's str.lower(), which differs
+// for some letters (final sigma, dotted capital I).
+
+static bool to_string(PyObject *obj, std::string& dst)
+{
+	if (PyUnicode_Check(obj)) {
+		Py_ssize_t len(0);
+		const char *s(PyUnicode_AsUTF8AndSize(obj, &len));
+		if (!s) {
+			return false;
+		}
+		dst.assign(s, len);
+		return true;
+	}
+	if (PyBytes_Check(obj)) {
+		dst.assign(PyBytes_AS_STRING(obj), PyBytes_GET_SIZE(obj));
+		return true;
+	}
+	PyErr_SetString(PyExc_TypeError, "expected str or bytes");
+	return false;
+}
+
+static PyObject * to_python(const search_results& r)
+{
+	PyObject *top(PyList_New(r.top.size()));
+	if (!top) {
+		return NULL;
+	}
+	for (size_t i(0); i < r.top.size(); ++i) {
+		const search_result& sr(r.top[i]);
+		PyObject *article(PyUnicode_DecodeUTF8(sr.article.data(), sr.article.size(), "replace"));
+		if (!article) {
+			Py_DECREF(top);
+			return NULL;
+		}
+		PyObject *item(Py_BuildValue("{s:N,s:n}", "article", article, "weight", sr.weight));
+		if (!item) {
+			Py_DECREF(top);
+			return NULL;
+		}
+		PyList_SET_ITEM(top, i, item);
+	}
+	PyObject *expanded(PyList_New(r.expanded.size()));
+	if (!expanded) {
+		Py_DECREF(top);
+		return NULL;
+	}
+	for (size_t i(0); i < r.expanded.size(); ++i) {
+		PyObject *term(PyUnicode_DecodeUTF8(r.expanded[i].data(), r.expanded[i].size(), "replace"));
+		if (!term) {
+			Py_DECREF(top);
+			Py_DECREF(expanded);
+			return NULL;
+		}
+		PyList_SET_ITEM(expanded, i, term);
+	}
+	PyObject *cursor(Py_None);
+	Py_INCREF(cursor);
+	if (!r.cursor.empty()) {
+		Py_DECREF(cursor);
+		cursor = PyUnicode_FromStringAndSize(r.cursor.data(), r.cursor.size());
+		if (!cursor) {
+			Py_DECREF(top);
+			Py_DECREF(expanded);
+			return NULL;
+		}
+	}
+	return Py_BuildValue("{s:n,s:N,s:N,s:N}", "hits", r.total, "top", top, "expanded", expanded, "cursor", cursor);
+}
+
+static PyObject * to_python(const search_trace& t)
+{
+	PyObject *segments(PyList_New(t.segments.size()));
+	if (!segments) {
+		return NULL;
+	}
+	for (size_t i(0); i < t.segments.size(); ++i) {
+		const segment_trace& s(t.segments[i]);
+		PyObject *item(Py_BuildValue(
+			"{s:s#,s:K,s:K,s:n,s:n,s:n,s:n,s:K,s:n}",
+			"file", s.filename.data(), static_cast<Py_ssize_t>(s.filename.size()),
+			"lookup_usec", static_cast<unsigned long long>(s.lookup_usec),
+			"aggregate_usec", static_cast<unsigned long long>(s.aggregate_usec),
+			"filtered", s.filtered,
+			"blocks", s.blocks,
+			"cache_hits", s.cache_hits,
+			"reads", s.reads,
+			"bytes_read", static_cast<unsigned long long>(s.bytes_read),
+			"postings", s.postings
+		));
+		if (!item) {
+			Py_DECREF(segments);
+			return NULL;
+		}
+		PyList_SET_ITEM(segments, i, item);
+	}
+	return Py_BuildValue(
+		"{s:K,s:K,s:K,s:K,s:N}",
+		"total_usec", static_cast<unsigned long long>(t.total_usec),
+		"expand_usec", static_cast<unsigned long long>(t.expand_usec),
+		"read_usec", static_cast<unsigned long long>(t.read_usec),
+		"merge_usec", static_cast<unsigned long long>(t.merge_usec),
+		"segments", segments
+	);
+}
 
 static PyObject * py_init(PyObject *self, PyObject *args)
 {
 	PyObject *list;
 	if (!PyArg_ParseTuple(args, "O!", &PyList_Type, &list)) {
-		PyErr_SetString(PyExc_RuntimeError, "error parsing list");
 		return NULL;
 	}
-	size_t len(PyList_Size(list));
+	Py_ssize_t len(PyList_Size(list));
 	std::vector<std::string> filenames;
-	for (size_t i(0); i < len; ++i) {
-		PyObject *sobj(PyList_GetItem(list, i));
-		if (!sobj) {
-			continue;
-		}
-		char *s(PyString_AsString(sobj));
-		if (!s) {
-			continue;
+	for (Py_ssize_t i(0); i < len; ++i) {
+		std::string s;
+		if (!to_string(PyList_GetItem(list, i), s)) {
+			return NULL;
 		}
 		filenames.push_back(s);
 	}
-	size_t count(init_indices(filenames));
-	return Py_BuildValue("i", count);
+	// searches on other threads carry on while the files load
+	size_t count(0);
+	bool ok(true);
+	std::string err;
+	Py_BEGIN_ALLOW_THREADS
+	try {
+		count = init_indices(filenames);
+	} catch (const std::runtime_error& ex) {
+		ok = false;
+		err = ex.what();
+	}
+	Py_END_ALLOW_THREADS
+	if (!ok) {
+		PyErr_SetString(PyExc_RuntimeError, err.c_str());
+		return NULL;
+	}
+	return PyLong_FromSize_t(count);
 }
 
-static PyObject * py_search(PyObject *self, PyObject *args)
+static PyObject * py_search(PyObject *self, PyObject *args, PyObject *kwargs)
 {
-	char *term;
-	if (!PyArg_ParseTuple(args, "s", &term)) {
-		PyErr_SetString(PyExc_RuntimeError, "error parsing string");
+	static const char *kwlist[] = { "term", "fuzzy", "trace", NULL };
+	const char *s;
+	Py_ssize_t len, fuzzy(0);
+	int traced(0);
+	if (!PyArg_ParseTupleAndKeywords(args, kwargs, "s#|np", const_cast<char **>(kwlist), &s, &len, &fuzzy, &traced)) {
+		return NULL;
+	}
+	if (fuzzy < 0) {
+		PyErr_SetString(PyExc_ValueError, "fuzzy must not be negative");
 		return NULL;
 	}
-	search_results r(search_indices(term));
-	std::ostringstream oss;
-	oss << "{\"hits\":" << r.total << ", ";
-	oss << "\"top\": [\n";
-	typedef std::vector<search_result>::const_iterator srcit;
-	for (srcit it(r.top.begin()); it != r.top.end(); ++it) {
-		oss << (it == r.top.begin() ? "" : ",\n");
-		oss << "\t{\"article\": \"" << it->article << "\", ";
-		oss << "\"weight\": " << it->weight << "}";
+	const std::string term(fold_case(std::string(s, len)));
+	search_results r;
+	search_trace trace;
+	bool ok(true);
+	std::string err;
+	Py_BEGIN_ALLOW_THREADS
+	try {
+		r = search_indices(term, fuzzy, traced ? &trace : NULL);
+	} catch (const std::runtime_error& ex) {
+		ok = false;
+		err = ex.what();
+	}
+	Py_END_ALLOW_THREADS
+	if (!ok) {
+		PyErr_SetString(PyExc_RuntimeError, err.c_str());
+		return NULL;
+	}
+	PyObject *result(to_python(r));
+	if (!result || !traced) {
+		return result;
+	}
+	PyObject *t(to_python(trace));
+	if (!t || PyDict_SetItemString(result, "trace", t) != 0) {
+		Py_XDECREF(t);
+		Py_DECREF(result);
+		return NULL;
 	}
-	oss << "\n]}";
-	return Py_BuildValue("s", oss.str().c_str());
+	Py_DECREF(t);
+	return result;
+}
+
+static PyObject * py_search_page(PyObject *self, PyObject *args, PyObject *kwargs)
+{
+	static const char *kwlist[] = { "term", "cursor", "count", "snapshot", NULL };
+	const char *s, *c(NULL);
+	Py_ssize_t len, clen(0), count(MAX_SEARCH_RESULTS);
+	int snapshot(0);
+	if (!PyArg_ParseTupleAndKeywords(args, kwargs, "s#|z#np", const_cast<char **>(kwlist), &s, &len, &c, &clen, &count, &snapshot)) {
+		return NULL;
+	}
+	if (count < 0) {
+		PyErr_SetString(PyExc_ValueError, "count must not be negative");
+		return NULL;
+	}
+	const std::string term(fold_case(std::string(s, len))), cursor(c ? std::string(c, clen) : "");
+	search_results r;
+	bool ok(true);
+	std::string err;
+	Py_BEGIN_ALLOW_THREADS
+	try {
+		r = search_page(term, cursor, count, snapshot != 0);
+	} catch (const std::runtime_error& ex) {
+		ok = false;
+		err = ex.what();
+	}
+	Py_END_ALLOW_THREADS
+	if (!ok) {
+		PyErr_SetString(PyExc_ValueError, err.c_str());
+		return NULL;
+	}
+	return to_python(r);
+}
+
+static PyObject * py_search_many(PyObject *self, PyObject *args)
+{
+	PyObject *seq;
+	if (!PyArg_ParseTuple(args, "O", &seq)) {
+		return NULL;
+	}
+	PyObject *fast(PySequence_Fast(seq, "search_many expects a sequence of terms"));
+	if (!fast) {
+		return NULL;
+	}
+	std::vector<std::string> terms;
+	const Py_ssize_t len(PySequence_Fast_GET_SIZE(fast));
+	for (Py_ssize_t i(0); i < len; ++i) {
+		std::string s;
+		if (!to_string(PySequence_Fast_GET_ITEM(fast, i), s)) {
+			Py_DECREF(fast);
+			return NULL;
+		}
+		terms.push_back(fold_case(s));
+	}
+	Py_DECREF(fast);
+	std::vector<search_results> results;
+	bool ok(true);
+	std::string err;
+	Py_BEGIN_ALLOW_THREADS
+	try {
+		results = search_indices(terms);
+	} catch (const std::runtime_error& ex) {
+		ok = false;
+		err = ex.what();
+	}
+	Py_END_ALLOW_THREADS
+	if (!ok) {
+		PyErr_SetString(PyExc_RuntimeError, err.c_str());
+		return NULL;
+	}
+	PyObject *list(PyList_New(results.size()));
+	if (!list) {
+		return NULL;
+	}
+	for (size_t i(0); i < results.size(); ++i) {
+		PyObject *r(to_python(results[i]));
+		if (!r) {
+			Py_DECREF(list);
+			return NULL;
+		}
+		PyList_SET_ITEM(list, i, r);
+	}
+	return list;
+}
+
+static PyObject * py_complete(PyObject *self, PyObject *args)
+{
+	const char *s;
+	Py_ssize_t len, n(MAX_SEARCH_RESULTS);
+	if (!PyArg_ParseTuple(args, "s#|n", &s, &len, &n)) {
+		return NULL;
+	}
+	if (n < 0) {
+		PyErr_SetString(PyExc_ValueError, "n must not be negative");
+		return NULL;
+	}
+	const std::string prefix(fold_case(std::string(s, len)));
+	std::vector<completion> c;
+	Py_BEGIN_ALLOW_THREADS
+	c = complete_terms(prefix, n);
+	Py_END_ALLOW_THREADS
+	PyObject *list(PyList_New(c.size()));
+	if (!list) {
+		return NULL;
+	}
+	for (size_t i(0); i < c.size(); ++i) {
+		PyObject *item(Py_BuildValue("(s#n)", c[i].term.data(), static_cast<Py_ssize_t>(c[i].term.size()), c[i].frequency));
+		if (!item) {
+			Py_DECREF(list);
+			return NULL;
+		}
+		PyList_SET_ITEM(list, i, item);
+	}
+	return list;
 }
 
 static PyMethodDef module_methods[] = {
-	{ "init",   py_init,   METH_VARARGS },
-	{ "search", py_search, METH_VARARGS },
-	{ NULL, NULL }
+	{ "init",        py_init,        METH_VARARGS, "init([idx, ...]) -> count" },
+	{ "search",      reinterpret_cast<PyCFunction>(reinterpret_cast<void (*)()>(py_search)), METH_VARARGS | METH_KEYWORDS, "search(term, fuzzy=0, trace=False) -> results" },
+	{ "search_page", reinterpret_cast<PyCFunction>(reinterpret_cast<void (*)()>(py_search_page)), METH_VARARGS | METH_KEYWORDS, "search_page(term, cursor=None, count=10, snapshot=False) -> results" },
+	{ "search_many", py_search_many, METH_VARARGS, "search_many([term, ...]) -> [results, ...]" },
+	{ "complete",    py_complete,    METH_VARARGS, "complete(prefix[, n]) -> [(term, frequency), ...]" },
+	{ NULL, NULL, 0, NULL }
+};
+
+static struct PyModuleDef module_def = {
+	PyModuleDef_HEAD_INIT,
+	"indisk",
+	NULL,
+	-1,
+	module_methods,
+	NULL,
+	NULL,
+	NULL,
+	NULL
 };
 
 extern "C" {
-	void initindisk()
+	PyMODINIT_FUNC PyInit_indisk()
 	{
-		Py_InitModule("indisk", module_methods);
+		return PyModule_Create(&module_def);
 	}
 }
-
@@ -1,10 +1,55 @@
 #include <iostream>
+#include <iomanip>
 #include <fstream>
 #include <cassert>
 #include <stdexcept>
 #include <map>
 #include "def.hh"
 #include "search.hh"
+#include "fold.hh"
+
+// One line per index file the search did any work in, and the totals.
+static void print_trace(const search_trace& t)
+{
+	std::cout << "trace: " << t.total_usec << "us total, " << t.expand_usec
+	          << "us expanding, " << t.read_usec << "us reading, "
+	          << t.merge_usec << "us merging" << std::endl;
+	std::cout << std::setw(8) << "lookup" << std::setw(10) << "aggregate"
+	          << std::setw(9) << "filtered" << std::setw(8) << "blocks"
+	          << std::setw(8) << "cached" << std::setw(7) << "reads"
+	          << std::setw(10) << "bytes" << std::setw(10) << "postings"
+	          << "  file" << std::endl;
+	segment_trace sum;
+	sum.filename = "(total)";
+	size_t idle(0);
+	typedef std::vector<segment_trace>::const_iterator stcit;
+	for (stcit it(t.segments.begin()); it != t.segments.end(); ++it) {
+		sum.lookup_usec += it->lookup_usec;
+		sum.aggregate_usec += it->aggregate_usec;
+		sum.filtered += it->filtered;
+		sum.blocks += it->blocks;
+		sum.cache_hits += it->cache_hits;
+		sum.reads += it->reads;
+		sum.bytes_read += it->bytes_read;
+		sum.postings += it->postings;
+	}
+	for (size_t i(0); i <= t.segments.size(); ++i) {
+		const segment_trace& s(i < t.segments.size() ? t.segments[i] : sum);
+		if (i < t.segments.size() && s.blocks == 0 && s.postings == 0) {
+			idle++;
+			continue;
+		}
+		std::cout << std::setw(6) << s.lookup_usec << "us"
+		          << std::setw(8) << s.aggregate_usec << "us"
+		          << std::setw(9) << s.filtered << std::setw(8) << s.blocks
+		          << std::setw(8) << s.cache_hits << std::setw(7) << s.reads
+		          << std::setw(10) << s.bytes_read << std::setw(10) << s.postings
+		          << "  " << s.filename << std::endl;
+	}
+	if (idle > 0) {
+		std::cout << "(and " << idle << " index files without the term)" << std::endl;
+	}
+}
 
 int main(int argc, char *argv[])
 {
@@ -20,20 +65,62 @@ int main(int argc, char *argv[])
 	std::cout << "searching " << indices << " index files" << std::endl;
 	int rc(0);
 	try {
+		std::string last_input, last_cursor;
 		while (true) {
 			std::string input;
 			std::cout << "> ";
 			std::getline(std::cin, input);
-			std::transform(input.begin(), input.end(), input.begin(), tolower);
+			input = fold_case(input);
 			if (input == "quit") {
 				break;
 			}
-			search_results r(search_indices(input));
+			static const std::string COMPLETE("complete ");
+			if (input.compare(0, COMPLETE.size(), COMPLETE) == 0) {
+				std::vector<completion> c(complete_terms(input.substr(COMPLETE.size()), MAX_SEARCH_RESULTS));
+				typedef std::vector<completion>::const_iterator ccit;
+				for (ccit it(c.begin()); it != c.end(); ++it) {
+					std::cout << it->term << " (" << it->frequency << ")" << std::endl;
+				}
+				continue;
+			}
+			search_results r;
+			search_trace trace;
+			static const std::string TRACE("trace ");
+			const bool traced(input.compare(0, TRACE.size(), TRACE) == 0);
+			if (traced) {
+				input = input.substr(TRACE.size());
+				r = search_indices(input, DEFAULT_FUZZY_DISTANCE, &trace);
+			} else if (input == "more") {
+				if (last_cursor.empty()) {
+					std::cout << "no more results" << std::endl;
+					continue;
+				}
+				input = last_input;
+				r = search_page(input, last_cursor, MAX_SEARCH_RESULTS, true);
+			} else {
+				r = search_page(input, "");
+				if (r.total == 0) {
+					r = search_indices(input, DEFAULT_FUZZY_DISTANCE);
+				}
+			}
+			last_input = input;
+			last_cursor = r.cursor;
 			std::cout << input << ": " << r.total << " hits" << std::endl;
+			if (!r.expanded.empty()) {
+				std::cout << "(searched for";
+				typedef std::vector<std::string>::const_iterator svcit;
+				for (svcit it(r.expanded.begin()); it != r.expanded.end(); ++it) {
+					std::cout << " " << *it;
+				}
+				std::cout << ")" << std::endl;
+			}
 			typedef std::vector<search_result>::const_iterator srit;
 			for (srit it(r.top.begin()); it != r.top.end(); ++it) {
 				std::cout << it->article << " (" << it->weight << ")" << std::endl;
 			}
+			if (traced) {
+				print_trace(trace);
+			}
 		}
 	} catch (const std::runtime_error& ex) {
 		std::cerr << ex.what() << std::endl;
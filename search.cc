@@ -4,7 +4,25 @@
 #include <cassert>
 #include <sstream>
 #include <map>
+#include <cstdlib>
+#include <cstring>
+#include <algorithm>
+#include <iterator>
 #include "search.hh"
+#include "cache.hh"
+#include "dict.hh"
+#include "tombstone.hh"
+#include "termdict.hh"
+#include "flat.hh"
+#include "aio.hh"
+#include "bloom.hh"
+#include "idx.hh"
+
+extern "C" {
+	#include <unistd.h>
+	#include <fcntl.h>
+	#include <sys/stat.h>
+}
 
 template<typename T>
 void read(std::ifstream& ifs, T& t)
@@ -12,176 +30,772 @@ void read(std::ifstream& ifs, T& t)
 	ifs.read(reinterpret_cast<char *>(&t), sizeof(T));
 }
 
+// Decoded postings blocks, shared by all index files and searches.
+static postings_cache CACHE(DEFAULT_CACHE_BUDGET);
+
+// Postings blocks are read with pread(2) in pieces of this size,
+// so concurrent searches never share a file position.
+#define BLOCK_READ_SIZE 4096
+
+// Batched reads coalesce nearby blocks into reads of at most this size.
+#define SWEEP_READ_SIZE (256 * 1024) // 256KB
+
+// Decode the postings block at the beginning of buf into dst:
+// <uint32_t term ID> <uint32_t article ID> . . . 
+//   <uint32_t UINT32_MAX> '\n'
+// Returns the number of bytes consumed, or 0 if buf doesn't hold the
+// complete block (in which case dst is left untouched).
+static size_t decode_block(const char *buf, size_t len, id_vector& dst)
+{
+	const size_t count(len / sizeof(uint32_t));
+	if (count < 2) {
+		return 0;
+	}
+	uint32_t termid(0);
+	memcpy(&termid, buf, sizeof(uint32_t));
+	assert(termid > 0);
+	for (size_t i(1); i < count; ++i) {
+		uint32_t articleid(0);
+		memcpy(&articleid, buf + i * sizeof(uint32_t), sizeof(uint32_t));
+		if (articleid == UINT32_MAX) {
+			const size_t consumed((i + 1) * sizeof(uint32_t) + 1);
+			if (consumed > len) {
+				return 0;
+			}
+			assert(buf[consumed-1] == '\n');
+			const char *begin(buf + sizeof(uint32_t));
+			const size_t n(i - 1);
+			const size_t at(dst.size());
+			dst.resize(at + n);
+			if (n > 0) {
+				memcpy(&dst[at], begin, n * sizeof(uint32_t));
+			}
+			return consumed;
+		}
+	}
+	return 0;
+}
+
+// The term dictionary an index set was written with (see termdict.hh),
+// shared by its index files. Each term is held once, however many files
+// it appears in.
+struct dictionary_repr {
+	dictionary_repr(const std::string& filename)
+	{
+		read_dictionary(filename, add, this);
+		terms.shrink();
+		shrink_to_fit(termids);
+		shrink_to_fit(by_termid);
+	}
+	
+	static void add(uint32_t termid, const std::string& term, void *arg)
+	{
+		dictionary_repr& d(*reinterpret_cast<dictionary_repr *>(arg));
+		const uint32_t n(d.terms.insert(term.data(), term.size()));
+		if (n == d.termids.size()) {
+			d.termids.push_back(termid);
+		}
+		if (termid >= d.by_termid.size()) {
+			d.by_termid.resize(termid + 1, FLAT_NOT_FOUND);
+		}
+		d.by_termid[termid] = n;
+	}
+	
+	// 0 if there's no such term.
+	uint32_t find(const std::string& term) const
+	{
+		const uint32_t n(terms.find(term));
+		return n == FLAT_NOT_FOUND ? 0 : termids[n];
+	}
+	
+	// NULL if there's no such term ID.
+	const char *term(uint32_t termid) const
+	{
+		if (termid >= by_termid.size() || by_termid[termid] == FLAT_NOT_FOUND) {
+			return NULL;
+		}
+		return terms.at(by_termid[termid]);
+	}
+	
+	string_table terms;
+	std::vector<uint32_t> termids;   // by number in terms
+	std::vector<uint32_t> by_termid; // number in terms
+};
+
+// Dictionaries by filename, loaded as index files ask for them.
+typedef std::map<std::string, dictionary_repr *> dictionary_map;
+
+static dictionary_repr *load_dictionary(dictionary_map& dictionaries, const std::string& filename)
+{
+	dictionary_repr *&d(dictionaries[filename]);
+	if (!d) {
+		try {
+			d = new dictionary_repr(filename);
+		} catch (const std::runtime_error& ex) {
+			dictionaries.erase(filename);
+			throw;
+		}
+	}
+	return d;
+}
+
+struct index_repr;
+
+// Which slice of the ranked results a search should produce: the first
+// count results ranked after (weight, article), or from the top if there
+// is no such cursor. Results rank by descending weight, then by title.
+struct page_request {
+	page_request(size_t count=MAX_SEARCH_RESULTS)
+	: count(count)
+	, after(false)
+	, weight(0)
+	{
+		//
+	}
+	
+	// Does (w, articleid) rank after the cursor?
+	// Titles are only looked up to break ties.
+	inline bool admits(size_t w, const index_repr& idx, uint32_t articleid) const;
+	
+	// Does (w, title) rank after the cursor?
+	bool admits(size_t w, const std::string& title) const
+	{
+		return !after || w < weight || (w == weight && title > article);
+	}
+	
+	size_t count;
+	bool after;
+	size_t weight;
+	std::string article;
+};
+
+// Every index_repr gets a distinct ID for the lifetime of the process,
+// so cached blocks can never be confused between index files.
+static uint32_t NEXT_SEGMENT_ID(1);
+
+// The postings block offsets of a term, in an index_repr.
+struct block_range {
+	block_range() : begin(NULL), end(NULL) { }
+	block_range(const uint64_t *begin, const uint64_t *end) : begin(begin), end(end) { }
+	
+	bool empty() const { return begin == end; }
+	
+	const uint64_t *begin;
+	const uint64_t *end;
+};
+
+// The article IDs of a term in the title index of an index_repr.
+struct title_range {
+	title_range() : begin(NULL), end(NULL) { }
+	title_range(const uint32_t *begin, const uint32_t *end) : begin(begin), end(end) { }
+	
+	const uint32_t *begin;
+	const uint32_t *end;
+};
+
+// The postings reads of a search, from any number of index files, are
+// planned (see index_repr::plan) and then issued all at once with
+// read_batch (see aio.hh), each sweep being decoded as it arrives.
+struct postings_fetch {
+	struct block {
+		block(uint64_t offset, id_vector *dst) : offset(offset), dst(dst) { }
+		bool operator<(const block& rhs) const { return offset < rhs.offset; }
+		
+		uint64_t offset;
+		id_vector *dst;
+	};
+	
+	// A read covering blocks close to one another, from one file.
+	struct sweep {
+		sweep(const index_repr *idx, uint64_t from) : idx(idx), from(from) { }
+		
+		const index_repr *idx;
+		uint64_t from;
+		std::vector<block> blocks;
+	};
+	
+	void run();
+	
+	std::vector<sweep> sweeps;
+	std::vector<read_op> ops; // one per sweep
+	
+	// Blocks which turned out bigger than the read of their sweep, each
+	// to be read again, alone, in a batch of its own.
+	std::vector<sweep> oversized;
+	std::vector<read_op> oversized_ops;
+};
+
+// Reads the header of an index file from memory.
+struct header_cursor {
+	header_cursor(const char *begin, const char *end) : p(begin), end(end) { }
+	
+	template<typename T>
+	T fixed()
+	{
+		T v(0);
+		if (p + sizeof(T) > end) {
+			throw std::runtime_error("truncated index header");
+		}
+		memcpy(&v, p, sizeof(T));
+		p += sizeof(T);
+		return v;
+	}
+	
+	char u8() { return fixed<char>(); }
+	uint32_t u32() { return fixed<uint32_t>(); }
+	uint64_t u64() { return fixed<uint64_t>(); }
+	
+	uint64_t varint()
+	{
+		uint64_t v(0);
+		const size_t n(decode_varint(p, end, v));
+		if (n == 0) {
+			throw std::runtime_error("truncated index header");
+		}
+		p += n;
+		return v;
+	}
+	
+	// The bytes up to delim, which is skipped.
+	std::pair<const char *, size_t> until(char delim)
+	{
+		const char *at(reinterpret_cast<const char *>(memchr(p, delim, end - p)));
+		if (!at) {
+			throw std::runtime_error("truncated index header");
+		}
+		std::pair<const char *, size_t> field(p, at - p);
+		p = at + 1;
+		return field;
+	}
+	
+	void skip(char expected)
+	{
+		if (p >= end || *p != expected) {
+			throw std::runtime_error("malformed index header");
+		}
+		p++;
+	}
+	
+	const char *p;
+	const char *end;
+};
+
 struct index_repr {
 	index_repr(const std::string& filename)
-	: ifs_ptr(new std::ifstream(filename.c_str(), std::ios::binary))
+	: filename(filename)
+	, fd(open(filename.c_str(), O_RDONLY))
+	, id(__sync_fetch_and_add(&NEXT_SEGMENT_ID, 1))
+	, version(0)
 	, index_offset(0)
 	, articles(0)
 	, terms(0)
+	, dictionary(NULL)
 	{
-		if (!ifs_ptr->good()) {
+		if (fd < 0) {
 			throw std::runtime_error("bad index file");
 		}
+		try {
+			deleted.load(filename);
+		} catch (const std::runtime_error& ex) {
+			close(fd);
+			throw;
+		}
 	}
 	
 	~index_repr()
 	{
-		if (ifs_ptr) {
-			ifs_ptr->close();
-			delete ifs_ptr;
-		}
+		close(fd);
+		CACHE.purge(id);
 	}
 	
-	std::ifstream *ifs_ptr;
+	const std::string filename;
+	
+	// The header is read once by parse(); postings are read as needed.
+	int fd;
+	const uint32_t id;
 
-	uint32_t index_offset;
+	int version; // of the file format
+	uint64_t index_offset;
 	uint32_t articles;
 	uint32_t terms;
 	
-	aid_title_map aid_title;
-	term_hov_map term_hov;
+	// Titles, NUL-terminated one after the other, and where each one
+	// starts by article ID (FLAT_NOT_FOUND for unused IDs).
+	std::vector<char> titles;
+	std::vector<uint32_t> title_at;
+	
+	// Terms are numbered in header order. The offsets of term n's
+	// postings blocks are block_offsets[term_blocks[n]] up to
+	// block_offsets[term_blocks[n+1]], a compressed sparse row layout.
+	// Terms are found by text in term_names, or, in files written with
+	// a term dictionary, by dictionary ID in term_numbers.
+	string_table term_names;
+	const dictionary_repr *dictionary;
+	id_table term_numbers;
+	std::vector<uint32_t> term_ids; // by number, with a dictionary
+	std::vector<uint32_t> term_blocks;
+	std::vector<uint64_t> block_offsets;
+	
+	// the terms of the file, by hash_bytes(); empty (letting every term
+	// through) for files written without one
+	bloom_filter filter;
 	
-	void parse()
+	// The title index, which is small, so it's kept here rather than
+	// read as needed. The articles with title term n in their titles
+	// are title_articles[title_begin[n]] up to title_articles[title_begin[n+1]],
+	// in ascending order. Empty for files written without one.
+	string_table title_terms;
+	std::vector<uint32_t> title_begin;
+	std::vector<uint32_t> title_articles;
+	
+	// articles superseded by a later segment
+	tombstones deleted;
+	
+	// Dictionaries are looked for in, and added to, dictionaries.
+	void parse(dictionary_map& dictionaries)
 	{
-		char c;
-		assert(ifs_ptr);
-		std::ifstream& ifs(*ifs_ptr);
-		assert(ifs.good());
-		
 		// header section:
-		// <uint32_t index_offset> '\n'
-		read<uint32_t>(ifs, index_offset);
-		read<char>(ifs, c);
-		assert(c == '\n');
+		// INDEX_MAGIC <uint8_t version> '\n' <uint64_t index_offset> '\n'
+		//   (or, in version 1, <uint32_t index_offset> '\n')
+		char preamble[INDEX_MAGIC_SIZE + 2 + sizeof(uint64_t)];
+		const ssize_t got(pread(fd, preamble, sizeof(preamble), 0));
+		if (got < static_cast<ssize_t>(sizeof(uint32_t) + 1)) {
+			throw std::runtime_error("bad index file " + filename);
+		}
+		if (memcmp(preamble, INDEX_MAGIC, INDEX_MAGIC_SIZE) == 0) {
+			version = preamble[INDEX_MAGIC_SIZE];
+			if (version != INDEX_FORMAT_VERSION || got != sizeof(preamble)) {
+				throw std::runtime_error("unknown format version of " + filename);
+			}
+			memcpy(&index_offset, preamble + INDEX_MAGIC_SIZE + 2, sizeof(uint64_t));
+		} else {
+			version = 1;
+			uint32_t offset(0);
+			memcpy(&offset, preamble, sizeof(uint32_t));
+			index_offset = offset;
+		}
+		if (index_offset <= static_cast<uint64_t>(got) || index_offset > SIZE_MAX) {
+			throw std::runtime_error("truncated index header in " + filename);
+		}
+		std::vector<char> header(index_offset);
+		if (pread(fd, &header[0], header.size(), 0) != static_cast<ssize_t>(header.size())) {
+			throw std::runtime_error("truncated index header in " + filename);
+		}
+		header_cursor h(&header[0], &header[0] + header.size());
+		if (version == 1) {
+			h.u32();
+		} else {
+			h.p += INDEX_MAGIC_SIZE + 2;
+			h.u64();
+		}
+		h.skip('\n');
 		
 		// <uint32_t article count> '\n'
 		// <uint32_t article ID> <article title> '\n'
 		//  . . .
-		read<uint32_t>(ifs, articles);
-		read<char>(ifs, c);
-		assert(c == '\n');
+		articles = h.u32();
+		h.skip('\n');
 		for (size_t i(0); i < articles; ++i) {
-			uint32_t articleid(0);
-			read<uint32_t>(ifs, articleid);
-			assert(articleid > 0);
-			assert(aid_title.find(articleid) == aid_title.end());
-			std::string title;
-			std::getline(ifs, title);
-			assert(!title.empty());
-			aid_title[articleid] = title;
+			const uint32_t articleid(h.u32());
+			const std::pair<const char *, size_t> title(h.until('\n'));
+			assert(articleid > 0 && title.second > 0);
+			if (articleid >= title_at.size()) {
+				title_at.resize(articleid + 1, FLAT_NOT_FOUND);
+			}
+			assert(title_at[articleid] == FLAT_NOT_FOUND);
+			title_at[articleid] = titles.size();
+			titles.insert(titles.end(), title.first, title.first + title.second);
+			titles.push_back('\0');
 		}
 
 		// <uint32_t term count> '\n'
-		// <uint32_t term ID> <term> END_DELIM
-		//    <uint32_t offset> . . . <uint32_t UINT32_MAX> '\n'
+		// <uint32_t term ID> <term> END_DELIM <varint offset count>
+		//    <varint offset> <varint distance from the last> . . . '\n'
 		//  . . .
-		read<uint32_t>(ifs, terms);
-		read<char>(ifs, c);
-		assert(c == '\n');
+		// (or, in version 1,
+		// <uint32_t term ID> <term> END_DELIM
+		//    <uint32_t offset> . . . <uint32_t UINT32_MAX> '\n')
+		// where a term ID of 0 names the file's term dictionary, in
+		// the same directory, and the terms after it are left out
+		terms = h.u32();
+		h.skip('\n');
+		// offsets as they come, with the term number of each entry,
+		// grouped by term afterwards
+		std::vector<uint64_t> offsets;
+		std::vector<uint32_t> entry_term, entry_begin;
 		for (size_t i(0); i < terms; ++i) {
-			uint32_t termid(0);
-			read<uint32_t>(ifs, termid);
-			assert(termid > 0);
-			std::string term;
-			std::getline(ifs, term, END_DELIM);
-			assert(!term.empty());
-			header_offset_vector hov;
-			uint32_t header_offset(0);
-			while (true) {
-				read<uint32_t>(ifs, header_offset);
-				if (header_offset == UINT32_MAX) {
-					break;
+			const uint32_t termid(h.u32());
+			assert(termid > 0 || i == 0);
+			const std::pair<const char *, size_t> term(h.until(END_DELIM));
+			const size_t first(offsets.size());
+			if (version == 1) {
+				for (uint32_t offset(h.u32()); offset != UINT32_MAX; offset = h.u32()) {
+					offsets.push_back(offset + index_offset);
+				}
+			} else {
+				uint64_t offset(index_offset);
+				for (uint64_t n(h.varint()); n > 0; --n) {
+					offset += h.varint();
+					offsets.push_back(offset);
+				}
+			}
+			h.skip('\n');
+			if (termid == 0) {
+				const std::string::size_type slash(filename.rfind('/'));
+				dictionary = load_dictionary(dictionaries, filename.substr(0, slash + 1) + std::string(term.first, term.second));
+				term_numbers.reserve(terms);
+				continue;
+			}
+			assert(offsets.size() > first);
+			uint32_t n(0);
+			if (dictionary) {
+				assert(term.second == 0);
+				n = term_numbers.find(termid);
+				if (n == FLAT_NOT_FOUND) {
+					n = term_ids.size();
+					term_ids.push_back(termid);
+					term_numbers.insert(termid, n);
 				}
-				header_offset += index_offset;
-				assert(header_offset > 0);
-				hov.push_back(header_offset);
-			}
-			assert(!hov.empty());
-			term_hov_map::iterator tgt(term_hov.find(term));
-			if (tgt != term_hov.end()) {
-				tgt->second.insert(tgt->second.end(), hov.begin(), hov.end());
 			} else {
-				term_hov[term] = hov;
+				assert(term.second > 0);
+				n = term_names.insert(term.first, term.second);
+			}
+			entry_term.push_back(n);
+			entry_begin.push_back(first);
+		}
+		entry_begin.push_back(offsets.size());
+		const size_t count(dictionary ? term_ids.size() : term_names.size());
+		if (entry_term.size() == count) {
+			// each term once, in order, as index_st writes them
+			block_offsets.swap(offsets);
+			term_blocks.swap(entry_begin);
+		} else {
+			term_blocks.assign(count + 1, 0);
+			for (size_t e(0); e < entry_term.size(); ++e) {
+				term_blocks[entry_term[e] + 1] += entry_begin[e + 1] - entry_begin[e];
+			}
+			for (size_t n(0); n < count; ++n) {
+				term_blocks[n + 1] += term_blocks[n];
+			}
+			block_offsets.resize(offsets.size());
+			std::vector<uint32_t> fill(term_blocks.begin(), term_blocks.end() - 1);
+			for (size_t e(0); e < entry_term.size(); ++e) {
+				for (uint32_t i(entry_begin[e]); i < entry_begin[e + 1]; ++i) {
+					block_offsets[fill[entry_term[e]]++] = offsets[i];
+				}
+			}
+		}
+		
+		// (version 2) sections:
+		// <uint8_t tag> <uint64_t length> <length bytes>
+		//  . . .
+		while (version > 1 && h.p < h.end) {
+			const char tag(h.u8());
+			const uint64_t length(h.u64());
+			if (length > static_cast<uint64_t>(h.end - h.p)) {
+				throw std::runtime_error("truncated index header in " + filename);
+			}
+			header_cursor section(h.p, h.p + length);
+			h.p += length;
+			if (tag == INDEX_SECTION_BLOOM) {
+				// <uint32_t hashes> <uint64_t word> . . .
+				const uint32_t hashes(section.u32());
+				if (hashes < 1 || hashes > BLOOM_MAX_HASHES) {
+					throw std::runtime_error("malformed bloom filter in " + filename);
+				}
+				std::vector<uint64_t> words((section.end - section.p) / sizeof(uint64_t));
+				for (size_t w(0); w < words.size(); ++w) {
+					words[w] = section.u64();
+				}
+				filter = bloom_filter(hashes, words);
+			} else if (tag == INDEX_SECTION_TITLES) {
+				// <uint32_t term count>
+				// <term> END_DELIM <varint article count>
+				//    <varint article ID> <varint distance from the last> . . .
+				//  . . .
+				const uint32_t count(section.u32());
+				title_begin.assign(1, 0);
+				for (uint32_t i(0); i < count; ++i) {
+					const std::pair<const char *, size_t> term(section.until(END_DELIM));
+					if (term.second == 0 || title_terms.insert(term.first, term.second) != i) {
+						throw std::runtime_error("malformed title index in " + filename);
+					}
+					uint32_t articleid(0);
+					for (uint64_t n(section.varint()); n > 0; --n) {
+						articleid += section.varint();
+						title_articles.push_back(articleid);
+					}
+					title_begin.push_back(title_articles.size());
+				}
 			}
-			read<char>(ifs, c);
-			assert(c == '\n');
 		}
+		
+		shrink_to_fit(titles);
+		shrink_to_fit(title_at);
+		term_names.shrink();
+		shrink_to_fit(term_ids);
+		shrink_to_fit(term_blocks);
+		shrink_to_fit(block_offsets);
+		title_terms.shrink();
+		shrink_to_fit(title_begin);
+		shrink_to_fit(title_articles);
 	}
 	
-	search_results search(const std::string& term) const
+	// Append the article IDs of the postings block at term_offset
+	// to dst, from the cache if possible.
+	void postings(uint64_t term_offset, id_vector& dst) const
 	{
-		// make sure the term exists in our in-memory term index
-		term_hov_map::const_iterator tgt(term_hov.find(term));
-		if (tgt == term_hov.end()) {
-			return search_results();
+		const block_key k(id, term_offset);
+		if (CACHE.get(k, dst)) {
+			return;
 		}
-		
-		// set up
-		assert(ifs_ptr);
-		std::ifstream& ifs(*ifs_ptr);
-		assert(ifs.good());
-		const header_offset_vector& hov(tgt->second);
-		typedef header_offset_vector::const_iterator hovcit;
-		std::vector<uint32_t> articleids;
-		char c(0);
-		
-		// collect all the articles which contain this term
-		// (each article may be represented multiple times)
-		for (hovcit it(hov.begin()); it != hov.end(); ++it) {
-			
-			// each entry represents an offset in the file
-			// which begins a sequence of article IDs
-			// terminated by UINT32_MAX
-			const uint32_t term_offset(*it);
-			
-			// <uint32_t term ID> <uint32_t article ID> . . . 
-			//   <uint32_t UINT32_MAX> '\n'
-			ifs.seekg(term_offset);
-			uint32_t termid(0);
-			read<uint32_t>(ifs, termid);
-			assert(termid > 0);
-			uint32_t articleid(UINT32_MAX);
-			while (true) {
-				read<uint32_t>(ifs, articleid);
-				if (articleid == UINT32_MAX) {
-					break;
+		std::vector<char> buf(BLOCK_READ_SIZE);
+		id_vector block;
+		while (true) {
+			const ssize_t n(pread(fd, &buf[0], buf.size(), term_offset));
+			if (n <= 0) {
+				throw std::runtime_error("short read in postings block");
+			}
+			if (decode_block(&buf[0], n, block) > 0) {
+				break;
+			}
+			if (static_cast<size_t>(n) < buf.size()) {
+				throw std::runtime_error("truncated postings block");
+			}
+			buf.resize(buf.size() * 2);
+		}
+		CACHE.put(k, block);
+		dst.insert(dst.end(), block.begin(), block.end());
+	}
+	
+	// For each of the block ranges, arrange for the article IDs of all
+	// of its postings blocks to be appended to the corresponding vector
+	// in dst: now, for blocks which are cached, and by the fetch for the
+	// rest, coalesced into as few reads as their proximity allows.
+	// Returns the number of blocks which were cached.
+	size_t plan(
+			const std::vector<block_range>& ranges,
+			std::vector<id_vector>& dst,
+			postings_fetch& fetch) const
+	{
+		assert(ranges.size() == dst.size());
+		std::vector<postings_fetch::block> pending;
+		size_t hits(0);
+		for (size_t i(0); i < ranges.size(); ++i) {
+			for (const uint64_t *it(ranges[i].begin); it != ranges[i].end; ++it) {
+				if (CACHE.get(block_key(id, *it), dst[i])) {
+					hits++;
+				} else {
+					pending.push_back(postings_fetch::block(*it, &dst[i]));
+				}
+			}
+		}
+		std::sort(pending.begin(), pending.end());
+		size_t run_begin(0);
+		while (run_begin < pending.size()) {
+			// gather a run of blocks which are close to one another
+			const uint64_t from(pending[run_begin].offset);
+			size_t run_end(run_begin + 1);
+			while (
+					run_end < pending.size() &&
+					pending[run_end].offset - pending[run_end-1].offset < BLOCK_READ_SIZE &&
+					pending[run_end].offset - from < SWEEP_READ_SIZE) {
+				run_end++;
+			}
+			const uint64_t to(pending[run_end-1].offset + BLOCK_READ_SIZE);
+			fetch.sweeps.push_back(postings_fetch::sweep(this, from));
+			fetch.sweeps.back().blocks.assign(pending.begin() + run_begin, pending.begin() + run_end);
+			fetch.ops.push_back(read_op(fd, from, to - from));
+			run_begin = run_end;
+		}
+		return hits;
+	}
+	
+	// The offsets of term's postings blocks; empty if it isn't here.
+	block_range find(const std::string& term) const
+	{
+		uint32_t n(FLAT_NOT_FOUND);
+		if (dictionary) {
+			const uint32_t termid(dictionary->find(term));
+			n = termid ? term_numbers.find(termid) : FLAT_NOT_FOUND;
+		} else {
+			n = term_names.find(term);
+		}
+		if (n == FLAT_NOT_FOUND) {
+			return block_range();
+		}
+		return block_range(&block_offsets[term_blocks[n]], &block_offsets[0] + term_blocks[n + 1]);
+	}
+	
+	// The articles with term in their titles.
+	title_range titled(const std::string& term) const
+	{
+		const uint32_t n(title_terms.find(term));
+		if (n == FLAT_NOT_FOUND) {
+			return title_range();
+		}
+		return title_range(&title_articles[0] + title_begin[n], &title_articles[0] + title_begin[n + 1]);
+	}
+	
+	// The frequency (number of postings) of every term in the file.
+	// Blocks are written back to back, so a block's size is the
+	// distance to the next one.
+	void term_frequencies(std::vector<term_frequency>& dst) const
+	{
+		std::vector<uint64_t> offsets(block_offsets);
+		std::sort(offsets.begin(), offsets.end());
+		struct stat st;
+		if (fstat(fd, &st) != 0) {
+			throw std::runtime_error("couldn't stat index file");
+		}
+		offsets.push_back(st.st_size);
+		// <uint32_t term ID> <uint32_t article ID> . . . 
+		//   <uint32_t UINT32_MAX> '\n'
+		static const size_t BLOCK_OVERHEAD(2 * sizeof(uint32_t) + 1);
+		typedef std::vector<uint64_t>::const_iterator uvcit;
+		for (size_t n(0); n + 1 < term_blocks.size(); ++n) {
+			size_t frequency(0);
+			for (uint32_t i(term_blocks[n]); i < term_blocks[n + 1]; ++i) {
+				uvcit next(std::upper_bound(offsets.begin(), offsets.end(), block_offsets[i]));
+				assert(next != offsets.end());
+				const size_t len(*next - block_offsets[i]);
+				if (len > BLOCK_OVERHEAD) {
+					frequency += (len - BLOCK_OVERHEAD) / sizeof(uint32_t);
 				}
-				articleids.push_back(articleid);
 			}
-			read<char>(ifs, c);
-			assert(c == '\n');
+			const char *term(dictionary ? dictionary->term(term_ids[n]) : term_names.at(n));
+			if (!term) {
+				throw std::runtime_error("term missing from the dictionary of " + filename);
+			}
+			dst.push_back(term_frequency(term, frequency > UINT32_MAX ? UINT32_MAX : frequency));
+		}
+	}
+	
+	// Aggregate article IDs (each may be represented multiple times)
+	// into search_results, keeping only the page's slice of the top.
+	search_results aggregate(id_vector& articleids, const page_request& page) const
+	{
+		// count runs of equal article IDs
+		std::sort(articleids.begin(), articleids.end());
+		search_results results;
+		typedef std::pair<size_t, uint32_t> weight_aid;
+		std::vector<weight_aid> candidates;
+		for (size_t i(0); i < articleids.size(); ) {
+			size_t j(i + 1);
+			while (j < articleids.size() && articleids[j] == articleids[i]) {
+				j++;
+			}
+			if (deleted.deleted(articleids[i])) {
+				i = j;
+				continue;
+			}
+			results.total++;
+			if (page.admits(j - i, *this, articleids[i])) {
+				candidates.push_back(std::make_pair(j - i, articleids[i]));
+			}
+			i = j;
 		}
 		
-		// now aggregate those article IDs into a map of ID to count
-		typedef std::map<uint32_t, size_t> aid_count_map;
-		aid_count_map acm;
-		typedef std::vector<uint32_t>::const_iterator uvcit;
-		for (uvcit it(articleids.begin()); it != articleids.end(); ++it) {
-			const uint32_t& articleid(*it);
-			aid_count_map::iterator tgt(acm.find(articleid));
-			if (tgt != acm.end()) {
-				tgt->second++;
-			} else {
-				acm[articleid] = 1;
+		// the page's results are the candidates with the greatest
+		// weights, plus any which tie with the last one
+		if (candidates.size() > page.count) {
+			if (page.count == 0) {
+				return results;
+			}
+			std::nth_element(
+				candidates.begin(),
+				candidates.begin() + page.count - 1,
+				candidates.end(),
+				std::greater<weight_aid>()
+			);
+			const size_t cutoff(candidates[page.count - 1].first);
+			std::vector<weight_aid> kept;
+			typedef std::vector<weight_aid>::const_iterator wacit;
+			for (wacit it(candidates.begin()); it != candidates.end(); ++it) {
+				if (it->first >= cutoff) {
+					kept.push_back(*it);
+				}
 			}
+			candidates.swap(kept);
 		}
 		
-		// and convert that map into search_results
-		search_results results;
-		results.total = acm.size();
-		size_t count(0);
-		typedef aid_count_map::const_iterator acmcit;
-		for (acmcit it(acm.begin());
-				it != acm.end() && ++count <= MAX_SEARCH_RESULTS;
-					++it) {
-			aid_title_map::const_iterator tgt(aid_title.find(it->first));
-			assert(tgt != aid_title.end());
-			results.top.push_back(search_result(tgt->second, it->second));
+		// and convert those into search_results
+		typedef std::vector<weight_aid>::const_iterator wacit;
+		for (wacit it(candidates.begin()); it != candidates.end(); ++it) {
+			results.top.push_back(search_result(title(it->second), it->first));
+		}
+		results.sort();
+		if (results.top.size() > page.count) {
+			results.top.erase(results.top.begin() + page.count, results.top.end());
 		}
 		return results;
 	}
+	
+	const char *title(uint32_t articleid) const
+	{
+		assert(articleid < title_at.size() && title_at[articleid] != FLAT_NOT_FOUND);
+		return &titles[title_at[articleid]];
+	}
 };
 
+// Decode the blocks of a sweep, once it's been read.
+static void decode_sweep(std::vector<read_op>& ops, size_t i, void *arg)
+{
+	postings_fetch& fetch(*reinterpret_cast<postings_fetch *>(arg));
+	const postings_fetch::sweep& sw(fetch.sweeps[i]);
+	const read_op& op(ops[i]);
+	if (op.result <= 0) {
+		throw std::runtime_error("short read in postings sweep of " + sw.idx->filename);
+	}
+	const size_t got(op.result);
+	typedef std::vector<postings_fetch::block>::const_iterator bcit;
+	for (bcit it(sw.blocks.begin()); it != sw.blocks.end(); ++it) {
+		id_vector block;
+		const size_t at(it->offset - sw.from);
+		if (at < got && decode_block(&op.buf[at], got - at, block) > 0) {
+			CACHE.put(block_key(sw.idx->id, it->offset), block);
+			it->dst->insert(it->dst->end(), block.begin(), block.end());
+		} else if (got < op.buf.size()) {
+			throw std::runtime_error("truncated postings block in " + sw.idx->filename);
+		} else {
+			// unusually big; not read from here, which would hold up
+			// the rest of the batch
+			fetch.oversized.push_back(postings_fetch::sweep(sw.idx, it->offset));
+			fetch.oversized.back().blocks.push_back(*it);
+			fetch.oversized_ops.push_back(read_op(sw.idx->fd, it->offset, std::max<size_t>(2 * (got - at), 2 * BLOCK_READ_SIZE)));
+		}
+	}
+}
+
+void postings_fetch::run()
+{
+	read_batch(ops, decode_sweep, this);
+	// twice as much as was read of each oversized block, until they fit
+	while (!oversized.empty()) {
+		postings_fetch again;
+		again.sweeps.swap(oversized);
+		again.ops.swap(oversized_ops);
+		read_batch(again.ops, decode_sweep, &again);
+		// kept with the rest, for the trace
+		sweeps.insert(sweeps.end(), again.sweeps.begin(), again.sweeps.end());
+		for (size_t i(0); i < again.ops.size(); ++i) {
+			ops.push_back(read_op(again.ops[i].fd, again.ops[i].offset, 0));
+			ops.back().buf.swap(again.ops[i].buf);
+			ops.back().result = again.ops[i].result;
+		}
+		oversized.swap(again.oversized);
+		oversized_ops.swap(again.oversized_ops);
+	}
+}
+
+bool page_request::admits(size_t w, const index_repr& idx, uint32_t articleid) const
+{
+	if (!after || w < weight) {
+		return true;
+	}
+	return w == weight && idx.title(articleid) > article;
+}
+
 static void merge(search_results& dst, const search_results& src)
 {
 	// naive algorithm
@@ -203,56 +817,933 @@ static void merge(search_results& dst, const search_results& src)
 	}
 }
 
-static search_results search(
+static void sort_and_cut(search_results& r, size_t count=MAX_SEARCH_RESULTS)
+{
+	r.sort();
+	if (r.top.size() > count) {
+		r.top.erase(r.top.begin() + count, r.top.end());
+	}
+}
+
+// Drop the results which don't rank after the page's cursor. Each index
+// file admits an article by its weight there, but the merged results
+// rank it by the sum of its weights in all of them, so an article in
+// more than one file may be admitted though an earlier page had it.
+static void keep_admitted(search_results& r, const page_request& page)
+{
+	if (!page.after) {
+		return;
+	}
+	std::vector<search_result> kept;
+	typedef std::vector<search_result>::const_iterator srcit;
+	for (srcit it(r.top.begin()); it != r.top.end(); ++it) {
+		if (page.admits(it->weight, it->article)) {
+			kept.push_back(*it);
+		}
+	}
+	r.top.swap(kept);
+}
+
+// One generation of the index files being searched, and everything
+// loaded along with them. init_indices loads a new set while searches
+// carry on with the current one, then publishes it.
+struct index_set : private noncopyable {
+	index_set() : refs(0) { }
+	
+	~index_set()
+	{
+		typedef std::vector<index_repr *>::iterator irit;
+		for (irit it(indices.begin()); it != indices.end(); ++it) {
+			delete *it;
+		}
+		typedef dictionary_map::iterator dit;
+		for (dit it(dictionaries.begin()); it != dictionaries.end(); ++it) {
+			delete it->second;
+		}
+	}
+	
+	std::vector<index_repr *> indices;
+	
+	// Every term of every index file, for prefix lookups.
+	sorted_terms terms;
+	
+	dictionary_map dictionaries;
+	size_t refs; // guarded by the set_registry
+};
+
+// The current index_set, which every search takes a reference to for as
+// long as it runs (see set_ref). A new set can be published at any time
+// without waiting for searches; the old one is deleted by whoever drops
+// the last reference to it, the publisher or the last search to finish.
+class set_registry : public monitor
+{
+public:
+	set_registry() : m_current(new index_set)
+	{
+		m_current->refs = 1;
+	}
+	
+	~set_registry()
+	{
+		release(m_current);
+	}
+	
+	index_set *acquire()
+	{
+		scoped_lock sync(monitor_mutex);
+		m_current->refs++;
+		return m_current;
+	}
+	
+	void release(index_set *set)
+	{
+		bool last(false);
+		{
+			scoped_lock sync(monitor_mutex);
+			last = --set->refs == 0;
+		}
+		if (last) {
+			// outside the lock; closing the files takes a while
+			delete set;
+		}
+	}
+	
+	void publish(index_set *set)
+	{
+		index_set *old(NULL);
+		{
+			scoped_lock sync(monitor_mutex);
+			set->refs++;
+			old = m_current;
+			m_current = set;
+		}
+		release(old);
+	}
+	
+private:
+	index_set *m_current;
+};
+
+static set_registry SETS;
+
+// A reference to the current index_set, for the scope of a search.
+class set_ref : private noncopyable
+{
+public:
+	set_ref() : m_set(SETS.acquire()) { }
+	~set_ref() { SETS.release(m_set); }
+	
+	const index_set& operator*() const { return *m_set; }
+	const index_set *operator->() const { return m_set; }
+	
+private:
+	index_set *m_set;
+};
+
+std::vector<completion> complete_terms(const std::string& prefix, size_t n)
+{
+	set_ref set;
+	return set->terms.complete(prefix, n);
+}
+
+struct collect_wildcard {
+	collect_wildcard(const sorted_terms& vocabulary, const std::string& pattern)
+	: vocabulary(vocabulary)
+	, pattern(pattern)
+	, scanned(0)
+	{
+		//
+	}
+
+	bool operator()(size_t i)
+	{
+		if (wildcard_match(pattern, vocabulary.term(i))) {
+			terms.push_back(vocabulary.term(i));
+		}
+		return terms.size() < MAX_WILDCARD_EXPANSION && ++scanned < MAX_WILDCARD_SCAN;
+	}
+
+	const sorted_terms& vocabulary;
+	const std::string& pattern;
+	size_t scanned;
+	std::vector<std::string> terms;
+};
+
+static std::vector<std::string> expand_wildcard(const sorted_terms& vocabulary, const std::string& pattern)
+{
+	// everything before the first '*' must match literally
+	const std::string prefix(pattern.substr(0, pattern.find('*')));
+	std::pair<size_t, size_t> range(vocabulary.prefix_range(prefix));
+	collect_wildcard c(vocabulary, pattern);
+	vocabulary.by_frequency(range.first, range.second, c);
+	return c.terms;
+}
+
+std::vector<std::string> expand_wildcard(const std::string& pattern)
+{
+	set_ref set;
+	return expand_wildcard(set->terms, pattern);
+}
+
+static filter_stats FILTER_STATS;
+
+// The postings of every term in every index file, as postings[file][term]
+// (each article may be represented multiple times), with TITLE_BOOST more
+// of each article having the term in its title. Files whose filters rule
+// a term out aren't asked for it (their title indexes, being in memory,
+// still are). Blocks which aren't cached are read in one batch, across
+// all the files. With a trace, what each file took is added to it.
+static void gather(
 		const std::vector<index_repr *>& indices,
-		const std::string& term)
+		const std::vector<std::string>& terms,
+		std::vector<std::vector<id_vector> >& postings,
+		search_trace *trace=NULL)
 {
-	// get
-	std::vector<search_results> intermediate;
-	typedef std::vector<index_repr *>::const_iterator ircit;
-	for (ircit it(indices.begin()); it != indices.end(); ++it) {
-		intermediate.push_back((*it)->search(term));
+	postings.assign(indices.size(), std::vector<id_vector>(terms.size()));
+	std::vector<uint64_t> hashes(terms.size());
+	for (size_t i(0); i < terms.size(); ++i) {
+		hashes[i] = hash_bytes(terms[i].data(), terms[i].size());
 	}
-	// merge
+	filter_stats stats;
+	postings_fetch fetch;
+	std::vector<block_range> ranges(terms.size());
+	std::vector<size_t> sweep_files; // with a trace
+	for (size_t f(0); f < indices.size(); ++f) {
+		const uint64_t begin(trace ? now_usec() : 0);
+		const size_t skipped(stats.skipped);
+		const bloom_filter& filter(indices[f]->filter);
+		for (size_t i(0); i < terms.size(); ++i) {
+			const title_range titled(indices[f]->titled(terms[i]));
+			for (const uint32_t *it(titled.begin); it != titled.end; ++it) {
+				postings[f][i].insert(postings[f][i].end(), TITLE_BOOST, *it);
+			}
+			stats.probes++;
+			if (!filter.may_contain(hashes[i])) {
+				stats.skipped++;
+				ranges[i] = block_range();
+				continue;
+			}
+			ranges[i] = indices[f]->find(terms[i]);
+			if (ranges[i].empty() && !filter.empty()) {
+				stats.false_positives++;
+			}
+		}
+		const size_t hits(indices[f]->plan(ranges, postings[f], fetch));
+		if (trace) {
+			segment_trace& st(trace->segments[f]);
+			st.lookup_usec += now_usec() - begin;
+			st.filtered += stats.skipped - skipped;
+			for (size_t i(0); i < terms.size(); ++i) {
+				st.blocks += ranges[i].end - ranges[i].begin;
+			}
+			st.cache_hits += hits;
+			st.reads += fetch.sweeps.size() - sweep_files.size();
+			sweep_files.resize(fetch.sweeps.size(), f);
+		}
+	}
+	__sync_fetch_and_add(&FILTER_STATS.probes, stats.probes);
+	__sync_fetch_and_add(&FILTER_STATS.skipped, stats.skipped);
+	__sync_fetch_and_add(&FILTER_STATS.false_positives, stats.false_positives);
+	if (!trace) {
+		fetch.run();
+		return;
+	}
+	const uint64_t begin(now_usec());
+	fetch.run();
+	trace->read_usec += now_usec() - begin;
+	for (size_t i(sweep_files.size()); i < fetch.sweeps.size(); ++i) {
+		// an oversized block, read again
+		sweep_files.push_back(std::find(indices.begin(), indices.end(), fetch.sweeps[i].idx) - indices.begin());
+		trace->segments[sweep_files[i]].reads++;
+	}
+	for (size_t i(0); i < fetch.ops.size(); ++i) {
+		if (fetch.ops[i].result > 0) {
+			trace->segments[sweep_files[i]].bytes_read += fetch.ops[i].result;
+		}
+	}
+	for (size_t f(0); f < indices.size(); ++f) {
+		for (size_t i(0); i < terms.size(); ++i) {
+			trace->segments[f].postings += postings[f][i].size();
+		}
+	}
+}
+
+// Aggregate the articles of index file f into dst, charging the time
+// taken to the trace, if there is one.
+static void collect(
+		const std::vector<index_repr *>& indices,
+		size_t f,
+		id_vector& articleids,
+		const page_request& page,
+		search_results& dst,
+		search_trace *trace)
+{
+	if (!trace) {
+		merge(dst, indices[f]->aggregate(articleids, page));
+		return;
+	}
+	const uint64_t begin(now_usec());
+	const search_results r(indices[f]->aggregate(articleids, page));
+	const uint64_t aggregated(now_usec());
+	merge(dst, r);
+	trace->segments[f].aggregate_usec += aggregated - begin;
+	trace->merge_usec += now_usec() - aggregated;
+}
+
+// Search for articles containing any of the terms.
+static search_results search_any(
+		const std::vector<index_repr *>& indices,
+		const std::vector<std::string>& terms,
+		const page_request& page=page_request(),
+		search_trace *trace=NULL)
+{
+	search_results final;
+	if (terms.empty()) {
+		return final;
+	}
+	std::vector<std::vector<id_vector> > postings;
+	gather(indices, terms, postings, trace);
+	for (size_t f(0); f < indices.size(); ++f) {
+		id_vector& articleids(postings[f][0]);
+		for (size_t i(1); i < terms.size(); ++i) {
+			articleids.insert(articleids.end(), postings[f][i].begin(), postings[f][i].end());
+		}
+		collect(indices, f, articleids, page, final, trace);
+	}
+	sort_and_cut(final, page.count);
+	final.expanded = terms;
+	return final;
+}
+
+static search_results search_wildcard(
+		const index_set& set,
+		const std::string& pattern,
+		const page_request& page=page_request(),
+		search_trace *trace=NULL)
+{
+	const uint64_t begin(trace ? now_usec() : 0);
+	const std::vector<std::string> terms(expand_wildcard(set.terms, pattern));
+	if (trace) {
+		trace->expand_usec += now_usec() - begin;
+	}
+	return search_any(set.indices, terms, page, trace);
+}
+
+static size_t fuzzy_distance_for(const std::string& term, size_t max_distance)
+{
+	// short terms are within an edit or two of far too many others
+	size_t distance(max_distance);
+	if (term.size() <= 3) {
+		distance = 0;
+	} else if (term.size() <= 5 && distance > 1) {
+		distance = 1;
+	}
+	return distance;
+}
+
+static std::vector<std::string> fuzzy_terms(
+		const sorted_terms& vocabulary,
+		const std::string& term,
+		size_t max_distance,
+		size_t n)
+{
+	std::vector<std::string> terms;
+	std::vector<fuzzy_match> matches(vocabulary.fuzzy(term, max_distance, n));
+	typedef std::vector<fuzzy_match>::const_iterator fmcit;
+	for (fmcit it(matches.begin()); it != matches.end(); ++it) {
+		terms.push_back(vocabulary.term(it->index));
+	}
+	return terms;
+}
+
+std::vector<std::string> fuzzy_terms(const std::string& term, size_t max_distance, size_t n)
+{
+	set_ref set;
+	return fuzzy_terms(set->terms, term, max_distance, n);
+}
+
+// Search for articles with all the words of query in their titles. The
+// title indexes are in memory, so no postings are read at all. Titles
+// with no other words rank above those with more.
+static search_results search_titles(
+		const std::vector<index_repr *>& indices,
+		const std::string& query,
+		const page_request& page=page_request(),
+		search_trace *trace=NULL)
+{
+	std::vector<std::string> terms;
+	tokenize_title(query, terms);
+	std::sort(terms.begin(), terms.end());
+	terms.erase(std::unique(terms.begin(), terms.end()), terms.end());
 	search_results final;
-	typedef std::vector<search_results>::const_iterator srscit;
-	for (srscit it(intermediate.begin()); it != intermediate.end(); ++it) {
-		merge(final, *it);
+	if (terms.empty()) {
+		return final;
+	}
+	for (size_t f(0); f < indices.size(); ++f) {
+		const uint64_t begin(trace ? now_usec() : 0);
+		const index_repr& idx(*indices[f]);
+		const title_range first(idx.titled(terms[0]));
+		id_vector matches(first.begin, first.end);
+		for (size_t i(1); i < terms.size() && !matches.empty(); ++i) {
+			const title_range next(idx.titled(terms[i]));
+			id_vector both;
+			std::set_intersection(matches.begin(), matches.end(), next.begin, next.end, std::back_inserter(both));
+			matches.swap(both);
+		}
+		// weights are by representation, as aggregate counts them
+		id_vector articleids;
+		typedef id_vector::const_iterator idvcit;
+		for (idvcit it(matches.begin()); it != matches.end(); ++it) {
+			std::vector<std::string> words;
+			tokenize_title(idx.title(*it), words);
+			std::sort(words.begin(), words.end());
+			words.erase(std::unique(words.begin(), words.end()), words.end());
+			const size_t weight(TITLE_BOOST * (terms.size() + (words == terms ? 1 : 0)));
+			articleids.insert(articleids.end(), weight, *it);
+		}
+		if (trace) {
+			trace->segments[f].lookup_usec += now_usec() - begin;
+			trace->segments[f].postings += matches.size();
+		}
+		collect(indices, f, articleids, page, final, trace);
+	}
+	sort_and_cut(final, page.count);
+	return final;
+}
+
+static search_results search(
+		const index_set& set,
+		const std::string& term,
+		const page_request& page=page_request(),
+		search_trace *trace=NULL)
+{
+	const std::vector<index_repr *>& indices(set.indices);
+	// no term has a space in it, but titles do
+	if (term.find(' ') != std::string::npos) {
+		return search_titles(indices, term, page, trace);
 	}
-	// sort and cut
-	final.sort();
-	if (final.top.size() > MAX_SEARCH_RESULTS) {
-		final.top.erase(final.top.begin() + MAX_SEARCH_RESULTS, final.top.end());
+	if (term.find('*') != std::string::npos) {
+		return search_wildcard(set, term, page, trace);
 	}
+	// get
+	std::vector<std::vector<id_vector> > postings;
+	gather(indices, std::vector<std::string>(1, term), postings, trace);
+	// merge
+	search_results final;
+	for (size_t f(0); f < indices.size(); ++f) {
+		collect(indices, f, postings[f][0], page, final, trace);
+	}
+	sort_and_cut(final, page.count);
 	return final;
 }
 
-std::vector<index_repr *> INDICES;
+static std::vector<search_results> search(
+		const index_set& set,
+		const std::vector<std::string>& terms)
+{
+	const std::vector<index_repr *>& indices(set.indices);
+	// each distinct term is looked up once
+	std::vector<std::string> distinct(terms);
+	std::sort(distinct.begin(), distinct.end());
+	distinct.erase(std::unique(distinct.begin(), distinct.end()), distinct.end());
+	// one batch of reads, across all index files, for all plain terms
+	std::vector<search_results> merged(distinct.size());
+	std::vector<std::string> plain;
+	std::vector<size_t> plain_slots;
+	for (size_t i(0); i < distinct.size(); ++i) {
+		if (distinct[i].find_first_of("* ") != std::string::npos) {
+			merged[i] = search(set, distinct[i]);
+		} else {
+			plain.push_back(distinct[i]);
+			plain_slots.push_back(i);
+		}
+	}
+	std::vector<std::vector<id_vector> > postings;
+	gather(indices, plain, postings);
+	for (size_t f(0); f < indices.size(); ++f) {
+		for (size_t i(0); i < plain.size(); ++i) {
+			merge(merged[plain_slots[i]], indices[f]->aggregate(postings[f][i], page_request()));
+		}
+	}
+	for (size_t i(0); i < plain_slots.size(); ++i) {
+		sort_and_cut(merged[plain_slots[i]]);
+	}
+	// back to input order
+	std::vector<search_results> results;
+	results.reserve(terms.size());
+	typedef std::vector<std::string>::const_iterator svcit;
+	for (svcit it(terms.begin()); it != terms.end(); ++it) {
+		const size_t i(std::lower_bound(distinct.begin(), distinct.end(), *it) - distinct.begin());
+		results.push_back(merged[i]);
+	}
+	return results;
+}
+
+
+// A cursor is the hex encoding of
+//   <snapshot ID> '|' <position> '|' <weight> '|' <article>
+// of the last result on a page. The snapshot ID is 0 if there is none.
+struct page_cursor {
+	page_cursor() : snapshot(0), position(0), weight(0) { }
+	
+	uint64_t snapshot;
+	size_t position;
+	size_t weight;
+	std::string article;
+};
+
+static std::string encode_cursor(const page_cursor& c)
+{
+	static const char *HEX("0123456789abcdef");
+	std::ostringstream oss;
+	oss << c.snapshot << '|' << c.position << '|' << c.weight << '|' << c.article;
+	const std::string raw(oss.str());
+	std::string encoded;
+	encoded.reserve(raw.size() * 2);
+	for (std::string::const_iterator it(raw.begin()); it != raw.end(); ++it) {
+		const unsigned char c(*it);
+		encoded += HEX[c >> 4];
+		encoded += HEX[c & 0xF];
+	}
+	return encoded;
+}
+
+static int unhex(char c)
+{
+	if (c >= '0' && c <= '9') return c - '0';
+	if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+	return -1;
+}
+
+static page_cursor decode_cursor(const std::string& encoded)
+{
+	if (encoded.size() % 2 != 0) {
+		throw std::runtime_error("bad cursor");
+	}
+	std::string raw;
+	for (size_t i(0); i < encoded.size(); i += 2) {
+		const int hi(unhex(encoded[i])), lo(unhex(encoded[i+1]));
+		if (hi < 0 || lo < 0) {
+			throw std::runtime_error("bad cursor");
+		}
+		raw += static_cast<char>(hi * 16 + lo);
+	}
+	page_cursor c;
+	std::istringstream iss(raw);
+	char d1(0), d2(0), d3(0);
+	iss >> c.snapshot >> d1 >> c.position >> d2 >> c.weight >> d3;
+	if (!iss || d1 != '|' || d2 != '|' || d3 != '|') {
+		throw std::runtime_error("bad cursor");
+	}
+	std::getline(iss, c.article, '\0');
+	return c;
+}
+
+// Snapshots of complete (well, up to MAX_SNAPSHOT_RESULTS) ranked
+// results, so deep pages can be served without reading postings again.
+// They live for SNAPSHOT_TTL_SEC after their last use.
+class snapshot_store : public monitor
+{
+public:
+	snapshot_store() : m_next_id(1) { }
+	
+	// complete is false if r was cut off at MAX_SNAPSHOT_RESULTS.
+	uint64_t put(const std::string& term, const search_results& r, bool complete)
+	{
+		scoped_lock sync(monitor_mutex);
+		expire();
+		while (m_snapshots.size() >= MAX_SNAPSHOTS) {
+			// evict the one closest to expiry
+			snapshot_map::iterator victim(m_snapshots.begin());
+			for (snapshot_map::iterator it(m_snapshots.begin()); it != m_snapshots.end(); ++it) {
+				if (it->second.expires < victim->second.expires) {
+					victim = it;
+				}
+			}
+			m_snapshots.erase(victim);
+		}
+		const uint64_t id(m_next_id++);
+		snapshot& s(m_snapshots[id]);
+		s.term = term;
+		s.results = r;
+		s.complete = complete;
+		s.expires = now_usec() + SNAPSHOT_TTL_SEC * 1000000ULL;
+		return id;
+	}
+	
+	// Copy results [position, position+count) of the snapshot into dst.
+	// Fails if the snapshot is gone, or doesn't reach that far.
+	bool get(uint64_t id, const std::string& term, size_t position, size_t count, search_results& dst)
+	{
+		scoped_lock sync(monitor_mutex);
+		expire();
+		snapshot_map::iterator tgt(m_snapshots.find(id));
+		if (tgt == m_snapshots.end() || tgt->second.term != term) {
+			return false;
+		}
+		snapshot& s(tgt->second);
+		if (!s.complete && position + count > s.results.top.size()) {
+			return false;
+		}
+		s.expires = now_usec() + SNAPSHOT_TTL_SEC * 1000000ULL;
+		dst.total = s.results.total;
+		dst.expanded = s.results.expanded;
+		dst.top.clear();
+		for (size_t i(position); i < s.results.top.size() && i < position + count; ++i) {
+			dst.top.push_back(s.results.top[i]);
+		}
+		return true;
+	}
+	
+	void clear()
+	{
+		scoped_lock sync(monitor_mutex);
+		m_snapshots.clear();
+	}
+	
+private:
+	void expire()
+	{
+		const uint64_t now(now_usec());
+		snapshot_map::iterator it(m_snapshots.begin());
+		while (it != m_snapshots.end()) {
+			if (it->second.expires <= now) {
+				m_snapshots.erase(it++);
+			} else {
+				++it;
+			}
+		}
+	}
+	
+	struct snapshot {
+		std::string term;
+		search_results results;
+		bool complete;
+		uint64_t expires;
+	};
+	typedef std::map<uint64_t, snapshot> snapshot_map;
+	
+	uint64_t m_next_id;
+	snapshot_map m_snapshots;
+};
+
+static snapshot_store SNAPSHOTS;
+
+search_results search_page(
+		const std::string& term,
+		const std::string& cursor,
+		size_t count,
+		bool snapshot)
+{
+	page_cursor c;
+	page_request page(count);
+	if (!cursor.empty()) {
+		c = decode_cursor(cursor);
+		page.after = true;
+		page.weight = c.weight;
+		page.article = c.article;
+	}
+	search_results r;
+	size_t position(c.position);
+	set_ref set;
+	if (c.snapshot != 0 && SNAPSHOTS.get(c.snapshot, term, c.position, count, r)) {
+		// served from the snapshot
+	} else if (snapshot) {
+		// rank (a bounded number of) all remaining results once
+		page_request all(page);
+		all.count = MAX_SNAPSHOT_RESULTS;
+		search_results full(search(*set, term, all));
+		const bool complete(full.top.size() < MAX_SNAPSHOT_RESULTS);
+		keep_admitted(full, page);
+		c.snapshot = SNAPSHOTS.put(term, full, complete);
+		SNAPSHOTS.get(c.snapshot, term, 0, count, r);
+		position = 0; // positions are relative to the snapshot
+	} else {
+		c.snapshot = 0;
+		// articles already shown can take the room of others, so
+		// that's made up for until the page is full or there's no more
+		page_request ask(page);
+		while (true) {
+			r = search(*set, term, ask);
+			const size_t found(r.top.size());
+			keep_admitted(r, page);
+			if (r.top.size() >= count || found < ask.count) {
+				break;
+			}
+			ask.count += found - r.top.size();
+		}
+		sort_and_cut(r, count);
+	}
+	if (r.top.size() == count && count > 0) {
+		page_cursor next(c);
+		next.position = position + count;
+		next.weight = r.top.back().weight;
+		next.article = r.top.back().article;
+		r.cursor = encode_cursor(next);
+	}
+	return r;
+}
+
+// The parts merged, but neither sorted nor cut.
+static search_results merge_all(const std::vector<search_results>& parts)
+{
+	search_results r;
+	typedef std::vector<search_results>::const_iterator srvcit;
+	for (srvcit it(parts.begin()); it != parts.end(); ++it) {
+		merge(r, *it);
+		// the same terms, or near enough, from every part
+		typedef std::vector<std::string>::const_iterator svcit;
+		for (svcit t(it->expanded.begin()); t != it->expanded.end(); ++t) {
+			if (std::find(r.expanded.begin(), r.expanded.end(), *t) == r.expanded.end()) {
+				r.expanded.push_back(*t);
+			}
+		}
+		r.partial = r.partial || it->partial;
+	}
+	return r;
+}
+
+search_results merge_results(const std::vector<search_results>& parts, size_t count)
+{
+	search_results r(merge_all(parts));
+	sort_and_cut(r, count);
+	return r;
+}
+
+search_results merge_pages(
+		const std::vector<search_results>& parts,
+		const std::string& cursor,
+		size_t count)
+{
+	const page_cursor c(cursor.empty() ? page_cursor() : decode_cursor(cursor));
+	page_request page(count);
+	page.after = !cursor.empty();
+	page.weight = c.weight;
+	page.article = c.article;
+	search_results r(merge_all(parts));
+	keep_admitted(r, page);
+	sort_and_cut(r, count);
+	if (r.top.size() == count && count > 0) {
+		page_cursor next;
+		next.position = c.position + count;
+		next.weight = r.top.back().weight;
+		next.article = r.top.back().article;
+		r.cursor = encode_cursor(next);
+	}
+	return r;
+}
+
+static bool by_frequency(const completion& a, const completion& b)
+{
+	return a.frequency > b.frequency || (a.frequency == b.frequency && a.term < b.term);
+}
+
+std::vector<completion> merge_completions(const std::vector<std::vector<completion> >& parts, size_t n)
+{
+	typedef std::map<std::string, size_t> frequency_map;
+	frequency_map frequencies;
+	for (size_t i(0); i < parts.size(); ++i) {
+		typedef std::vector<completion>::const_iterator ccit;
+		for (ccit it(parts[i].begin()); it != parts[i].end(); ++it) {
+			frequencies[it->term] += it->frequency;
+		}
+	}
+	std::vector<completion> merged;
+	for (frequency_map::const_iterator it(frequencies.begin()); it != frequencies.end(); ++it) {
+		merged.push_back(completion(it->first, it->second));
+	}
+	std::sort(merged.begin(), merged.end(), by_frequency);
+	if (merged.size() > n) {
+		merged.erase(merged.begin() + n, merged.end());
+	}
+	return merged;
+}
+
+void set_cache_budget(size_t bytes)
+{
+	CACHE.set_budget(bytes);
+}
+
+cache_stats get_cache_stats()
+{
+	return CACHE.stats();
+}
+
+filter_stats get_filter_stats()
+{
+	filter_stats s;
+	s.probes = __sync_fetch_and_add(&FILTER_STATS.probes, 0);
+	s.skipped = __sync_fetch_and_add(&FILTER_STATS.skipped, 0);
+	s.false_positives = __sync_fetch_and_add(&FILTER_STATS.false_positives, 0);
+	return s;
+}
+
+void drop_caches()
+{
+	const size_t budget(CACHE.budget());
+	CACHE.set_budget(0);
+	CACHE.set_budget(budget);
+#ifdef POSIX_FADV_DONTNEED
+	set_ref set;
+	typedef std::vector<index_repr *>::const_iterator ircit;
+	for (ircit it(set->indices.begin()); it != set->indices.end(); ++it) {
+		posix_fadvise((*it)->fd, 0, 0, POSIX_FADV_DONTNEED);
+	}
+#endif
+}
 
 size_t init_indices(const std::vector<std::string>& filenames)
 {
-	typedef std::vector<index_repr *>::iterator irit;
-	for (irit it(INDICES.begin()); it != INDICES.end(); ++it) {
-		delete *it;
+	const char *cache_env(getenv("CACHE_MB"));
+	if (cache_env) {
+		set_cache_budget(static_cast<size_t>(atoi(cache_env)) * 1024 * 1024);
 	}
-	INDICES.clear();
+	// the current set goes on serving searches while this one loads
+	index_set *set(new index_set);
 	size_t count(0);
 	typedef std::vector<std::string>::const_iterator svcit;
 	for (svcit it(filenames.begin()); it != filenames.end(); ++it) {
+		// a glob of idx.* takes in the dictionary, which is loaded
+		// by the index files that use it
+		const std::string suffix(TERM_DICTIONARY_SUFFIX);
+		if (it->size() > suffix.size() && it->compare(it->size() - suffix.size(), suffix.size(), suffix) == 0) {
+			continue;
+		}
 		try {
 			index_repr *idx(new index_repr(*it));
-			idx->parse();
-			INDICES.push_back(idx);
+			try {
+				idx->parse(set->dictionaries); // throws if its dictionary is missing
+			} catch (const std::runtime_error& ex) {
+				delete idx;
+				throw;
+			}
+			set->indices.push_back(idx);
 			count++;
 		} catch (const std::runtime_error& ex) {
 			continue;
 		}
 	}
+	try {
+		std::vector<term_frequency> terms;
+		typedef std::vector<index_repr *>::const_iterator ircit;
+		for (ircit it(set->indices.begin()); it != set->indices.end(); ++it) {
+			(*it)->term_frequencies(terms);
+		}
+		set->terms.build(terms);
+	} catch (const std::runtime_error& ex) {
+		delete set;
+		throw;
+	}
+	SETS.publish(set);
+	SNAPSHOTS.clear();
 	return count;
 }
 
-search_results search_indices(const std::string& term)
+search_results search_indices(const std::string& term, size_t fuzzy, search_trace *trace)
+{
+	const uint64_t begin(trace ? now_usec() : 0);
+	set_ref set;
+	if (trace) {
+		*trace = search_trace();
+		trace->segments.resize(set->indices.size());
+		for (size_t f(0); f < set->indices.size(); ++f) {
+			trace->segments[f].filename = set->indices[f]->filename;
+		}
+	}
+	search_results r(search(*set, term, page_request(), trace));
+	if (r.total == 0 && fuzzy > 0 && term.find('*') == std::string::npos) {
+		const size_t distance(fuzzy_distance_for(term, fuzzy));
+		if (distance > 0) {
+			const uint64_t expanding(trace ? now_usec() : 0);
+			const std::vector<std::string> terms(fuzzy_terms(set->terms, term, distance, MAX_FUZZY_EXPANSION));
+			if (trace) {
+				trace->expand_usec += now_usec() - expanding;
+			}
+			r = search_any(set->indices, terms, page_request(), trace);
+		}
+	}
+	if (trace) {
+		trace->total_usec = now_usec() - begin;
+	}
+	return r;
+}
+
+std::vector<search_results> search_indices(const std::vector<std::string>& terms)
+{
+	set_ref set;
+	return search(*set, terms);
+}
+
+static void json_escape(std::ostringstream& oss, const std::string& s)
+{
+	static const char *HEX("0123456789abcdef");
+	for (std::string::const_iterator it(s.begin()); it != s.end(); ++it) {
+		const unsigned char c(*it);
+		switch (c) {
+		case '"':  oss << "\\\""; break;
+		case '\\': oss << "\\\\"; break;
+		case '\n': oss << "\\n"; break;
+		case '\r': oss << "\\r"; break;
+		case '\t': oss << "\\t"; break;
+		default:
+			if (c < 0x20) {
+				oss << "\\u00" << HEX[c >> 4] << HEX[c & 0xF];
+			} else {
+				oss << c;
+			}
+			break;
+		}
+	}
+}
+
+std::string to_json(const search_results& r)
 {
-	return search(INDICES, term);
+	std::ostringstream oss;
+	oss << "{\"hits\": " << r.total << ", ";
+	oss << "\"top\": [\n";
+	typedef std::vector<search_result>::const_iterator srcit;
+	for (srcit it(r.top.begin()); it != r.top.end(); ++it) {
+		oss << (it == r.top.begin() ? "" : ",\n");
+		oss << "\t{\"article\": \"";
+		json_escape(oss, it->article);
+		oss << "\", \"weight\": " << it->weight << "}";
+	}
+	oss << "\n]";
+	if (!r.expanded.empty()) {
+		oss << ", \"expanded\": [";
+		typedef std::vector<std::string>::const_iterator svcit;
+		for (svcit it(r.expanded.begin()); it != r.expanded.end(); ++it) {
+			oss << (it == r.expanded.begin() ? "\"" : ", \"");
+			json_escape(oss, *it);
+			oss << "\"";
+		}
+		oss << "]";
+	}
+	if (!r.cursor.empty()) {
+		oss << ", \"cursor\": \"" << r.cursor << "\"";
+	}
+	if (r.partial) {
+		oss << ", \"partial\": true";
+	}
+	oss << "}";
+	return oss.str();
 }
 
+std::string to_json(const std::vector<completion>& completions, bool partial)
+{
+	std::ostringstream oss;
+	oss << "{\"completions\": [";
+	typedef std::vector<completion>::const_iterator ccit;
+	for (ccit it(completions.begin()); it != completions.end(); ++it) {
+		oss << (it == completions.begin() ? "\n" : ",\n");
+		oss << "\t{\"term\": \"";
+		json_escape(oss, it->term);
+		oss << "\", \"frequency\": " << it->frequency << "}";
+	}
+	oss << "\n]";
+	if (partial) {
+		oss << ", \"partial\": true";
+	}
+	oss << "}";
+	return oss.str();
+}
@@ -4,10 +4,169 @@
 #include <string>
 #include <vector>
 #include "def.hh"
+#include "cache.hh"
+#include "dict.hh"
 
 #define MAX_SEARCH_RESULTS 10
 
+// A wildcard query (eg. "foo*") is the OR of at most this many terms,
+// the most frequent ones that match...
+#define MAX_WILDCARD_EXPANSION 32
+// ...found among at most this many candidates sharing its literal prefix.
+#define MAX_WILDCARD_SCAN 4096
+
+// A fuzzy fallback search is the OR of at most this many terms,
+// the closest ones to the query.
+#define MAX_FUZZY_EXPANSION 8
+#define DEFAULT_FUZZY_DISTANCE 2
+
+// Memory budget for decoded postings blocks, shared by all index files.
+// May be overridden by the CACHE_MB environment variable at init time.
+#define DEFAULT_CACHE_BUDGET (64 * 1024 * 1024) // 64MB
+
+// An article with a term in its title ranks as if it had the term this
+// many more times in its text. Titles are indexed apart from the text,
+// in a small title index which the reader keeps in memory.
+#define TITLE_BOOST 10
+
+// Load the index files (returning how many would load), and search them
+// from then on. They can be reloaded, or replaced by others, at any time:
+// searches carry on with the files already loaded until the new ones are
+// ready, and those still running then finish with the files they started
+// with, which are closed once the last of them is done.
 size_t init_indices(const std::vector<std::string>& filenames);
-search_results search_indices(const std::string& term);
+
+// What a search spent its time on in one index file. Times are
+// wall-clock microseconds.
+struct segment_trace {
+	segment_trace()
+	: lookup_usec(0)
+	, aggregate_usec(0)
+	, filtered(0)
+	, blocks(0)
+	, cache_hits(0)
+	, reads(0)
+	, bytes_read(0)
+	, postings(0)
+	{
+		//
+	}
+	
+	std::string filename;
+	uint64_t lookup_usec;    // finding the terms, and their cached blocks
+	uint64_t aggregate_usec; // counting and ranking the articles found
+	size_t filtered;         // term lookups its Bloom filter ruled out
+	size_t blocks;           // postings blocks of the terms
+	size_t cache_hits;       // blocks found in the postings cache
+	size_t reads;            // issued for the rest
+	uint64_t bytes_read;
+	size_t postings;         // article IDs found, title matches included
+};
+
+// What a search spent its time on, for the searches asked to record it.
+// The reads of all the files are issued together, so only their total
+// time is known, which includes decoding the blocks as they arrive.
+struct search_trace {
+	search_trace() : total_usec(0), expand_usec(0), read_usec(0), merge_usec(0) { }
+	
+	uint64_t total_usec;
+	uint64_t expand_usec; // finding the terms of wildcard and fuzzy searches
+	uint64_t read_usec;
+	uint64_t merge_usec; // combining the results of the files
+	std::vector<segment_trace> segments; // by index file
+};
+
+// A term containing '*' is a wildcard query, matching any sequence.
+// A query of several words (which no term can be) finds the articles
+// with all of them in their titles, from the title indexes alone,
+// exact titles first.
+// If fuzzy is nonzero and the term has no hits, search instead for the
+// terms within that many edits of it (fewer for short terms).
+// Given a trace, the search records where its time went there.
+search_results search_indices(const std::string& term, size_t fuzzy=0, search_trace *trace=NULL);
+
+// Search for many terms at once, returning results in the same order.
+// Cheaper than searching one at a time: dictionary lookups are shared
+// between duplicate terms, and each index file is read in a single
+// ascending sweep over the postings blocks of all terms.
+std::vector<search_results> search_indices(const std::vector<std::string>& terms);
+
+// Snapshots of ranked results for deep pagination are kept for this long
+// after their last use, and hold at most this many results each.
+#define SNAPSHOT_TTL_SEC 60
+#define MAX_SNAPSHOTS 64
+#define MAX_SNAPSHOT_RESULTS 10000
+
+// One page of results: the first count results after the cursor (from
+// the top, if it's empty). results.cursor resumes after this page.
+// With snapshot, the complete ranking is computed once and kept on the
+// server for a while, so following pages don't read postings at all.
+// An article in more than one index file ranks by the sum of its weights
+// in them, and isn't shown again on a later page.
+// Throws std::runtime_error for a malformed cursor.
+search_results search_page(
+		const std::string& term,
+		const std::string& cursor,
+		size_t count=MAX_SEARCH_RESULTS,
+		bool snapshot=false);
+
+// Combine the results of searching disjoint sets of index files (in
+// other processes, say) as one search of them all would have: the
+// weights of an article found in more than one are added up, and the top
+// count kept. Given the cursor the parts were searched with, the result
+// also has a cursor for the next page, as from search_page; snapshots
+// can't be shared, so pages of merged results are always searched anew.
+// An article in more than one part which an earlier page had is left
+// out, which may leave the page short.
+search_results merge_results(const std::vector<search_results>& parts, size_t count=MAX_SEARCH_RESULTS);
+search_results merge_pages(
+		const std::vector<search_results>& parts,
+		const std::string& cursor,
+		size_t count=MAX_SEARCH_RESULTS);
+
+// Likewise for completions: the frequencies of a term are added up, and
+// the n most frequent kept.
+std::vector<completion> merge_completions(const std::vector<std::vector<completion> >& parts, size_t n);
+
+// Up to n terms starting with prefix, most frequent first.
+std::vector<completion> complete_terms(const std::string& prefix, size_t n);
+
+// Up to n terms within max_distance edits of term, closest first.
+std::vector<std::string> fuzzy_terms(const std::string& term, size_t max_distance, size_t n);
+
+// The terms a wildcard query will search for.
+std::vector<std::string> expand_wildcard(const std::string& pattern);
+
+// Serialize results as {"hits": N, "top": [{"article": ..., "weight": N}]},
+// plus "expanded": [term, ...] for wildcard and fuzzy searches,
+// "cursor": "..." for pages with a next page
+// and "partial": true if some index files couldn't be searched.
+std::string to_json(const search_results& r);
+
+// Serialize completions as {"completions": [{"term": ..., "frequency": N}]},
+// plus "partial": true if some index files couldn't be searched.
+std::string to_json(const std::vector<completion>& completions, bool partial=false);
+
+void set_cache_budget(size_t bytes);
+cache_stats get_cache_stats();
+
+// Lookups of a term in an index file, how many of them the file's Bloom
+// filter answered without looking (see bloom.hh), and how many it let
+// through for terms the file didn't have after all.
+struct filter_stats {
+	filter_stats() : probes(0), skipped(0), false_positives(0) { }
+	
+	size_t probes;
+	size_t skipped;
+	size_t false_positives;
+};
+
+filter_stats get_filter_stats();
+
+// Empty the postings cache and ask the kernel to drop the index files
+// from the page cache, so the next searches go to disk. For cold-cache
+// measurements; the page cache part is a no-op where posix_fadvise
+// isn't available.
+void drop_caches();
 
 #endif
@@ -0,0 +1,918 @@
+#include <iostream>
+#include <sstream>
+#include <fstream>
+#include <stdexcept>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cassert>
+#include <map>
+#include "def.hh"
+#include "search.hh"
+#include "fold.hh"
+#include "thread.hh"
+#include "shard.hh"
+
+extern "C" {
+	#include <unistd.h>
+	#include <fcntl.h>
+	#include <errno.h>
+	#include <signal.h>
+	#include <stdlib.h>
+	#include <sys/epoll.h>
+	#include <sys/socket.h>
+	#include <sys/stat.h>
+	#include <sys/un.h>
+	#include <sys/wait.h>
+	#include <sys/prctl.h>
+	#include <netinet/in.h>
+	#include <netinet/tcp.h>
+}
+
+// searchd serves the same HTTP interface as server.py, natively.
+//
+// Every worker thread runs its own epoll loop. They all watch the shared
+// listening socket (with EPOLLEXCLUSIVE, so a new connection wakes only
+// one of them), and each owns the connections it accepts for their whole
+// lifetime. Searches run inline on the worker; they're short, and the
+// postings cache and pread(2) make them safe to run concurrently.
+// Connections are kept alive per HTTP/1.1 semantics.
+//
+// SIGHUP reloads the index files (see init_indices) on the main thread,
+// while the workers go on searching the ones already loaded.
+//
+// With -n, searchd is instead the coordinator of that many shards (see
+// shard.hh): searchd processes of its own, started with -s to listen on
+// Unix sockets, which share out the index files between them. The
+// coordinator loads no index files itself; its workers pass every query
+// on to all the shards, and merge their answers. It restarts a shard
+// which exits, and on SIGHUP shares the files out again and has every
+// shard reload its share.
+
+#define DEFAULT_PORT 8080
+#define LISTEN_BACKLOG 1024
+#define MAX_EVENTS 256
+#define READ_CHUNK_SIZE 16384
+#define MAX_REQUEST_SIZE (64 * 1024) // 64KB
+#define EPOLL_TIMEOUT_MS 500
+#define MAX_PAGE_SIZE 1000
+#define SHARD_RESTART_SEC 1 // at most one restart a second, per shard
+#define SHARD_READY_POLL_MS 100
+
+#ifndef EPOLLEXCLUSIVE
+#define EPOLLEXCLUSIVE (1u << 28)
+#endif
+
+static volatile sig_atomic_t RUNNING(1);
+static volatile sig_atomic_t RELOAD(0);
+
+static void on_signal(int)
+{
+	RUNNING = 0;
+}
+
+static void on_hangup(int)
+{
+	RELOAD = 1;
+}
+
+static bool set_nonblocking(int fd)
+{
+	int flags(fcntl(fd, F_GETFL, 0));
+	return flags >= 0 && fcntl(fd, F_SETFL, flags | O_NONBLOCK) == 0;
+}
+
+// so the shards a coordinator starts don't inherit its sockets
+static void set_cloexec(int fd)
+{
+	fcntl(fd, F_SETFD, FD_CLOEXEC);
+}
+
+static std::string lower(const std::string& s)
+{
+	return fold_case(s);
+}
+
+static int hex_value(char c)
+{
+	if (c >= '0' && c <= '9') return c - '0';
+	if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+	if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+	return -1;
+}
+
+static std::string url_decode(const std::string& s)
+{
+	std::string out;
+	out.reserve(s.size());
+	for (size_t i(0); i < s.size(); ++i) {
+		if (s[i] == '%' && i+2 < s.size()) {
+			int hi(hex_value(s[i+1])), lo(hex_value(s[i+2]));
+			if (hi >= 0 && lo >= 0) {
+				out += static_cast<char>(hi * 16 + lo);
+				i += 2;
+				continue;
+			}
+		} else if (s[i] == '+') {
+			out += ' ';
+			continue;
+		}
+		out += s[i];
+	}
+	return out;
+}
+
+static std::string content_type(const std::string& filename)
+{
+	const std::string::size_type dot(filename.rfind('.'));
+	const std::string ext(dot == std::string::npos ? "" : filename.substr(dot));
+	if (ext == ".html" || ext == ".htm") {
+		return "text/html";
+	} else if (ext == ".js") {
+		return "application/javascript";
+	} else if (ext == ".css") {
+		return "text/css";
+	} else if (ext == ".json") {
+		return "application/json";
+	}
+	return "application/octet-stream";
+}
+
+struct http_request {
+	http_request() : keep_alive(true) { }
+
+	std::string method;
+	std::string path;
+	std::string query; // after the '?', if any
+	bool keep_alive;
+};
+
+// The value of the parameter in a query string, or "" if it isn't there.
+static std::string query_param(const std::string& query, const std::string& name)
+{
+	std::istringstream iss(query);
+	std::string pair;
+	while (std::getline(iss, pair, '&')) {
+		if (pair.compare(0, name.size() + 1, name + "=") == 0) {
+			return pair.substr(name.size() + 1);
+		}
+	}
+	return "";
+}
+
+struct http_response {
+	http_response(int status, const std::string& type, const std::string& body)
+	: status(status)
+	, type(type)
+	, body(body)
+	{
+		//
+	}
+
+	int status;
+	std::string type;
+	std::string body;
+};
+
+static const char * status_text(int status)
+{
+	switch (status) {
+	case 200: return "OK";
+	case 400: return "Bad Request";
+	case 404: return "Not Found";
+	case 405: return "Method Not Allowed";
+	case 413: return "Request Entity Too Large";
+	}
+	return "Internal Server Error";
+}
+
+// Parse a complete request head (everything before the blank line).
+static bool parse_request(const std::string& head, http_request& req)
+{
+	std::istringstream iss(head);
+	std::string line, version;
+	if (!std::getline(iss, line)) {
+		return false;
+	}
+	std::istringstream rl(line);
+	if (!(rl >> req.method >> req.path >> version)) {
+		return false;
+	}
+	req.keep_alive = (version == "HTTP/1.1");
+	while (std::getline(iss, line)) {
+		if (!line.empty() && line[line.size()-1] == '\r') {
+			line.erase(line.size()-1);
+		}
+		const std::string::size_type colon(line.find(':'));
+		if (colon == std::string::npos) {
+			continue;
+		}
+		const std::string name(lower(line.substr(0, colon)));
+		std::string value(lower(line.substr(colon+1)));
+		value.erase(0, value.find_first_not_of(" \t"));
+		if (name == "connection") {
+			if (value.find("close") != std::string::npos) {
+				req.keep_alive = false;
+			} else if (value.find("keep-alive") != std::string::npos) {
+				req.keep_alive = true;
+			}
+		}
+	}
+	const std::string::size_type q(req.path.find('?'));
+	if (q != std::string::npos) {
+		req.query = req.path.substr(q + 1);
+		req.path.erase(q);
+	}
+	return true;
+}
+
+static http_response serve_file(const std::string& docroot, const std::string& path)
+{
+	// never serve anything outside of the document root
+	if (path.find("..") != std::string::npos) {
+		return http_response(404, "text/plain", "not found\n");
+	}
+	const std::string filename(docroot + "/" + path);
+	// a directory opens as a file, but reads as nothing
+	struct stat st;
+	if (stat(filename.c_str(), &st) != 0 || !S_ISREG(st.st_mode)) {
+		return http_response(404, "text/plain", "not found\n");
+	}
+	std::ifstream ifs(filename.c_str(), std::ios::binary);
+	if (!ifs.good()) {
+		return http_response(404, "text/plain", "not found\n");
+	}
+	std::ostringstream oss;
+	oss << ifs.rdbuf();
+	return http_response(200, content_type(filename), oss.str());
+}
+
+static http_response results_response(const search_results& r, bool lines)
+{
+	if (lines) {
+		return http_response(200, "text/plain", to_lines(r));
+	}
+	return http_response(200, "application/json", to_json(r));
+}
+
+// A search, or a page of one; of the index files loaded here, or through
+// the shards, if there are any. As lines, for a coordinator, or JSON.
+static http_response query(
+		const std::string& term,
+		const std::string& params,
+		shard_client *shards,
+		bool lines)
+{
+	const std::string cursor(query_param(params, "cursor"));
+	const std::string count(query_param(params, "count"));
+	const bool snapshot(query_param(params, "snapshot") == "1");
+	if (!cursor.empty() || !count.empty() || snapshot) {
+		const size_t n(count.empty() ? MAX_SEARCH_RESULTS : atoi(count.c_str()));
+		if (n > MAX_PAGE_SIZE) {
+			return http_response(400, "text/plain", "count too large\n");
+		}
+		try {
+			if (shards) {
+				return results_response(search_shards_page(*shards, term, cursor, n), lines);
+			}
+			return results_response(search_page(term, cursor, n, snapshot), lines);
+		} catch (const std::runtime_error& ex) {
+			return http_response(400, "text/plain", std::string(ex.what()) + "\n");
+		}
+	}
+	const size_t fuzzy(atoi(query_param(params, "fuzzy").c_str()));
+	if (shards) {
+		return results_response(search_shards(*shards, term, fuzzy), lines);
+	}
+	return results_response(search_indices(term, fuzzy), lines);
+}
+
+static http_response route(const std::string& docroot, const http_request& req, shard_client *shards)
+{
+	if (req.method != "GET") {
+		return http_response(405, "text/plain", "method not allowed\n");
+	}
+	static const std::string QUERY_PREFIX("/query/");
+	if (req.path.compare(0, QUERY_PREFIX.size(), QUERY_PREFIX) == 0) {
+		const std::string term(lower(url_decode(req.path.substr(QUERY_PREFIX.size()))));
+		return query(term, req.query, shards, false);
+	}
+	static const std::string COMPLETE_PREFIX("/complete/");
+	if (req.path.compare(0, COMPLETE_PREFIX.size(), COMPLETE_PREFIX) == 0) {
+		const std::string prefix(lower(url_decode(req.path.substr(COMPLETE_PREFIX.size()))));
+		if (shards) {
+			bool partial(false);
+			const std::vector<completion> c(complete_shards(*shards, prefix, MAX_SEARCH_RESULTS, partial));
+			return http_response(200, "application/json", to_json(c, partial));
+		}
+		return http_response(200, "application/json", to_json(complete_terms(prefix, MAX_SEARCH_RESULTS)));
+	}
+	// what a coordinator asks its shards
+	static const std::string SHARD_QUERY_PREFIX("/shard/query/");
+	if (req.path.compare(0, SHARD_QUERY_PREFIX.size(), SHARD_QUERY_PREFIX) == 0) {
+		const std::string term(lower(url_decode(req.path.substr(SHARD_QUERY_PREFIX.size()))));
+		return query(term, req.query, NULL, true);
+	}
+	static const std::string SHARD_COMPLETE_PREFIX("/shard/complete/");
+	if (req.path.compare(0, SHARD_COMPLETE_PREFIX.size(), SHARD_COMPLETE_PREFIX) == 0) {
+		const std::string prefix(lower(url_decode(req.path.substr(SHARD_COMPLETE_PREFIX.size()))));
+		const std::string count(query_param(req.query, "count"));
+		const size_t n(count.empty() ? MAX_SEARCH_RESULTS : atoi(count.c_str()));
+		return http_response(200, "text/plain", to_lines(complete_terms(prefix, n)));
+	}
+	if (req.path == "/") {
+		return serve_file(docroot, "index.html");
+	}
+	return serve_file(docroot, url_decode(req.path.substr(1)));
+}
+
+static std::string serialize(const http_response& r, bool keep_alive)
+{
+	std::ostringstream oss;
+	oss << "HTTP/1.1 " << r.status << " " << status_text(r.status) << "\r\n"
+	    << "Content-Type: " << r.type << "\r\n"
+	    << "Content-Length: " << r.body.size() << "\r\n"
+	    << "Connection: " << (keep_alive ? "keep-alive" : "close") << "\r\n"
+	    << "\r\n"
+	    << r.body;
+	return oss.str();
+}
+
+struct connection {
+	connection(int fd) : fd(fd), out_pos(0), close_after(false), want_write(false) { }
+
+	int fd;
+	std::string in;
+	std::string out;
+	size_t out_pos;
+	bool close_after;
+	bool want_write;
+};
+
+class http_worker : public threadbase
+{
+public:
+	http_worker(int listen_fd, const std::string& docroot, const std::vector<std::string>& shards);
+	virtual ~http_worker();
+	virtual void run();
+
+	size_t requests() const { return m_requests; }
+
+private:
+	void accept_all();
+	void on_readable(connection *c);
+	void on_writable(connection *c);
+	void handle_requests(connection *c);
+	void update_events(connection *c);
+	void close_connection(connection *c);
+
+	const int m_listen_fd;
+	const std::string m_docroot;
+	shard_client *m_shards; // for a coordinator, or NULL
+	int m_epoll_fd;
+	std::map<int, connection *> m_connections;
+	size_t m_requests;
+};
+
+http_worker::http_worker(int listen_fd, const std::string& docroot, const std::vector<std::string>& shards)
+: m_listen_fd(listen_fd)
+, m_docroot(docroot)
+, m_shards(shards.empty() ? NULL : new shard_client(shards))
+, m_epoll_fd(epoll_create(MAX_EVENTS))
+, m_requests(0)
+{
+	if (m_epoll_fd < 0) {
+		throw std::runtime_error("epoll_create failed");
+	}
+	set_cloexec(m_epoll_fd);
+	struct epoll_event ev;
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN | EPOLLEXCLUSIVE;
+	ev.data.fd = m_listen_fd;
+	if (epoll_ctl(m_epoll_fd, EPOLL_CTL_ADD, m_listen_fd, &ev) != 0) {
+		// kernels before 4.5 don't know EPOLLEXCLUSIVE
+		ev.events = EPOLLIN;
+		if (epoll_ctl(m_epoll_fd, EPOLL_CTL_ADD, m_listen_fd, &ev) != 0) {
+			throw std::runtime_error("epoll_ctl on listening socket failed");
+		}
+	}
+}
+
+http_worker::~http_worker()
+{
+	typedef std::map<int, connection *>::iterator cit;
+	for (cit it(m_connections.begin()); it != m_connections.end(); ++it) {
+		close(it->first);
+		delete it->second;
+	}
+	close(m_epoll_fd);
+	delete m_shards;
+}
+
+void http_worker::run()
+{
+	struct epoll_event events[MAX_EVENTS];
+	while (RUNNING) {
+		int n(epoll_wait(m_epoll_fd, events, MAX_EVENTS, EPOLL_TIMEOUT_MS));
+		if (n < 0 && errno != EINTR) {
+			std::cerr << "epoll_wait: " << strerror(errno) << std::endl;
+			break;
+		}
+		for (int i(0); i < n; ++i) {
+			const int fd(events[i].data.fd);
+			if (fd == m_listen_fd) {
+				accept_all();
+				continue;
+			}
+			std::map<int, connection *>::iterator tgt(m_connections.find(fd));
+			if (tgt == m_connections.end()) {
+				continue;
+			}
+			connection *c(tgt->second);
+			if (events[i].events & (EPOLLERR | EPOLLHUP)) {
+				close_connection(c);
+				continue;
+			}
+			if (events[i].events & EPOLLOUT) {
+				on_writable(c);
+				if (m_connections.find(fd) == m_connections.end()) {
+					continue;
+				}
+			}
+			if (events[i].events & EPOLLIN) {
+				on_readable(c);
+			}
+		}
+	}
+}
+
+void http_worker::accept_all()
+{
+	while (true) {
+		int fd(accept(m_listen_fd, NULL, NULL));
+		if (fd < 0) {
+			return; // EAGAIN, or another worker got it
+		}
+		int one(1);
+		setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one)); // fails for Unix sockets; no matter
+		set_cloexec(fd);
+		if (!set_nonblocking(fd)) {
+			close(fd);
+			continue;
+		}
+		connection *c(new connection(fd));
+		struct epoll_event ev;
+		memset(&ev, 0, sizeof(ev));
+		ev.events = EPOLLIN;
+		ev.data.fd = fd;
+		if (epoll_ctl(m_epoll_fd, EPOLL_CTL_ADD, fd, &ev) != 0) {
+			close(fd);
+			delete c;
+			continue;
+		}
+		m_connections[fd] = c;
+	}
+}
+
+void http_worker::on_readable(connection *c)
+{
+	char buf[READ_CHUNK_SIZE];
+	while (true) {
+		ssize_t n(read(c->fd, buf, sizeof(buf)));
+		if (n > 0) {
+			c->in.append(buf, n);
+			if (c->in.size() > MAX_REQUEST_SIZE) {
+				c->out += serialize(http_response(413, "text/plain", "too large\n"), false);
+				c->in.clear();
+				c->close_after = true;
+				break;
+			}
+			continue;
+		}
+		if (n == 0 || (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)) {
+			close_connection(c);
+			return;
+		}
+		if (errno == EINTR) {
+			continue;
+		}
+		break;
+	}
+	handle_requests(c);
+	on_writable(c);
+}
+
+void http_worker::handle_requests(connection *c)
+{
+	// requests may be pipelined; answer them in order
+	while (!c->close_after) {
+		const std::string::size_type end(c->in.find("\r\n\r\n"));
+		if (end == std::string::npos) {
+			return;
+		}
+		http_request req;
+		const bool ok(parse_request(c->in.substr(0, end), req));
+		c->in.erase(0, end + 4);
+		m_requests++;
+		if (!ok) {
+			c->out += serialize(http_response(400, "text/plain", "bad request\n"), false);
+			c->close_after = true;
+			return;
+		}
+		try {
+			c->out += serialize(route(m_docroot, req, m_shards), req.keep_alive);
+		} catch (const std::runtime_error& ex) {
+			c->out += serialize(http_response(500, "text/plain", std::string(ex.what()) + "\n"), req.keep_alive);
+		}
+		if (!req.keep_alive) {
+			c->close_after = true;
+		}
+	}
+}
+
+void http_worker::on_writable(connection *c)
+{
+	while (c->out_pos < c->out.size()) {
+		ssize_t n(write(c->fd, c->out.data() + c->out_pos, c->out.size() - c->out_pos));
+		if (n < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			if (errno == EAGAIN || errno == EWOULDBLOCK) {
+				break;
+			}
+			close_connection(c);
+			return;
+		}
+		c->out_pos += n;
+	}
+	if (c->out_pos >= c->out.size()) {
+		c->out.clear();
+		c->out_pos = 0;
+		if (c->close_after) {
+			close_connection(c);
+			return;
+		}
+	}
+	update_events(c);
+}
+
+void http_worker::update_events(connection *c)
+{
+	const bool want_write(!c->out.empty());
+	if (want_write == c->want_write) {
+		return;
+	}
+	struct epoll_event ev;
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN | (want_write ? EPOLLOUT : 0);
+	ev.data.fd = c->fd;
+	epoll_ctl(m_epoll_fd, EPOLL_CTL_MOD, c->fd, &ev);
+	c->want_write = want_write;
+}
+
+void http_worker::close_connection(connection *c)
+{
+	epoll_ctl(m_epoll_fd, EPOLL_CTL_DEL, c->fd, NULL);
+	close(c->fd);
+	m_connections.erase(c->fd);
+	delete c;
+}
+
+static int listen_on(int port)
+{
+	int fd(socket(AF_INET, SOCK_STREAM, 0));
+	if (fd < 0) {
+		throw std::runtime_error("socket failed");
+	}
+	int one(1);
+	setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+	struct sockaddr_in addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_ANY);
+	addr.sin_port = htons(port);
+	if (bind(fd, reinterpret_cast<struct sockaddr *>(&addr), sizeof(addr)) != 0) {
+		close(fd);
+		throw std::runtime_error("bind failed");
+	}
+	if (listen(fd, LISTEN_BACKLOG) != 0 || !set_nonblocking(fd)) {
+		close(fd);
+		throw std::runtime_error("listen failed");
+	}
+	set_cloexec(fd);
+	return fd;
+}
+
+// A shard listens on a Unix socket, at path; left over from an earlier
+// run, it's replaced.
+static int listen_unix(const std::string& path)
+{
+	struct sockaddr_un addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	if (path.size() >= sizeof(addr.sun_path)) {
+		throw std::runtime_error("socket path too long: " + path);
+	}
+	strcpy(addr.sun_path, path.c_str());
+	int fd(socket(AF_UNIX, SOCK_STREAM, 0));
+	if (fd < 0) {
+		throw std::runtime_error("socket failed");
+	}
+	unlink(path.c_str());
+	if (bind(fd, reinterpret_cast<struct sockaddr *>(&addr), sizeof(addr)) != 0) {
+		close(fd);
+		throw std::runtime_error("bind failed: " + path);
+	}
+	if (listen(fd, LISTEN_BACKLOG) != 0 || !set_nonblocking(fd)) {
+		close(fd);
+		throw std::runtime_error("listen failed");
+	}
+	set_cloexec(fd);
+	return fd;
+}
+
+static void usage(const char *argv0)
+{
+	std::cerr << "usage: " << argv0
+	          << " [-p port | -s socket | -n shards] [-t threads] [-d docroot] [-f list] [<idx> ...]"
+	          << std::endl;
+}
+
+// The index files named on the commandline, and those listed one per line
+// in the list file, if there is one. The list is read again on every
+// reload, so a new set of files can be swapped in by rewriting it.
+static std::vector<std::string> index_filenames(
+		const std::vector<std::string>& args,
+		const std::string& list)
+{
+	std::vector<std::string> filenames(args);
+	if (!list.empty()) {
+		std::ifstream ifs(list.c_str());
+		if (!ifs.good()) {
+			throw std::runtime_error("couldn't read index list " + list);
+		}
+		std::string line;
+		while (std::getline(ifs, line)) {
+			if (!line.empty()) {
+				filenames.push_back(line);
+			}
+		}
+	}
+	return filenames;
+}
+
+static void reload(const std::vector<std::string>& args, const std::string& list)
+{
+	try {
+		const uint64_t begin(now_usec());
+		const std::vector<std::string> filenames(index_filenames(args, list));
+		const size_t indices(init_indices(filenames));
+		std::cout << "reloaded " << indices << " of " << filenames.size()
+		          << " index files in " << (now_usec() - begin) / 1000 << "ms"
+		          << std::endl;
+	} catch (const std::runtime_error& ex) {
+		// keep searching the files we have
+		std::cerr << "reload failed: " << ex.what() << std::endl;
+	}
+}
+
+// The shards of a coordinator: searchd -s processes, each listening on a
+// socket in a directory of the coordinator's, and searching the index
+// files listed for it there. A shard which exits is started again.
+class shard_processes : private noncopyable
+{
+public:
+	shard_processes(size_t n, size_t threads);
+	~shard_processes(); // stops them all
+
+	// Share out the index files, then start every shard, or have it
+	// reload its share if it's running.
+	void assign(const std::vector<std::string>& filenames);
+
+	// Start again any shard which has exited.
+	void supervise();
+
+	const std::vector<std::string>& sockets() const { return m_sockets; }
+
+private:
+	void start(size_t i);
+
+	std::string m_dir;
+	std::string m_threads;
+	std::vector<std::string> m_sockets;
+	std::vector<std::string> m_lists;
+	std::vector<pid_t> m_pids; // 0 if not running
+	std::vector<uint64_t> m_started;
+};
+
+shard_processes::shard_processes(size_t n, size_t threads)
+: m_pids(n, 0)
+, m_started(n, 0)
+{
+	std::ostringstream t;
+	t << threads;
+	m_threads = t.str();
+	char dir[] = "/tmp/searchd.XXXXXX";
+	if (!mkdtemp(dir)) {
+		throw std::runtime_error("couldn't make a directory for the shards");
+	}
+	m_dir = dir;
+	for (size_t i(0); i < n; ++i) {
+		std::ostringstream oss;
+		oss << m_dir << "/shard." << i;
+		m_sockets.push_back(oss.str() + ".sock");
+		m_lists.push_back(oss.str() + ".list");
+	}
+}
+
+shard_processes::~shard_processes()
+{
+	for (size_t i(0); i < m_pids.size(); ++i) {
+		if (m_pids[i] > 0) {
+			kill(m_pids[i], SIGTERM);
+		}
+	}
+	for (size_t i(0); i < m_pids.size(); ++i) {
+		if (m_pids[i] > 0) {
+			waitpid(m_pids[i], NULL, 0);
+		}
+		unlink(m_sockets[i].c_str());
+		unlink(m_lists[i].c_str());
+	}
+	rmdir(m_dir.c_str());
+}
+
+void shard_processes::assign(const std::vector<std::string>& filenames)
+{
+	const std::vector<std::vector<std::string> > shares(partition_files(filenames, m_pids.size()));
+	for (size_t i(0); i < shares.size(); ++i) {
+		// replaced all at once, so a shard never reads half a list
+		const std::string tmp(m_lists[i] + ".tmp");
+		std::ofstream ofs(tmp.c_str());
+		for (size_t f(0); f < shares[i].size(); ++f) {
+			ofs << shares[i][f] << "\n";
+		}
+		ofs.close();
+		if (!ofs || rename(tmp.c_str(), m_lists[i].c_str()) != 0) {
+			throw std::runtime_error("couldn't write " + m_lists[i]);
+		}
+	}
+	for (size_t i(0); i < m_pids.size(); ++i) {
+		if (m_pids[i] > 0) {
+			kill(m_pids[i], SIGHUP);
+		} else {
+			start(i);
+		}
+	}
+}
+
+void shard_processes::start(size_t i)
+{
+	m_started[i] = now_usec();
+	const pid_t pid(fork());
+	if (pid < 0) {
+		std::cerr << "couldn't start shard " << i << ": " << strerror(errno) << std::endl;
+		return;
+	}
+	if (pid == 0) {
+		// we may have other threads: nothing but system calls until exec
+		prctl(PR_SET_PDEATHSIG, SIGTERM);
+		execl("/proc/self/exe", "searchd",
+			"-s", m_sockets[i].c_str(),
+			"-t", m_threads.c_str(),
+			"-f", m_lists[i].c_str(),
+			static_cast<char *>(NULL));
+		_exit(127);
+	}
+	m_pids[i] = pid;
+}
+
+void shard_processes::supervise()
+{
+	int status(0);
+	pid_t pid;
+	while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+		for (size_t i(0); i < m_pids.size(); ++i) {
+			if (m_pids[i] == pid) {
+				std::cerr << "shard " << i << " exited with status " << status
+				          << "; its results are partial until it's back" << std::endl;
+				m_pids[i] = 0;
+			}
+		}
+	}
+	for (size_t i(0); i < m_pids.size(); ++i) {
+		if (m_pids[i] == 0 && now_usec() - m_started[i] >= SHARD_RESTART_SEC * 1000000ULL) {
+			start(i);
+		}
+	}
+}
+
+int main(int argc, char *argv[])
+{
+	int port(DEFAULT_PORT);
+	size_t threads(get_cpus());
+	std::string docroot(".");
+	std::string list;
+	std::string socket_path;
+	size_t shards(0);
+	int opt;
+	while ((opt = getopt(argc, argv, "p:t:d:f:s:n:")) != -1) {
+		switch (opt) {
+		case 'p': port = atoi(optarg); break;
+		case 't': threads = atoi(optarg); break;
+		case 'd': docroot = optarg; break;
+		case 'f': list = optarg; break;
+		case 's': socket_path = optarg; break;
+		case 'n': shards = atoi(optarg); break;
+		default: usage(argv[0]); return 1;
+		}
+	}
+	if ((optind >= argc && list.empty()) || threads < 1 || (shards > 0 && !socket_path.empty())) {
+		usage(argv[0]);
+		return 1;
+	}
+	std::vector<std::string> args;
+	for (int i(optind); i < argc; i++) {
+		args.push_back(argv[i]);
+	}
+	int rc(0);
+	try {
+		signal(SIGPIPE, SIG_IGN);
+		signal(SIGINT, on_signal);
+		signal(SIGTERM, on_signal);
+		signal(SIGHUP, on_hangup);
+		const std::vector<std::string> filenames(index_filenames(args, list));
+		shard_processes *children(NULL);
+		std::vector<std::string> sockets;
+		if (shards > 0) {
+			// each shard gets its share of the cores, as well as the files
+			children = new shard_processes(shards, std::max<size_t>(1, threads / shards));
+			std::cout << "sharing " << filenames.size() << " index files between "
+			          << shards << " shards" << std::endl;
+			children->assign(filenames);
+			sockets = children->sockets();
+			shard_client probe(sockets);
+			std::vector<int> status;
+			std::vector<std::string> bodies;
+			while (RUNNING && probe.fan_out("/shard/complete/?count=0", status, bodies) < shards) {
+				children->supervise();
+				usleep(SHARD_READY_POLL_MS * 1000);
+			}
+			std::cout << "searching through " << shards << " shards" << std::endl;
+		} else {
+			std::cout << "parsing " << filenames.size() << " index files" << std::endl;
+			size_t indices(init_indices(filenames));
+			std::cout << "searching " << indices << " index files" << std::endl;
+		}
+		int listen_fd(socket_path.empty() ? listen_on(port) : listen_unix(socket_path));
+		std::vector<http_worker *> workers;
+		typedef std::vector<http_worker *>::iterator wit;
+		for (size_t i(0); i < threads; ++i) {
+			http_worker *w(new http_worker(listen_fd, docroot, sockets));
+			w->start();
+			workers.push_back(w);
+		}
+		if (socket_path.empty()) {
+			std::cout << "listening on port " << port;
+		} else {
+			std::cout << "listening on " << socket_path;
+		}
+		std::cout << " with " << threads << " workers" << std::endl;
+		while (RUNNING) {
+			if (RELOAD) {
+				RELOAD = 0;
+				if (children) {
+					try {
+						children->assign(index_filenames(args, list));
+						std::cout << "shards reloading" << std::endl;
+					} catch (const std::runtime_error& ex) {
+						std::cerr << "reload failed: " << ex.what() << std::endl;
+					}
+				} else {
+					reload(args, list);
+				}
+			}
+			if (children) {
+				children->supervise();
+			}
+			usleep(EPOLL_TIMEOUT_MS * 1000);
+		}
+		size_t requests(0);
+		for (wit it(workers.begin()); it != workers.end(); ++it) {
+			(*it)->join();
+			requests += (*it)->requests();
+			delete *it;
+		}
+		close(listen_fd);
+		if (!socket_path.empty()) {
+			unlink(socket_path.c_str());
+		}
+		delete children;
+		std::cout << "shutdown after " << requests << " requests" << std::endl;
+	} catch (const std::runtime_error& ex) {
+		std::cerr << ex.what() << std::endl;
+		rc = -1;
+	}
+	return rc;
+}
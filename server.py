@@ -1,6 +1,8 @@
-#!/usr/bin/env python2.7
+#!/usr/bin/env python3
 
-from BaseHTTPServer import BaseHTTPRequestHandler, HTTPServer
+from http.server import BaseHTTPRequestHandler, ThreadingHTTPServer
+from urllib.parse import unquote
+import json
 import indisk
 
 mock_results = """{
@@ -29,12 +31,12 @@ class MockHandler(BaseHTTPRequestHandler):
 			self.send_response(200)
 			self.send_header("Content-type", "application/json")
 			self.end_headers()
-			results = indisk.search(tokens[1].lower())
-			self.wfile.write(results)
+			results = indisk.search(unquote(tokens[1]))  # folded by indisk
+			self.wfile.write(json.dumps(results).encode("utf-8"))
 		else:
 			try:
 				filename = "/".join(tokens)
-				f = open(filename)
+				f = open(filename, "rb")
 				self.send_response(200)
 				self.send_header("Content-type", "text/html")
 				self.end_headers()
@@ -44,20 +46,21 @@ class MockHandler(BaseHTTPRequestHandler):
 				self.send_error(500, "Error loading file %s" % filename)
 
 def main(args):
+	server = None
 	try:
-		print "parsing %d index files" % len(args)
+		print("parsing %d index files" % len(args))
 		count = indisk.init(args)
-		print "searching %d index files" % count
-		server = HTTPServer(("", 8080), MockHandler)
+		print("searching %d index files" % count)
+		server = ThreadingHTTPServer(("", 8080), MockHandler)
 		server.serve_forever()
 	except KeyboardInterrupt:
-		print "shutdown"
-		server.socket.close()
+		print("shutdown")
+		if server:
+			server.socket.close()
 
 import sys
 if __name__ == "__main__":
 	if len(sys.argv) < 2:
-		print "usage: %s <idx> [<idx> ...]" % sys.argv[0]
+		print("usage: %s <idx> [<idx> ...]" % sys.argv[0])
 		sys.exit(1)
 	main(sys.argv[1:])
-
@@ -0,0 +1,419 @@
+#include <sstream>
+#include <stdexcept>
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include "shard.hh"
+#include "search.hh"
+
+extern "C" {
+	#include <unistd.h>
+	#include <fcntl.h>
+	#include <errno.h>
+	#include <sys/stat.h>
+	#include <sys/socket.h>
+	#include <poll.h>
+	#include <sys/un.h>
+}
+
+#define READ_CHUNK_SIZE 16384
+
+struct sized_file {
+	sized_file(size_t i, uint64_t size) : i(i), size(size) { }
+
+	bool operator<(const sized_file& rhs) const
+	{
+		return size > rhs.size || (size == rhs.size && i < rhs.i);
+	}
+
+	size_t i;
+	uint64_t size;
+};
+
+std::vector<std::vector<std::string> > partition_files(const std::vector<std::string>& filenames, size_t n)
+{
+	if (n == 0) {
+		throw std::runtime_error("partition_files needs at least one share");
+	}
+	// biggest first, each to the share with the least so far
+	std::vector<sized_file> files;
+	for (size_t i(0); i < filenames.size(); ++i) {
+		struct stat st;
+		files.push_back(sized_file(i, stat(filenames[i].c_str(), &st) == 0 ? st.st_size : 0));
+	}
+	std::sort(files.begin(), files.end());
+	std::vector<uint64_t> loads(n, 0);
+	std::vector<size_t> share(filenames.size());
+	typedef std::vector<sized_file>::const_iterator sfcit;
+	for (sfcit it(files.begin()); it != files.end(); ++it) {
+		const size_t s(std::min_element(loads.begin(), loads.end()) - loads.begin());
+		share[it->i] = s;
+		loads[s] += it->size;
+	}
+	std::vector<std::vector<std::string> > shares(n);
+	for (size_t i(0); i < filenames.size(); ++i) {
+		shares[share[i]].push_back(filenames[i]);
+	}
+	return shares;
+}
+
+std::string to_lines(const search_results& r)
+{
+	std::ostringstream oss;
+	oss << "hits " << r.total << "\n";
+	typedef std::vector<std::string>::const_iterator svcit;
+	for (svcit it(r.expanded.begin()); it != r.expanded.end(); ++it) {
+		oss << "expanded " << *it << "\n";
+	}
+	typedef std::vector<search_result>::const_iterator srcit;
+	for (srcit it(r.top.begin()); it != r.top.end(); ++it) {
+		oss << "top " << it->weight << " " << it->article << "\n";
+	}
+	if (!r.cursor.empty()) {
+		oss << "cursor " << r.cursor << "\n";
+	}
+	return oss.str();
+}
+
+std::string to_lines(const std::vector<completion>& completions)
+{
+	std::ostringstream oss;
+	typedef std::vector<completion>::const_iterator ccit;
+	for (ccit it(completions.begin()); it != completions.end(); ++it) {
+		oss << "completion " << it->frequency << " " << it->term << "\n";
+	}
+	return oss.str();
+}
+
+// Split "<keyword> <rest>"; and "<number> <rest>" too, if number.
+static void split_line(const std::string& line, std::string& keyword, size_t *number, std::string& rest)
+{
+	std::string::size_type space(line.find(' '));
+	if (space == std::string::npos) {
+		throw std::runtime_error("bad shard line: " + line);
+	}
+	keyword = line.substr(0, space);
+	rest = line.substr(space + 1);
+	if (number) {
+		space = rest.find(' ');
+		char *end(NULL);
+		*number = strtoul(rest.c_str(), &end, 10);
+		if (space == std::string::npos || end != rest.c_str() + space) {
+			throw std::runtime_error("bad shard line: " + line);
+		}
+		rest.erase(0, space + 1);
+	}
+}
+
+search_results results_from_lines(const std::string& lines)
+{
+	search_results r;
+	std::istringstream iss(lines);
+	std::string line, keyword, rest;
+	while (std::getline(iss, line)) {
+		size_t n(0);
+		split_line(line, keyword, line.compare(0, 4, "top ") == 0 ? &n : NULL, rest);
+		if (keyword == "hits") {
+			r.total = strtoul(rest.c_str(), NULL, 10);
+		} else if (keyword == "expanded") {
+			r.expanded.push_back(rest);
+		} else if (keyword == "top") {
+			r.top.push_back(search_result(rest, n));
+		} else if (keyword == "cursor") {
+			r.cursor = rest;
+		} else {
+			throw std::runtime_error("bad shard line: " + line);
+		}
+	}
+	return r;
+}
+
+std::vector<completion> completions_from_lines(const std::string& lines)
+{
+	std::vector<completion> completions;
+	std::istringstream iss(lines);
+	std::string line, keyword, rest;
+	while (std::getline(iss, line)) {
+		size_t n(0);
+		split_line(line, keyword, &n, rest);
+		if (keyword != "completion") {
+			throw std::runtime_error("bad shard line: " + line);
+		}
+		completions.push_back(completion(rest, n));
+	}
+	return completions;
+}
+
+shard_client::shard_client(const std::vector<std::string>& sockets)
+: m_sockets(sockets)
+, m_fds(sockets.size(), -1)
+{
+	//
+}
+
+shard_client::~shard_client()
+{
+	for (size_t i(0); i < m_fds.size(); ++i) {
+		disconnect(i);
+	}
+}
+
+size_t shard_client::fan_out(const std::string& path, std::vector<int>& status, std::vector<std::string>& bodies)
+{
+	const std::string request("GET " + path + " HTTP/1.1\r\nHost: shard\r\n\r\n");
+	status.assign(m_sockets.size(), 0);
+	bodies.assign(m_sockets.size(), "");
+	// every shard gets the request before any answer is waited for
+	std::vector<struct pollfd> waiting;
+	std::vector<size_t> shard; // of each waiting
+	for (size_t i(0); i < m_sockets.size(); ++i) {
+		if (send(i, request)) {
+			struct pollfd pfd;
+			pfd.fd = m_fds[i];
+			pfd.events = POLLIN;
+			pfd.revents = 0;
+			waiting.push_back(pfd);
+			shard.push_back(i);
+		}
+	}
+	// then all the answers are waited for together, however many shards
+	// are slow, and however slowly they send
+	std::vector<std::string> in(m_sockets.size());
+	const uint64_t deadline(now_usec() + SHARD_TIMEOUT_MS * 1000);
+	size_t answered(0);
+	while (!waiting.empty()) {
+		const uint64_t now(now_usec());
+		if (now >= deadline) {
+			break;
+		}
+		const int n(poll(&waiting[0], waiting.size(), (deadline - now + 999) / 1000));
+		if (n < 0 && errno == EINTR) {
+			continue;
+		}
+		if (n <= 0) {
+			break;
+		}
+		for (size_t w(0); w < waiting.size(); ) {
+			if (waiting[w].revents) {
+				const size_t i(shard[w]);
+				const int rc(receive(i, in[i], bodies[i]));
+				if (rc != 0) {
+					// answered, or gone
+					status[i] = rc > 0 ? rc : 0;
+					answered += rc > 0;
+					waiting.erase(waiting.begin() + w);
+					shard.erase(shard.begin() + w);
+					continue;
+				}
+			}
+			++w;
+		}
+	}
+	// an answer that comes later mustn't be taken for the next one's
+	for (size_t w(0); w < shard.size(); ++w) {
+		disconnect(shard[w]);
+	}
+	return answered;
+}
+
+bool shard_client::connect(size_t i)
+{
+	struct sockaddr_un addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	if (m_sockets[i].size() >= sizeof(addr.sun_path)) {
+		return false;
+	}
+	strcpy(addr.sun_path, m_sockets[i].c_str());
+	const int fd(socket(AF_UNIX, SOCK_STREAM, 0));
+	if (fd < 0) {
+		return false;
+	}
+	// not to be inherited by the shards the coordinator starts
+	fcntl(fd, F_SETFD, FD_CLOEXEC);
+	// nothing waits on one shard alone (see fan_out)
+	fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+	if (::connect(fd, reinterpret_cast<struct sockaddr *>(&addr), sizeof(addr)) != 0) {
+		close(fd);
+		return false;
+	}
+	m_fds[i] = fd;
+	return true;
+}
+
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0 // eg. Mac OS, where searchd doesn't build anyway
+#endif
+
+bool shard_client::send(size_t i, const std::string& request)
+{
+	// a connection from before the shard was restarted fails at once,
+	// so that gets one more try, on a new connection; a shard too busy
+	// to take a request this small is as good as gone
+	for (int attempt(0); attempt < 2; ++attempt) {
+		if (m_fds[i] < 0 && !connect(i)) {
+			return false;
+		}
+		size_t pos(0);
+		while (pos < request.size()) {
+			const ssize_t n(::send(m_fds[i], request.data() + pos, request.size() - pos, MSG_NOSIGNAL));
+			if (n < 0 && errno == EINTR) {
+				continue;
+			}
+			if (n <= 0) {
+				break;
+			}
+			pos += n;
+		}
+		if (pos == request.size()) {
+			return true;
+		}
+		disconnect(i);
+	}
+	return false;
+}
+
+int shard_client::receive(size_t i, std::string& in, std::string& body)
+{
+	static const std::string HEAD_END("\r\n\r\n"), LENGTH("\r\nContent-Length: ");
+	char buf[READ_CHUNK_SIZE];
+	while (true) {
+		const ssize_t n(read(m_fds[i], buf, sizeof(buf)));
+		if (n < 0 && errno == EINTR) {
+			continue;
+		}
+		if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+			break;
+		}
+		if (n <= 0) {
+			disconnect(i);
+			return -1;
+		}
+		in.append(buf, n);
+	}
+	const std::string::size_type head_end(in.find(HEAD_END));
+	if (head_end == std::string::npos) {
+		return 0;
+	}
+	const std::string::size_type l(in.find(LENGTH));
+	if (l == std::string::npos || l > head_end) {
+		disconnect(i);
+		return -1;
+	}
+	const size_t length(strtoul(in.c_str() + l + LENGTH.size(), NULL, 10));
+	if (in.size() < head_end + HEAD_END.size() + length) {
+		return 0;
+	}
+	const int status(atoi(in.c_str() + in.find(' ') + 1));
+	if (status <= 0) {
+		disconnect(i);
+		return -1;
+	}
+	body = in.substr(head_end + HEAD_END.size(), length);
+	return status;
+}
+
+void shard_client::disconnect(size_t i)
+{
+	if (m_fds[i] >= 0) {
+		close(m_fds[i]);
+		m_fds[i] = -1;
+	}
+}
+
+static std::string url_encode(const std::string& s)
+{
+	static const char *HEX("0123456789ABCDEF");
+	std::string out;
+	for (std::string::const_iterator it(s.begin()); it != s.end(); ++it) {
+		const unsigned char c(*it);
+		if ((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') ||
+				c == '-' || c == '_' || c == '.' || c == '*') {
+			out += c;
+		} else {
+			out += '%';
+			out += HEX[c >> 4];
+			out += HEX[c & 0xF];
+		}
+	}
+	return out;
+}
+
+// GET path from every shard: the bodies of those that answered. partial
+// is set if any didn't; a shard rejecting the request rejects it all.
+static std::vector<std::string> ask(shard_client& shards, const std::string& path, bool& partial)
+{
+	std::vector<int> status;
+	std::vector<std::string> bodies, answers;
+	shards.fan_out(path, status, bodies);
+	for (size_t i(0); i < shards.size(); ++i) {
+		if (status[i] == 0) {
+			partial = true;
+		} else if (status[i] != 200) {
+			// the error message is the body's first line
+			throw std::runtime_error(bodies[i].substr(0, bodies[i].find('\n')));
+		} else {
+			answers.push_back(bodies[i]);
+		}
+	}
+	return answers;
+}
+
+static std::vector<search_results> ask_results(shard_client& shards, const std::string& path, bool& partial)
+{
+	const std::vector<std::string> answers(ask(shards, path, partial));
+	std::vector<search_results> parts;
+	for (size_t i(0); i < answers.size(); ++i) {
+		parts.push_back(results_from_lines(answers[i]));
+	}
+	return parts;
+}
+
+search_results search_shards(shard_client& shards, const std::string& term, size_t fuzzy)
+{
+	const std::string path("/shard/query/" + url_encode(term));
+	bool partial(false);
+	search_results r(merge_results(ask_results(shards, path, partial)));
+	// only if no shard has the term itself
+	if (r.total == 0 && fuzzy > 0 && term.find('*') == std::string::npos) {
+		std::ostringstream oss;
+		oss << path << "?fuzzy=" << fuzzy;
+		r = merge_results(ask_results(shards, oss.str(), partial));
+	}
+	r.partial = r.partial || partial;
+	return r;
+}
+
+search_results search_shards_page(
+		shard_client& shards,
+		const std::string& term,
+		const std::string& cursor,
+		size_t count)
+{
+	std::ostringstream oss;
+	oss << "/shard/query/" << url_encode(term) << "?count=" << count;
+	if (!cursor.empty()) {
+		oss << "&cursor=" << url_encode(cursor);
+	}
+	bool partial(false);
+	search_results r(merge_pages(ask_results(shards, oss.str(), partial), cursor, count));
+	r.partial = r.partial || partial;
+	return r;
+}
+
+std::vector<completion> complete_shards(
+		shard_client& shards,
+		const std::string& prefix,
+		size_t n,
+		bool& partial)
+{
+	std::ostringstream oss;
+	oss << "/shard/complete/" << url_encode(prefix) << "?count=" << n * SHARD_COMPLETION_FETCH;
+	partial = false;
+	const std::vector<std::string> answers(ask(shards, oss.str(), partial));
+	std::vector<std::vector<completion> > parts;
+	for (size_t i(0); i < answers.size(); ++i) {
+		parts.push_back(completions_from_lines(answers[i]));
+	}
+	return merge_completions(parts, n);
+}
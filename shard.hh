@@ -0,0 +1,99 @@
+#ifndef SHARD_HH_
+#define SHARD_HH_
+
+#include <string>
+#include <vector>
+#include "def.hh"
+#include "dict.hh"
+#include "thread.hh"
+
+// Serving one index set from several local processes, or shards, each
+// of which loads only its share of the index files, so no one process
+// needs every file's dictionary and titles in memory. A coordinator fans
+// each query out to all the shards at once and merges what they find
+// (see merge_results); a shard that doesn't answer, because it's being
+// restarted say, leaves the results marked partial.
+//
+// The shards are searchd processes listening on Unix sockets (searchd -s),
+// and the coordinator is searchd -n, which starts them. They speak HTTP,
+// over connections kept alive between queries, but for /shard/query/ and
+// /shard/complete/ results are passed in a line format which is simpler
+// to parse than JSON:
+//
+//   hits <total>
+//   expanded <term>
+//   top <weight> <article>
+//   cursor <cursor>
+//   completion <frequency> <term>
+//
+// Articles and terms never contain newlines.
+
+// How long to wait for the shards' answers before giving up on those
+// still to answer.
+#define SHARD_TIMEOUT_MS 2000
+
+// Each shard is asked for this many times the completions wanted.
+#define SHARD_COMPLETION_FETCH 4
+
+// Split the index files into n shares of about equal size on disk.
+std::vector<std::vector<std::string> > partition_files(const std::vector<std::string>& filenames, size_t n);
+
+std::string to_lines(const search_results& r);
+std::string to_lines(const std::vector<completion>& completions);
+// Throw std::runtime_error for a malformed line.
+search_results results_from_lines(const std::string& lines);
+std::vector<completion> completions_from_lines(const std::string& lines);
+
+// Connections to every shard, for one thread at a time. A connection is
+// made when it's first needed, and made again after a shard restarts.
+class shard_client : private noncopyable
+{
+public:
+	explicit shard_client(const std::vector<std::string>& sockets);
+	~shard_client();
+
+	// GET path from every shard at once, waiting at most
+	// SHARD_TIMEOUT_MS in all for their answers. status[i] is shard i's
+	// HTTP status, and bodies[i] its response, or 0 if it didn't answer
+	// in time. Returns how many shards answered.
+	size_t fan_out(const std::string& path, std::vector<int>& status, std::vector<std::string>& bodies);
+
+	size_t size() const { return m_sockets.size(); }
+
+private:
+	bool connect(size_t i);
+	bool send(size_t i, const std::string& request);
+	// Read what shard i has sent of its answer into in: its status,
+	// with the body in body, once all of it is there; 0 until then;
+	// -1 if the shard went away or sent something malformed.
+	int receive(size_t i, std::string& in, std::string& body);
+	void disconnect(size_t i);
+
+	std::vector<std::string> m_sockets;
+	std::vector<int> m_fds;
+};
+
+// A search through all the shards, as search_indices would give it
+// with all their files (but fuzzy and wildcard terms are expanded by
+// each shard, from its own vocabulary, and merged), or one page of it,
+// as search_page would. Throws std::runtime_error if a shard rejects
+// the query, eg. for a malformed cursor.
+search_results search_shards(shard_client& shards, const std::string& term, size_t fuzzy=0);
+search_results search_shards_page(
+		shard_client& shards,
+		const std::string& term,
+		const std::string& cursor,
+		size_t count);
+
+// Completions from all the shards; from those that answered, that is,
+// and partial is set if any didn't. A term's frequency is the sum of its
+// frequencies in the shards which have it among their top completions,
+// so each is asked for more than n, to make it less likely that one of
+// them leaves a term out.
+std::vector<completion> complete_shards(
+		shard_client& shards,
+		const std::string& prefix,
+		size_t n,
+		bool& partial);
+
+#endif
@@ -0,0 +1,263 @@
+#include <fstream>
+#include <stdexcept>
+#include <cstdio>
+#include "termdict.hh"
+
+extern "C" {
+	#include <unistd.h>
+}
+
+template<typename T>
+static void read(std::ifstream& ifs, T& t)
+{
+	ifs.read(reinterpret_cast<char *>(&t), sizeof(T));
+}
+
+// The top bits of the hash pick the shard, the bottom bits the slot.
+static uint64_t term_hash(const std::string& term)
+{
+	return hash_bytes(term.data(), term.size());
+}
+
+term_dictionary::entry::entry(const std::string& term, uint64_t hash, uint32_t id)
+: term(term)
+, hash(hash)
+, id(id)
+{
+	//
+}
+
+term_dictionary::table::table(size_t slots)
+: mask(slots - 1)
+, slots(new entry *[slots]())
+{
+	//
+}
+
+term_dictionary::table::~table()
+{
+	delete [] slots;
+}
+
+term_dictionary::shard::shard()
+: current(new table(TERM_DICTIONARY_SHARD_SLOTS))
+, used(0)
+{
+	pthread_mutex_init(&mutex, NULL);
+}
+
+term_dictionary::shard::~shard()
+{
+	for (size_t i(0); i <= current->mask; ++i) {
+		delete current->slots[i];
+	}
+	delete current;
+	for (size_t i(0); i < retired.size(); ++i) {
+		delete retired[i];
+	}
+	pthread_mutex_destroy(&mutex);
+}
+
+term_dictionary::term_dictionary(const std::string& filename, bool resume)
+: m_filename(filename)
+, m_shards(new shard[TERM_DICTIONARY_SHARDS])
+, m_last_id(0)
+{
+	pthread_mutex_init(&m_id_mutex, NULL);
+	pthread_mutex_init(&m_sync_mutex, NULL);
+	if (resume && access(filename.c_str(), F_OK) == 0) {
+		str_id_map m;
+		const uint64_t length(read_dictionary(filename, m));
+		if (truncate(filename.c_str(), length) != 0) {
+			throw std::runtime_error("failed to truncate " + filename);
+		}
+		typedef str_id_map::const_iterator sidcit;
+		for (sidcit it(m.begin()); it != m.end(); ++it) {
+			const uint64_t h(term_hash(it->first));
+			shard& s(shard_for(h));
+			scoped_lock sync(s.mutex);
+			insert(s, it->first, h, it->second);
+		}
+	} else {
+		FILE *f(fopen(filename.c_str(), "wb"));
+		if (!f) {
+			throw std::runtime_error("failed to create " + filename);
+		}
+		fclose(f);
+	}
+}
+
+term_dictionary::~term_dictionary()
+{
+	delete [] m_shards;
+	pthread_mutex_destroy(&m_id_mutex);
+	pthread_mutex_destroy(&m_sync_mutex);
+}
+
+term_dictionary::entry *term_dictionary::probe(const table& t, const std::string& term, uint64_t hash)
+{
+	for (size_t i(hash & t.mask); ; i = (i + 1) & t.mask) {
+		entry *e(__atomic_load_n(&t.slots[i], __ATOMIC_ACQUIRE));
+		if (!e || (e->hash == hash && e->term == term)) {
+			return e;
+		}
+	}
+}
+
+term_dictionary::shard& term_dictionary::shard_for(uint64_t hash) const
+{
+	return m_shards[hash >> 58]; // 64 shards
+}
+
+uint32_t term_dictionary::intern(const std::string& term)
+{
+	const uint64_t h(term_hash(term));
+	shard& s(shard_for(h));
+	const entry *e(probe(*__atomic_load_n(&s.current, __ATOMIC_ACQUIRE), term, h));
+	if (e) {
+		return e->id;
+	}
+	scoped_lock sync(s.mutex);
+	return insert(s, term, h, 0);
+}
+
+uint32_t term_dictionary::find(const std::string& term) const
+{
+	const uint64_t h(term_hash(term));
+	const shard& s(shard_for(h));
+	const entry *e(probe(*__atomic_load_n(&s.current, __ATOMIC_ACQUIRE), term, h));
+	return e ? e->id : 0;
+}
+
+size_t term_dictionary::size() const
+{
+	size_t n(0);
+	for (size_t i(0); i < TERM_DICTIONARY_SHARDS; ++i) {
+		scoped_lock sync(m_shards[i].mutex);
+		n += m_shards[i].used;
+	}
+	return n;
+}
+
+std::string term_dictionary::term(uint32_t id) const
+{
+	scoped_lock sync(m_id_mutex);
+	return id < m_by_id.size() && m_by_id[id] ? m_by_id[id]->term : std::string();
+}
+
+uint32_t term_dictionary::insert(shard& s, const std::string& term, uint64_t hash, uint32_t id)
+{
+	// someone else may have got here first
+	const entry *found(probe(*s.current, term, hash));
+	if (found) {
+		return found->id;
+	}
+	if ((s.used + 1) * 2 > s.current->mask + 1) {
+		table *bigger(new table((s.current->mask + 1) * 2));
+		for (size_t i(0); i <= s.current->mask; ++i) {
+			entry *e(s.current->slots[i]);
+			if (e) {
+				size_t j(e->hash & bigger->mask);
+				while (bigger->slots[j]) {
+					j = (j + 1) & bigger->mask;
+				}
+				bigger->slots[j] = e;
+			}
+		}
+		s.retired.push_back(s.current);
+		__atomic_store_n(&s.current, bigger, __ATOMIC_RELEASE);
+	}
+	entry *e(NULL);
+	{
+		// queued for sync() before anyone can find it, so an ID is on
+		// disk by the time any index file using it is
+		scoped_lock sync(m_id_mutex);
+		if (id == 0) {
+			if (m_last_id == UINT32_MAX - 1) {
+				abort();
+			}
+			id = ++m_last_id;
+			e = new entry(term, hash, id);
+			m_unsynced.push_back(e);
+		} else {
+			m_last_id = std::max(m_last_id, id);
+			e = new entry(term, hash, id);
+		}
+		if (id >= m_by_id.size()) {
+			m_by_id.resize(id + 1, NULL);
+		}
+		m_by_id[id] = e;
+	}
+	size_t i(hash & s.current->mask);
+	while (s.current->slots[i]) {
+		i = (i + 1) & s.current->mask;
+	}
+	__atomic_store_n(&s.current->slots[i], e, __ATOMIC_RELEASE);
+	s.used++;
+	return id;
+}
+
+void term_dictionary::sync()
+{
+	scoped_lock sync(m_sync_mutex);
+	std::vector<const entry *> pending;
+	{
+		scoped_lock ids(m_id_mutex);
+		pending.swap(m_unsynced);
+	}
+	if (pending.empty()) {
+		return;
+	}
+	FILE *f(fopen(m_filename.c_str(), "ab"));
+	if (!f) {
+		throw std::runtime_error("failed to open " + m_filename);
+	}
+	bool ok(true);
+	typedef std::vector<const entry *>::const_iterator ecit;
+	for (ecit it(pending.begin()); ok && it != pending.end(); ++it) {
+		ok = fwrite(&(*it)->id, sizeof(uint32_t), 1, f) == 1 &&
+			fwrite((*it)->term.data(), 1, (*it)->term.size(), f) == (*it)->term.size() &&
+			fputc('\n', f) != EOF;
+	}
+	ok = ok && fflush(f) == 0 && fsync(fileno(f)) == 0;
+	fclose(f);
+	if (!ok) {
+		throw std::runtime_error("failed to write " + m_filename);
+	}
+}
+
+uint64_t read_dictionary(const std::string& filename, dictionary_func f, void *arg)
+{
+	// <uint32_t term ID> <term> '\n'
+	//  . . .
+	std::ifstream ifs(filename.c_str(), std::ios::binary);
+	if (!ifs.good()) {
+		throw std::runtime_error("bad term dictionary " + filename);
+	}
+	uint64_t length(0);
+	std::string term;
+	while (true) {
+		uint32_t termid(0);
+		read<uint32_t>(ifs, termid);
+		std::getline(ifs, term);
+		if (ifs.eof() || !ifs.good()) {
+			break; // the end, or a torn entry
+		}
+		if (termid == 0 || term.empty()) {
+			throw std::runtime_error("bad entry in term dictionary " + filename);
+		}
+		f(termid, term, arg);
+		length += sizeof(uint32_t) + term.size() + 1;
+	}
+	return length;
+}
+
+static void add_to_map(uint32_t termid, const std::string& term, void *arg)
+{
+	(*reinterpret_cast<str_id_map *>(arg))[term] = termid;
+}
+
+uint64_t read_dictionary(const std::string& filename, str_id_map& m)
+{
+	return read_dictionary(filename, add_to_map, &m);
+}
@@ -0,0 +1,108 @@
+#ifndef TERMDICT_HH_
+#define TERMDICT_HH_
+
+#include <string>
+#include <vector>
+#include <stdint.h>
+#include "def.hh"
+#include "thread.hh"
+
+// A term_dictionary gives every term a global ID, shared by all the
+// indexing threads of a run, so index files can refer to terms by ID
+// alone and the vocabulary is written once, to <basename>.dict, rather
+// than in the header of every index file.
+//
+// Terms are spread over TERM_DICTIONARY_SHARDS open-addressing tables
+// by hash. Looking up a term that's already known takes no locks: slots
+// are only ever filled in, with entries that never change, and a table
+// outgrowing its slots is replaced by a bigger copy (the old one is
+// kept until the dictionary goes away, for threads still probing it).
+// Only a term's first appearance takes its shard's lock.
+//
+// On disk, entries are appended as
+// <uint32 term ID> <term as text> '\n'
+// in no particular order. An index_st calls sync() before its file is
+// complete, so every ID in a finished index file is in the dictionary.
+
+#define TERM_DICTIONARY_SUFFIX ".dict"
+#define TERM_DICTIONARY_SHARDS 64
+#define TERM_DICTIONARY_SHARD_SLOTS 4096 // initially; kept at most half full
+
+class term_dictionary : private noncopyable
+{
+public:
+	// With resume, the entries already in filename are loaded (and an
+	// incomplete last one cut off) and new ones appended after them;
+	// otherwise the file is truncated.
+	term_dictionary(const std::string& filename, bool resume=false);
+	~term_dictionary();
+
+	// The ID of term, assigning the next one if it's new.
+	uint32_t intern(const std::string& term);
+
+	// The ID of term, or 0 if it has none.
+	uint32_t find(const std::string& term) const;
+
+	// Number of terms.
+	size_t size() const;
+	
+	// The term with ID id, or "" if there's none.
+	std::string term(uint32_t id) const;
+
+	// Append the terms interned since the last sync to the file,
+	// and sync it to disk.
+	void sync();
+
+	const std::string& filename() const { return m_filename; }
+
+private:
+	struct entry {
+		entry(const std::string& term, uint64_t hash, uint32_t id);
+		const std::string term;
+		const uint64_t hash;
+		const uint32_t id;
+	};
+
+	struct table {
+		explicit table(size_t slots);
+		~table();
+		const size_t mask;
+		entry **slots;
+	};
+
+	struct shard {
+		shard();
+		~shard();
+		pthread_mutex_t mutex;
+		table *current;
+		size_t used;
+		std::vector<table *> retired;
+	};
+
+	static entry *probe(const table& t, const std::string& term, uint64_t hash);
+	shard& shard_for(uint64_t hash) const;
+
+	// Under the shard's lock. An id of 0 assigns the next one.
+	uint32_t insert(shard& s, const std::string& term, uint64_t hash, uint32_t id);
+
+	const std::string m_filename;
+	shard *m_shards;
+
+	mutable pthread_mutex_t m_id_mutex; // for the three below
+	uint32_t m_last_id;
+	std::vector<const entry *> m_unsynced;
+	std::vector<const entry *> m_by_id;
+
+	pthread_mutex_t m_sync_mutex; // one sync at a time, in order
+};
+
+// Read the entries of a dictionary file, passing each to f. Returns the
+// length of the complete entries at the start of the file; anything
+// after that is a torn append. Throws if the file can't be read.
+typedef void (*dictionary_func)(uint32_t termid, const std::string& term, void *arg);
+uint64_t read_dictionary(const std::string& filename, dictionary_func f, void *arg);
+
+// The same, into m (term to ID).
+uint64_t read_dictionary(const std::string& filename, str_id_map& m);
+
+#endif
@@ -0,0 +1,223 @@
+#include <iostream>
+#include <stdexcept>
+#include <sstream>
+#include <fstream>
+#include <iterator>
+#include <algorithm>
+#include <set>
+#include "bz2.hh"
+#include "idx.hh"
+#include "tombstone.hh"
+#include "ensure.hh"
+
+static std::string read_file(const std::string& filename)
+{
+	std::ifstream ifs(filename.c_str(), std::ios::binary);
+	return std::string(std::istreambuf_iterator<char>(ifs), std::istreambuf_iterator<char>());
+}
+
+// Write pieces as consecutive bzip2 streams, returning where each starts.
+static std::vector<uint64_t> write_multistream(const std::string& filename, const std::vector<std::string>& pieces)
+{
+	std::ofstream ofs(filename.c_str(), std::ios::binary);
+	std::vector<uint64_t> offsets;
+	uint64_t offset(0);
+	for (size_t i(0); i < pieces.size(); ++i) {
+		std::string piece(pieces[i]);
+		std::vector<char> out(piece.size() + piece.size() / 100 + 600);
+		unsigned int len(out.size());
+		ENSURE(BZ2_bzBuffToBuffCompress(&out[0], &len, &piece[0], piece.size(), 9, 0, 0) == BZ_OK);
+		ofs.write(&out[0], len);
+		offsets.push_back(offset);
+		offset += len;
+	}
+	return offsets;
+}
+
+// short.xml split before every page, as Wikimedia's dumps are
+static std::vector<std::string> split_at_pages(const std::string& xml)
+{
+	std::vector<std::string> pieces;
+	std::string::size_type begin(0), pos(0);
+	while ((pos = xml.find("<page>", pos + 1)) != std::string::npos) {
+		pieces.push_back(xml.substr(begin, pos - begin));
+		begin = pos;
+	}
+	pieces.push_back(xml.substr(begin));
+	return pieces;
+}
+
+// short.xml split every n bytes, pages straddling streams
+static std::vector<std::string> split_every(const std::string& xml, size_t n)
+{
+	std::vector<std::string> pieces;
+	for (size_t i(0); i < xml.size(); i += n) {
+		pieces.push_back(xml.substr(i, n));
+	}
+	return pieces;
+}
+
+static std::set<std::string> titles(const std::string& basename, size_t threads)
+{
+	std::set<std::string> s;
+	for (size_t i(0); i < threads; ++i) {
+		std::ostringstream oss;
+		oss << basename << '.' << i << ".1";
+		std::vector<aid_title> t(read_titles(oss.str()));
+		for (size_t j(0); j < t.size(); ++j) {
+			ENSURE(s.insert(t[j].second).second); // indexed only once
+		}
+	}
+	return s;
+}
+
+// Index filename with one idx_thread per region, as the indexer does.
+static std::set<std::string> index_regions(const std::string& filename, const std::vector<region>& regions)
+{
+	for (size_t i(0); i < regions.size(); ++i) {
+		std::ostringstream oss;
+		oss << "tmp.bz2idx." << i;
+		idx_thread t(filename, regions[i], oss.str());
+		t.start();
+		t.join();
+	}
+	return titles("tmp.bz2idx", regions.size());
+}
+
+void test_decode()
+{
+	const std::string xml(read_file("data/short.xml"));
+	const std::vector<std::string> pieces(split_at_pages(xml));
+	ENSURE(pieces.size() == 6);
+	const std::vector<uint64_t> offsets(write_multistream("tmp.xml.bz2", pieces));
+	ENSURE(is_bz2("tmp.xml.bz2"));
+	ENSURE(!is_bz2("data/short.xml"));
+
+	// reads stop at every stream end, and know where the next one starts
+	bz2_decoder dec("tmp.xml.bz2");
+	std::string out;
+	for (size_t i(0); i < pieces.size(); ++i) {
+		const size_t before(out.size());
+		while (!dec.at_stream_end() || out.size() == before) {
+			dec.read(out, 1024);
+		}
+		ENSURE(out.substr(before) == pieces[i]);
+		ENSURE(i + 1 == pieces.size() ? dec.eof() : dec.offset() == offsets[i+1]);
+	}
+	ENSURE(out == xml);
+
+	// from the middle
+	bz2_decoder mid("tmp.xml.bz2", offsets[3]);
+	out.clear();
+	while (!mid.eof()) {
+		mid.read(out, BZ2_CHUNK_SIZE);
+	}
+	ENSURE(out == pieces[3] + pieces[4] + pieces[5]);
+
+	// a truncated stream is an error, not an early end
+	const std::string whole(read_file("tmp.xml.bz2"));
+	{
+		std::ofstream ofs("tmp.trunc.bz2", std::ios::binary);
+		ofs << whole.substr(0, whole.size() - 10);
+	}
+	bz2_decoder trunc("tmp.trunc.bz2");
+	bool threw(false);
+	try {
+		while (!trunc.eof()) {
+			trunc.read(out, BZ2_CHUNK_SIZE);
+		}
+	} catch (const std::runtime_error& ex) {
+		threw = true;
+	}
+	ENSURE(threw);
+
+	system("rm tmp.xml.bz2 tmp.trunc.bz2");
+}
+
+void test_regionize()
+{
+	const std::string xml(read_file("data/short.xml"));
+	const std::vector<uint64_t> offsets(write_multistream("tmp.xml.bz2", split_at_pages(xml)));
+
+	// by scanning for stream headers
+	std::vector<region> regions(regionize_bz2("tmp.xml.bz2", 3));
+	ENSURE(regions.size() == 3);
+	for (size_t i(0); i < regions.size(); ++i) {
+		const uint64_t begin(regions[i].begin);
+		ENSURE(std::find(offsets.begin(), offsets.end(), begin) != offsets.end());
+		ENSURE(i == 0 || regions[i].begin == regions[i-1].end);
+	}
+	ENSURE(regions.back().end == static_cast<stream_pos>(read_file("tmp.xml.bz2").size()));
+
+	// from an index, which may list a stream once per page in it
+	{
+		std::ofstream ofs("tmp.index.txt");
+		for (size_t i(1); i < offsets.size(); ++i) {
+			ofs << offsets[i] << ":" << i << ":Page " << i << "\n";
+			ofs << offsets[i] << ":" << i + 100 << ":Page " << i + 100 << "\n";
+		}
+	}
+	std::vector<uint64_t> indexed(bz2_index_offsets("tmp.index.txt"));
+	ENSURE(indexed == std::vector<uint64_t>(offsets.begin() + 1, offsets.end()));
+	std::vector<region> from_index(regionize_bz2("tmp.xml.bz2", 3, "tmp.index.txt"));
+	ENSURE(from_index.size() == regions.size());
+	for (size_t i(0); i < regions.size(); ++i) {
+		ENSURE(from_index[i].begin == regions[i].begin);
+	}
+
+	// a single stream can't be split
+	write_multistream("tmp.single.bz2", std::vector<std::string>(1, xml));
+	ENSURE(regionize_bz2("tmp.single.bz2", 4).size() == 1);
+
+	system("rm tmp.xml.bz2 tmp.single.bz2 tmp.index.txt");
+}
+
+void test_index()
+{
+	const std::string xml(read_file("data/short.xml"));
+	std::set<std::string> expected;
+	{
+		index_st idx_st("tmp.plain");
+		stream s("data/short.xml", region(0, 0));
+		while (index_article(s, idx_st) != END_OF_REGION) {
+			//
+		}
+		idx_st.flush(true);
+		std::vector<aid_title> t(read_titles("tmp.plain.1"));
+		for (size_t i(0); i < t.size(); ++i) {
+			expected.insert(t[i].second);
+		}
+	}
+	ENSURE(expected.size() == 5);
+
+	// pages aligned to streams
+	write_multistream("tmp.xml.bz2", split_at_pages(xml));
+	for (size_t n(1); n <= 4; ++n) {
+		ENSURE(index_regions("tmp.xml.bz2", regionize_bz2("tmp.xml.bz2", n)) == expected);
+		system("rm -f tmp.bz2idx.*");
+	}
+
+	// pages straddling streams and regions
+	write_multistream("tmp.xml.bz2", split_every(xml, 1000));
+	for (size_t n(1); n <= 8; ++n) {
+		ENSURE(index_regions("tmp.xml.bz2", regionize_bz2("tmp.xml.bz2", n)) == expected);
+		system("rm -f tmp.bz2idx.*");
+	}
+
+	system("rm tmp.xml.bz2 tmp.plain*");
+}
+
+int main()
+{
+	int rc(0);
+	try {
+		test_decode();
+		test_regionize();
+		test_index();
+		std::cout << "success" << std::endl;
+	} catch (const std::runtime_error& ex) {
+		std::cerr << ex.what() << std::endl;
+		rc = -1;
+	}
+	return rc;
+}
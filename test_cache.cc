@@ -0,0 +1,80 @@
+#include <iostream>
+#include <stdexcept>
+#include <sstream>
+#include "cache.hh"
+#include "ensure.hh"
+
+static id_vector block_of(size_t n, uint32_t aid)
+{
+	return id_vector(n, aid);
+}
+
+void test_hit_and_miss()
+{
+	postings_cache c(1024 * 1024);
+	id_vector dst;
+	ENSURE(!c.get(block_key(1, 0), dst));
+	c.put(block_key(1, 0), block_of(3, 7));
+	ENSURE(c.get(block_key(1, 0), dst));
+	ENSURE(dst.size() == 3 && dst.at(0) == 7);
+	ENSURE(c.get(block_key(1, 0), dst)); // appends
+	ENSURE(dst.size() == 6);
+	ENSURE(!c.get(block_key(2, 0), dst));
+	ENSURE(c.stats().hits == 2);
+	ENSURE(c.stats().misses == 2);
+	c.purge(1);
+	ENSURE(!c.get(block_key(1, 0), dst));
+	ENSURE(c.stats().blocks == 0);
+	ENSURE(c.stats().bytes == 0);
+}
+
+void test_budget()
+{
+	// room for ~10 blocks of 64 IDs
+	const size_t block_cost(64 * sizeof(uint32_t) + CACHE_ENTRY_OVERHEAD);
+	postings_cache c(block_cost * 10);
+	for (uint32_t i(0); i < 100; ++i) {
+		c.put(block_key(1, i), block_of(64, i+1));
+		ENSURE(c.stats().bytes <= c.budget());
+	}
+	ENSURE(c.stats().blocks == 10);
+	ENSURE(c.stats().evictions == 90);
+	c.set_budget(0);
+	ENSURE(c.stats().blocks == 0);
+	c.put(block_key(1, 0), block_of(64, 1));
+	ENSURE(c.stats().blocks == 0);
+}
+
+void test_scan_resistance()
+{
+	const size_t block_cost(64 * sizeof(uint32_t) + CACHE_ENTRY_OVERHEAD);
+	postings_cache c(block_cost * 10);
+	id_vector dst;
+	// a few hot blocks, hit twice so they're protected
+	for (uint32_t i(0); i < 4; ++i) {
+		c.put(block_key(1, i), block_of(64, i+1));
+		ENSURE(c.get(block_key(1, i), dst));
+	}
+	// a long scan of one-off blocks
+	for (uint32_t i(100); i < 1000; ++i) {
+		c.put(block_key(2, i), block_of(64, i));
+	}
+	for (uint32_t i(0); i < 4; ++i) {
+		ENSURE(c.get(block_key(1, i), dst));
+	}
+}
+
+int main()
+{
+	int rc(0);
+	try {
+		test_hit_and_miss();
+		test_budget();
+		test_scan_resistance();
+		std::cout << "success" << std::endl;
+	} catch (const std::runtime_error& ex) {
+		std::cerr << ex.what() << std::endl;
+		rc = -1;
+	}
+	return rc;
+}
@@ -0,0 +1,128 @@
+#include <iostream>
+#include <stdexcept>
+#include <sstream>
+#include <algorithm>
+#include <cstdlib>
+#include "fold.hh"
+#include "idx.hh"
+#include "ensure.hh"
+
+void test_ascii_run()
+{
+	// every byte value, at every offset into a vector
+	for (int b(0); b < 256; ++b) {
+		for (size_t at(0); at < 40; ++at) {
+			std::string buf(40, 'Q');
+			buf[at] = static_cast<char>(b);
+			std::string simd, scalar;
+			const size_t n(fold_ascii_run(buf.data(), buf.size(), simd));
+			ENSURE(n == fold_ascii_run_scalar(buf.data(), buf.size(), scalar));
+			ENSURE(simd == scalar);
+			const bool term_byte((b >= '0' && b <= '9') || (b >= 'A' && b <= 'Z') || (b >= 'a' && b <= 'z'));
+			ENSURE(n == (term_byte ? buf.size() : at));
+		}
+	}
+	// random text, lengths and alignments
+	static const char ALPHABET[] = "abcXYZ019 .,[]{}<&|\x03\xc3\xa9";
+	unsigned int seed(1);
+	for (size_t i(0); i < 10000; ++i) {
+		std::string buf(rand_r(&seed) % 80, ' ');
+		for (size_t j(0); j < buf.size(); ++j) {
+			buf[j] = ALPHABET[rand_r(&seed) % (sizeof(ALPHABET) - 1)];
+		}
+		const size_t from(buf.empty() ? 0 : rand_r(&seed) % buf.size());
+		std::string simd("prefix"), scalar("prefix");
+		ENSURE(fold_ascii_run(buf.data() + from, buf.size() - from, simd) ==
+			fold_ascii_run_scalar(buf.data() + from, buf.size() - from, scalar));
+		ENSURE(simd == scalar);
+	}
+}
+
+void test_utf8()
+{
+	ENSURE(fold_case("APRIL") == "april");
+	ENSURE(fold_case("\xc3\x89" "COLE") == "\xc3\xa9" "cole"); // École
+	ENSURE(fold_case("\xc3\x97") == "\xc3\x97"); // the multiplication sign has no case
+	ENSURE(fold_case("\xc5\x81\xc3\x93\xc4\x8e\xc5\xb9") == "\xc5\x82\xc3\xb3\xc4\x8f\xc5\xba"); // ŁÓĎŹ
+	ENSURE(fold_case("\xce\x91\xce\x98\xce\x97\xce\x9d\xce\x91") == "\xce\xb1\xce\xb8\xce\xb7\xce\xbd\xce\xb1"); // ΑΘΗΝΑ
+	ENSURE(fold_case("\xd0\x9c\xd0\x9e\xd0\xa1\xd0\x9a\xd0\x92\xd0\x90") == "\xd0\xbc\xd0\xbe\xd1\x81\xd0\xba\xd0\xb2\xd0\xb0"); // МОСКВА
+	ENSURE(fold_case("\xd0\x81") == "\xd1\x91"); // Ё
+	ENSURE(fold_case("\xe4\xb8\xad\xe6\x96\x87") == "\xe4\xb8\xad\xe6\x96\x87"); // no case in CJK
+	ENSURE(fold_case("\xef\xbc\xa1") == "\xef\xbd\x81"); // fullwidth A
+	ENSURE(fold_case("\xf0\x9f\x98\x80") == "\xf0\x9f\x98\x80"); // 4 bytes
+	// malformed: passed through a byte at a time
+	ENSURE(fold_case("A\xc3") == "a\xc3"); // truncated
+	ENSURE(fold_case("\xc0\xafX") == "\xc0\xafx"); // overlong
+	ENSURE(fold_case("\x80\xbfZ") == "\x80\xbfz"); // stray continuations
+	ENSURE(fold_case("\xed\xa0\x80") == "\xed\xa0\x80"); // surrogate
+	std::string term;
+	ENSURE(fold_utf8("\xc3\x89X", 3, term) == 2 && term == "\xc3\xa9");
+}
+
+static std::vector<std::string> terms_of(const std::string& text)
+{
+	std::vector<std::string> terms;
+	tokenize(text.data(), text.size(), terms);
+	return terms;
+}
+
+void test_tokenize()
+{
+	std::vector<std::string> t(terms_of("The QUICK brown fox's {{Infobox|x=1}} [[Link target|Shown Words]] "
+		"&lt;ref&gt;cite&lt;/ref&gt; [http://example.com Example] end."));
+	const char *expected[] = { "quick", "brown", "foxs", "words", "example", "end" };
+	ENSURE(t == std::vector<std::string>(expected, expected + sizeof(expected) / sizeof(*expected)));
+
+	t = terms_of("\xc3\x89" "cole Normale \xd0\x9c\xd0\x9e\xd0\xa1\xd0\x9a\xd0\x92\xd0\x90 [[X|\xc3\x9c" "BER]] na\xc3\xafve.");
+	const char *folded[] = {
+		"\xc3\xa9" "cole", "normale", "\xd0\xbc\xd0\xbe\xd1\x81\xd0\xba\xd0\xb2\xd0\xb0",
+		"\xc3\xbc" "ber", "na\xc3\xafve"
+	};
+	ENSURE(t == std::vector<std::string>(folded, folded + sizeof(folded) / sizeof(*folded)));
+}
+
+// Feeding text a piece at a time gives the same terms as tokenizing it
+// whole, wherever the pieces end: in a template, tag, entity, markup or
+// UTF-8 sequence.
+void test_tokenize_pieces()
+{
+	const std::string text("The QUICK brown {{Infobox|x={{y}}}} fox's &amp; over "
+		"[[Link target|Shown Words]] &lt;ref name=a&gt;cite&lt;/ref&gt; \xc3\x89" "cole "
+		"\xd0\x9c\xd0\x9e\xd0\xa1\xd0\x9a\xd0\x92\xd0\x90 [http://example.com Example] &&gt; end. "
+		"<b>bold</b> tail");
+	const std::vector<std::string> whole(terms_of(text));
+	ENSURE(whole.size() == 9);
+	for (size_t n(1); n <= text.size(); ++n) {
+		tokenizer tok;
+		std::vector<std::string> terms;
+		for (size_t i(0); i < text.size(); i += n) {
+			tok.feed(text.data() + i, std::min(n, text.size() - i), terms);
+		}
+		tok.finish(terms);
+		ENSURE(terms == whole);
+	}
+	// and the tokenizer starts afresh after finish
+	tokenizer tok;
+	std::vector<std::string> terms;
+	tok.feed("{{open abc ", 11, terms);
+	tok.finish(terms);
+	tok.feed(text.data(), text.size(), terms);
+	tok.finish(terms);
+	ENSURE(terms == whole);
+}
+
+int main()
+{
+	int rc(0);
+	try {
+		test_ascii_run();
+		test_utf8();
+		test_tokenize();
+		test_tokenize_pieces();
+		std::cout << "success" << std::endl;
+	} catch (const std::runtime_error& ex) {
+		std::cerr << ex.what() << std::endl;
+		rc = -1;
+	}
+	return rc;
+}
@@ -1,9 +1,16 @@
 #include <iostream>
 #include <stdexcept>
 #include <sstream>
+#include <fstream>
+#include <iterator>
+#include <set>
 #include "idx.hh"
 #include "ensure.hh"
 
+extern "C" {
+	#include <unistd.h>
+}
+
 void test_simple_index()
 {
 	index_st idx_st("tmp.idx");
@@ -20,6 +27,8 @@ void test_simple_index()
 	ENSURE(idx_st.is_associated("April", "easter"));
 	ENSURE(idx_st.is_associated("April", "australian"));
 	ENSURE(!idx_st.is_associated("April", "the"));
+	ENSURE(idx_st.in_title("April", "april"));
+	ENSURE(!idx_st.in_title("April", "month"));
 	
 	index_result r2(index_article(s, idx_st));
 	ENSURE(r2 == INDEX_GOOD);
@@ -48,14 +57,196 @@ void test_simple_index()
 	ENSURE(idx_st.is_associated("Art", "poetry"));
 	// more...
 	
+	// the file is written in the current format
+	idx_st.flush(true);
+	std::ifstream ifs("tmp.idx.1", std::ios::binary);
+	char preamble[INDEX_MAGIC_SIZE + 2];
+	ENSURE(ifs.read(preamble, sizeof(preamble)).good());
+	ENSURE(std::string(preamble, INDEX_MAGIC_SIZE) == INDEX_MAGIC);
+	ENSURE(preamble[INDEX_MAGIC_SIZE] == INDEX_FORMAT_VERSION);
+	ENSURE(preamble[INDEX_MAGIC_SIZE + 1] == '\n');
+	
 	system("rm tmp.idx*");
 }
 
+void test_varint()
+{
+	const uint64_t values[] = {
+		0, 1, 0x7f, 0x80, 0x3fff, 0x4000, UINT32_MAX,
+		static_cast<uint64_t>(UINT32_MAX) + 1, 0x123456789abcULL, ~0ULL
+	};
+	const size_t count(sizeof(values) / sizeof(values[0]));
+	std::string buf;
+	for (size_t i(0); i < count; ++i) {
+		char v[VARINT_MAX_SIZE];
+		buf.append(v, encode_varint(values[i], v));
+	}
+	ENSURE(buf.size() == 1 + 1 + 1 + 2 + 2 + 3 + 5 + 5 + 7 + 10);
+	const char *p(buf.data()), *end(buf.data() + buf.size());
+	for (size_t i(0); i < count; ++i) {
+		uint64_t v(0);
+		const size_t n(decode_varint(p, end, v));
+		ENSURE(n > 0 && v == values[i]);
+		p += n;
+	}
+	ENSURE(p == end);
+	uint64_t v(0);
+	ENSURE(decode_varint(buf.data(), buf.data() + buf.size() - 1, v) == 1); // the first is whole
+	ENSURE(decode_varint(end - 10, end - 1, v) == 0); // the last isn't
+}
+
+void test_checkpoint()
+{
+	checkpoint c(region(10, 100));
+	ENSURE(c.offset == 10 && c.flushes == 0 && !c.done);
+	c.offset = 50;
+	c.flushes = 3;
+	c.done = true;
+	c.write("tmp.ckpt");
+	checkpoint d;
+	d.read("tmp.ckpt");
+	ENSURE(d.begin == 10 && d.end == 100 && d.offset == 50);
+	ENSURE(d.flushes == 3 && d.done);
+	
+	bool threw(false);
+	try {
+		checkpoint e;
+		e.read("tmp.missing.ckpt");
+	} catch (const std::runtime_error& ex) {
+		threw = true;
+	}
+	ENSURE(threw);
+	
+	// a resumed index_st numbers its files after the checkpointed ones
+	{
+		index_st idx_st("tmp.resume", 2);
+		stream s("data/short.xml", region(0, 0));
+		ENSURE(index_article(s, idx_st) == INDEX_GOOD);
+		idx_st.flush(true);
+		ENSURE(idx_st.flush_count() == 3);
+	}
+	std::ifstream ifs("tmp.resume.3");
+	ENSURE(ifs.good());
+	
+	system("rm tmp.ckpt tmp.resume*");
+}
+
+void test_streaming()
+{
+	int fds[2];
+	ENSURE(pipe(fds) == 0);
+	page_queue q(1);
+	page_reader reader(fds[0], q);
+	reader.start();
+	std::vector<idx_thread *> threads;
+	for (size_t i(0); i < 2; ++i) {
+		std::ostringstream oss;
+		oss << "tmp.stream." << i + 1;
+		threads.push_back(new idx_thread(q, oss.str()));
+		threads.back()->start();
+	}
+	std::ifstream ifs("data/short.xml", std::ios::binary);
+	const std::string xml((std::istreambuf_iterator<char>(ifs)), std::istreambuf_iterator<char>());
+	ENSURE(write(fds[1], xml.data(), xml.size()) == static_cast<ssize_t>(xml.size()));
+	close(fds[1]);
+	size_t articles(0);
+	for (size_t i(0); i < threads.size(); ++i) {
+		threads[i]->join();
+		articles += threads[i]->article_count();
+		ENSURE(threads[i]->get_index_st().flush_count() == 1);
+		delete threads[i];
+	}
+	reader.join();
+	close(fds[0]);
+	ENSURE(articles == 5);
+	ENSURE(reader.bytes() == xml.size());
+	
+	system("rm tmp.stream.*");
+}
+
+// interns the same terms as the others, in its own order
+class intern_thread : public threadbase
+{
+public:
+	intern_thread(term_dictionary& dict, size_t seed) : m_dict(dict), m_seed(seed) { }
+	virtual void run()
+	{
+		for (size_t i(0); i < 20000; ++i) {
+			std::ostringstream oss;
+			oss << "term" << (i * 7919 + m_seed * 104729) % 20000;
+			const uint32_t id(m_dict.intern(oss.str()));
+			ids[oss.str()] = id;
+		}
+	}
+	str_id_map ids;
+
+private:
+	term_dictionary& m_dict;
+	const size_t m_seed;
+};
+
+void test_term_dictionary()
+{
+	std::vector<intern_thread *> threads;
+	{
+		term_dictionary dict("tmp.terms");
+		for (size_t i(0); i < 4; ++i) {
+			threads.push_back(new intern_thread(dict, i));
+			threads.back()->start();
+		}
+		for (size_t i(0); i < threads.size(); ++i) {
+			threads[i]->join();
+		}
+		ENSURE(dict.size() == 20000);
+		ENSURE(dict.find("term123") > 0 && dict.find("nothing") == 0);
+		dict.sync();
+	}
+	// every thread got the same ID for a term, and the IDs are 1..N
+	std::set<uint32_t> distinct;
+	for (size_t i(0); i < threads.size(); ++i) {
+		ENSURE(threads[i]->ids == threads[0]->ids);
+		typedef str_id_map::const_iterator sidcit;
+		for (sidcit it(threads[i]->ids.begin()); it != threads[i]->ids.end(); ++it) {
+			distinct.insert(it->second);
+		}
+		if (i > 0) {
+			delete threads[i];
+		}
+	}
+	ENSURE(distinct.size() == 20000 && *distinct.begin() == 1 && *distinct.rbegin() == 20000);
+	str_id_map on_disk;
+	read_dictionary("tmp.terms", on_disk);
+	ENSURE(on_disk == threads[0]->ids);
+	
+	// a torn entry at the end is cut off on resume, and IDs carry on
+	{
+		std::ofstream ofs("tmp.terms", std::ios::out | std::ios::app | std::ios::binary);
+		ofs << "\x01\x02torn";
+	}
+	{
+		term_dictionary dict("tmp.terms", true);
+		ENSURE(dict.size() == 20000);
+		ENSURE(dict.find("term123") == threads[0]->ids["term123"]);
+		ENSURE(dict.intern("another") == 20001);
+		dict.sync();
+	}
+	on_disk.clear();
+	read_dictionary("tmp.terms", on_disk);
+	ENSURE(on_disk.size() == 20001 && on_disk["another"] == 20001);
+	delete threads[0];
+	
+	system("rm tmp.terms");
+}
+
 int main()
 {
 	int rc(0);
 	try {
 		test_simple_index();
+		test_varint();
+		test_checkpoint();
+		test_streaming();
+		test_term_dictionary();
 		std::cout << "success" << std::endl;
 	} catch (const std::runtime_error& ex) {
 		std::cerr << ex.what() << std::endl;
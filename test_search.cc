@@ -0,0 +1,680 @@
+#include <iostream>
+#include <fstream>
+#include <stdexcept>
+#include <sstream>
+#include <cstring>
+#include "idx.hh"
+#include "search.hh"
+#include "tombstone.hh"
+#include "flat.hh"
+#include "aio.hh"
+#include "bloom.hh"
+#include "shard.hh"
+#include "ensure.hh"
+
+extern "C" {
+	#include <unistd.h>
+	#include <fcntl.h>
+}
+
+static void build_index(const std::string& basename)
+{
+	index_st idx_st(basename);
+	stream s("data/short.xml", region(0, 0));
+	while (index_article(s, idx_st) != END_OF_REGION);
+	idx_st.flush(true);
+	std::vector<std::string> filenames;
+	filenames.push_back(basename + ".1");
+	ENSURE(init_indices(filenames) == 1);
+}
+
+static bool same(const search_results& a, const search_results& b)
+{
+	if (a.total != b.total || a.top.size() != b.top.size()) {
+		return false;
+	}
+	for (size_t i(0); i < a.top.size(); ++i) {
+		if (a.top[i].article != b.top[i].article || a.top[i].weight != b.top[i].weight) {
+			return false;
+		}
+	}
+	return true;
+}
+
+void test_search()
+{
+	search_results r(search_indices("april"));
+	ENSURE(r.total >= 1);
+	ENSURE(!r.top.empty());
+	ENSURE(r.top.at(0).article == "April");
+	ENSURE(search_indices("month").total >= 2);
+	ENSURE(search_indices("zzzzzz").total == 0);
+	ENSURE(search_indices("zzzzzz").top.empty());
+}
+
+void test_batch_search()
+{
+	std::vector<std::string> terms;
+	terms.push_back("month");
+	terms.push_back("zzzzzz");
+	terms.push_back("april");
+	terms.push_back("poetry");
+	terms.push_back("month"); // duplicates are fine
+	set_cache_budget(0); // make sure the sweep reads from disk
+	std::vector<search_results> batch(search_indices(terms));
+	set_cache_budget(DEFAULT_CACHE_BUDGET);
+	ENSURE(batch.size() == terms.size());
+	for (size_t i(0); i < terms.size(); ++i) {
+		ENSURE(same(batch[i], search_indices(terms[i])));
+	}
+	ENSURE(search_indices(std::vector<std::string>()).empty());
+}
+
+void test_trace()
+{
+	// from disk, then from the cache
+	set_cache_budget(0);
+	set_cache_budget(DEFAULT_CACHE_BUDGET);
+	search_trace cold, warm;
+	const search_results r(search_indices("month", 0, &cold));
+	ENSURE(same(search_indices("month", 0, &warm), r));
+	ENSURE(same(search_indices("month"), r));
+	ENSURE(cold.segments.size() == 1 && warm.segments.size() == 1);
+	const segment_trace& c(cold.segments[0]);
+	const segment_trace& w(warm.segments[0]);
+	ENSURE(c.filename == "tmp_search.idx.1");
+	ENSURE(c.blocks >= 1 && c.cache_hits == 0 && c.reads >= 1 && c.bytes_read > 0);
+	ENSURE(w.blocks == c.blocks && w.cache_hits == w.blocks && w.reads == 0 && w.bytes_read == 0);
+	ENSURE(c.postings == w.postings && c.postings >= search_indices("month").total);
+	ENSURE(cold.total_usec >= cold.read_usec + cold.merge_usec);
+	
+	// a term that isn't there costs no reads, and a fuzzy search expands
+	search_trace none;
+	ENSURE(search_indices("zzzzzz", 0, &none).total == 0);
+	ENSURE(none.segments.at(0).blocks == 0 && none.segments[0].postings == 0);
+	search_trace fuzzy;
+	ENSURE(search_indices("montj", 2, &fuzzy).total > 0);
+	ENSURE(fuzzy.segments.at(0).postings > 0);
+}
+
+void test_complete()
+{
+	std::vector<completion> c(complete_terms("mon", 5));
+	ENSURE(!c.empty() && c.size() <= 5);
+	for (size_t i(0); i < c.size(); ++i) {
+		ENSURE(c[i].term.compare(0, 3, "mon") == 0);
+		ENSURE(i == 0 || c[i-1].frequency >= c[i].frequency);
+	}
+	ENSURE(complete_terms("zzzzzz", 5).empty());
+	ENSURE(complete_terms("", 3).size() == 3);
+	ENSURE(complete_terms("a", 0).empty());
+}
+
+void test_wildcard()
+{
+	ENSURE(wildcard_match("mon*", "month"));
+	ENSURE(wildcard_match("*th", "month"));
+	ENSURE(wildcard_match("m*n*h", "month"));
+	ENSURE(!wildcard_match("m*x", "month"));
+	ENSURE(wildcard_match("*", ""));
+	std::vector<std::string> expanded(expand_wildcard("mont*"));
+	ENSURE(std::find(expanded.begin(), expanded.end(), "month") != expanded.end());
+	ENSURE(expand_wildcard("a*").size() <= MAX_WILDCARD_EXPANSION);
+	search_results r(search_indices("mont*"));
+	ENSURE(r.total >= search_indices("month").total);
+	ENSURE(search_indices("zzzz*").total == 0);
+}
+
+static size_t levenshtein(const std::string& a, const std::string& b)
+{
+	std::vector<size_t> row(b.size() + 1);
+	for (size_t j(0); j <= b.size(); ++j) {
+		row[j] = j;
+	}
+	for (size_t i(1); i <= a.size(); ++i) {
+		size_t diag(row[0]);
+		row[0] = i;
+		for (size_t j(1); j <= b.size(); ++j) {
+			const size_t above(row[j]);
+			row[j] = std::min(std::min(row[j] + 1, row[j-1] + 1), diag + (a[i-1] == b[j-1] ? 0 : 1));
+			diag = above;
+		}
+	}
+	return row[b.size()];
+}
+
+void test_fuzzy()
+{
+	// the automaton walk must agree with brute force over the vocabulary
+	std::vector<completion> vocabulary(complete_terms("", 1000000));
+	const char *queries[] = { "mnoth", "arts", "agust", "ai", "zzzzzzzz" };
+	for (size_t q(0); q < sizeof(queries) / sizeof(queries[0]); ++q) {
+		std::vector<std::string> expected;
+		typedef std::vector<completion>::const_iterator ccit;
+		for (ccit it(vocabulary.begin()); it != vocabulary.end(); ++it) {
+			if (levenshtein(queries[q], it->term) <= 2) {
+				expected.push_back(it->term);
+			}
+		}
+		std::vector<std::string> actual(fuzzy_terms(queries[q], 2, 1000000));
+		std::sort(expected.begin(), expected.end());
+		std::sort(actual.begin(), actual.end());
+		ENSURE(expected == actual);
+	}
+
+	std::vector<std::string> terms(fuzzy_terms("mnoth", 2, 8));
+	ENSURE(std::find(terms.begin(), terms.end(), "month") != terms.end());
+	terms = fuzzy_terms("month", 0, 8);
+	ENSURE(terms.size() == 1 && terms.at(0) == "month");
+	terms = fuzzy_terms("monthz", 1, 8);
+	ENSURE(!terms.empty() && terms.at(0) == "month");
+	ENSURE(fuzzy_terms("qqqqqqqq", 2, 8).empty());
+	// no fallback unless asked for
+	ENSURE(search_indices("mounth").total == 0);
+	search_results r(search_indices("mounth", DEFAULT_FUZZY_DISTANCE));
+	ENSURE(r.total > 0);
+	ENSURE(std::find(r.expanded.begin(), r.expanded.end(), "month") != r.expanded.end());
+	// exact hits never fall back
+	ENSURE(search_indices("april", DEFAULT_FUZZY_DISTANCE).expanded.empty());
+}
+
+static std::vector<search_result> all_pages(const std::string& term, size_t count, bool snapshot)
+{
+	std::vector<search_result> all;
+	std::string cursor;
+	do {
+		search_results r(search_page(term, cursor, count, snapshot));
+		all.insert(all.end(), r.top.begin(), r.top.end());
+		cursor = r.cursor;
+	} while (!cursor.empty());
+	return all;
+}
+
+void test_pagination()
+{
+	// the whole ranking, in one page
+	search_results everything(search_page("a*", "", 1000));
+	ENSURE(everything.total == everything.top.size());
+	ENSURE(everything.cursor.empty());
+	for (size_t count(1); count <= 4; ++count) {
+		for (int snapshot(0); snapshot <= 1; ++snapshot) {
+			std::vector<search_result> paged(all_pages("a*", count, snapshot));
+			ENSURE(paged.size() == everything.top.size());
+			for (size_t i(0); i < paged.size(); ++i) {
+				ENSURE(paged[i].article == everything.top[i].article);
+				ENSURE(paged[i].weight == everything.top[i].weight);
+			}
+		}
+	}
+	// the first page is the same as a plain search
+	search_results first(search_page("month", "", MAX_SEARCH_RESULTS));
+	ENSURE(same(first, search_indices("month")));
+	bool threw(false);
+	try {
+		search_page("month", "not a cursor");
+	} catch (const std::runtime_error& ex) {
+		threw = true;
+	}
+	ENSURE(threw);
+}
+
+// An article in two index files ranks by its weights in both, and each
+// page has it at most once.
+void test_pagination_across_files()
+{
+	{
+		index_st idx_st("tmp_search.paged");
+		idx_st.index(std::vector<std::string>(3, "word"), "Twice");
+		idx_st.index(std::vector<std::string>(2, "word"), "Two");
+		idx_st.index(std::vector<std::string>(1, "word"), "One");
+		idx_st.flush();
+		idx_st.index(std::vector<std::string>(3, "word"), "Twice");
+		idx_st.index(std::vector<std::string>(1, "word"), "Also");
+		idx_st.flush(true);
+	}
+	std::vector<std::string> filenames;
+	filenames.push_back("tmp_search.paged.1");
+	filenames.push_back("tmp_search.paged.2");
+	ENSURE(init_indices(filenames) == 2);
+	// past the first page, each file still has Twice first
+	const char *ranked[] = { "Twice", "Two", "Also", "One" };
+	const size_t weights[] = { 6, 2, 1, 1 };
+	for (size_t count(1); count <= 3; ++count) {
+		for (int snapshot(0); snapshot <= 1; ++snapshot) {
+			std::vector<search_result> paged(all_pages("word", count, snapshot));
+			ENSURE(paged.size() == 4);
+			for (size_t i(0); i < paged.size(); ++i) {
+				ENSURE(paged[i].article == ranked[i] && paged[i].weight == weights[i]);
+			}
+		}
+	}
+	ENSURE(init_indices(std::vector<std::string>(1, "tmp_search.idx.1")) == 1);
+}
+
+// Searches for a term over and over, counting any results that differ
+// from the expected ones, until stopped.
+struct search_loop : public threadbase {
+	search_loop(const search_results& expected)
+	: expected(expected)
+	, stopped(0)
+	, searches(0)
+	, mismatches(0)
+	{
+		//
+	}
+	
+	void run()
+	{
+		while (!__sync_fetch_and_add(&stopped, 0)) {
+			if (!same(search_indices("month"), expected)) {
+				__sync_fetch_and_add(&mismatches, 1);
+			}
+			__sync_fetch_and_add(&searches, 1);
+		}
+	}
+	
+	const search_results expected;
+	int stopped;
+	size_t searches;
+	size_t mismatches;
+};
+
+void test_reload()
+{
+	// searches carry on, undisturbed, while the files are loaded again
+	std::vector<std::string> filenames(1, "tmp_search.idx.1");
+	const search_results expected(search_indices("month"));
+	std::vector<search_loop *> loops;
+	for (size_t i(0); i < 4; ++i) {
+		loops.push_back(new search_loop(expected));
+		loops.back()->start();
+	}
+	for (size_t i(0); i < 20; ++i) {
+		ENSURE(init_indices(filenames) == 1);
+	}
+	for (size_t i(0); i < loops.size(); ++i) {
+		while (__sync_fetch_and_add(&loops[i]->searches, 0) == 0) {
+			usleep(1000);
+		}
+		__sync_fetch_and_add(&loops[i]->stopped, 1);
+		loops[i]->join();
+		ENSURE(loops[i]->mismatches == 0);
+		delete loops[i];
+	}
+	
+	// an empty set of files finds nothing, until they're back
+	ENSURE(init_indices(std::vector<std::string>()) == 0);
+	ENSURE(search_indices("month").total == 0);
+	ENSURE(complete_terms("mon", 5).empty());
+	ENSURE(init_indices(filenames) == 1);
+	ENSURE(same(search_indices("month"), expected));
+}
+
+static void count_read(std::vector<read_op>& ops, size_t i, void *arg)
+{
+	ENSURE(ops[i].result == static_cast<ssize_t>(ops[i].buf.size()) || ops[i].fd < 0);
+	(*reinterpret_cast<size_t *>(arg))++;
+}
+
+void test_read_batch()
+{
+	const int fd(open("tmp_search.idx.1", O_RDONLY));
+	ENSURE(fd >= 0);
+	const bool backends[] = { true, false };
+	for (size_t b(0); b < 2; ++b) {
+		set_io_uring(backends[b]);
+		// more reads than a ring holds at once
+		std::vector<read_op> ops;
+		for (size_t i(0); i < AIO_QUEUE_DEPTH * 3; ++i) {
+			ops.push_back(read_op(fd, i * 7, 16));
+		}
+		ops.push_back(read_op(-1, 0, 16));
+		size_t completed(0);
+		read_batch(ops, count_read, &completed);
+		ENSURE(completed == ops.size());
+		ENSURE(ops.back().result < 0);
+		for (size_t i(0); i + 1 < ops.size(); ++i) {
+			char expected[16];
+			ENSURE(pread(fd, expected, sizeof(expected), ops[i].offset) == sizeof(expected));
+			ENSURE(memcmp(expected, &ops[i].buf[0], sizeof(expected)) == 0);
+		}
+	}
+	close(fd);
+	
+	// searches come out the same whichever way they're read
+	std::vector<std::string> terms;
+	terms.push_back("month");
+	terms.push_back("april");
+	terms.push_back("poe*");
+	set_io_uring(true);
+	drop_caches();
+	const std::vector<search_results> a(search_indices(terms));
+	set_io_uring(false);
+	drop_caches();
+	const std::vector<search_results> b(search_indices(terms));
+	set_io_uring(true);
+	for (size_t i(0); i < terms.size(); ++i) {
+		ENSURE(same(a[i], b[i]));
+	}
+	ENSURE(a[0].total > 0);
+}
+
+void test_tombstones()
+{
+	tombstones t;
+	ENSURE(t.empty() && !t.deleted(0) && !t.deleted(1000));
+	t.mark(3);
+	t.mark(17);
+	ENSURE(t.deleted(3) && t.deleted(17) && !t.deleted(4) && t.count() == 2);
+	t.save("tmp_search.idx.1");
+	tombstones u;
+	ENSURE(u.load("tmp_search.idx.1"));
+	ENSURE(u.deleted(3) && u.deleted(17) && u.count() == 2);
+	ENSURE(!u.load("tmp_search.idx.none") && u.empty());
+	
+	// mask April, and it drops out of the results once reloaded
+	std::vector<aid_title> titles(read_titles("tmp_search.idx.1"));
+	ENSURE(titles.size() == 5);
+	tombstones mask;
+	for (size_t i(0); i < titles.size(); ++i) {
+		if (titles[i].second == "April") {
+			mask.mark(titles[i].first);
+		}
+	}
+	ENSURE(mask.count() == 1);
+	mask.save("tmp_search.idx.1");
+	const search_results before(search_indices("month"));
+	std::vector<std::string> filenames(1, "tmp_search.idx.1");
+	ENSURE(init_indices(filenames) == 1);
+	const search_results after(search_indices("month"));
+	ENSURE(after.total + 1 == before.total);
+	for (size_t i(0); i < after.top.size(); ++i) {
+		ENSURE(after.top[i].article != "April");
+	}
+	unlink("tmp_search.idx.1" TOMBSTONE_SUFFIX);
+	ENSURE(init_indices(filenames) == 1);
+	ENSURE(same(search_indices("month"), before));
+}
+
+void test_dictionary()
+{
+	// the same articles, split over two files sharing a term dictionary,
+	// rank the same as the single file without one
+	std::vector<std::string> terms;
+	terms.push_back("month");
+	terms.push_back("april");
+	terms.push_back("poetry");
+	terms.push_back("zzzzzz");
+	const std::vector<search_results> before(search_indices(terms));
+	const std::vector<completion> completions(complete_terms("mon", 5));
+	{
+		term_dictionary dict("tmp_search.dict" TERM_DICTIONARY_SUFFIX);
+		index_st idx_st("tmp_search.dict", 0, &dict);
+		stream s("data/short.xml", region(0, 0));
+		for (size_t i(0); index_article(s, idx_st) != END_OF_REGION; ++i) {
+			if (i == 2) {
+				idx_st.flush();
+			}
+		}
+		idx_st.flush(true);
+		ENSURE(idx_st.flush_count() == 2);
+	}
+	std::vector<std::string> filenames;
+	filenames.push_back("tmp_search.dict.1");
+	filenames.push_back("tmp_search.dict.2");
+	filenames.push_back("tmp_search.dict" TERM_DICTIONARY_SUFFIX); // skipped
+	ENSURE(init_indices(filenames) == 2);
+	const std::vector<search_results> after(search_indices(terms));
+	for (size_t i(0); i < terms.size(); ++i) {
+		ENSURE(same(after[i], before[i]));
+	}
+	const std::vector<completion> again(complete_terms("mon", 5));
+	ENSURE(again.size() == completions.size());
+	for (size_t i(0); i < again.size(); ++i) {
+		ENSURE(again[i].term == completions[i].term && again[i].frequency == completions[i].frequency);
+	}
+	// and without it, the files can't be read
+	unlink("tmp_search.dict" TERM_DICTIONARY_SUFFIX);
+	ENSURE(init_indices(filenames) == 0);
+}
+
+void test_flat_tables()
+{
+	string_table st;
+	std::vector<std::string> words;
+	for (size_t i(0); i < 5000; ++i) {
+		std::ostringstream oss;
+		oss << "w" << i * 7919;
+		words.push_back(oss.str());
+		ENSURE(st.insert(words.back().data(), words.back().size()) == i);
+	}
+	st.shrink();
+	ENSURE(st.size() == words.size());
+	for (size_t i(0); i < words.size(); ++i) {
+		ENSURE(st.find(words[i]) == i);
+		ENSURE(words[i] == st.at(i));
+		ENSURE(st.insert(words[i].data(), words[i].size()) == i);
+	}
+	ENSURE(st.find("w") == FLAT_NOT_FOUND);
+	ENSURE(st.find(words[1] + "x") == FLAT_NOT_FOUND);
+	ENSURE(st.find(std::string("w0\0", 3)) == FLAT_NOT_FOUND);
+	
+	id_table it;
+	ENSURE(it.find(1) == FLAT_NOT_FOUND);
+	for (uint32_t k(1); k <= 5000; ++k) {
+		it.insert(k * 64, k);
+	}
+	ENSURE(it.size() == 5000);
+	for (uint32_t k(1); k <= 5000; ++k) {
+		ENSURE(it.find(k * 64) == k);
+		ENSURE(it.find(k * 64 + 1) == FLAT_NOT_FOUND);
+	}
+}
+
+void test_bloom_filter()
+{
+	bloom_filter empty;
+	ENSURE(empty.may_contain(hash_bytes("x", 1)));
+	
+	bloom_filter f(10000);
+	for (size_t i(0); i < 10000; ++i) {
+		std::ostringstream oss;
+		oss << "in" << i;
+		f.add(hash_bytes(oss.str().data(), oss.str().size()));
+	}
+	const bloom_filter copy(f.hashes(), f.words());
+	size_t passed(0);
+	for (size_t i(0); i < 10000; ++i) {
+		std::ostringstream in, out;
+		in << "in" << i;
+		out << "out" << i;
+		ENSURE(copy.may_contain(hash_bytes(in.str().data(), in.str().size())));
+		if (copy.may_contain(hash_bytes(out.str().data(), out.str().size()))) {
+			passed++;
+		}
+	}
+	ENSURE(passed < 300); // about 1% expected
+	
+	// index files carry one, and searches consult it
+	const filter_stats before(get_filter_stats());
+	ENSURE(search_indices("zzzzzz").total == 0);
+	ENSURE(search_indices("month").total > 0);
+	const filter_stats after(get_filter_stats());
+	ENSURE(after.probes - before.probes == 2);
+	ENSURE(after.skipped - before.skipped + after.false_positives - before.false_positives == 1);
+	
+	// a file claiming too many probes, or none, isn't loaded
+	std::string file;
+	{
+		std::ifstream ifs("tmp_search.idx.1", std::ios::binary);
+		std::ostringstream oss;
+		oss << ifs.rdbuf();
+		file = oss.str();
+	}
+	// the section is 'B' <uint64_t length> <uint32_t hashes> <words>
+	size_t at(std::string::npos);
+	for (size_t i(0); i + 13 <= file.size() && at == std::string::npos; ++i) {
+		uint64_t length(0);
+		uint32_t hashes(0);
+		memcpy(&length, &file[i + 1], sizeof(length));
+		memcpy(&hashes, &file[i + 9], sizeof(hashes));
+		if (file[i] == INDEX_SECTION_BLOOM && length % 8 == 4 && length < file.size() && hashes == BLOOM_HASHES) {
+			at = i + 9;
+		}
+	}
+	ENSURE(at != std::string::npos);
+	const uint32_t bad[] = { 0xFFFFFFFF, BLOOM_MAX_HASHES + 1, 0 };
+	for (size_t i(0); i < sizeof(bad) / sizeof(*bad); ++i) {
+		memcpy(&file[at], &bad[i], sizeof(bad[i]));
+		{
+			std::ofstream ofs("tmp_search.idx.bad", std::ios::binary);
+			ofs << file;
+		}
+		ENSURE(init_indices(std::vector<std::string>(1, "tmp_search.idx.bad")) == 0);
+	}
+	ENSURE(init_indices(std::vector<std::string>(1, "tmp_search.idx.1")) == 1);
+}
+
+static void index_titled(index_st& idx_st, const std::string& title, const std::string& text)
+{
+	std::vector<std::string> terms, title_terms;
+	tokenize(text.data(), text.size(), terms);
+	tokenize_title(title, title_terms);
+	idx_st.index(terms, title);
+	idx_st.index_title(title_terms, title);
+}
+
+void test_title_index()
+{
+	{
+		index_st idx_st("tmp_search.titles");
+		index_titled(idx_st, "Albert Einstein", "physicist relativity einstein ");
+		index_titled(idx_st, "Albert Einstein Medal", "award physicist ");
+		index_titled(idx_st, "Einstein (crater)", "lunar crater ");
+		index_titled(idx_st, "Relativity", "theory einstein einstein ");
+		idx_st.flush(true);
+	}
+	std::vector<std::string> filenames(1, "tmp_search.titles.1");
+	ENSURE(init_indices(filenames) == 1);
+	
+	// several words search the titles alone, exact titles first,
+	// without looking up any postings
+	const filter_stats before(get_filter_stats());
+	search_results r(search_indices("albert einstein"));
+	ENSURE(get_filter_stats().probes == before.probes);
+	ENSURE(r.total == 2 && r.top.size() == 2);
+	ENSURE(r.top[0].article == "Albert Einstein");
+	ENSURE(r.top[1].article == "Albert Einstein Medal");
+	ENSURE(r.top[0].weight > r.top[1].weight);
+	ENSURE(search_indices("einstein crater").top.at(0).article == "Einstein (crater)");
+	ENSURE(search_indices("albert crater").total == 0);
+	
+	// one word finds titles and text together, titles boosted
+	r = search_indices("einstein");
+	ENSURE(r.total == 4);
+	ENSURE(r.top[0].article == "Albert Einstein" && r.top[0].weight == TITLE_BOOST + 1);
+	ENSURE(r.top[3].article == "Relativity" && r.top[3].weight == 2);
+	ENSURE(search_indices("crater").top.at(0).weight == TITLE_BOOST + 1);
+	ENSURE(search_indices("medal").total == 1); // only in a title
+	
+	std::vector<std::string> terms;
+	terms.push_back("albert einstein");
+	terms.push_back("einstein");
+	std::vector<search_results> batch(search_indices(terms));
+	ENSURE(same(batch[0], search_indices("albert einstein")));
+	ENSURE(same(batch[1], search_indices("einstein")));
+}
+
+// Searching two files apart, as two shards would, and merging what they
+// find gives the same as searching them together.
+void test_shards()
+{
+	{
+		index_st idx_st("tmp_search.shard");
+		stream s("data/short.xml", region(0, 0));
+		for (size_t i(0); index_article(s, idx_st) != END_OF_REGION; ++i) {
+			if (i == 2) {
+				idx_st.flush();
+			}
+		}
+		idx_st.flush(true);
+	}
+	std::vector<std::string> both;
+	both.push_back("tmp_search.shard.1");
+	both.push_back("tmp_search.shard.2");
+	// not wildcards, which each shard expands from its own terms
+	const char *terms[] = { "month", "april", "poetry", "art", "zzzzzz" };
+	for (size_t t(0); t < sizeof(terms) / sizeof(*terms); ++t) {
+		std::vector<search_results> parts, pages;
+		std::vector<std::vector<completion> > completions;
+		for (size_t f(0); f < both.size(); ++f) {
+			ENSURE(init_indices(std::vector<std::string>(1, both[f])) == 1);
+			// by way of the line format, as shards send them
+			parts.push_back(results_from_lines(to_lines(search_indices(terms[t]))));
+			pages.push_back(results_from_lines(to_lines(search_page(terms[t], "", 2))));
+			completions.push_back(completions_from_lines(to_lines(complete_terms(std::string(terms[t], 1), 100))));
+		}
+		ENSURE(init_indices(both) == 2);
+		ENSURE(same(merge_results(parts), search_indices(terms[t])));
+		const search_results page(search_page(terms[t], "", 2));
+		const search_results merged(merge_pages(pages, "", 2));
+		ENSURE(same(merged, page) && merged.cursor == page.cursor);
+		// terms of equal frequency may come in any order
+		const std::vector<completion> expected(complete_terms(std::string(terms[t], 1), 5));
+		const std::vector<completion> all(complete_terms(std::string(terms[t], 1), 100));
+		const std::vector<completion> got(merge_completions(completions, 5));
+		ENSURE(got.size() == expected.size());
+		for (size_t i(0); i < got.size(); ++i) {
+			ENSURE(got[i].frequency == expected[i].frequency);
+			bool found(false);
+			for (size_t j(0); j < all.size(); ++j) {
+				found = found || (all[j].term == got[i].term && all[j].frequency == got[i].frequency);
+			}
+			ENSURE(found);
+		}
+	}
+	std::vector<search_results> parts(1, search_indices("month"));
+	parts[0].partial = true;
+	ENSURE(to_json(merge_results(parts)).find("\"partial\": true") != std::string::npos);
+	ENSURE(to_json(search_indices("month")).find("partial") == std::string::npos);
+	ENSURE(to_json(complete_terms("m", 5), true).find("\"partial\": true") != std::string::npos);
+	ENSURE(to_json(complete_terms("m", 5)).find("partial") == std::string::npos);
+
+	// every file goes to one share, the biggest first to the emptiest
+	std::vector<std::vector<std::string> > shares(partition_files(both, 3));
+	ENSURE(shares.size() == 3);
+	ENSURE(shares[0].size() + shares[1].size() + shares[2].size() == 2);
+	ENSURE(shares[2].empty());
+	ENSURE(partition_files(both, 1).at(0) == both);
+	ENSURE(init_indices(std::vector<std::string>(1, "tmp_search.idx.1")) == 1);
+}
+
+int main()
+{
+	int rc(0);
+	try {
+		build_index("tmp_search.idx");
+		test_search();
+		test_batch_search();
+		test_trace();
+		test_complete();
+		test_wildcard();
+		test_fuzzy();
+		test_pagination();
+		test_pagination_across_files();
+		test_reload();
+		test_read_batch();
+		test_bloom_filter();
+		test_tombstones();
+		test_dictionary();
+		test_flat_tables();
+		test_title_index();
+		test_shards();
+		std::cout << "success" << std::endl;
+	} catch (const std::runtime_error& ex) {
+		std::cerr << ex.what() << std::endl;
+		rc = -1;
+	}
+	system("rm tmp_search.idx* tmp_search.dict* tmp_search.titles* tmp_search.shard* tmp_search.paged*");
+	return rc;
+}
@@ -1,9 +1,17 @@
 #include <iostream>
 #include <stdexcept>
 #include <sstream>
+#include <fstream>
+#include <iterator>
+#include <algorithm>
 #include "xml.hh"
+#include "thread.hh"
 #include "ensure.hh"
 
+extern "C" {
+	#include <unistd.h>
+}
+
 void test_basic_reading()
 {
 	stream s("data/short.xml", region(0, 0));
@@ -54,6 +62,124 @@ void test_regionized_reading()
 	ENSURE(s2.tell() == regions.at(1).end);
 }
 
+static void copy_to(char *buf, size_t len, void *arg)
+{
+	reinterpret_cast<std::string *>(arg)->assign(buf, len);
+}
+
+static void append_chunk(char *buf, size_t len, void *arg)
+{
+	ENSURE(len > 0 && len <= STREAM_CHUNK_SIZE);
+	std::vector<std::string> *chunks(reinterpret_cast<std::vector<std::string> *>(arg));
+	chunks->push_back(std::string(buf, len));
+}
+
+void test_chunked_reading()
+{
+	const std::string body(STREAM_CHUNK_SIZE * 2 + 5, 'x');
+	stream s(new std::istringstream("<text>" + body + "</text>after\n"), region(0, 0));
+	std::vector<std::string> chunks;
+	ENSURE(s.read_chunks_until("<text>", true, append_chunk, &chunks));
+	ENSURE(chunks.size() == 1 && chunks[0] == "<text>");
+	chunks.clear();
+	ENSURE(s.read_chunks_until("</text", false, append_chunk, &chunks));
+	ENSURE(chunks.size() == 3 && chunks[2].size() == 5);
+	std::string got;
+	for (size_t i(0); i < chunks.size(); ++i) {
+		got += chunks[i];
+	}
+	ENSURE(got == body);
+	chunks.clear();
+	ENSURE(s.read_chunks_until("</text", false, append_chunk, &chunks));
+	ENSURE(chunks.empty()); // found immediately
+	ENSURE(s.read(5) == "</tex");
+	ENSURE(!s.read_chunks_until("<text>", false, append_chunk, &chunks));
+	ENSURE(chunks.empty());
+}
+
+// writes to a pipe from another thread, as a producer upstream would
+class pipe_writer : public threadbase
+{
+public:
+	pipe_writer(int fd, const std::string& data) : m_fd(fd), m_data(data) { }
+	virtual void run()
+	{
+		for (size_t i(0); i < m_data.size(); ) {
+			const ssize_t n(write(m_fd, m_data.data() + i, std::min<size_t>(m_data.size() - i, 4096)));
+			if (n <= 0) {
+				break;
+			}
+			i += n;
+		}
+		close(m_fd);
+	}
+
+private:
+	int m_fd;
+	const std::string m_data;
+};
+
+void test_pipe_reading()
+{
+	std::ifstream ifs("data/short.xml", std::ios::binary);
+	const std::string xml((std::istreambuf_iterator<char>(ifs)), std::istreambuf_iterator<char>());
+	int fds[2];
+	ENSURE(pipe(fds) == 0);
+	pipe_writer w(fds[1], xml);
+	w.start();
+	pipe_stream s(fds[0]);
+	std::string got;
+	ENSURE(s.read_until("<title>", true, NULL, NULL));
+	ENSURE(s.read_until("</title>", false, copy_to, &got));
+	ENSURE(got == "April");
+	ENSURE(s.read_until("</title>", true, copy_to, &got));
+	ENSURE(got == "</title>"); // found immediately, the token passed on
+	ENSURE(s.read_until("<title>", true, NULL, NULL));
+	ENSURE(s.read_until("<", false, copy_to, &got));
+	ENSURE(got == "August");
+	for (size_t i(0); i < 3; ++i) {
+		ENSURE(s.read_until("<title>", true, NULL, NULL));
+	}
+	ENSURE(s.read_until("<", false, copy_to, &got));
+	ENSURE(got == "Air");
+	ENSURE(!s.read_until("<title>", true, NULL, NULL));
+	ENSURE(s.tell() == xml.size());
+	ENSURE(!s.read_until("<title>", true, NULL, NULL));
+	w.join();
+	close(fds[0]);
+
+	// a span longer than the buffer, with the token split across reads
+	const std::string big("<a>" + std::string(PIPE_BUFFER_SIZE * 3 + 1, 'x') + "</a>tail");
+	ENSURE(pipe(fds) == 0);
+	pipe_writer w2(fds[1], big);
+	w2.start();
+	pipe_stream s2(fds[0]);
+	ENSURE(s2.read_until("<a>", true, NULL, NULL));
+	ENSURE(s2.read_until("</a>", false, copy_to, &got));
+	ENSURE(got == std::string(PIPE_BUFFER_SIZE * 3 + 1, 'x'));
+	ENSURE(s2.read_until("tail", true, copy_to, &got));
+	ENSURE(got == "</a>tail");
+	ENSURE(!s2.read_until("x", false, NULL, NULL));
+	w2.join();
+	close(fds[0]);
+	
+	// skipping megabytes without the token, in the buffer it began with
+	const std::string skipped(std::string(PIPE_BUFFER_SIZE * 5 - 2, 'x') + "<page>" + std::string(PIPE_BUFFER_SIZE * 3, 'y'));
+	ENSURE(pipe(fds) == 0);
+	pipe_writer w3(fds[1], skipped);
+	w3.start();
+	pipe_stream s3(fds[0]);
+	ENSURE(s3.read_until("<page", false, NULL, NULL));
+	ENSURE(s3.tell() == PIPE_BUFFER_SIZE * 5 - 2);
+	ENSURE(s3.read_until(">", true, copy_to, &got));
+	ENSURE(got == "<page>");
+	ENSURE(!s3.read_until("<page", false, NULL, NULL));
+	ENSURE(s3.tell() == skipped.size());
+	ENSURE(s3.capacity() == PIPE_BUFFER_SIZE);
+	w3.join();
+	close(fds[0]);
+}
+
 int main()
 {
 	int rc(0);
@@ -61,6 +187,8 @@ int main()
 		test_basic_reading();
 		test_regionize();
 		test_regionized_reading();
+		test_chunked_reading();
+		test_pipe_reading();
 		std::cout << "success" << std::endl;
 	} catch (const std::runtime_error& ex) {
 		std::cerr << ex.what() << std::endl;
@@ -0,0 +1,127 @@
+#include <fstream>
+#include <stdexcept>
+#include <cstdio>
+#include <cstring>
+#include "tombstone.hh"
+
+extern "C" {
+	#include <unistd.h>
+}
+
+template<typename T>
+static void read(std::ifstream& ifs, T& t)
+{
+	ifs.read(reinterpret_cast<char *>(&t), sizeof(T));
+}
+
+tombstones::tombstones()
+{
+	//
+}
+
+bool tombstones::load(const std::string& segment)
+{
+	m_bits.clear();
+	std::ifstream ifs((segment + TOMBSTONE_SUFFIX).c_str(), std::ios::binary);
+	if (!ifs.good()) {
+		return false;
+	}
+	uint32_t highest(0);
+	read<uint32_t>(ifs, highest);
+	m_bits.resize(highest / 8 + 1);
+	ifs.read(reinterpret_cast<char *>(&m_bits[0]), m_bits.size());
+	if (!ifs.good()) {
+		m_bits.clear();
+		throw std::runtime_error("truncated tombstones for " + segment);
+	}
+	return true;
+}
+
+void tombstones::save(const std::string& segment) const
+{
+	const std::string filename(segment + TOMBSTONE_SUFFIX), tmp(filename + ".tmp");
+	FILE *f(fopen(tmp.c_str(), "wb"));
+	if (!f) {
+		throw std::runtime_error("failed to create " + tmp);
+	}
+	const uint32_t highest(m_bits.empty() ? 0 : m_bits.size() * 8 - 1);
+	std::vector<unsigned char> bits(m_bits);
+	bits.resize(highest / 8 + 1);
+	// on disk before the rename, and the rename too before we return
+	const bool ok(
+		fwrite(&highest, sizeof(highest), 1, f) == 1 &&
+		fwrite(&bits[0], bits.size(), 1, f) == 1 &&
+		fflush(f) == 0 &&
+		fsync(fileno(f)) == 0
+	);
+	fclose(f);
+	if (!ok) {
+		throw std::runtime_error("failed to write " + tmp);
+	}
+	if (rename(tmp.c_str(), filename.c_str()) != 0 || !sync_parent_dir(filename)) {
+		throw std::runtime_error("failed to replace " + filename);
+	}
+}
+
+void tombstones::mark(uint32_t articleid)
+{
+	const size_t byte(articleid >> 3);
+	if (byte >= m_bits.size()) {
+		m_bits.resize(byte + 1, 0);
+	}
+	m_bits[byte] |= 1 << (articleid & 7);
+}
+
+size_t tombstones::count() const
+{
+	size_t n(0);
+	typedef std::vector<unsigned char>::const_iterator ucvcit;
+	for (ucvcit it(m_bits.begin()); it != m_bits.end(); ++it) {
+		for (unsigned char b(*it); b; b &= b - 1) {
+			n++;
+		}
+	}
+	return n;
+}
+
+std::vector<aid_title> read_titles(const std::string& segment)
+{
+	// INDEX_MAGIC <uint8_t version> '\n' <uint64_t index_offset> '\n'
+	//   (or, in version 1, <uint32_t index_offset> '\n')
+	// <uint32_t article count> '\n'
+	// <uint32_t article ID> <article title> '\n'
+	//  . . .
+	std::ifstream ifs(segment.c_str(), std::ios::binary);
+	if (!ifs.good()) {
+		throw std::runtime_error("bad index file " + segment);
+	}
+	char magic[INDEX_MAGIC_SIZE];
+	uint32_t articles(0);
+	char c;
+	ifs.read(magic, INDEX_MAGIC_SIZE);
+	read<char>(ifs, c);
+	if (memcmp(magic, INDEX_MAGIC, INDEX_MAGIC_SIZE) == 0) {
+		if (c != INDEX_FORMAT_VERSION) {
+			throw std::runtime_error("unknown format version of " + segment);
+		}
+		uint64_t index_offset(0);
+		read<char>(ifs, c);
+		read<uint64_t>(ifs, index_offset);
+		read<char>(ifs, c);
+	}
+	read<uint32_t>(ifs, articles);
+	read<char>(ifs, c);
+	std::vector<aid_title> titles;
+	titles.reserve(articles);
+	for (size_t i(0); i < articles && ifs.good(); ++i) {
+		uint32_t articleid(0);
+		read<uint32_t>(ifs, articleid);
+		std::string title;
+		std::getline(ifs, title);
+		titles.push_back(aid_title(articleid, title));
+	}
+	if (!ifs.good()) {
+		throw std::runtime_error("truncated header in " + segment);
+	}
+	return titles;
+}
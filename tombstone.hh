@@ -0,0 +1,52 @@
+#ifndef TOMBSTONE_HH_
+#define TOMBSTONE_HH_
+
+#include <string>
+#include <vector>
+#include "def.hh"
+
+// Index files are immutable once written, so an incremental update
+// (indexer --update) writes changed and new articles to new index files
+// -- segments -- and masks the superseded versions in the older ones
+// with tombstones, a bitmap of deleted article IDs kept alongside each
+// segment as <segment>.del. Searches skip masked articles.
+//
+// On disk, <uint32 highest article ID> followed by a bit per article ID
+// from 0 up to it, least significant bit first.
+
+#define TOMBSTONE_SUFFIX ".del"
+
+class tombstones
+{
+public:
+	tombstones();
+	
+	// Load the tombstones for segment; false (and empty) if there
+	// are none. Throws if the file exists but is malformed.
+	bool load(const std::string& segment);
+	
+	// Atomically and durably replace the tombstones for segment.
+	void save(const std::string& segment) const;
+	
+	void mark(uint32_t articleid);
+	
+	bool deleted(uint32_t articleid) const
+	{
+		const size_t byte(articleid >> 3);
+		return byte < m_bits.size() && (m_bits[byte] >> (articleid & 7)) & 1;
+	}
+	
+	// Number of deleted articles.
+	size_t count() const;
+	bool empty() const { return count() == 0; }
+	
+private:
+	std::vector<unsigned char> m_bits;
+};
+
+typedef std::pair<uint32_t, std::string> aid_title;
+
+// The article IDs and titles in a segment, from its header.
+std::vector<aid_title> read_titles(const std::string& segment);
+
+#endif
@@ -1,8 +1,15 @@
 #include <stdexcept>
 #include <cassert>
 #include <cstdlib>
+#include <cstring>
+#include <algorithm>
 #include "xml.hh"
 
+extern "C" {
+	#include <unistd.h>
+	#include <errno.h>
+}
+
 #define MAX_REGIONS 64
 static const std::string REGION_TOKEN("<title>");
 std::vector<region> regionize(const std::string& filename, size_t count)
@@ -45,8 +52,23 @@ stream::stream(const std::string& filename, const region& r)
 : m_fptr(new std::ifstream(filename.c_str(), std::ios::in & std::ios::binary))
 , m_region(r)
 , m_finished(false)
+{
+	init();
+}
+
+stream::stream(std::istream *is, const region& r)
+: m_fptr(is)
+, m_region(r)
+, m_finished(false)
+{
+	init();
+}
+
+void stream::init()
 {
 	if (!m_fptr->good()) {
+		delete m_fptr;
+		m_fptr = NULL;
 		throw std::runtime_error("bad input file");
 	}
 	if (m_region.begin > 0) {
@@ -59,18 +81,15 @@ stream::stream(const std::string& filename, const region& r)
 
 stream::~stream()
 {
-	if (m_fptr) {
-		m_fptr->close();
-		delete m_fptr;
-	}
+	delete m_fptr; // closes, if it's a file
 }
 
-bool stream::read_until(const std::string& tok, bool consume, rfunc rf, void *arg)
+bool stream::find(const std::string& tok, bool consume, stream_pos& start_pos)
 {
 	assert(m_fptr);
-	std::ifstream& f(*m_fptr);
+	std::istream& f(*m_fptr);
 	const size_t tok_sz(tok.size());
-	stream_pos start_pos(tell()), end_pos(tell());
+	start_pos = tell();
 	bool found(false);
 	std::string line;
 	while (!found && !m_finished) {
@@ -78,7 +97,7 @@ bool stream::read_until(const std::string& tok, bool consume, rfunc rf, void *ar
 		std::string::size_type loc(line.find(tok));
 		if (loc != std::string::npos) {
 			int backup( -(line.size() - loc + 1) );
-			f.seekg(backup, std::ifstream::cur);
+			f.seekg(backup, std::istream::cur);
 			assert(read(tok_sz) == tok);
 			if (tell() < m_region.end) {
 				found = true;
@@ -88,15 +107,25 @@ bool stream::read_until(const std::string& tok, bool consume, rfunc rf, void *ar
 	}
 	if (m_finished && tell() > m_region.end) {
 		int backup( m_region.end - tell() );
-		f.seekg(backup, std::ifstream::cur);
+		f.seekg(backup, std::istream::cur);
 	}
 	if (!found) {
 		return false;
 	}
 	if (consume) {
-		f.seekg(tok_sz, std::ifstream::cur);
+		f.seekg(tok_sz, std::istream::cur);
 	}
-	end_pos = f.tellg();
+	return true;
+}
+
+bool stream::read_until(const std::string& tok, bool consume, rfunc rf, void *arg)
+{
+	stream_pos start_pos;
+	if (!find(tok, consume, start_pos)) {
+		return false;
+	}
+	std::istream& f(*m_fptr);
+	const stream_pos end_pos(f.tellg());
 	if (end_pos == start_pos) {
 		// found immediately; no data to push anywhere
 		return true;
@@ -115,6 +144,32 @@ bool stream::read_until(const std::string& tok, bool consume, rfunc rf, void *ar
 	return true;
 }
 
+bool stream::read_chunks_until(const std::string& tok, bool consume, rfunc rf, void *arg)
+{
+	stream_pos start_pos;
+	if (!find(tok, consume, start_pos)) {
+		return false;
+	}
+	std::istream& f(*m_fptr);
+	const stream_pos end_pos(f.tellg());
+	if (end_pos == start_pos || !rf) {
+		return true;
+	}
+	f.seekg(start_pos);
+	assert(f.good());
+	size_t left(end_pos - start_pos);
+	std::vector<char> buf(std::min<size_t>(left, STREAM_CHUNK_SIZE));
+	while (left > 0) {
+		const size_t n(std::min(left, buf.size()));
+		f.read(&buf[0], n);
+		assert(f.good());
+		rf(&buf[0], n, arg);
+		left -= n;
+	}
+	assert(f.tellg() == end_pos);
+	return true;
+}
+
 bool stream::seek(const stream_pos& pos)
 {
 	assert(m_fptr);
@@ -135,7 +190,7 @@ stream_pos stream::size()
 {
 	assert(m_fptr);
 	stream_pos start_pos(tell());
-	m_fptr->seekg(0, std::ifstream::end);
+	m_fptr->seekg(0, std::istream::end);
 	stream_pos end_pos(tell());
 	m_fptr->seekg(start_pos);
 	return end_pos;
@@ -152,3 +207,83 @@ std::string stream::read(size_t n)
 	seek(start_pos);
 	return s;
 }
+
+pipe_stream::pipe_stream(int fd)
+: m_fd(fd)
+, m_buf(PIPE_BUFFER_SIZE)
+, m_begin(0)
+, m_end(0)
+, m_consumed(0)
+, m_eof(false)
+{
+	//
+}
+
+bool pipe_stream::fill()
+{
+	if (m_eof) {
+		return false;
+	}
+	if (m_begin > 0) {
+		memmove(&m_buf[0], &m_buf[m_begin], m_end - m_begin);
+		m_end -= m_begin;
+		m_begin = 0;
+	}
+	if (m_end == m_buf.size()) {
+		m_buf.resize(m_buf.size() * 2);
+	}
+	for (;;) {
+		const ssize_t n(::read(m_fd, &m_buf[m_end], m_buf.size() - m_end));
+		if (n > 0) {
+			m_end += n;
+			return true;
+		} else if (n == 0) {
+			m_eof = true;
+			return false;
+		} else if (errno != EINTR) {
+			throw std::runtime_error("failed to read input");
+		}
+	}
+}
+
+bool pipe_stream::read_until(const std::string& tok, bool consume, rfunc rf, void *arg)
+{
+	const size_t tok_sz(tok.size());
+	size_t scanned(0); // past m_begin, known not to start tok
+	size_t loc(0);
+	bool found(false);
+	for (;;) {
+		const char *begin(&m_buf[0] + m_begin + scanned), *end(&m_buf[0] + m_end);
+		const char *match(std::search(begin, end, tok.begin(), tok.end()));
+		if (match != end) {
+			loc = match - &m_buf[m_begin];
+			found = true;
+			break;
+		}
+		// a partial match may still be completed by more input
+		const size_t unread(m_end - m_begin);
+		scanned = unread >= tok_sz ? unread - tok_sz + 1 : 0;
+		if (!rf) {
+			// nobody wants what's passed over, so it needn't be kept
+			m_begin += scanned;
+			m_consumed += scanned;
+			scanned = 0;
+		}
+		if (!fill()) {
+			break;
+		}
+	}
+	if (!found) {
+		// like stream at the end of its region: everything was passed over
+		m_consumed += m_end - m_begin;
+		m_begin = m_end;
+		return false;
+	}
+	const size_t len(consume ? loc + tok_sz : loc);
+	if (rf && len > 0) {
+		rf(&m_buf[m_begin], len, arg);
+	}
+	m_begin += len;
+	m_consumed += len;
+	return true;
+}
@@ -3,6 +3,7 @@
 
 #include <fstream>
 #include <vector>
+#include <stdint.h>
 
 // Regions define areas of an input file
 // which are yielded by a stream.
@@ -25,14 +26,27 @@ std::vector<region> regionize(const std::string& filename, size_t count);
 
 typedef void (*rfunc)(char *, size_t, void *);
 
+// read_chunks_until reads what it passes to its rfunc through a buffer
+// of this many bytes, however long the span.
+#define STREAM_CHUNK_SIZE (64 * 1024)
+
 class stream
 {
 public:
 	stream(const std::string& filename, const region& r);
+	
+	// A stream over any seekable istream, eg. decompressed input held
+	// in memory. Takes ownership of is.
+	stream(std::istream *is, const region& r);
 	~stream();
 	
 	bool read_until(const std::string& tok, bool consume, rfunc f, void *arg);
 	
+	// As read_until, but f is called with the span a piece at a time, in
+	// order, each piece at most STREAM_CHUNK_SIZE bytes; not at all if
+	// the span is empty.
+	bool read_chunks_until(const std::string& tok, bool consume, rfunc f, void *arg);
+	
 	bool seek(const stream_pos& pos);
 	stream_pos tell();
 	stream_pos size();
@@ -41,9 +55,51 @@ public:
 	std::string read(size_t n);
 	
 private:
-	std::ifstream *m_fptr;
+	void init();
+	
+	// Look for tok, leaving the stream past it if consume, or at it.
+	// start is where the search began.
+	bool find(const std::string& tok, bool consume, stream_pos& start);
+	
+	std::istream *m_fptr;
 	region m_region;
 	bool m_finished;
 };
 
+// A pipe_stream reads forward only, from a pipe, a socket or stdin, so
+// there are no regions, no seeking and no size. read_until behaves as
+// stream's does, except that what it passes over is gone.
+//
+// Input is read through a buffer of PIPE_BUFFER_SIZE bytes, which is
+// compacted rather than wrapped so rfuncs get contiguous spans. It only
+// grows to hold a single span longer than that, eg. an outsized page,
+// and only for an rfunc; skipping, however far, never grows it.
+
+#define PIPE_BUFFER_SIZE (1024 * 1024)
+
+class pipe_stream
+{
+public:
+	explicit pipe_stream(int fd); // not closed when done
+	
+	bool read_until(const std::string& tok, bool consume, rfunc f, void *arg);
+	
+	// Bytes passed over so far.
+	uint64_t tell() const { return m_consumed; }
+	
+	// Bytes of buffer held.
+	size_t capacity() const { return m_buf.size(); }
+	
+private:
+	// Read more input, making room first. False at end of input.
+	bool fill();
+	
+	int m_fd;
+	std::vector<char> m_buf;
+	size_t m_begin; // unread input is m_buf[m_begin, m_end)
+	size_t m_end;
+	uint64_t m_consumed;
+	bool m_eof;
+};
+
 #endif